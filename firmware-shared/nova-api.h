@@ -59,13 +59,36 @@ void nova_on_disconnect_hid(nova_t *nova);
  */
 void nova_on_app_command(nova_t *nova, app_command_t *cmd);
 
+/**
+ * Should be called when Nova BLE characteristic receives a frame of
+ * commands from the App, once NOVA_FEATURE_FRAMES is on (see
+ * nova_app_features()). Commands are processed in order, and the
+ * responses are sent back together with nova_send_app_commands().
+ *
+ * See nova_codec_decode_frame() in nova-codec.h.
+ */
+void nova_on_app_commands(nova_t *nova, app_command_t *cmds, uint8_t count);
+
 /**
  * Device implementations should provide nova_timer_schedule() functions
  * (see nova-device.h). When the timer is complete it should call back
  * to this function.
+ *
+ * It's harmless to call this when no timer is due (e.g. if the hardware
+ * timer fires early) - nothing happens other than the timer being
+ * rescheduled.
  */
 void nova_on_timer_complete(nova_t *nova);
 
+/**
+ * Should be called when the platform detects power is about to be lost
+ * (e.g. brownout detector, or battery below a critical level).
+ *
+ * This turns the lights off and saves any pending usage counters, so it
+ * should be called while there's still enough power to write to flash.
+ */
+void nova_on_power_failing(nova_t *nova);
+
 
 
 // ----------------------------------------------------------------------------
@@ -86,3 +109,12 @@ bool nova_is_ble_app_connected(nova_t *nova);
  * After nova_on_disconnect_hid() returns false.
  */
 bool nova_is_ble_hid_connected(nova_t *nova);
+
+/**
+ * Protocol features turned on by the App (bitmask of app_feature). If
+ * NOVA_FEATURE_FRAMES is set, writes from the App should be decoded as
+ * frames and passed to nova_on_app_commands().
+ *
+ * Always 0 when the App is not connected.
+ */
+uint8_t nova_app_features(nova_t *nova);
@@ -0,0 +1,249 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * Wire format of data exchanged with the App over BLE.
+ *
+ * See nova-codec.h for the layouts and usage. Everything here is
+ * generated from the schemas in nova-codec.h.
+ */
+
+#include "nova-codec.h"
+
+
+// ----------------------------------------------------------------------------
+// Compile-time checks of schemas
+
+/** Fails to compile if cond is false. */
+#define CHECK(name, cond) typedef char check_##name[(cond) ? 1 : -1]
+
+#define FIELD_SIZE(group, member, kind, offset) + NOVA_CODEC_SIZE_##kind
+
+/** Bitmask of bytes occupied by a field. */
+#define FIELD_BYTES(group, member, kind, offset) \
+  | (((1ULL << NOVA_CODEC_SIZE_##kind) - 1) << (offset))
+
+/**
+ * Fields must exactly tile the declared size: sizes add up, and together
+ * they cover every byte (so there are no gaps or overlaps).
+ */
+#define CHECK_SCHEMA(name, SCHEMA, size) \
+  CHECK(name##_size, (0 SCHEMA(FIELD_SIZE)) == (size)); \
+  CHECK(name##_layout, (0 SCHEMA(FIELD_BYTES)) == ((1ULL << (size)) - 1))
+
+CHECK_SCHEMA(header, NOVA_CODEC_SCHEMA_HEADER, NOVA_CODEC_HEADER_SIZE);
+CHECK_SCHEMA(flash_settings, NOVA_CODEC_SCHEMA_FLASH_SETTINGS, NOVA_CODEC_FLASH_SETTINGS_SIZE);
+CHECK_SCHEMA(trigger, NOVA_CODEC_SCHEMA_TRIGGER, NOVA_CODEC_TRIGGER_SIZE);
+CHECK_SCHEMA(negotiate, NOVA_CODEC_SCHEMA_NEGOTIATE, NOVA_CODEC_NEGOTIATE_SIZE);
+CHECK_SCHEMA(sync, NOVA_CODEC_SCHEMA_SYNC, NOVA_CODEC_SYNC_SIZE);
+CHECK_SCHEMA(flash_at, NOVA_CODEC_SCHEMA_FLASH_AT, NOVA_CODEC_FLASH_AT_SIZE);
+CHECK_SCHEMA(counters, NOVA_CODEC_SCHEMA_COUNTERS, NOVA_CODEC_COUNTERS_SIZE);
+
+// Every counters_t field must be in the schema.
+CHECK(counters_complete, NOVA_CODEC_COUNTERS_SIZE == sizeof(counters_t));
+
+#define CHECK_COMMAND_SIZE(type, body) \
+  && (NOVA_CODEC_HEADER_SIZE + NOVA_CODEC_##body##_SIZE <= NOVA_CODEC_MAX_COMMAND_SIZE)
+CHECK(max_command_size, 1 NOVA_CODEC_COMMANDS(CHECK_COMMAND_SIZE));
+
+// Any command must fit in a frame.
+CHECK(max_frame_size,
+    NOVA_CODEC_FRAME_PREFIX_SIZE + NOVA_CODEC_MAX_COMMAND_SIZE <= NOVA_CODEC_MAX_FRAME_SIZE);
+
+
+// ----------------------------------------------------------------------------
+// Generated field encoders/decoders
+
+#define ENCODE_FIELD(group, member, kind, offset) \
+  nova_codec_put_##kind(buf + (offset), value->member);
+
+#define DECODE_FIELD(group, member, kind, offset) \
+  value->member = nova_codec_get_##kind(buf + (offset));
+
+/** Only PAD fields can be invalid (they must be 0). */
+#define VALID_FIELD(group, member, kind, offset) \
+  && valid_##kind(buf + (offset))
+
+static bool valid_U8(const uint8_t *buf)
+{
+  (void)buf;
+  return true;
+}
+
+static bool valid_U16(const uint8_t *buf)
+{
+  (void)buf;
+  return true;
+}
+
+static bool valid_PAD(const uint8_t *buf)
+{
+  return nova_codec_get_PAD(buf) == 0;
+}
+
+static void encode_header(const struct app_command_header_t *value, uint8_t *buf)
+{
+  NOVA_CODEC_SCHEMA_HEADER(ENCODE_FIELD)
+}
+
+static void decode_header(const uint8_t *buf, struct app_command_header_t *value)
+{
+  NOVA_CODEC_SCHEMA_HEADER(DECODE_FIELD)
+}
+
+static bool valid_header(const uint8_t *buf)
+{
+  return true NOVA_CODEC_SCHEMA_HEADER(VALID_FIELD);
+}
+
+static void encode_flash_settings(const flash_settings_t *value, uint8_t *buf)
+{
+  NOVA_CODEC_SCHEMA_FLASH_SETTINGS(ENCODE_FIELD)
+}
+
+static void decode_flash_settings(const uint8_t *buf, flash_settings_t *value)
+{
+  NOVA_CODEC_SCHEMA_FLASH_SETTINGS(DECODE_FIELD)
+}
+
+
+// ----------------------------------------------------------------------------
+// Commands
+
+#define ENCODE_BODY_FIELD(group, member, kind, offset) \
+  nova_codec_put_##kind(buf + NOVA_CODEC_HEADER_SIZE + (offset), cmd->body.group.member);
+
+#define DECODE_BODY_FIELD(group, member, kind, offset) \
+  cmd->body.group.member = nova_codec_get_##kind(buf + NOVA_CODEC_HEADER_SIZE + (offset));
+
+#define ENCODE_BODY_CASE(type, body) \
+  case type: \
+    NOVA_CODEC_SCHEMA_##body(ENCODE_BODY_FIELD) \
+    break;
+
+#define DECODE_BODY_CASE(type, body) \
+  case type: \
+    NOVA_CODEC_SCHEMA_##body(DECODE_BODY_FIELD) \
+    break;
+
+uint16_t nova_codec_encode_command(const app_command_t *cmd, uint8_t *buf)
+{
+  uint16_t size = nova_codec_command_size(cmd->header.type);
+  if (size == 0) {
+    return 0;
+  }
+
+  encode_header(&cmd->header, buf);
+  switch (cmd->header.type) {
+    NOVA_CODEC_COMMANDS(ENCODE_BODY_CASE)
+  }
+  return size;
+}
+
+bool nova_codec_check_command(const uint8_t *buf, uint16_t len)
+{
+  if (len < NOVA_CODEC_HEADER_SIZE || !valid_header(buf)) {
+    return false;
+  }
+  uint16_t size = nova_codec_command_size(nova_codec_header_type(buf));
+  return size != 0 && size == len;
+}
+
+bool nova_codec_decode_command(const uint8_t *buf, uint16_t len, app_command_t *cmd)
+{
+  if (!nova_codec_check_command(buf, len)) {
+    return false;
+  }
+
+  decode_header(buf, &cmd->header);
+  switch (cmd->header.type) {
+    NOVA_CODEC_COMMANDS(DECODE_BODY_CASE)
+  }
+  return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Frames
+
+uint8_t nova_codec_encode_frame(const app_command_t *cmds, uint8_t count, uint8_t *buf, uint16_t *len)
+{
+  uint16_t offset = 0;
+  uint8_t used = 0;
+
+  for (; used < count; used++) {
+    uint16_t size = nova_codec_command_size(cmds[used].header.type);
+    if (offset + NOVA_CODEC_FRAME_PREFIX_SIZE + size > NOVA_CODEC_MAX_FRAME_SIZE) {
+      break;
+    }
+    if (size == 0) {
+      continue;
+    }
+    nova_codec_put_U8(buf + offset, (uint8_t)size);
+    offset += NOVA_CODEC_FRAME_PREFIX_SIZE;
+    offset += nova_codec_encode_command(&cmds[used], buf + offset);
+  }
+
+  *len = offset;
+  return used;
+}
+
+int nova_codec_decode_frame(const uint8_t *buf, uint16_t len, app_command_t *cmds, uint8_t max)
+{
+  uint16_t offset = 0;
+  int count = 0;
+
+  if (len == 0) {
+    return -1;
+  }
+
+  while (offset < len) {
+    uint16_t size = nova_codec_get_U8(buf + offset);
+    offset += NOVA_CODEC_FRAME_PREFIX_SIZE;
+    if (count == max || size > len - offset
+        || !nova_codec_decode_command(buf + offset, size, &cmds[count])) {
+      return -1;
+    }
+    offset += size;
+    count++;
+  }
+
+  return count;
+}
+
+
+// ----------------------------------------------------------------------------
+// Settings and counters
+
+void nova_codec_encode_flash_defaults(const flash_defaults_t *defaults, uint8_t *buf)
+{
+  encode_flash_settings(&defaults->regular, buf);
+  encode_flash_settings(&defaults->preflash, buf + NOVA_CODEC_FLASH_SETTINGS_SIZE);
+}
+
+bool nova_codec_decode_flash_defaults(const uint8_t *buf, uint16_t len, flash_defaults_t *defaults)
+{
+  if (len != NOVA_CODEC_FLASH_DEFAULTS_SIZE) {
+    return false;
+  }
+  decode_flash_settings(buf, &defaults->regular);
+  decode_flash_settings(buf + NOVA_CODEC_FLASH_SETTINGS_SIZE, &defaults->preflash);
+  return true;
+}
+
+void nova_codec_encode_counters(const counters_t *value, uint8_t *buf)
+{
+  NOVA_CODEC_SCHEMA_COUNTERS(ENCODE_FIELD)
+}
+
+#define DECODE_COUNTER(group, member, kind, offset) \
+  value->member = (offset) + NOVA_CODEC_SIZE_##kind <= len \
+      ? nova_codec_get_##kind(buf + (offset)) : 0;
+
+bool nova_codec_decode_counters(const uint8_t *buf, uint16_t len, counters_t *value)
+{
+  if (len % NOVA_CODEC_SIZE_U32 != 0) {
+    return false;
+  }
+  NOVA_CODEC_SCHEMA_COUNTERS(DECODE_COUNTER)
+  return true;
+}
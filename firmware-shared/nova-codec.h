@@ -0,0 +1,358 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Wire format of data exchanged with the App over BLE.
+ *
+ * Structs in nova.h are in host byte order and may be laid out with
+ * padding by the compiler, so they're never sent over the air as-is.
+ * Instead they're packed into big-endian byte buffers as described by
+ * the schemas below. The same schemas generate everything: encoders,
+ * decoders, encoded sizes, and accessors that read single fields straight
+ * out of a received buffer.
+ *
+ * Layouts match the iOS SDK (NVCodecV2, see NVCodecV2Tests.m):
+ *
+ *   PING     01 00 ID ID                   (also ACK=00, OFF=03)
+ *   FLASH    02 00 ID ID TT TT WW CC       (timeout, warm, cool)
+ *   TRIGGER  04 00 ID ID PP                (is_pressed)
+ *   NEGOTIATE 05 00 ID ID FF WW            (features, window)
+ *   SYNC     06 00 ID ID T1 T2 T3 T4       (time)
+ *   FLASH_AT 07 00 ID ID A1 A2 A3 A4 TT TT WW CC  (at, timeout, warm, cool)
+ *
+ *   frame    LL <command> LL <command> ...  (LL = length of command)
+ *
+ *   flash_defaults_t  TT TT WW CC TT TT WW CC   (regular, preflash)
+ *   counters_t        one 32 bit value per field, in struct order
+ *
+ * Usage:
+ *
+ *   // Sending (e.g. in nova_send_app_command()):
+ *   uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+ *   uint16_t len = nova_codec_encode_command(cmd, buf);
+ *   my_gatt_notify(buf, len);
+ *
+ *   // Receiving a GATT write:
+ *   app_command_t cmd;
+ *   if (nova_codec_decode_command(data, len, &cmd)) {
+ *     nova_on_app_command(nova, &cmd);
+ *   }
+ *
+ *   // Or, once NOVA_FEATURE_FRAMES is on (see nova_app_features()):
+ *   app_command_t cmds[NOVA_APP_FRAME_MAX_COMMANDS];
+ *   int count = nova_codec_decode_frame(data, len, cmds, NOVA_APP_FRAME_MAX_COMMANDS);
+ *   if (count > 0) {
+ *     nova_on_app_commands(nova, cmds, count);
+ *   }
+ *
+ *   // Or, without decoding into a struct:
+ *   if (nova_codec_check_command(data, len)
+ *       && nova_codec_header_type(data) == NOVA_CMD_FLASH) {
+ *     milliseconds_t timeout =
+ *         nova_codec_flash_settings_timeout(nova_codec_command_body(data));
+ *   }
+ *
+ * Everything here is fixed size with no allocation, so it's suitable for
+ * firmware and host tools alike.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+
+// ----------------------------------------------------------------------------
+// Primitive wire types
+
+/**
+ * Each kind of field on the wire: U8, U16, U32 (unsigned, big-endian) and
+ * PAD (a byte that is always sent as 0, and must be 0 when received).
+ */
+#define NOVA_CODEC_SIZE_U8  1
+#define NOVA_CODEC_SIZE_U16 2
+#define NOVA_CODEC_SIZE_U32 4
+#define NOVA_CODEC_SIZE_PAD 1
+
+typedef uint8_t nova_codec_U8_t;
+typedef uint16_t nova_codec_U16_t;
+typedef uint32_t nova_codec_U32_t;
+typedef uint8_t nova_codec_PAD_t;
+
+static inline uint8_t nova_codec_get_U8(const uint8_t *buf)
+{
+  return buf[0];
+}
+
+static inline uint16_t nova_codec_get_U16(const uint8_t *buf)
+{
+  return ((uint16_t)buf[0] << 8) | buf[1];
+}
+
+static inline uint32_t nova_codec_get_U32(const uint8_t *buf)
+{
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16)
+      | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static inline uint8_t nova_codec_get_PAD(const uint8_t *buf)
+{
+  return buf[0];
+}
+
+static inline void nova_codec_put_U8(uint8_t *buf, uint8_t value)
+{
+  buf[0] = value;
+}
+
+static inline void nova_codec_put_U16(uint8_t *buf, uint16_t value)
+{
+  buf[0] = (uint8_t)(value >> 8);
+  buf[1] = (uint8_t)value;
+}
+
+static inline void nova_codec_put_U32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = (uint8_t)(value >> 24);
+  buf[1] = (uint8_t)(value >> 16);
+  buf[2] = (uint8_t)(value >> 8);
+  buf[3] = (uint8_t)value;
+}
+
+static inline void nova_codec_put_PAD(uint8_t *buf, uint8_t value)
+{
+  (void)value;
+  buf[0] = 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Schemas
+//
+// Each schema lists the fields of a struct as:
+//
+//   FIELD(group, member, kind, offset)
+//
+// group:  name of the struct (and the app_command_t body member, if any)
+// member: name of the field in the struct
+// kind:   wire type (see above)
+// offset: byte offset from the start of the encoded struct
+//
+// Each has a matching _SIZE. Sizes and offsets are checked at compile
+// time in nova-codec.c.
+
+#define NOVA_CODEC_SCHEMA_HEADER(FIELD) \
+  FIELD(header, type,  U8,  0) \
+  FIELD(header, __pad, PAD, 1) \
+  FIELD(header, id,    U16, 2)
+#define NOVA_CODEC_HEADER_SIZE 4
+
+#define NOVA_CODEC_SCHEMA_FLASH_SETTINGS(FIELD) \
+  FIELD(flash_settings, timeout, U16, 0) \
+  FIELD(flash_settings, warm,    U8,  2) \
+  FIELD(flash_settings, cool,    U8,  3)
+#define NOVA_CODEC_FLASH_SETTINGS_SIZE 4
+
+#define NOVA_CODEC_SCHEMA_TRIGGER(FIELD) \
+  FIELD(trigger, is_pressed, U8, 0)
+#define NOVA_CODEC_TRIGGER_SIZE 1
+
+#define NOVA_CODEC_SCHEMA_NEGOTIATE(FIELD) \
+  FIELD(negotiate, features, U8, 0) \
+  FIELD(negotiate, window,   U8, 1)
+#define NOVA_CODEC_NEGOTIATE_SIZE 2
+
+#define NOVA_CODEC_SCHEMA_SYNC(FIELD) \
+  FIELD(sync, time, U32, 0)
+#define NOVA_CODEC_SYNC_SIZE 4
+
+#define NOVA_CODEC_SCHEMA_FLASH_AT(FIELD) \
+  FIELD(flash_at, at,      U32, 0) \
+  FIELD(flash_at, timeout, U16, 4) \
+  FIELD(flash_at, warm,    U8,  6) \
+  FIELD(flash_at, cool,    U8,  7)
+#define NOVA_CODEC_FLASH_AT_SIZE 8
+
+#define NOVA_CODEC_SCHEMA_NONE(FIELD)
+#define NOVA_CODEC_NONE_SIZE 0
+
+#define NOVA_CODEC_SCHEMA_COUNTERS(FIELD) \
+  FIELD(counters, boot,                      U32, 0) \
+  FIELD(counters, app_connect,               U32, 4) \
+  FIELD(counters, hid_connect,               U32, 8) \
+  FIELD(counters, flash_button_app,          U32, 12) \
+  FIELD(counters, flash_button_native,       U32, 16) \
+  FIELD(counters, flash_button_disconnected, U32, 20) \
+  FIELD(counters, flash_remote_app,          U32, 24)
+#define NOVA_CODEC_COUNTERS_SIZE 28
+
+/** flash_defaults_t is regular then preflash, each a flash_settings_t. */
+#define NOVA_CODEC_FLASH_DEFAULTS_SIZE (2 * NOVA_CODEC_FLASH_SETTINGS_SIZE)
+
+/**
+ * Every command type, and the schema of its body (which follows the
+ * header).
+ */
+#define NOVA_CODEC_COMMANDS(COMMAND) \
+  COMMAND(NOVA_CMD_ACK,       NONE) \
+  COMMAND(NOVA_CMD_PING,      NONE) \
+  COMMAND(NOVA_CMD_FLASH,     FLASH_SETTINGS) \
+  COMMAND(NOVA_CMD_OFF,       NONE) \
+  COMMAND(NOVA_CMD_TRIGGER,   TRIGGER) \
+  COMMAND(NOVA_CMD_NEGOTIATE, NEGOTIATE) \
+  COMMAND(NOVA_CMD_SYNC,      SYNC) \
+  COMMAND(NOVA_CMD_FLASH_AT,  FLASH_AT)
+
+/** Largest encoded command (FLASH_AT). Checked in nova-codec.c. */
+#define NOVA_CODEC_MAX_COMMAND_SIZE 12
+
+/**
+ * Largest frame (see NOVA_FEATURE_FRAMES): the payload of a single BLE
+ * write/notification with the default ATT MTU of 23.
+ */
+#define NOVA_CODEC_MAX_FRAME_SIZE 20
+
+/** Size of the length prefix of each command in a frame. */
+#define NOVA_CODEC_FRAME_PREFIX_SIZE 1
+
+/** Most commands a frame can hold (all header only). */
+#define NOVA_CODEC_MAX_FRAME_COMMANDS \
+  (NOVA_CODEC_MAX_FRAME_SIZE / (NOVA_CODEC_FRAME_PREFIX_SIZE + NOVA_CODEC_HEADER_SIZE))
+
+
+// ----------------------------------------------------------------------------
+// Encoded sizes
+
+#define NOVA_CODEC_COMMAND_SIZE_ENTRY(type, body) \
+  [type] = NOVA_CODEC_HEADER_SIZE + NOVA_CODEC_##body##_SIZE,
+
+/**
+ * Initializer for a table of encoded command sizes, indexed by type:
+ *
+ *   static const uint8_t sizes[] = NOVA_CODEC_COMMAND_SIZES;
+ */
+#define NOVA_CODEC_COMMAND_SIZES { NOVA_CODEC_COMMANDS(NOVA_CODEC_COMMAND_SIZE_ENTRY) }
+
+#define NOVA_CODEC_COMMAND_SIZE_CASE(type, body) \
+  case type: return NOVA_CODEC_HEADER_SIZE + NOVA_CODEC_##body##_SIZE;
+
+/**
+ * Encoded size of a command of the given type, or 0 if the type is unknown.
+ */
+static inline uint16_t nova_codec_command_size(uint8_t type)
+{
+  switch (type) {
+    NOVA_CODEC_COMMANDS(NOVA_CODEC_COMMAND_SIZE_CASE)
+    default: return 0;
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Zero-copy accessors
+//
+// Read a single field straight out of an encoded buffer. For example:
+//
+//   nova_codec_header_id(buf)
+//   nova_codec_flash_settings_warm(nova_codec_command_body(buf))
+//   nova_codec_counters_boot(buf)
+//
+// Only use on buffers that have been checked first (see
+// nova_codec_check_command()).
+
+#define NOVA_CODEC_ACCESSOR(group, member, kind, offset) \
+  static inline nova_codec_##kind##_t nova_codec_##group##_##member(const uint8_t *buf) \
+  { \
+    return nova_codec_get_##kind(buf + (offset)); \
+  }
+
+NOVA_CODEC_SCHEMA_HEADER(NOVA_CODEC_ACCESSOR)
+NOVA_CODEC_SCHEMA_FLASH_SETTINGS(NOVA_CODEC_ACCESSOR)
+NOVA_CODEC_SCHEMA_TRIGGER(NOVA_CODEC_ACCESSOR)
+NOVA_CODEC_SCHEMA_NEGOTIATE(NOVA_CODEC_ACCESSOR)
+NOVA_CODEC_SCHEMA_SYNC(NOVA_CODEC_ACCESSOR)
+NOVA_CODEC_SCHEMA_FLASH_AT(NOVA_CODEC_ACCESSOR)
+NOVA_CODEC_SCHEMA_COUNTERS(NOVA_CODEC_ACCESSOR)
+
+/**
+ * Start of the body of an encoded command.
+ */
+static inline const uint8_t *nova_codec_command_body(const uint8_t *buf)
+{
+  return buf + NOVA_CODEC_HEADER_SIZE;
+}
+
+
+// ----------------------------------------------------------------------------
+// Commands
+
+/**
+ * Encode cmd into buf, which must have room for NOVA_CODEC_MAX_COMMAND_SIZE
+ * bytes. Returns number of bytes written, or 0 if the command type is
+ * unknown.
+ */
+uint16_t nova_codec_encode_command(const app_command_t *cmd, uint8_t *buf);
+
+/**
+ * Check that buf holds exactly one valid command: known type, zero
+ * padding, and the right length for the type.
+ */
+bool nova_codec_check_command(const uint8_t *buf, uint16_t len);
+
+/**
+ * Decode a received command into cmd. Returns false (leaving cmd
+ * undefined) if it's not valid (see nova_codec_check_command()).
+ */
+bool nova_codec_decode_command(const uint8_t *buf, uint16_t len, app_command_t *cmd);
+
+
+// ----------------------------------------------------------------------------
+// Frames (see NOVA_FEATURE_FRAMES in nova.h)
+
+/**
+ * Encode as many of cmds as fit into a single frame in buf, which must
+ * have room for NOVA_CODEC_MAX_FRAME_SIZE bytes. The size of the frame is
+ * written to len.
+ *
+ * Returns how many commands were used up. If less than count, encode the
+ * rest into more frames. Commands of unknown type are skipped.
+ */
+uint8_t nova_codec_encode_frame(const app_command_t *cmds, uint8_t count, uint8_t *buf, uint16_t *len);
+
+/**
+ * Decode a received frame into cmds, which has room for max commands.
+ *
+ * Returns the number of commands, or -1 if the frame is not valid: empty,
+ * truncated, holding more than max commands, or holding any command that
+ * is not valid (see nova_codec_check_command()). Nothing in an invalid
+ * frame should be processed.
+ */
+int nova_codec_decode_frame(const uint8_t *buf, uint16_t len, app_command_t *cmds, uint8_t max);
+
+
+// ----------------------------------------------------------------------------
+// Settings and counters (GATT characteristics, without a command header)
+
+/**
+ * Encode flash defaults into buf (NOVA_CODEC_FLASH_DEFAULTS_SIZE bytes).
+ */
+void nova_codec_encode_flash_defaults(const flash_defaults_t *defaults, uint8_t *buf);
+
+/**
+ * Decode flash defaults. Returns false if len is wrong.
+ */
+bool nova_codec_decode_flash_defaults(const uint8_t *buf, uint16_t len, flash_defaults_t *defaults);
+
+/**
+ * Encode counters into buf (NOVA_CODEC_COUNTERS_SIZE bytes).
+ */
+void nova_codec_encode_counters(const counters_t *counters, uint8_t *buf);
+
+/**
+ * Decode counters. The number of counters may change between firmware
+ * versions, so any whole number of 32 bit values is accepted: fields
+ * beyond the end of buf are set to 0 and extra values are ignored.
+ * Returns false if len is not a multiple of 4.
+ */
+bool nova_codec_decode_counters(const uint8_t *buf, uint16_t len, counters_t *counters);
@@ -0,0 +1,349 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * Log-structured, wear-leveled persistent store for usage counters.
+ *
+ * See nova-counter-log.h for the flash layout and usage.
+ */
+
+#include "nova-counter-log.h"
+
+#define NO_PAGE 0xFF
+
+#define COUNTER_FIELDS (sizeof(counters_t) / sizeof(uint32_t))
+
+#define TAG_HEADER  0x1
+#define TAG_BASE_HI 0x2
+#define TAG_BASE_LO 0x3
+#define TAG_COMMIT  0x4
+#define TAG_INC     0x5
+
+#define CHECK_SALT  0xA5
+
+/**
+ * A decoded record.
+ */
+typedef struct record_t
+{
+  uint8_t tag;
+  uint8_t field;
+  uint16_t value;
+} record_t;
+
+static uint32_t *counter_fields(counters_t *counters)
+{
+  return (uint32_t*)counters;
+}
+
+
+// ----------------------------------------------------------------------------
+// Record encoding
+
+static void record_encode(uint8_t *buf, uint8_t tag, uint8_t field, uint16_t value)
+{
+  buf[0] = (uint8_t)((tag << 4) | (field & 0x0F));
+  buf[1] = (uint8_t)(value >> 8);
+  buf[2] = (uint8_t)(value & 0xFF);
+  buf[3] = buf[0] ^ buf[1] ^ buf[2] ^ CHECK_SALT;
+}
+
+/**
+ * Returns false if the word is erased, torn or otherwise corrupt.
+ */
+static bool record_decode(const uint8_t *buf, record_t *record)
+{
+  if ((buf[0] ^ buf[1] ^ buf[2] ^ CHECK_SALT) != buf[3]) {
+    return false;
+  }
+  record->tag = buf[0] >> 4;
+  record->field = buf[0] & 0x0F;
+  record->value = ((uint16_t)buf[1] << 8) | buf[2];
+  return true;
+}
+
+static bool word_is_erased(const uint8_t *buf)
+{
+  return buf[0] == 0xFF && buf[1] == 0xFF && buf[2] == 0xFF && buf[3] == 0xFF;
+}
+
+/**
+ * Is sequence number a newer than b? Copes with wrap-around.
+ */
+static bool sequence_newer(uint16_t a, uint16_t b)
+{
+  return (int16_t)(a - b) > 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Page scanning
+
+/**
+ * Check that a page is fully erased.
+ */
+static bool page_is_blank(nova_counter_log_t *log, uint8_t page)
+{
+  uint8_t word[NOVA_COUNTER_LOG_RECORD_SIZE];
+  for (uint16_t offset = 0; offset < log->page_size; offset += NOVA_COUNTER_LOG_RECORD_SIZE) {
+    nova_counter_log_flash_read(log, page, offset, word, NOVA_COUNTER_LOG_RECORD_SIZE);
+    if (!word_is_erased(word)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Determine whether page holds a committed snapshot. If so, returns true
+ * and sets the sequence number.
+ */
+static bool page_is_committed(nova_counter_log_t *log, uint8_t page, uint16_t *sequence)
+{
+  uint8_t word[NOVA_COUNTER_LOG_RECORD_SIZE];
+  record_t record;
+
+  nova_counter_log_flash_read(log, page, 0, word, NOVA_COUNTER_LOG_RECORD_SIZE);
+  if (!record_decode(word, &record) || record.tag != TAG_HEADER) {
+    return false;
+  }
+
+  // Snapshot is only valid if it was followed by a matching COMMIT.
+  for (uint16_t offset = NOVA_COUNTER_LOG_RECORD_SIZE; offset < log->page_size; offset += NOVA_COUNTER_LOG_RECORD_SIZE) {
+    nova_counter_log_flash_read(log, page, offset, word, NOVA_COUNTER_LOG_RECORD_SIZE);
+    if (word_is_erased(word)) {
+      return false;
+    }
+    if (record_decode(word, &record) && record.tag == TAG_COMMIT) {
+      *sequence = record.value;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Rebuild totals by replaying every record in the active page, and find
+ * where the next record should be appended.
+ */
+static void page_replay(nova_counter_log_t *log)
+{
+  uint8_t word[NOVA_COUNTER_LOG_RECORD_SIZE];
+  record_t record;
+  uint32_t *totals = counter_fields(&log->totals);
+
+  log->write_offset = 0;
+  for (uint16_t offset = 0; offset < log->page_size; offset += NOVA_COUNTER_LOG_RECORD_SIZE) {
+    nova_counter_log_flash_read(log, log->active_page, offset, word, NOVA_COUNTER_LOG_RECORD_SIZE);
+    if (word_is_erased(word)) {
+      continue;
+    }
+
+    // Anything programmed (even if torn) can't be reused.
+    log->write_offset = offset + NOVA_COUNTER_LOG_RECORD_SIZE;
+
+    if (!record_decode(word, &record) || record.field >= COUNTER_FIELDS) {
+      continue;
+    }
+    switch (record.tag) {
+      case TAG_BASE_HI:
+        totals[record.field] = (totals[record.field] & 0x0000FFFF) | ((uint32_t)record.value << 16);
+        break;
+      case TAG_BASE_LO:
+        totals[record.field] = (totals[record.field] & 0xFFFF0000) | record.value;
+        break;
+      case TAG_INC:
+        totals[record.field] += record.value;
+        break;
+    }
+  }
+}
+
+/**
+ * Scan all pages to find the active one and reconstruct totals.
+ */
+static void mount(nova_counter_log_t *log)
+{
+  uint32_t *totals = counter_fields(&log->totals);
+  for (uint8_t i = 0; i < COUNTER_FIELDS; i++) {
+    totals[i] = 0;
+  }
+
+  log->active_page = NO_PAGE;
+  log->write_offset = 0;
+  log->sequence = 0;
+  log->erased_pages = 0;
+
+  // Find newest committed page.
+  for (uint8_t page = 0; page < log->page_count; page++) {
+    uint16_t sequence;
+    if (page_is_committed(log, page, &sequence)
+        && (log->active_page == NO_PAGE || sequence_newer(sequence, log->sequence))) {
+      log->active_page = page;
+      log->sequence = sequence;
+    }
+  }
+
+  // Only pages verified blank are reused without erasing first.
+  for (uint8_t page = 0; page < log->page_count; page++) {
+    if (page != log->active_page && page_is_blank(log, page)) {
+      log->erased_pages |= (1 << page);
+    }
+  }
+
+  if (log->active_page != NO_PAGE) {
+    page_replay(log);
+  }
+
+  log->mounted = true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Writing
+
+static void append(nova_counter_log_t *log, uint8_t tag, uint8_t field, uint16_t value)
+{
+  uint8_t word[NOVA_COUNTER_LOG_RECORD_SIZE];
+  record_encode(word, tag, field, value);
+  nova_counter_log_flash_write(log, log->active_page, log->write_offset, word, NOVA_COUNTER_LOG_RECORD_SIZE);
+  log->write_offset += NOVA_COUNTER_LOG_RECORD_SIZE;
+}
+
+static uint8_t next_page(nova_counter_log_t *log)
+{
+  if (log->active_page == NO_PAGE) {
+    return 0;
+  }
+  return (log->active_page + 1) % log->page_count;
+}
+
+static void erase(nova_counter_log_t *log, uint8_t page)
+{
+  nova_counter_log_flash_erase(log, page);
+  log->erased_pages |= (1 << page);
+}
+
+/**
+ * Write a snapshot of the current totals to the next page and make it the
+ * active page. The old page is left for nova_counter_log_idle() to erase.
+ */
+static void compact(nova_counter_log_t *log)
+{
+  uint8_t target = next_page(log);
+  if (!(log->erased_pages & (1 << target))) {
+    erase(log, target);
+  }
+  log->erased_pages &= ~(1 << target);
+
+  log->active_page = target;
+  log->write_offset = 0;
+  log->sequence++;
+
+  uint32_t *totals = counter_fields(&log->totals);
+  append(log, TAG_HEADER, 0, log->sequence);
+  for (uint8_t i = 0; i < COUNTER_FIELDS; i++) {
+    append(log, TAG_BASE_HI, i, (uint16_t)(totals[i] >> 16));
+    append(log, TAG_BASE_LO, i, (uint16_t)(totals[i] & 0xFFFF));
+  }
+  append(log, TAG_COMMIT, 0, log->sequence);
+}
+
+static bool needs_compaction(nova_counter_log_t *log)
+{
+  return log->active_page == NO_PAGE
+      || log->write_offset >= (log->page_size / 4) * NOVA_COUNTER_LOG_COMPACT_QUARTERS;
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void nova_counter_log_init(nova_counter_log_t *log, uint16_t page_size, uint8_t page_count, void *data)
+{
+  log->page_size = page_size;
+  log->page_count = page_count;
+  log->active_page = NO_PAGE;
+  log->write_offset = 0;
+  log->sequence = 0;
+  log->erased_pages = 0;
+  log->mounted = false;
+  log->data = data;
+}
+
+void nova_counter_log_load(nova_counter_log_t *log, counters_t *counters)
+{
+  // Always rescan, as load signifies a fresh start (e.g. nova_on_reset()).
+  mount(log);
+  *counters = log->totals;
+}
+
+void nova_counter_log_save(nova_counter_log_t *log, counters_t *counters)
+{
+  if (!log->mounted) {
+    mount(log);
+  }
+
+  uint32_t *totals = counter_fields(&log->totals);
+  uint32_t *updated = counter_fields(counters);
+
+  // Work out how many increment records are needed. Counters that went
+  // backwards (or jumped a long way) can't be expressed as increments,
+  // so those force a fresh snapshot instead.
+  uint16_t records = 0;
+  bool snapshot = false;
+  for (uint8_t i = 0; i < COUNTER_FIELDS; i++) {
+    if (updated[i] < totals[i] || updated[i] - totals[i] > 0xFFFF) {
+      snapshot = true;
+    } else if (updated[i] != totals[i]) {
+      records++;
+    }
+  }
+
+  if (!snapshot && records == 0) {
+    return;
+  }
+
+  if (snapshot || log->active_page == NO_PAGE
+      || log->write_offset + records * NOVA_COUNTER_LOG_RECORD_SIZE > log->page_size) {
+    // Slow path: compacting inline.
+    log->totals = *counters;
+    compact(log);
+    return;
+  }
+
+  for (uint8_t i = 0; i < COUNTER_FIELDS; i++) {
+    if (updated[i] != totals[i]) {
+      append(log, TAG_INC, i, (uint16_t)(updated[i] - totals[i]));
+      totals[i] = updated[i];
+    }
+  }
+}
+
+bool nova_counter_log_idle(nova_counter_log_t *log)
+{
+  if (!log->mounted) {
+    return false;
+  }
+
+  // Compact before the active page fills up, so saves never have to.
+  // Erasing the target page first is a separate unit of work.
+  if (log->active_page != NO_PAGE && needs_compaction(log)) {
+    uint8_t target = next_page(log);
+    if (!(log->erased_pages & (1 << target))) {
+      erase(log, target);
+    } else {
+      compact(log);
+    }
+    return true;
+  }
+
+  // Erase an obsolete page ahead of time.
+  for (uint8_t page = 0; page < log->page_count; page++) {
+    if (page != log->active_page && !(log->erased_pages & (1 << page))) {
+      erase(log, page);
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,167 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Log-structured, wear-leveled persistent store for usage counters.
+ *
+ * Rewriting the whole counters_t struct every time a counter changes costs
+ * a page erase and a full program cycle per event, and quickly wears out
+ * the flash on busy units. Instead, this store appends small increment
+ * records to a log that rotates across several flash pages. The live
+ * totals are kept in RAM.
+ *
+ * Platforms can use this to implement nova_load_counters() and
+ * nova_save_counters() (see nova-device.h):
+ *
+ *   void nova_load_counters(nova_t *nova, counters_t *counters) {
+ *     nova_counter_log_load(&my_log, counters);
+ *   }
+ *
+ *   void nova_save_counters(nova_t *nova, counters_t *counters) {
+ *     nova_counter_log_save(&my_log, counters);
+ *   }
+ *
+ * and should call nova_counter_log_idle() whenever the device has nothing
+ * else to do, so page compaction and erasing happens in the background
+ * rather than inside event handlers.
+ *
+ * Flash layout:
+ *
+ * Every record is 4 bytes (one flash word on the CC2541):
+ *
+ *   byte 0    : record tag (high nibble) | counter field index (low nibble)
+ *   byte 1..2 : 16 bit value, big-endian
+ *   byte 3    : check byte (bytes 0..2 XOR'd with 0xA5)
+ *
+ * Each page starts with a HEADER record holding an incrementing sequence
+ * number, followed by a snapshot of all counters (BASE_HI + BASE_LO per
+ * field), a COMMIT record, and then INC records appended as counters
+ * change. The committed page with the highest sequence number is the
+ * active page.
+ *
+ * When the active page fills up, the totals are compacted into a snapshot
+ * on the next (pre-erased) page, and the old page is queued for erasing.
+ * Pages are used round-robin so wear is spread evenly across them.
+ *
+ * A record torn by power loss fails its check byte and is skipped. A
+ * snapshot torn by power loss never gets its COMMIT record, so the
+ * previous page remains the active one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+/**
+ * Maximum number of flash pages the log can rotate across.
+ */
+#define NOVA_COUNTER_LOG_MAX_PAGES 8
+
+/**
+ * Size of each record written to flash.
+ */
+#define NOVA_COUNTER_LOG_RECORD_SIZE 4
+
+/**
+ * Background compaction starts once the active page is this full
+ * (numerator over 4, i.e. 3 => 75%).
+ */
+#define NOVA_COUNTER_LOG_COMPACT_QUARTERS 3
+
+/**
+ * State of the counter log. Allocate one per device and initialize with
+ * nova_counter_log_init().
+ */
+typedef struct nova_counter_log_t
+{
+  /** Live counter totals, reconstructed from flash by nova_counter_log_load(). */
+  counters_t totals;
+
+  /** Size of each flash page in bytes. Must be a multiple of the record size. */
+  uint16_t page_size;
+
+  /** Number of flash pages to rotate across (2..NOVA_COUNTER_LOG_MAX_PAGES). */
+  uint8_t page_count;
+
+  /** Page currently being appended to, or 0xFF if flash holds no log yet. */
+  uint8_t active_page;
+
+  /** Offset in active page where the next record will be written. */
+  uint16_t write_offset;
+
+  /** Sequence number of active page. */
+  uint16_t sequence;
+
+  /** Bitmask of pages known to be fully erased. */
+  uint8_t erased_pages;
+
+  /** Has the log been scanned from flash yet? */
+  bool mounted;
+
+  /**
+   * Arbitrary data that can be associated with the log, for use by the
+   * flash hooks below.
+   */
+  void *data;
+
+} nova_counter_log_t;
+
+/**
+ * Initialize log state. Does not touch flash - the log is scanned the
+ * first time nova_counter_log_load() is called.
+ */
+void nova_counter_log_init(nova_counter_log_t *log, uint16_t page_size, uint8_t page_count, void *data);
+
+/**
+ * Scan flash to reconstruct counter totals, and copy them into counters.
+ *
+ * Only the active page is replayed, so this is quick enough to be called
+ * on every nova_on_reset().
+ */
+void nova_counter_log_load(nova_counter_log_t *log, counters_t *counters);
+
+/**
+ * Persist counters by appending an increment record for each field that
+ * changed since the last load/save.
+ *
+ * Normally this costs one word program per changed field. Only when the
+ * active page is full (because nova_counter_log_idle() hasn't been called)
+ * does it fall back to compacting inline.
+ */
+void nova_counter_log_save(nova_counter_log_t *log, counters_t *counters);
+
+/**
+ * Perform one unit of background maintenance: compacting a nearly full
+ * active page, or erasing one obsolete page.
+ *
+ * Returns true if any work was done (so call again), false if idle.
+ */
+bool nova_counter_log_idle(nova_counter_log_t *log);
+
+
+
+// ----------------------------------------------------------------------------
+// Platform hooks.
+//
+// These must be implemented by platforms that use the counter log.
+// Offsets and lengths are always multiples of the record size.
+
+/**
+ * Read len bytes from flash page, starting at offset.
+ */
+void nova_counter_log_flash_read(nova_counter_log_t *log, uint8_t page, uint16_t offset, uint8_t *buf, uint16_t len);
+
+/**
+ * Program len bytes to flash page, starting at offset.
+ *
+ * Following flash semantics, programming can only clear bits, so the
+ * log only ever writes to words that have been erased.
+ */
+void nova_counter_log_flash_write(nova_counter_log_t *log, uint8_t page, uint16_t offset, const uint8_t *buf, uint16_t len);
+
+/**
+ * Erase a flash page, setting all bytes to 0xFF.
+ */
+void nova_counter_log_flash_erase(nova_counter_log_t *log, uint8_t page);
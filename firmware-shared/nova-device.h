@@ -27,6 +27,9 @@ void nova_load_counters(nova_t *nova, counters_t *counters);
 /**
  * Save counter data (diagnostic stats) to persistent store
  * (e.g. flash memory).
+ *
+ * Saves are deferred until the device is idle and coalesced, so this is
+ * never called while handling a button press or FLASH command.
  */
 void nova_save_counters(nova_t *nova, counters_t *counters);
 
@@ -50,9 +53,23 @@ void nova_load_flash_defaults(nova_t *nova, flash_defaults_t *flash_defaults);
  *
  * Implementations should encode the struct and write it to the BLE
  * GATT characteristic for communicating with the custom Nova app.
+ * See nova_codec_encode_command() in nova-codec.h.
  */
 void nova_send_app_command(nova_t *nova, app_command_t *cmd);
 
+/**
+ * Send several BLE commands to Nova app, in order.
+ *
+ * This is used instead of nova_send_app_command() once the App has turned
+ * on NOVA_FEATURE_FRAMES (see nova.h), with up to
+ * NOVA_APP_FRAME_MAX_COMMANDS commands at a time.
+ *
+ * Implementations should pack the commands into frames, and send each
+ * as a single write to the GATT characteristic.
+ * See nova_codec_encode_frame() in nova-codec.h.
+ */
+void nova_send_app_commands(nova_t *nova, app_command_t *cmds, uint8_t count);
+
 /**
  * Send a BLE Human Input Device (HID) key press to a connected device.
  *
@@ -76,11 +93,30 @@ void nova_set_status_indicator(nova_t *nova, bool lit);
  */
 void nova_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm);
 
+/**
+ * Return the current time in milliseconds from a free-running clock.
+ *
+ * The epoch is arbitrary (e.g. power on) and the value may wrap around.
+ * Typically this is the counter the hardware timer below compares against.
+ */
+timestamp_t nova_time_now(nova_t *nova);
+
+/**
+ * Return a timestamp for a trace record (see nova-trace.h), from a
+ * free-running counter that may wrap around. Use the finest resolution
+ * available; only differences between timestamps are used.
+ *
+ * Only called (and only needs implementing) when built with NOVA_TRACE.
+ */
+uint32_t nova_trace_timestamp(nova_t *nova);
+
 /**
  * Schedule a timer to fire in a given number of milliseconds.
  *
- * This is used to automatically turn the lights off if left on too long
- * (e.g. if the App crashes).
+ * This single hardware timer is multiplexed into many logical timers
+ * (see nova-timers.h), used to automatically turn the lights off if left
+ * on too long (e.g. if the App crashes), to save usage counters once the
+ * device has been idle for a while, etc.
  *
  * There will only ever be one timer scheduled at a time. If another
  * timer is to be scheduled before this one completes, nova_timer_clear()
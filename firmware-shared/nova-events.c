@@ -0,0 +1,183 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * Event queue between interrupt handlers and nova.c.
+ *
+ * See nova-events.h for usage.
+ */
+
+#include "nova-events.h"
+
+#include "nova-api.h"
+
+// Queue indexes are free running bytes, masked to a slot.
+typedef char check_queue_size[(NOVA_EVENT_QUEUE_SIZE & (NOVA_EVENT_QUEUE_SIZE - 1)) == 0
+    && NOVA_EVENT_QUEUE_SIZE <= 128 ? 1 : -1];
+
+#define SLOT(index) ((index) & (NOVA_EVENT_QUEUE_SIZE - 1))
+
+/**
+ * Reading the other side's index must happen before touching slots it
+ * guards (acquire), and publishing our own index must happen after
+ * (release).
+ */
+#if defined(__GNUC__)
+#define LOAD_INDEX(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_INDEX(p, value) __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#else
+#define LOAD_INDEX(p) (*(volatile uint8_t*)(p))
+#define STORE_INDEX(p, value) (*(volatile uint8_t*)(p) = (value))
+#endif
+
+void nova_events_init(nova_event_queue_t *queue)
+{
+  queue->tail = 0;
+  queue->head = 0;
+  queue->dropped = 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Producer
+
+/**
+ * Number of free slots, as seen by the producer.
+ */
+static uint8_t space(nova_event_queue_t *queue)
+{
+  uint8_t used = (uint8_t)(queue->tail - LOAD_INDEX(&queue->head));
+  return NOVA_EVENT_QUEUE_SIZE - used;
+}
+
+bool nova_events_post(nova_event_queue_t *queue, nova_event_type type, const app_command_t *cmd)
+{
+  if (space(queue) == 0) {
+    queue->dropped++;
+    return false;
+  }
+
+  nova_event_t *event = &queue->slots[SLOT(queue->tail)];
+  event->type = type;
+  event->frame_remaining = 0;
+  if (type == NOVA_EVENT_APP_COMMAND) {
+    event->cmd = *cmd;
+  }
+
+  STORE_INDEX(&queue->tail, (uint8_t)(queue->tail + 1));
+  return true;
+}
+
+bool nova_events_post_app_commands(nova_event_queue_t *queue, const app_command_t *cmds, uint8_t count)
+{
+  if (space(queue) < count) {
+    queue->dropped++;
+    return false;
+  }
+
+  // Publish the whole frame at once, so the consumer never sees part of it.
+  uint8_t tail = queue->tail;
+  for (uint8_t i = 0; i < count; i++, tail++) {
+    nova_event_t *event = &queue->slots[SLOT(tail)];
+    event->type = NOVA_EVENT_APP_FRAME_COMMAND;
+    event->frame_remaining = count - 1 - i;
+    event->cmd = cmds[i];
+  }
+
+  STORE_INDEX(&queue->tail, tail);
+  return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Consumer
+
+bool nova_events_take(nova_event_queue_t *queue, nova_event_t *event)
+{
+  if (queue->head == LOAD_INDEX(&queue->tail)) {
+    return false;
+  }
+
+  *event = queue->slots[SLOT(queue->head)];
+  STORE_INDEX(&queue->head, (uint8_t)(queue->head + 1));
+  return true;
+}
+
+/**
+ * Take the remaining commands of a frame, and pass it all on.
+ */
+static uint8_t dispatch_frame(nova_t *nova, nova_event_queue_t *queue, nova_event_t *first)
+{
+  app_command_t cmds[NOVA_EVENT_QUEUE_SIZE];
+  nova_event_t event;
+  uint8_t count = 0;
+
+  cmds[count++] = first->cmd;
+  for (uint8_t remaining = first->frame_remaining; remaining > 0 && count < NOVA_EVENT_QUEUE_SIZE; remaining--) {
+    if (!nova_events_take(queue, &event)) {
+      break;
+    }
+    cmds[count++] = event.cmd;
+  }
+
+  nova_on_app_commands(nova, cmds, count);
+  return count;
+}
+
+void nova_events_handle(nova_t *nova, nova_event_t *event)
+{
+  switch (event->type) {
+    case NOVA_EVENT_RESET:
+      nova_on_reset(nova);
+      break;
+    case NOVA_EVENT_BUTTON_PRESSDOWN:
+      nova_on_button_pressdown(nova);
+      break;
+    case NOVA_EVENT_BUTTON_RELEASE:
+      nova_on_button_release(nova);
+      break;
+    case NOVA_EVENT_CONNECT_APP:
+      nova_on_connect_app(nova);
+      break;
+    case NOVA_EVENT_DISCONNECT_APP:
+      nova_on_disconnect_app(nova);
+      break;
+    case NOVA_EVENT_CONNECT_HID:
+      nova_on_connect_hid(nova);
+      break;
+    case NOVA_EVENT_DISCONNECT_HID:
+      nova_on_disconnect_hid(nova);
+      break;
+    case NOVA_EVENT_TIMER_COMPLETE:
+      nova_on_timer_complete(nova);
+      break;
+    case NOVA_EVENT_POWER_FAILING:
+      nova_on_power_failing(nova);
+      break;
+    case NOVA_EVENT_APP_COMMAND:
+      nova_on_app_command(nova, &event->cmd);
+      break;
+    case NOVA_EVENT_APP_FRAME_COMMAND:
+      // A frame of one.
+      nova_on_app_commands(nova, &event->cmd, 1);
+      break;
+  }
+}
+
+uint8_t nova_events_dispatch(nova_t *nova, nova_event_queue_t *queue)
+{
+  // Only what's queued now, so a busy producer can't keep us here forever.
+  uint8_t pending = (uint8_t)(LOAD_INDEX(&queue->tail) - queue->head);
+  uint8_t handled = 0;
+  nova_event_t event;
+
+  while (handled < pending && nova_events_take(queue, &event)) {
+    if (event.type == NOVA_EVENT_APP_FRAME_COMMAND) {
+      handled += dispatch_frame(nova, queue, &event) - 1;
+    } else {
+      nova_events_handle(nova, &event);
+    }
+    handled++;
+  }
+
+  return handled;
+}
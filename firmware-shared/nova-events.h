@@ -0,0 +1,177 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Event queue between interrupt handlers and nova.c.
+ *
+ * nova.c is not re-entrant: if an interrupt calls nova_on_app_command()
+ * while the main loop is half way through nova_on_button_pressdown(), its
+ * state gets corrupted. And work done inside interrupts (lights, BLE
+ * notifications, flash writes) holds up everything else.
+ *
+ * Instead, interrupt handlers only post small typed events to a queue,
+ * and the main loop drains the queue, calling each nova_on_????() handler
+ * in turn and letting it run to completion before starting the next:
+ *
+ *   nova_event_queue_t events;
+ *   nova_events_init(&events);
+ *
+ *   // In interrupt handlers:
+ *   void button_isr() {
+ *     nova_events_post(&events, NOVA_EVENT_BUTTON_PRESSDOWN, NULL);
+ *   }
+ *   void gatt_write_isr(const uint8_t *data, uint16_t len) {
+ *     app_command_t cmd;
+ *     if (nova_codec_decode_command(data, len, &cmd)) {
+ *       nova_events_post(&events, NOVA_EVENT_APP_COMMAND, &cmd);
+ *     }
+ *   }
+ *
+ *   // Main loop:
+ *   for (;;) {
+ *     nova_events_dispatch(nova, &events);
+ *     sleep_until_interrupt();
+ *   }
+ *
+ * The queue is a lock-free single-producer/single-consumer ring buffer of
+ * fixed size slots. Posting never blocks and never allocates. Only one
+ * context may post (e.g. interrupts that can't preempt each other, or a
+ * single thread) and only one may drain. If the queue is full, the event
+ * is dropped, counted, and nova_events_post() returns false, so size it
+ * for the worst burst between two passes of the main loop.
+ *
+ * On the CC2541 single byte loads and stores are atomic, so it needs no
+ * locks or interrupt masking. Compilers with GCC style __atomic builtins
+ * also get the memory barriers needed on multi-core hosts (e.g. for
+ * simulators with a thread per interrupt source).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+/**
+ * Number of slots in the queue. Must be a power of 2, no more than 128.
+ * Override at compile time to trade RAM for burst capacity.
+ */
+#ifndef NOVA_EVENT_QUEUE_SIZE
+#define NOVA_EVENT_QUEUE_SIZE 8
+#endif
+
+/**
+ * Type of event. Each corresponds to a nova_on_????() function in
+ * nova-api.h.
+ */
+typedef enum
+{
+  NOVA_EVENT_RESET,
+  NOVA_EVENT_BUTTON_PRESSDOWN,
+  NOVA_EVENT_BUTTON_RELEASE,
+  NOVA_EVENT_CONNECT_APP,
+  NOVA_EVENT_DISCONNECT_APP,
+  NOVA_EVENT_CONNECT_HID,
+  NOVA_EVENT_DISCONNECT_HID,
+  NOVA_EVENT_TIMER_COMPLETE,
+  NOVA_EVENT_POWER_FAILING,
+
+  /** nova_on_app_command(). Holds the command. */
+  NOVA_EVENT_APP_COMMAND,
+
+  /**
+   * One command of a frame for nova_on_app_commands(). Posted together by
+   * nova_events_post_app_commands().
+   */
+  NOVA_EVENT_APP_FRAME_COMMAND
+
+} nova_event_type;
+
+/**
+ * One slot in the queue.
+ */
+typedef struct nova_event_t
+{
+  /** Value from nova_event_type. */
+  uint8_t type;
+
+  /**
+   * For NOVA_EVENT_APP_FRAME_COMMAND, how many more commands of the same
+   * frame follow this one.
+   */
+  uint8_t frame_remaining;
+
+  /** For NOVA_EVENT_APP_COMMAND and NOVA_EVENT_APP_FRAME_COMMAND. */
+  app_command_t cmd;
+
+} nova_event_t;
+
+typedef struct nova_event_queue_t
+{
+  nova_event_t slots[NOVA_EVENT_QUEUE_SIZE];
+
+  /**
+   * Free running counts of events posted and taken. Only the producer
+   * writes tail, and only the consumer writes head. The number of queued
+   * events is tail - head (wrapping).
+   */
+  uint8_t tail;
+  uint8_t head;
+
+  /** Events dropped because the queue was full. Written by producer. */
+  uint8_t dropped;
+
+} nova_event_queue_t;
+
+/**
+ * Empty the queue. Call before any interrupts that post are enabled.
+ */
+void nova_events_init(nova_event_queue_t *queue);
+
+
+// ----------------------------------------------------------------------------
+// Producer (e.g. interrupt handlers)
+
+/**
+ * Post an event. cmd is copied for NOVA_EVENT_APP_COMMAND, and ignored
+ * (may be NULL) otherwise.
+ *
+ * Returns false if the queue is full and the event was dropped.
+ */
+bool nova_events_post(nova_event_queue_t *queue, nova_event_type type, const app_command_t *cmd);
+
+/**
+ * Post a frame of commands (see NOVA_FEATURE_FRAMES), to be dispatched
+ * together to nova_on_app_commands(). All or nothing: returns false if
+ * there's not room for all of them, and drops the whole frame.
+ *
+ * count must be between 1 and NOVA_EVENT_QUEUE_SIZE.
+ */
+bool nova_events_post_app_commands(nova_event_queue_t *queue, const app_command_t *cmds, uint8_t count);
+
+
+// ----------------------------------------------------------------------------
+// Consumer (main loop)
+
+/**
+ * Take the oldest event off the queue, into event. Returns false if the
+ * queue is empty.
+ */
+bool nova_events_take(nova_event_queue_t *queue, nova_event_t *event);
+
+/**
+ * Pass one event straight to its nova_on_????() handler, without queuing.
+ * A NOVA_EVENT_APP_FRAME_COMMAND is handled as a frame of one.
+ *
+ * For code that gets events from somewhere other than interrupts (e.g.
+ * replaying a recording) but wants to treat them the same way.
+ */
+void nova_events_handle(nova_t *nova, nova_event_t *event);
+
+/**
+ * Take every event currently queued and pass each to its nova_on_????()
+ * handler, in order. Events posted meanwhile are left for the next call.
+ *
+ * Returns number of events handled.
+ */
+uint8_t nova_events_dispatch(nova_t *nova, nova_event_queue_t *queue);
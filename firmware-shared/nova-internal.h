@@ -12,14 +12,83 @@
 #include <stdbool.h>
 
 #include "nova.h"
+#include "nova-log.h"
+#include "nova-shadow.h"
+#include "nova-timers.h"
+#include "nova-trace.h"
+
+/**
+ * Usage counters are not saved as soon as they change, as that would put
+ * a flash write in the middle of triggering the light. Instead they are
+ * flushed when the device goes idle (lights off), once either:
+ *
+ * - NOVA_COUNTERS_FLUSH_EVENTS increments are waiting to be saved, or
+ * - NOVA_COUNTERS_FLUSH_IDLE milliseconds have passed with lights off.
+ *
+ * Counters are also flushed by nova_on_power_failing().
+ *
+ * Override these at compile time to trade flash wear against how many
+ * increments can be lost on a sudden power cut.
+ */
+#ifndef NOVA_COUNTERS_FLUSH_EVENTS
+#define NOVA_COUNTERS_FLUSH_EVENTS 16
+#endif
+
+#ifndef NOVA_COUNTERS_FLUSH_IDLE
+#define NOVA_COUNTERS_FLUSH_IDLE 2000
+#endif
+
+/**
+ * Protocol features this firmware supports (bitmask of app_feature).
+ * See NOVA_CMD_NEGOTIATE.
+ */
+#define NOVA_SUPPORTED_FEATURES (NOVA_FEATURE_FRAMES)
+
+/**
+ * Most commands a frame (see NOVA_FEATURE_FRAMES) can hold. A frame of
+ * the smallest commands in the default 20 byte BLE payload holds 4.
+ */
+#ifndef NOVA_APP_FRAME_MAX_COMMANDS
+#define NOVA_APP_FRAME_MAX_COMMANDS 4
+#endif
+
+/**
+ * Largest window (negotiate_t.window) the device agrees to: how many
+ * recent command ids from the App it remembers, to spot resends.
+ */
+#ifndef NOVA_APP_WINDOW_MAX
+#define NOVA_APP_WINDOW_MAX 8
+#endif
+
+/**
+ * Furthest ahead a flash can be scheduled (see NOVA_CMD_FLASH_AT), in
+ * milliseconds. No more than the longest timer (milliseconds_t).
+ */
+#ifndef NOVA_FLASH_AT_MAX_AHEAD
+#define NOVA_FLASH_AT_MAX_AHEAD 60000
+#endif
+
+/**
+ * Longest ago a scheduled flash (see NOVA_CMD_FLASH_AT) can have been
+ * due and still be started, late, in milliseconds.
+ */
+#ifndef NOVA_FLASH_AT_MAX_LATE
+#define NOVA_FLASH_AT_MAX_LATE 1000
+#endif
 
 struct nova_t
 {
   /**
-   * Usage counters. Loaded at startup and saved after each modification.
+   * Usage counters. Loaded at startup and saved once idle after
+   * modification (see counters_idle() in nova.c).
    */
   counters_t counters;
 
+  /**
+   * How many counter increments have not yet been saved.
+   */
+  uint8_t counters_unsaved;
+
   /**
    * Default flash settings for when user uses the button to trigger a flash.
    *
@@ -42,6 +111,35 @@ struct nova_t
    */
   bool is_lit;
 
+  /**
+   * Logical timers, multiplexed onto the single hardware timer.
+   * See nova-timers.h.
+   */
+  nova_timer_wheel_t timers;
+
+  /**
+   * Turns lights off if left on too long (e.g. if the App crashes).
+   */
+  nova_timer_t flash_timer;
+
+  /**
+   * Saves counters once device has been idle for a while.
+   */
+  nova_timer_t counters_timer;
+
+  /**
+   * Starts the flash scheduled by the App (see NOVA_CMD_FLASH_AT), with
+   * flash_at_settings.
+   */
+  nova_timer_t flash_at_timer;
+  flash_settings_t flash_at_settings;
+
+  /**
+   * What the lights, status LED and hardware timer were last set to, so
+   * calls that change nothing can be skipped. See nova-shadow.h.
+   */
+  nova_shadow_t shadow;
+
   /**
    * id incremented each time a command is sent to the app.
    */
@@ -53,6 +151,56 @@ struct nova_t
    */
   cmd_id_t command_id_for_trigger_ack;
 
+  /**
+   * Protocol features turned on by the App (bitmask of app_feature).
+   * See NOVA_CMD_NEGOTIATE.
+   */
+  uint8_t app_features;
+
+  /**
+   * Most commands the App may have in flight at once, as negotiated (see
+   * NOVA_CMD_NEGOTIATE). 0 if the App hasn't negotiated.
+   */
+  uint8_t app_window;
+
+  /**
+   * ids of the most recent commands received from the App (ring buffer of
+   * up to app_window entries, oldest at app_received_next once full).
+   * A command whose id is here has already been processed and ACKed, so
+   * a resend is ACKed again without being repeated. Not used if the App
+   * hasn't negotiated.
+   */
+  cmd_id_t app_received[NOVA_APP_WINDOW_MAX];
+  uint8_t app_received_count;
+  uint8_t app_received_next;
+
+  /**
+   * Is a frame of commands from the App being processed? If so, commands
+   * to send are held in app_outbox until it's done, so they can go back
+   * in a single frame.
+   */
+  bool app_in_frame;
+
+  /**
+   * Commands waiting to be sent to the App in a frame.
+   */
+  app_command_t app_outbox[NOVA_APP_FRAME_MAX_COMMANDS];
+  uint8_t app_outbox_count;
+
+#ifdef NOVA_TRACE
+  /**
+   * Latency trace records. See nova-trace.h.
+   */
+  nova_trace_t trace;
+#endif
+
+#ifdef NOVA_LOG
+  /**
+   * Tokenized debug log records. See nova-log.h.
+   */
+  nova_log_t log;
+#endif
+
   /**
    * Arbitrary data that can be associated with nova_t instance.
    * See nova_data()/nova_data_set() in nova.h.
@@ -0,0 +1,40 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * Tokenized debug log ring buffer.
+ *
+ * See nova-log.h for usage.
+ */
+
+#include "nova-log.h"
+
+#include "nova-internal.h"
+
+typedef char check_log_size[(NOVA_LOG_SIZE & (NOVA_LOG_SIZE - 1)) == 0 ? 1 : -1];
+typedef char check_log_messages[NOVA_LOG_MESSAGE_COUNT <= 0x100 ? 1 : -1];
+
+#ifdef NOVA_LOG
+
+bool nova_log_take(nova_t *nova, nova_log_record_t *record)
+{
+  nova_log_t *log = &nova->log;
+  if (log->written - log->taken > NOVA_LOG_SIZE) {
+    log->lost += log->written - log->taken - NOVA_LOG_SIZE;
+    log->taken = log->written - NOVA_LOG_SIZE;
+  }
+  if (log->taken == log->written) {
+    return false;
+  }
+  *record = log->records[log->taken & (NOVA_LOG_SIZE - 1)];
+  log->taken++;
+  return true;
+}
+
+#else
+
+bool nova_log_take(nova_t *nova, nova_log_record_t *record)
+{
+  return false;
+}
+
+#endif
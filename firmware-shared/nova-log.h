@@ -0,0 +1,139 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Optional tokenized debug log for nova.c.
+ *
+ * Formatting messages is too slow and the format strings too big for
+ * the device, so nova.c doesn't. Each message is given a name in
+ * NOVA_LOG_MESSAGES below, and a call site such as:
+ *
+ *   NOVA_LOG_WRITE(nova, FLASH_ON, warm, cool);
+ *
+ * just stores a 4 byte record (the message's id and two raw argument
+ * values) in a fixed size ring buffer in nova_t, overwriting the oldest
+ * if not taken off in time with nova_log_take(). The platform can copy
+ * records to flash, or send them over a debug UART or BLE, when idle.
+ *
+ * The format strings are only compiled into host tools, which expand
+ * NOVA_LOG_MESSAGES into a table of them (indexed by id) to turn
+ * records back into messages. See firmware-ui/log-decode.h.
+ *
+ * Records are only kept when built with NOVA_LOG defined (for every
+ * file, as it changes the layout of nova_t). Without it,
+ * NOVA_LOG_WRITE() expands to nothing, and nothing is added to nova_t.
+ *
+ * The ring buffer starts empty if nova_t is zeroed before first use
+ * (nova_on_reset() doesn't clear it, so records survive a reset).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+/**
+ * Number of records in the ring buffer. Must be a power of 2.
+ */
+#ifndef NOVA_LOG_SIZE
+#define NOVA_LOG_SIZE 32
+#endif
+
+/**
+ * Messages, with their format: {a} and {b} are replaced by the record's
+ * a (8 bit) and b (16 bit) values. Only add to the end, so ids (and
+ * records already saved) keep their meaning.
+ *
+ *   MESSAGE(name, format)
+ */
+#define NOVA_LOG_MESSAGES(MESSAGE) \
+  MESSAGE(RESET,                "reset, boot {b}") \
+  MESSAGE(DEFAULT_REGULAR,      "no regular flash defaults saved, using built-in") \
+  MESSAGE(DEFAULT_PREFLASH,     "no preflash defaults saved, using built-in") \
+  MESSAGE(APP_CONNECTED,        "App connected") \
+  MESSAGE(APP_DISCONNECTED,     "App disconnected") \
+  MESSAGE(HID_CONNECTED,        "HID connected") \
+  MESSAGE(HID_DISCONNECTED,     "HID disconnected") \
+  MESSAGE(FLASH_ON,             "flash on, warm {a} cool {b}") \
+  MESSAGE(FLASH_OFF,            "flash off") \
+  MESSAGE(TRIGGER_SENT,         "trigger {b} sent to App, pressed {a}") \
+  MESSAGE(TRIGGER_ACKED,        "trigger {b} ACKed by App") \
+  MESSAGE(APP_RESEND,           "command {b} (type {a}) resent by App, ACKing again") \
+  MESSAGE(APP_UNKNOWN,          "command {b} of unknown type {a} ignored") \
+  MESSAGE(NEGOTIATED,           "negotiated features {a}, window {b}") \
+  MESSAGE(COUNTERS_SAVED,       "counters saved, {a} changes") \
+  MESSAGE(POWER_FAILING,        "power failing") \
+  MESSAGE(FLASH_AT_SCHEDULED,   "flash scheduled by App in {b}ms") \
+  MESSAGE(FLASH_AT_LATE,        "flash scheduled by App {b}ms ago, starting now") \
+  MESSAGE(FLASH_AT_TOO_FAR,     "flash scheduled by App {b}s ahead ignored") \
+  MESSAGE(FLASH_AT_CANCELLED,   "flash scheduled by App cancelled") \
+  MESSAGE(FLASH_AT_TOO_LATE,    "flash scheduled by App {b}s ago ignored")
+
+#define NOVA_LOG_ENUM(name, format) NOVA_LOG_##name,
+
+typedef enum
+{
+  NOVA_LOG_MESSAGES(NOVA_LOG_ENUM)
+  NOVA_LOG_MESSAGE_COUNT
+} nova_log_message;
+
+#undef NOVA_LOG_ENUM
+
+/**
+ * One record: 4 bytes.
+ */
+typedef struct nova_log_record_t
+{
+  /** nova_log_message. */
+  uint8_t message;
+
+  /** Arguments (see NOVA_LOG_MESSAGES). */
+  uint8_t a;
+  uint16_t b;
+
+} nova_log_record_t;
+
+/**
+ * Ring buffer, kept in nova_t.
+ */
+typedef struct nova_log_t
+{
+  nova_log_record_t records[NOVA_LOG_SIZE];
+
+  /** Free running counts of records written and taken. */
+  uint32_t written;
+  uint32_t taken;
+
+  /** Records overwritten before they were taken. */
+  uint32_t lost;
+
+} nova_log_t;
+
+#ifdef NOVA_LOG
+
+/**
+ * Append a record. Expanded inline (nova_t must be complete, i.e.
+ * nova-internal.h included) so it costs a few stores, not a call.
+ */
+#define NOVA_LOG_WRITE(nova, name, a_val, b_val) \
+  do { \
+    nova_log_record_t *nova_log_slot_ = \
+        &(nova)->log.records[(nova)->log.written++ & (NOVA_LOG_SIZE - 1)]; \
+    nova_log_slot_->message = NOVA_LOG_##name; \
+    nova_log_slot_->a = (uint8_t)(a_val); \
+    nova_log_slot_->b = (uint16_t)(b_val); \
+  } while (0)
+
+#else
+
+#define NOVA_LOG_WRITE(nova, name, a, b) ((void)0)
+
+#endif
+
+/**
+ * Take the oldest record not yet taken. Returns false if there are none
+ * (or logging is compiled out). Records overwritten before being taken
+ * are skipped, and counted in nova_t.log.lost.
+ */
+bool nova_log_take(nova_t *nova, nova_log_record_t *record);
@@ -0,0 +1,73 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See nova-shadow.h
+ */
+
+#include "nova-shadow.h"
+#include "nova-device.h"
+#include "nova-internal.h"
+
+void nova_shadow_reset(nova_t *nova)
+{
+  nova_shadow_t *shadow = &nova->shadow;
+  shadow->lights_known = false;
+  shadow->status_known = false;
+  shadow->timer_known = false;
+}
+
+void nova_shadow_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm)
+{
+  nova_shadow_t *shadow = &nova->shadow;
+  if (shadow->lights_known && shadow->warm_pwm == warm_pwm && shadow->cool_pwm == cool_pwm) {
+    shadow->lights_suppressed++;
+    return;
+  }
+  nova_set_lights(nova, warm_pwm, cool_pwm);
+  shadow->lights_known = true;
+  shadow->warm_pwm = warm_pwm;
+  shadow->cool_pwm = cool_pwm;
+}
+
+void nova_shadow_set_status_indicator(nova_t *nova, bool lit)
+{
+  nova_shadow_t *shadow = &nova->shadow;
+  if (shadow->status_known && shadow->status_lit == lit) {
+    shadow->status_suppressed++;
+    return;
+  }
+  nova_set_status_indicator(nova, lit);
+  shadow->status_known = true;
+  shadow->status_lit = lit;
+}
+
+void nova_shadow_timer_schedule(nova_t *nova, milliseconds_t timeout)
+{
+  nova_shadow_t *shadow = &nova->shadow;
+  nova_timer_schedule(nova, timeout);
+  shadow->timer_known = true;
+  shadow->timer_scheduled = true;
+}
+
+void nova_shadow_timer_clear(nova_t *nova)
+{
+  nova_shadow_t *shadow = &nova->shadow;
+  if (shadow->timer_known && !shadow->timer_scheduled) {
+    shadow->timer_clears_suppressed++;
+    return;
+  }
+  nova_timer_clear(nova);
+  shadow->timer_known = true;
+  shadow->timer_scheduled = false;
+}
+
+void nova_shadow_timer_fired(nova_t *nova)
+{
+  nova->shadow.timer_scheduled = false;
+}
+
+uint32_t nova_shadow_suppressed(nova_t *nova)
+{
+  nova_shadow_t *shadow = &nova->shadow;
+  return shadow->lights_suppressed + shadow->status_suppressed + shadow->timer_clears_suppressed;
+}
@@ -0,0 +1,96 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Shadow copy of the hardware state nova.c sets through nova-device.h.
+ *
+ * nova.c sets the lights, status indicator and hardware timer from
+ * several places (flash_start(), flash_end(), update_status_indicator(),
+ * nova-timers.c), often to what they already are: e.g. an OFF while the
+ * lights are off, or a disconnect while the indicator is already off
+ * because the lights are on. Each of these is a PWM, GPIO or timer
+ * register write on real hardware, and reconfiguring PWM can glitch
+ * the lights.
+ *
+ * nova.c calls these instead of the nova-device.h functions. Each
+ * remembers what it last set, and only passes a call on to the device
+ * if it changes something. Suppressed calls are counted, for profiling.
+ *
+ * Nothing is known about the hardware after nova_shadow_reset() (called
+ * by nova_on_reset()), so the first call of each is always passed on.
+ *
+ * Usage:
+ *
+ *   nova_shadow_set_lights(nova, 0, 0);  // calls nova_set_lights()
+ *   nova_shadow_set_lights(nova, 0, 0);  // doesn't, lights already off
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+typedef struct nova_shadow_t
+{
+  /** Whether each of the below is known (see nova_shadow_reset()). */
+  bool lights_known;
+  bool status_known;
+  bool timer_known;
+
+  /** Last set with nova_set_lights(). */
+  uint8_t warm_pwm;
+  uint8_t cool_pwm;
+
+  /** Last set with nova_set_status_indicator(). */
+  bool status_lit;
+
+  /**
+   * Whether the hardware timer is scheduled: from nova_timer_schedule()
+   * until nova_timer_clear() or nova_on_timer_complete().
+   */
+  bool timer_scheduled;
+
+  /** Calls not passed on to the device, as nothing would change. */
+  uint32_t lights_suppressed;
+  uint32_t status_suppressed;
+  uint32_t timer_clears_suppressed;
+
+} nova_shadow_t;
+
+/**
+ * Forget what the hardware was set to, e.g. at startup. Suppression
+ * counters are kept.
+ */
+void nova_shadow_reset(nova_t *nova);
+
+/**
+ * nova_set_lights(), if the PWM settings have changed.
+ */
+void nova_shadow_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm);
+
+/**
+ * nova_set_status_indicator(), if it has changed.
+ */
+void nova_shadow_set_status_indicator(nova_t *nova, bool lit);
+
+/**
+ * nova_timer_schedule(). Always passed on, as time has moved on.
+ */
+void nova_shadow_timer_schedule(nova_t *nova, milliseconds_t timeout);
+
+/**
+ * nova_timer_clear(), if the hardware timer is scheduled.
+ */
+void nova_shadow_timer_clear(nova_t *nova);
+
+/**
+ * Note the hardware timer has fired, so is no longer scheduled. Called by
+ * nova_on_timer_complete().
+ */
+void nova_shadow_timer_fired(nova_t *nova);
+
+/**
+ * Total calls suppressed, of all kinds.
+ */
+uint32_t nova_shadow_suppressed(nova_t *nova);
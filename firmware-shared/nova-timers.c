@@ -0,0 +1,252 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * Logical timer service.
+ *
+ * See nova-timers.h for how it works and usage.
+ */
+
+#include "nova-timers.h"
+
+#include <stddef.h>
+
+#include "nova-device.h"
+#include "nova-internal.h"
+#include "nova-shadow.h"
+
+#define SLOT_MASK (NOVA_TIMER_WHEEL_SLOTS - 1)
+
+static uint8_t slot_of(timestamp_t time)
+{
+  return (uint8_t)((time >> NOVA_TIMER_SLOT_SHIFT) & SLOT_MASK);
+}
+
+/**
+ * Is time a before time b? Copes with clock wrap-around.
+ */
+static bool before(timestamp_t a, timestamp_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// Wheel slots
+
+static void link(nova_timer_wheel_t *wheel, nova_timer_t *timer)
+{
+  uint8_t slot = slot_of(timer->deadline);
+  timer->prev = NULL;
+  timer->next = wheel->slots[slot];
+  if (timer->next) {
+    timer->next->prev = timer;
+  }
+  wheel->slots[slot] = timer;
+  wheel->occupied |= ((uint32_t)1 << slot);
+  timer->armed = true;
+}
+
+static void unlink(nova_timer_wheel_t *wheel, nova_timer_t *timer)
+{
+  uint8_t slot = slot_of(timer->deadline);
+  if (timer->prev) {
+    timer->prev->next = timer->next;
+  } else {
+    wheel->slots[slot] = timer->next;
+  }
+  if (timer->next) {
+    timer->next->prev = timer->prev;
+  }
+  if (!wheel->slots[slot]) {
+    wheel->occupied &= ~((uint32_t)1 << slot);
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->armed = false;
+}
+
+/**
+ * Find timer with earliest deadline, or NULL if none are armed.
+ *
+ * All deadlines are within one revolution after the cursor, so the first
+ * occupied slot (walking forwards from the cursor) holds the earliest.
+ */
+static nova_timer_t *earliest(nova_timer_wheel_t *wheel)
+{
+  if (!wheel->occupied) {
+    return NULL;
+  }
+
+  uint8_t start = slot_of(wheel->cursor);
+  for (uint8_t i = 0; i < NOVA_TIMER_WHEEL_SLOTS; i++) {
+    uint8_t slot = (start + i) & SLOT_MASK;
+    if (wheel->occupied & ((uint32_t)1 << slot)) {
+      nova_timer_t *result = wheel->slots[slot];
+      for (nova_timer_t *timer = result->next; timer; timer = timer->next) {
+        if (before(timer->deadline, result->deadline)) {
+          result = timer;
+        }
+      }
+      return result;
+    }
+  }
+  return NULL;
+}
+
+
+// ----------------------------------------------------------------------------
+// Hardware timer
+
+static void hardware_program(nova_t *nova, timestamp_t deadline, timestamp_t now)
+{
+  nova_timer_wheel_t *wheel = &nova->timers;
+  milliseconds_t timeout = before(now, deadline) ? (milliseconds_t)(deadline - now) : 0;
+  NOVA_TRACE_BEGIN(nova, TIMER_CLEAR, 0, 0);
+  nova_shadow_timer_clear(nova);
+  NOVA_TRACE_END(nova, TIMER_CLEAR);
+  NOVA_TRACE_BEGIN(nova, TIMER_SCHEDULE, 0, timeout);
+  nova_shadow_timer_schedule(nova, timeout);
+  NOVA_TRACE_END(nova, TIMER_SCHEDULE);
+  wheel->hardware_armed = true;
+  wheel->hardware_deadline = deadline;
+}
+
+/**
+ * Ensure hardware timer is set for the earliest deadline (or cleared if
+ * nothing is armed).
+ */
+static void hardware_update(nova_t *nova, timestamp_t now)
+{
+  nova_timer_wheel_t *wheel = &nova->timers;
+  nova_timer_t *next = earliest(wheel);
+  if (!next) {
+    if (wheel->hardware_armed) {
+      NOVA_TRACE_BEGIN(nova, TIMER_CLEAR, 0, 0);
+      nova_shadow_timer_clear(nova);
+      NOVA_TRACE_END(nova, TIMER_CLEAR);
+      wheel->hardware_armed = false;
+    }
+  } else if (!wheel->hardware_armed || next->deadline != wheel->hardware_deadline) {
+    hardware_program(nova, next->deadline, now);
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void nova_timers_reset(nova_t *nova)
+{
+  nova_timer_wheel_t *wheel = &nova->timers;
+  for (uint8_t i = 0; i < NOVA_TIMER_WHEEL_SLOTS; i++) {
+    wheel->slots[i] = NULL;
+  }
+  wheel->occupied = 0;
+  wheel->cursor = nova_time_now(nova);
+  wheel->hardware_armed = false;
+  wheel->hardware_deadline = 0;
+  NOVA_TRACE_BEGIN(nova, TIMER_CLEAR, 0, 0);
+  nova_shadow_timer_clear(nova);
+  NOVA_TRACE_END(nova, TIMER_CLEAR);
+}
+
+void nova_timer_init(nova_timer_t *timer, nova_timer_callback callback)
+{
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->deadline = 0;
+  timer->timeout = 0;
+  timer->callback = callback;
+  timer->armed = false;
+}
+
+void nova_timer_arm(nova_t *nova, nova_timer_t *timer, milliseconds_t timeout)
+{
+  nova_timer_arm_at(nova, timer, nova_time_now(nova) + timeout);
+}
+
+void nova_timer_arm_at(nova_t *nova, nova_timer_t *timer, timestamp_t deadline)
+{
+  nova_timer_wheel_t *wheel = &nova->timers;
+  timestamp_t now = nova_time_now(nova);
+
+  // If rescheduling the timer the hardware was set for, the hardware
+  // timer will need updating even if this deadline is later.
+  bool was_earliest = timer->armed && wheel->hardware_armed
+      && timer->deadline == wheel->hardware_deadline;
+  if (timer->armed) {
+    unlink(wheel, timer);
+  }
+
+  // Move the cursor forward when it's safe to do so, i.e. nothing is
+  // overdue. This keeps all deadlines within one revolution of it.
+  if (!wheel->occupied
+      || (wheel->hardware_armed && !before(wheel->hardware_deadline, now))) {
+    wheel->cursor = now;
+  }
+
+  // Nothing may be due before the cursor, so anything overdue is due now.
+  timer->deadline = before(deadline, now) ? now : deadline;
+  timer->timeout = (milliseconds_t)(timer->deadline - now);
+  link(wheel, timer);
+
+  if (!wheel->hardware_armed || before(timer->deadline, wheel->hardware_deadline)) {
+    hardware_program(nova, timer->deadline, now);
+  } else if (was_earliest) {
+    hardware_update(nova, now);
+  }
+}
+
+void nova_timer_cancel(nova_t *nova, nova_timer_t *timer)
+{
+  nova_timer_wheel_t *wheel = &nova->timers;
+  if (!timer->armed) {
+    return;
+  }
+
+  unlink(wheel, timer);
+
+  // Only need to touch the hardware timer if it was set for this one.
+  if (wheel->hardware_armed && timer->deadline == wheel->hardware_deadline) {
+    hardware_update(nova, nova_time_now(nova));
+  }
+}
+
+bool nova_timer_is_armed(nova_timer_t *timer)
+{
+  return timer->armed;
+}
+
+uint32_t nova_timer_remaining(nova_t *nova, nova_timer_t *timer)
+{
+  if (!timer->armed) {
+    return 0;
+  }
+  timestamp_t now = nova_time_now(nova);
+  return before(now, timer->deadline) ? timer->deadline - now : 0;
+}
+
+uint32_t nova_timer_timeout(nova_timer_t *timer)
+{
+  return timer->timeout;
+}
+
+void nova_timers_expire(nova_t *nova)
+{
+  nova_timer_wheel_t *wheel = &nova->timers;
+  timestamp_t now = nova_time_now(nova);
+
+  // The hardware timer has fired, so it's no longer armed.
+  wheel->hardware_armed = false;
+
+  // Fire everything that's due. Callbacks may arm or cancel timers.
+  nova_timer_t *timer;
+  while ((timer = earliest(wheel)) && !before(now, timer->deadline)) {
+    unlink(wheel, timer);
+    timer->callback(nova);
+  }
+
+  // Nothing left is overdue.
+  wheel->cursor = now;
+  hardware_update(nova, now);
+}
@@ -0,0 +1,152 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Logical timer service.
+ *
+ * Platforms only have to provide a single compare-match timer (see
+ * nova_timer_schedule() and nova_timer_clear() in nova-device.h) plus a
+ * free-running clock (nova_time_now()). This multiplexes any number of
+ * logical timers on top of it, so independent features (flash timeout,
+ * saving counters, etc) can each own their own timer.
+ *
+ * Timers are kept in a hashed timing wheel: each slot holds an unsorted
+ * doubly linked list of timers whose deadline falls in that slot, plus a
+ * bitmask of which slots are occupied. Arming and cancelling a timer
+ * are O(1) list operations. The hardware timer is always programmed for
+ * the earliest deadline, which is found by scanning the occupancy mask
+ * from the current slot and then the (short) list of the first occupied
+ * slot.
+ *
+ * The wheel spans NOVA_TIMER_WHEEL_SLOTS << NOVA_TIMER_SLOT_SHIFT
+ * milliseconds, which comfortably exceeds the longest timeout
+ * (milliseconds_t), so timers never wrap around the wheel.
+ *
+ * Usage:
+ *
+ *   // At reset:
+ *   nova_timers_reset(nova);
+ *   nova_timer_init(&nova->my_timer, my_callback);
+ *
+ *   // Later:
+ *   nova_timer_arm(nova, &nova->my_timer, 1000);  // my_callback(nova) in 1s
+ *   nova_timer_arm_at(nova, &nova->my_timer, t);  // or when the clock reads t
+ *   nova_timer_cancel(nova, &nova->my_timer);     // changed my mind
+ *
+ *   // And nova_on_timer_complete() calls:
+ *   nova_timers_expire(nova);
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+#define NOVA_TIMER_WHEEL_SLOTS 32
+#define NOVA_TIMER_SLOT_SHIFT 13 // 8192ms per slot
+
+/**
+ * Function to call when a logical timer expires.
+ */
+typedef void (*nova_timer_callback)(nova_t *nova);
+
+/**
+ * A logical timer. Typically embedded in nova_t.
+ */
+typedef struct nova_timer_t
+{
+  /** Links to other timers in the same wheel slot. */
+  struct nova_timer_t *next;
+  struct nova_timer_t *prev;
+
+  /** Absolute time (see nova_time_now()) when timer should fire. */
+  timestamp_t deadline;
+
+  /** Milliseconds from when timer was last armed to its deadline. */
+  milliseconds_t timeout;
+
+  /** Function to call when timer fires. */
+  nova_timer_callback callback;
+
+  /** Is timer waiting to fire? */
+  bool armed;
+
+} nova_timer_t;
+
+/**
+ * All logical timers for a device, and the state of the hardware timer.
+ */
+typedef struct nova_timer_wheel_t
+{
+  /** Head of list of timers for each slot. */
+  nova_timer_t *slots[NOVA_TIMER_WHEEL_SLOTS];
+
+  /** Bitmask of slots that contain at least one timer. */
+  uint32_t occupied;
+
+  /**
+   * Time that the wheel has been processed up to. All armed timers have
+   * a deadline at or after this.
+   */
+  timestamp_t cursor;
+
+  /** Is the hardware timer currently scheduled? */
+  bool hardware_armed;
+
+  /** When the hardware timer will fire. Always the earliest deadline. */
+  timestamp_t hardware_deadline;
+
+} nova_timer_wheel_t;
+
+/**
+ * Cancel all timers and the hardware timer. Call at startup before
+ * using any other functions.
+ */
+void nova_timers_reset(nova_t *nova);
+
+/**
+ * Prepare a timer for use. It starts disarmed.
+ */
+void nova_timer_init(nova_timer_t *timer, nova_timer_callback callback);
+
+/**
+ * Arm timer to fire timeout milliseconds from now. If the timer is
+ * already armed, it's rescheduled.
+ */
+void nova_timer_arm(nova_t *nova, nova_timer_t *timer, milliseconds_t timeout);
+
+/**
+ * Arm timer to fire at deadline (see nova_time_now()), which must be no
+ * further ahead than the longest timeout (milliseconds_t). A deadline
+ * that has already passed fires as soon as possible. If the timer is
+ * already armed, it's rescheduled.
+ */
+void nova_timer_arm_at(nova_t *nova, nova_timer_t *timer, timestamp_t deadline);
+
+/**
+ * Disarm timer. If not armed, this does nothing.
+ */
+void nova_timer_cancel(nova_t *nova, nova_timer_t *timer);
+
+/**
+ * Is timer waiting to fire?
+ */
+bool nova_timer_is_armed(nova_timer_t *timer);
+
+/**
+ * How many milliseconds until timer fires (0 if not armed or overdue).
+ */
+uint32_t nova_timer_remaining(nova_t *nova, nova_timer_t *timer);
+
+/**
+ * How many milliseconds timer was armed for, when last armed (0 if
+ * never armed). With nova_timer_remaining(), how far along it is.
+ */
+uint32_t nova_timer_timeout(nova_timer_t *timer);
+
+/**
+ * Fire callbacks of all timers that are due, then reprogram the hardware
+ * timer for the next deadline. Called from nova_on_timer_complete().
+ */
+void nova_timers_expire(nova_t *nova);
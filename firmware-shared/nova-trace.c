@@ -0,0 +1,57 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * Latency tracing ring buffer.
+ *
+ * See nova-trace.h for usage.
+ */
+
+#include "nova-trace.h"
+
+#include "nova-device.h"
+#include "nova-internal.h"
+
+typedef char check_trace_size[(NOVA_TRACE_SIZE & (NOVA_TRACE_SIZE - 1)) == 0 ? 1 : -1];
+typedef char check_trace_points[NOVA_TRACE_POINT_COUNT <= NOVA_TRACE_INSTANT ? 1 : -1];
+
+#define SLOT(index) ((index) & (NOVA_TRACE_SIZE - 1))
+
+#ifdef NOVA_TRACE
+
+void nova_trace_record(nova_t *nova, uint8_t point, uint8_t a, uint16_t b)
+{
+  nova_trace_record_t *record = &nova->trace.records[SLOT(nova->trace.written)];
+  record->timestamp = nova_trace_timestamp(nova);
+  record->point = point;
+  record->a = a;
+  record->b = b;
+  nova->trace.written++;
+}
+
+bool nova_trace_take(nova_t *nova, nova_trace_record_t *record)
+{
+  nova_trace_t *trace = &nova->trace;
+  if (trace->written - trace->taken > NOVA_TRACE_SIZE) {
+    trace->lost += trace->written - trace->taken - NOVA_TRACE_SIZE;
+    trace->taken = trace->written - NOVA_TRACE_SIZE;
+  }
+  if (trace->taken == trace->written) {
+    return false;
+  }
+  *record = trace->records[SLOT(trace->taken)];
+  trace->taken++;
+  return true;
+}
+
+#else
+
+void nova_trace_record(nova_t *nova, uint8_t point, uint8_t a, uint16_t b)
+{
+}
+
+bool nova_trace_take(nova_t *nova, nova_trace_record_t *record)
+{
+  return false;
+}
+
+#endif
@@ -0,0 +1,149 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Optional latency tracing for nova.c.
+ *
+ * When built with NOVA_TRACE defined (for every file, as it changes the
+ * layout of nova_t), nova.c records a compact timestamped record on entry
+ * to and exit from every nova_on_????() handler, around every call to a
+ * nova-device.h function, and whenever a command is queued for the App.
+ * Records go in a fixed size ring buffer in nova_t, overwriting the
+ * oldest if not taken off in time with nova_trace_take().
+ *
+ * From these, the time along a path can be measured, e.g. from the button
+ * being pressed to the lights coming on, or from a FLASH command arriving
+ * to its ACK being sent.
+ *
+ * Timestamps come from nova_trace_timestamp() in nova-device.h, which
+ * only needs implementing when tracing.
+ *
+ * The ring buffer starts empty if nova_t is zeroed before first use
+ * (nova_on_reset() doesn't clear it, so records survive a reset).
+ *
+ * Without NOVA_TRACE, the NOVA_TRACE_????() macros expand to nothing, and
+ * nothing is added to nova_t.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova.h"
+
+/**
+ * Number of records in the ring buffer. Must be a power of 2.
+ */
+#ifndef NOVA_TRACE_SIZE
+#define NOVA_TRACE_SIZE 64
+#endif
+
+/**
+ * Points traced, with the meaning of each record's a and b values:
+ *
+ *   POINT(name, a, b)
+ */
+#define NOVA_TRACE_POINTS(POINT) \
+  /* nova_on_????() handlers (nova-api.h) */ \
+  POINT(ON_RESET,               -,        -) \
+  POINT(ON_CONNECT_APP,         -,        -) \
+  POINT(ON_DISCONNECT_APP,      -,        -) \
+  POINT(ON_CONNECT_HID,         -,        -) \
+  POINT(ON_DISCONNECT_HID,      -,        -) \
+  POINT(ON_BUTTON_PRESSDOWN,    -,        -) \
+  POINT(ON_BUTTON_RELEASE,      -,        -) \
+  POINT(ON_APP_COMMAND,         type,     id) \
+  POINT(ON_APP_COMMANDS,        count,    first id) \
+  POINT(ON_TIMER_COMPLETE,      -,        -) \
+  POINT(ON_POWER_FAILING,       -,        -) \
+  /* nova-device.h calls */ \
+  POINT(LOAD_COUNTERS,          -,        -) \
+  POINT(SAVE_COUNTERS,          -,        -) \
+  POINT(LOAD_FLASH_DEFAULTS,    -,        -) \
+  POINT(SEND_APP_COMMAND,       type,     id) \
+  POINT(SEND_APP_COMMANDS,      count,    first id) \
+  POINT(SEND_HID_KEY,           key code, -) \
+  POINT(SET_STATUS_INDICATOR,   lit,      -) \
+  POINT(SET_LIGHTS,             warm,     cool) \
+  POINT(TIMER_SCHEDULE,         -,        timeout) \
+  POINT(TIMER_CLEAR,            -,        -) \
+  /* Instant: command queued for the App (sent by next SEND_APP_COMMAND(S)) */ \
+  POINT(APP_QUEUED,             type,     id)
+
+#define NOVA_TRACE_ENUM(name, a, b) NOVA_TRACE_##name,
+
+typedef enum
+{
+  NOVA_TRACE_POINTS(NOVA_TRACE_ENUM)
+  NOVA_TRACE_POINT_COUNT
+} nova_trace_point;
+
+#undef NOVA_TRACE_ENUM
+
+/** Phase of a record, in the top bits of nova_trace_record_t.point. */
+#define NOVA_TRACE_ENTER   0x00
+#define NOVA_TRACE_EXIT    0x80
+#define NOVA_TRACE_INSTANT 0x40
+#define NOVA_TRACE_PHASE_MASK 0xC0
+
+/**
+ * One record: 8 bytes.
+ */
+typedef struct nova_trace_record_t
+{
+  /** From nova_trace_timestamp(). */
+  uint32_t timestamp;
+
+  /** nova_trace_point, ORed with NOVA_TRACE_ENTER/EXIT/INSTANT. */
+  uint8_t point;
+
+  /** Depends on point (see NOVA_TRACE_POINTS). */
+  uint8_t a;
+  uint16_t b;
+
+} nova_trace_record_t;
+
+/**
+ * Ring buffer, kept in nova_t.
+ */
+typedef struct nova_trace_t
+{
+  nova_trace_record_t records[NOVA_TRACE_SIZE];
+
+  /** Free running counts of records written and taken. */
+  uint32_t written;
+  uint32_t taken;
+
+  /** Records overwritten before they were taken. */
+  uint32_t lost;
+
+} nova_trace_t;
+
+#ifdef NOVA_TRACE
+
+#define NOVA_TRACE_BEGIN(nova, point, a, b) \
+  nova_trace_record((nova), NOVA_TRACE_##point | NOVA_TRACE_ENTER, (uint8_t)(a), (uint16_t)(b))
+#define NOVA_TRACE_END(nova, point) \
+  nova_trace_record((nova), NOVA_TRACE_##point | NOVA_TRACE_EXIT, 0, 0)
+#define NOVA_TRACE_MARK(nova, point, a, b) \
+  nova_trace_record((nova), NOVA_TRACE_##point | NOVA_TRACE_INSTANT, (uint8_t)(a), (uint16_t)(b))
+
+#else
+
+#define NOVA_TRACE_BEGIN(nova, point, a, b) ((void)0)
+#define NOVA_TRACE_END(nova, point) ((void)0)
+#define NOVA_TRACE_MARK(nova, point, a, b) ((void)0)
+
+#endif
+
+/**
+ * Append a record. Use the NOVA_TRACE_????() macros instead.
+ */
+void nova_trace_record(nova_t *nova, uint8_t point, uint8_t a, uint16_t b);
+
+/**
+ * Take the oldest record not yet taken. Returns false if there are none
+ * (or tracing is compiled out). Records overwritten before being taken
+ * are skipped, and counted in nova_t.trace.lost.
+ */
+bool nova_trace_take(nova_t *nova, nova_trace_record_t *record);
@@ -32,11 +32,22 @@
 #include "nova-api.h"
 #include "nova-device.h"
 #include "nova-internal.h"
+#include "nova-shadow.h"
+#include "nova-timers.h"
 
 // Forward declarations: see below.
 void flash_start(nova_t *nova, flash_settings_t *flash_settings);
 void flash_end(nova_t *nova);
+void flash_at_fire(nova_t *nova);
+void flash_at_cancel(nova_t *nova);
 void update_status_indicator(nova_t *nova);
+void counters_changed(nova_t *nova);
+void counters_idle(nova_t *nova);
+void counters_flush(nova_t *nova);
+void app_send(nova_t *nova, app_command_t *cmd);
+void app_flush(nova_t *nova);
+void app_window_reset(nova_t *nova, uint8_t window);
+bool app_is_resend(nova_t *nova, cmd_id_t id);
 
 
 // ----------------------------------------------------------------------------
@@ -48,27 +59,47 @@ void update_status_indicator(nova_t *nova);
  */
 void nova_on_reset(nova_t *nova)
 {
+  NOVA_TRACE_BEGIN(nova, ON_RESET, 0, 0);
+
+  // Whatever the lights, status LED and timer were set to before is
+  // unknown, so set them all again.
+  nova_shadow_reset(nova);
+
+  // Cancel all timers.
+  nova_timers_reset(nova);
+  nova_timer_init(&nova->flash_timer, flash_end);
+  nova_timer_init(&nova->counters_timer, counters_flush);
+  nova_timer_init(&nova->flash_at_timer, flash_at_fire);
+
   // Restore flash defaults from non-volatile memory.
+  NOVA_TRACE_BEGIN(nova, LOAD_FLASH_DEFAULTS, 0, 0);
   nova_load_flash_defaults(nova, &nova->flash_defaults);
+  NOVA_TRACE_END(nova, LOAD_FLASH_DEFAULTS);
 
   // If no flash defaults have been set, use something sensible.
   if (nova->flash_defaults.regular.timeout == 0) {
+    NOVA_LOG_WRITE(nova, DEFAULT_REGULAR, 0, 0);
     nova->flash_defaults.regular.timeout = 5000;
     nova->flash_defaults.regular.warm = 127;
     nova->flash_defaults.regular.cool = 127;
   }
   if (nova->flash_defaults.preflash.timeout == 0) {
+    NOVA_LOG_WRITE(nova, DEFAULT_PREFLASH, 0, 0);
     nova->flash_defaults.preflash.timeout = 10000;
     nova->flash_defaults.preflash.warm = 63;
     nova->flash_defaults.preflash.cool = 63;
   }
 
   // Restore usage counters from non-volatile memory.
+  NOVA_TRACE_BEGIN(nova, LOAD_COUNTERS, 0, 0);
   nova_load_counters(nova, &nova->counters);
+  NOVA_TRACE_END(nova, LOAD_COUNTERS);
+  nova->counters_unsaved = 0;
 
-  // Increment and save boot counter.
+  // Increment boot counter (saved once idle, see flash_end()).
   nova->counters.boot++;
-  nova_save_counters(nova, &nova->counters);
+  counters_changed(nova);
+  NOVA_LOG_WRITE(nova, RESET, 0, nova->counters.boot);
 
   // Ensure lights are off, timers are reset, etc.
   flash_end(nova);
@@ -78,9 +109,15 @@ void nova_on_reset(nova_t *nova)
   nova->ble_hid_connected = false;
   nova->outbound_command_id = 0;
   nova->command_id_for_trigger_ack = 0;
+  nova->app_features = 0;
+  nova->app_in_frame = false;
+  nova->app_outbox_count = 0;
+  app_window_reset(nova, 0);
 
   // Reset status LED.
   update_status_indicator(nova);
+
+  NOVA_TRACE_END(nova, ON_RESET);
 }
 
 
@@ -92,15 +129,24 @@ void nova_on_reset(nova_t *nova)
  */
 void nova_on_connect_app(nova_t *nova)
 {
-  // Update internal state.
+  NOVA_TRACE_BEGIN(nova, ON_CONNECT_APP, 0, 0);
+  NOVA_LOG_WRITE(nova, APP_CONNECTED, 0, 0);
+
+  // Update internal state. Each connection starts without optional
+  // protocol features, until the App negotiates them.
   nova->ble_app_connected = true;
+  nova->app_features = 0;
+  app_window_reset(nova, 0);
 
   // Update status LED.
   update_status_indicator(nova);
 
-  // Increment and save counter.
+  // Increment counter, and save it if idle.
   nova->counters.app_connect++;
-  nova_save_counters(nova, &nova->counters);
+  counters_changed(nova);
+  counters_idle(nova);
+
+  NOVA_TRACE_END(nova, ON_CONNECT_APP);
 }
 
 /**
@@ -108,8 +154,16 @@ void nova_on_connect_app(nova_t *nova)
  */
 void nova_on_disconnect_app(nova_t *nova)
 {
+  NOVA_TRACE_BEGIN(nova, ON_DISCONNECT_APP, 0, 0);
+  NOVA_LOG_WRITE(nova, APP_DISCONNECTED, 0, 0);
+
   // Update internal state.
   nova->ble_app_connected = false;
+  nova->app_features = 0;
+  app_window_reset(nova, 0);
+
+  // A flash scheduled by the App has nobody to take the photo.
+  flash_at_cancel(nova);
 
   // Update status LED.
   update_status_indicator(nova);
@@ -118,6 +172,8 @@ void nova_on_disconnect_app(nova_t *nova)
   if (!nova->ble_hid_connected) {
     flash_end(nova);
   }
+
+  NOVA_TRACE_END(nova, ON_DISCONNECT_APP);
 }
 
 /**
@@ -125,15 +181,21 @@ void nova_on_disconnect_app(nova_t *nova)
  */
 void nova_on_connect_hid(nova_t *nova)
 {
+  NOVA_TRACE_BEGIN(nova, ON_CONNECT_HID, 0, 0);
+  NOVA_LOG_WRITE(nova, HID_CONNECTED, 0, 0);
+
   // Update internal state.
   nova->ble_hid_connected = true;
 
   // Update status LED.
   update_status_indicator(nova);
 
-  // Increment and save counter.
+  // Increment counter, and save it if idle.
   nova->counters.hid_connect++;
-  nova_save_counters(nova, &nova->counters);
+  counters_changed(nova);
+  counters_idle(nova);
+
+  NOVA_TRACE_END(nova, ON_CONNECT_HID);
 }
 
 /**
@@ -141,6 +203,9 @@ void nova_on_connect_hid(nova_t *nova)
  */
 void nova_on_disconnect_hid(nova_t *nova)
 {
+  NOVA_TRACE_BEGIN(nova, ON_DISCONNECT_HID, 0, 0);
+  NOVA_LOG_WRITE(nova, HID_DISCONNECTED, 0, 0);
+
   // Update internal state.
   nova->ble_hid_connected = false;
 
@@ -151,6 +216,8 @@ void nova_on_disconnect_hid(nova_t *nova)
   if (!nova->ble_app_connected) {
     flash_end(nova);
   }
+
+  NOVA_TRACE_END(nova, ON_DISCONNECT_HID);
 }
 
 
@@ -163,6 +230,8 @@ void nova_on_disconnect_hid(nova_t *nova)
  */
 void nova_on_button_pressdown(nova_t *nova)
 {
+  NOVA_TRACE_BEGIN(nova, ON_BUTTON_PRESSDOWN, 0, 0);
+
   // Turn lights on with pre-flash warm/cool settings.
   flash_start(nova, &nova->flash_defaults.preflash);
 
@@ -173,7 +242,8 @@ void nova_on_button_pressdown(nova_t *nova)
     cmd.header.id = ++(nova->outbound_command_id);
     cmd.header.type = NOVA_CMD_TRIGGER;
     cmd.body.trigger.is_pressed = true;
-    nova_send_app_command(nova, &cmd);
+    app_send(nova, &cmd);
+    NOVA_LOG_WRITE(nova, TRIGGER_SENT, 1, cmd.header.id);
 
     // Increment counter.
     nova->counters.flash_button_app++;
@@ -189,8 +259,11 @@ void nova_on_button_pressdown(nova_t *nova)
     nova->counters.flash_button_disconnected++;
   }
 
-  // Save counter.
-  nova_save_counters(nova, &nova->counters);
+  // Mark counter for saving. This is deferred until the flash has ended
+  // so no flash memory writes get in the way of lighting up.
+  counters_changed(nova);
+
+  NOVA_TRACE_END(nova, ON_BUTTON_PRESSDOWN);
 }
 
 
@@ -202,6 +275,8 @@ void nova_on_button_pressdown(nova_t *nova)
  */
 void nova_on_button_release(nova_t *nova)
 {
+  NOVA_TRACE_BEGIN(nova, ON_BUTTON_RELEASE, 0, 0);
+
   // If paired to custom app...
   if (nova->ble_app_connected) {
 
@@ -213,7 +288,8 @@ void nova_on_button_release(nova_t *nova)
     cmd.header.id = ++(nova->outbound_command_id);
     cmd.header.type = NOVA_CMD_TRIGGER;
     cmd.body.trigger.is_pressed = false;
-    nova_send_app_command(nova, &cmd);
+    app_send(nova, &cmd);
+    NOVA_LOG_WRITE(nova, TRIGGER_SENT, 0, cmd.header.id);
 
     // Prepare ACK handler (nova_on_app_command() below)
     // so it knows the app has taken the photo.
@@ -227,8 +303,12 @@ void nova_on_button_release(nova_t *nova)
     flash_start(nova, &nova->flash_defaults.regular);
 
     // Trigger native camera by sending media keys over HID.
+    NOVA_TRACE_BEGIN(nova, SEND_HID_KEY, 0x20, 0);
     nova_send_hid_key(nova, 0x20); // multimedia key volume up
+    NOVA_TRACE_END(nova, SEND_HID_KEY);
+    NOVA_TRACE_BEGIN(nova, SEND_HID_KEY, 0x00, 0);
     nova_send_hid_key(nova, 0x00); // multimedia key release
+    NOVA_TRACE_END(nova, SEND_HID_KEY);
   }
 
   // If not paired...
@@ -236,6 +316,8 @@ void nova_on_button_release(nova_t *nova)
     // End flash immediately.
     flash_end(nova);
   }
+
+  NOVA_TRACE_END(nova, ON_BUTTON_RELEASE);
 }
 
 
@@ -247,15 +329,26 @@ void nova_on_button_release(nova_t *nova)
  */
 void nova_on_app_command(nova_t *nova, app_command_t *cmd)
 {
+  NOVA_TRACE_BEGIN(nova, ON_APP_COMMAND, cmd->header.type, cmd->header.id);
+
   // Prepare "ACK" response (but don't send it yet).
   app_command_t ack;
   ack.header.id = cmd->header.id;
   ack.header.type = NOVA_CMD_ACK;
 
+  // With several commands in flight, the App resends any whose ACK it
+  // hasn't seen. If we've already done it, just ACK again.
+  if ((cmd->header.type == NOVA_CMD_PING || cmd->header.type == NOVA_CMD_FLASH
+      || cmd->header.type == NOVA_CMD_OFF || cmd->header.type == NOVA_CMD_FLASH_AT)
+      && app_is_resend(nova, cmd->header.id)) {
+    NOVA_LOG_WRITE(nova, APP_RESEND, cmd->header.type, cmd->header.id);
+    app_send(nova, &ack);
+  }
+
   // Receive "PING" command...
-  if (cmd->header.type == NOVA_CMD_PING) {
+  else if (cmd->header.type == NOVA_CMD_PING) {
     // Just respond with "ACK".
-    nova_send_app_command(nova, &ack);
+    app_send(nova, &ack);
   }
 
   // Receive "FLASH" command...
@@ -263,21 +356,77 @@ void nova_on_app_command(nova_t *nova, app_command_t *cmd)
     // Start the flash.
     flash_start(nova, &cmd->body.flash_settings);
 
-    // Increment and save counter.
+    // Increment counter (saved once the flash has ended).
     nova->counters.flash_remote_app++;
-    nova_save_counters(nova, &nova->counters);
+    counters_changed(nova);
 
     // Respond with "ACK".
-    nova_send_app_command(nova, &ack);
+    app_send(nova, &ack);
   }
 
   // Receive "OFF" command...
   else if (cmd->header.type == NOVA_CMD_OFF) {
-    // End flash,
+    // End flash, and any that's scheduled.
     flash_end(nova);
+    flash_at_cancel(nova);
 
     // Respond with "ACK".
-    nova_send_app_command(nova, &ack);
+    app_send(nova, &ack);
+  }
+
+  // Receive "NEGOTIATE" command...
+  else if (cmd->header.type == NOVA_CMD_NEGOTIATE) {
+    // Respond with the requested features we support (instead of "ACK").
+    app_command_t response;
+    response.header.id = cmd->header.id;
+    response.header.type = NOVA_CMD_NEGOTIATE;
+    response.body.negotiate.features = cmd->body.negotiate.features & NOVA_SUPPORTED_FEATURES;
+    response.body.negotiate.window = cmd->body.negotiate.window < 1 ? 1
+        : cmd->body.negotiate.window > NOVA_APP_WINDOW_MAX ? NOVA_APP_WINDOW_MAX
+        : cmd->body.negotiate.window;
+    app_send(nova, &response);
+
+    // Make sure the response goes out the way the App asked for it,
+    // before switching.
+    app_flush(nova);
+    nova->app_features = response.body.negotiate.features;
+    app_window_reset(nova, response.body.negotiate.window);
+    NOVA_LOG_WRITE(nova, NEGOTIATED, nova->app_features, nova->app_window);
+  }
+
+  // Receive "SYNC" command...
+  else if (cmd->header.type == NOVA_CMD_SYNC) {
+    // Respond with our clock (instead of "ACK").
+    app_command_t response;
+    response.header.id = cmd->header.id;
+    response.header.type = NOVA_CMD_SYNC;
+    response.body.sync.time = nova_time_now(nova);
+    app_send(nova, &response);
+  }
+
+  // Receive "FLASH_AT" command...
+  else if (cmd->header.type == NOVA_CMD_FLASH_AT) {
+    // Schedule flash_at_fire() (see below), replacing any already
+    // scheduled. The difference copes with the clock wrapping around.
+    int32_t ahead = (int32_t)(cmd->body.flash_at.at - nova_time_now(nova));
+    if (ahead > NOVA_FLASH_AT_MAX_AHEAD) {
+      NOVA_LOG_WRITE(nova, FLASH_AT_TOO_FAR, 0, ahead / 1000 > 0xFFFF ? 0xFFFF : (uint16_t)(ahead / 1000));
+    } else if (ahead < -NOVA_FLASH_AT_MAX_LATE) {
+      NOVA_LOG_WRITE(nova, FLASH_AT_TOO_LATE, 0, -ahead / 1000 > 0xFFFF ? 0xFFFF : (uint16_t)(-ahead / 1000));
+    } else {
+      nova->flash_at_settings.timeout = cmd->body.flash_at.timeout;
+      nova->flash_at_settings.warm = cmd->body.flash_at.warm;
+      nova->flash_at_settings.cool = cmd->body.flash_at.cool;
+      if (ahead >= 0) {
+        NOVA_LOG_WRITE(nova, FLASH_AT_SCHEDULED, 0, (uint16_t)ahead);
+      } else {
+        NOVA_LOG_WRITE(nova, FLASH_AT_LATE, 0, (uint16_t)-ahead);
+      }
+      nova_timer_arm_at(nova, &nova->flash_at_timer, cmd->body.flash_at.at);
+    }
+
+    // Respond with "ACK" now, not when the flash starts.
+    app_send(nova, &ack);
   }
 
   // Receive "ACK" response from request previously sent to app...
@@ -285,6 +434,7 @@ void nova_on_app_command(nova_t *nova, app_command_t *cmd)
 
     // Response from trigger: app has completed photo so end_flash().
     if (nova->command_id_for_trigger_ack == cmd->header.id) {
+      NOVA_LOG_WRITE(nova, TRIGGER_ACKED, 0, cmd->header.id);
       flash_end(nova);
       nova->command_id_for_trigger_ack = 0;
     }
@@ -292,6 +442,34 @@ void nova_on_app_command(nova_t *nova, app_command_t *cmd)
     // Note: Don't send an ACK response here, otherwise we'll be
     // ACKing the ACK and get caught in an infinite loop.
   }
+
+  else {
+    NOVA_LOG_WRITE(nova, APP_UNKNOWN, cmd->header.type, cmd->header.id);
+  }
+
+  NOVA_TRACE_END(nova, ON_APP_COMMAND);
+}
+
+
+/**
+ * Called when Nova BLE characteristic receives a frame of commands from
+ * the App.
+ */
+void nova_on_app_commands(nova_t *nova, app_command_t *cmds, uint8_t count)
+{
+  NOVA_TRACE_BEGIN(nova, ON_APP_COMMANDS, count, count > 0 ? cmds[0].header.id : 0);
+
+  // Hold back responses while processing...
+  nova->app_in_frame = true;
+  for (uint8_t i = 0; i < count; i++) {
+    nova_on_app_command(nova, &cmds[i]);
+  }
+  nova->app_in_frame = false;
+
+  // ...then send them all together.
+  app_flush(nova);
+
+  NOVA_TRACE_END(nova, ON_APP_COMMANDS);
 }
 
 
@@ -299,12 +477,42 @@ void nova_on_app_command(nova_t *nova, app_command_t *cmd)
 // TIMER COMPLETION
 
 /**
- * Called sometime after nova_timer_schedule() to indicate flash has timed out.
+ * Called sometime after nova_timer_schedule() to indicate the earliest
+ * logical timer is due.
  */
 void nova_on_timer_complete(nova_t *nova)
 {
-  // Just turn it off.
+  NOVA_TRACE_BEGIN(nova, ON_TIMER_COMPLETE, 0, 0);
+
+  // The hardware timer is no longer scheduled.
+  nova_shadow_timer_fired(nova);
+
+  // Run callbacks of due timers: flash_end() if the flash timed out,
+  // counters_flush() if device has been idle long enough, etc.
+  nova_timers_expire(nova);
+
+  NOVA_TRACE_END(nova, ON_TIMER_COMPLETE);
+}
+
+
+// ----------------------------------------------------------------------------
+// POWER
+
+/**
+ * Called when the platform detects power is about to be lost.
+ */
+void nova_on_power_failing(nova_t *nova)
+{
+  NOVA_TRACE_BEGIN(nova, ON_POWER_FAILING, 0, 0);
+  NOVA_LOG_WRITE(nova, POWER_FAILING, 0, 0);
+
+  // Turn lights off first, to free up what power remains for saving.
   flash_end(nova);
+
+  // Save counters while we still can.
+  counters_flush(nova);
+
+  NOVA_TRACE_END(nova, ON_POWER_FAILING);
 }
 
 
@@ -332,6 +540,11 @@ bool nova_is_ble_hid_connected(nova_t *nova)
   return nova->ble_hid_connected;
 }
 
+uint8_t nova_app_features(nova_t *nova)
+{
+  return nova->app_features;
+}
+
 
 // ----------------------------------------------------------------------------
 // HELPER FUNCTIONS
@@ -343,16 +556,19 @@ bool nova_is_ble_hid_connected(nova_t *nova)
 void flash_start(nova_t *nova, flash_settings_t *flash_settings)
 {
   // Activate device lights.
-  nova_set_lights(nova, flash_settings->warm, flash_settings->cool);
+  NOVA_TRACE_BEGIN(nova, SET_LIGHTS, flash_settings->warm, flash_settings->cool);
+  nova_shadow_set_lights(nova, flash_settings->warm, flash_settings->cool);
+  NOVA_TRACE_END(nova, SET_LIGHTS);
+  NOVA_LOG_WRITE(nova, FLASH_ON, flash_settings->warm, flash_settings->cool);
   nova->is_lit = (flash_settings->cool > 0 && flash_settings->warm > 0);
 
   // Ensure status light does not interfere with flash light.
   update_status_indicator(nova);
 
-  // Schedule end_flash() (see below) to run after elapsed time
+  // Schedule flash_end() (see below) to run after elapsed time
   // to shutdown light.
   if (nova->is_lit) {
-    nova_timer_schedule(nova, flash_settings->timeout);
+    nova_timer_arm(nova, &nova->flash_timer, flash_settings->timeout);
   }
 }
 
@@ -361,15 +577,47 @@ void flash_start(nova_t *nova, flash_settings_t *flash_settings)
  */
 void flash_end(nova_t *nova)
 {
-  // Abort any timer that may still be running.
-  nova_timer_clear(nova);
+  // Abort flash timer if it's still running.
+  nova_timer_cancel(nova, &nova->flash_timer);
+  if (nova->is_lit) {
+    NOVA_LOG_WRITE(nova, FLASH_OFF, 0, 0);
+  }
 
   // Deactivate device lights.
-  nova_set_lights(nova, 0, 0);
+  NOVA_TRACE_BEGIN(nova, SET_LIGHTS, 0, 0);
+  nova_shadow_set_lights(nova, 0, 0);
+  NOVA_TRACE_END(nova, SET_LIGHTS);
   nova->is_lit = false;
 
   // Re-enable status indicator, if needed.
   update_status_indicator(nova);
+
+  // Now the lights are off, it's a good time to save counters.
+  counters_idle(nova);
+}
+
+/**
+ * Timer callback to start the flash scheduled by the App (see
+ * NOVA_CMD_FLASH_AT).
+ */
+void flash_at_fire(nova_t *nova)
+{
+  flash_start(nova, &nova->flash_at_settings);
+
+  // Increment counter (saved once the flash has ended).
+  nova->counters.flash_remote_app++;
+  counters_changed(nova);
+}
+
+/**
+ * Common code to cancel the flash scheduled by the App, if any.
+ */
+void flash_at_cancel(nova_t *nova)
+{
+  if (nova_timer_is_armed(&nova->flash_at_timer)) {
+    NOVA_LOG_WRITE(nova, FLASH_AT_CANCELLED, 0, 0);
+    nova_timer_cancel(nova, &nova->flash_at_timer);
+  }
 }
 
 /**
@@ -380,6 +628,137 @@ void update_status_indicator(nova_t *nova)
   // Show status as connected if either HID BLE or Nova App BLE is connected,
   // but disable LED while the main lights are on to prevent color from
   // interfering with photo.
-  nova_set_status_indicator(nova,
-      (nova->ble_app_connected || nova->ble_hid_connected) && !nova->is_lit);
+  bool lit = (nova->ble_app_connected || nova->ble_hid_connected) && !nova->is_lit;
+  NOVA_TRACE_BEGIN(nova, SET_STATUS_INDICATOR, lit, 0);
+  nova_shadow_set_status_indicator(nova, lit);
+  NOVA_TRACE_END(nova, SET_STATUS_INDICATOR);
+}
+
+/**
+ * Common code to note that usage counters have been incremented.
+ *
+ * This does no persistent I/O. See counters_idle().
+ */
+void counters_changed(nova_t *nova)
+{
+  if (nova->counters_unsaved < 0xFF) {
+    nova->counters_unsaved++;
+  }
+
+  // A flash that doesn't light (e.g. warm only) never ends with
+  // flash_end(), so start the idle deadline now if nothing else will.
+  if (!nova->is_lit && !nova_timer_is_armed(&nova->counters_timer)) {
+    nova_timer_arm(nova, &nova->counters_timer, NOVA_COUNTERS_FLUSH_IDLE);
+  }
+}
+
+/**
+ * Common code to save usage counters, if needed, once the device is idle.
+ *
+ * Saves immediately if enough increments have built up, otherwise
+ * (re)starts a timer to save them after a quiet period.
+ */
+void counters_idle(nova_t *nova)
+{
+  if (nova->is_lit || nova->counters_unsaved == 0) {
+    return;
+  }
+
+  if (nova->counters_unsaved >= NOVA_COUNTERS_FLUSH_EVENTS) {
+    counters_flush(nova);
+  } else {
+    nova_timer_arm(nova, &nova->counters_timer, NOVA_COUNTERS_FLUSH_IDLE);
+  }
+}
+
+/**
+ * Common code to save usage counters to persistent store, if changed.
+ */
+void counters_flush(nova_t *nova)
+{
+  nova_timer_cancel(nova, &nova->counters_timer);
+  if (nova->counters_unsaved > 0) {
+    NOVA_TRACE_BEGIN(nova, SAVE_COUNTERS, 0, 0);
+    nova_save_counters(nova, &nova->counters);
+    NOVA_TRACE_END(nova, SAVE_COUNTERS);
+    NOVA_LOG_WRITE(nova, COUNTERS_SAVED, nova->counters_unsaved, 0);
+    nova->counters_unsaved = 0;
+  }
+}
+
+/**
+ * Common code to send a command to the App.
+ *
+ * Once the App has turned on frames, commands are queued and sent in
+ * frames: immediately, unless a frame from the App is being processed
+ * (see nova_on_app_commands()).
+ */
+void app_send(nova_t *nova, app_command_t *cmd)
+{
+  if (!(nova->app_features & NOVA_FEATURE_FRAMES)) {
+    NOVA_TRACE_MARK(nova, APP_QUEUED, cmd->header.type, cmd->header.id);
+    NOVA_TRACE_BEGIN(nova, SEND_APP_COMMAND, cmd->header.type, cmd->header.id);
+    nova_send_app_command(nova, cmd);
+    NOVA_TRACE_END(nova, SEND_APP_COMMAND);
+    return;
+  }
+
+  if (nova->app_outbox_count == NOVA_APP_FRAME_MAX_COMMANDS) {
+    app_flush(nova);
+  }
+  nova->app_outbox[nova->app_outbox_count++] = *cmd;
+  NOVA_TRACE_MARK(nova, APP_QUEUED, cmd->header.type, cmd->header.id);
+
+  if (!nova->app_in_frame) {
+    app_flush(nova);
+  }
+}
+
+/**
+ * Common code to send any commands queued by app_send().
+ */
+void app_flush(nova_t *nova)
+{
+  if (nova->app_outbox_count > 0) {
+    NOVA_TRACE_BEGIN(nova, SEND_APP_COMMANDS, nova->app_outbox_count, nova->app_outbox[0].header.id);
+    nova_send_app_commands(nova, nova->app_outbox, nova->app_outbox_count);
+    NOVA_TRACE_END(nova, SEND_APP_COMMANDS);
+    nova->app_outbox_count = 0;
+  }
+}
+
+/**
+ * Common code to set the window of commands the App may have in flight,
+ * forgetting previously received ids.
+ */
+void app_window_reset(nova_t *nova, uint8_t window)
+{
+  nova->app_window = window;
+  nova->app_received_count = 0;
+  nova->app_received_next = 0;
+}
+
+/**
+ * Common code to check whether a command from the App has already been
+ * received (i.e. it's been resent). If not, remembers its id.
+ */
+bool app_is_resend(nova_t *nova, cmd_id_t id)
+{
+  if (nova->app_window == 0) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < nova->app_received_count; i++) {
+    if (nova->app_received[i] == id) {
+      return true;
+    }
+  }
+
+  // Not seen: replace the oldest.
+  nova->app_received[nova->app_received_next] = id;
+  nova->app_received_next = (nova->app_received_next + 1) % nova->app_window;
+  if (nova->app_received_count < nova->app_window) {
+    nova->app_received_count++;
+  }
+  return false;
 }
@@ -11,7 +11,7 @@
  * - nova_data(), nova_set_data() functions for associating device specific data
  *   with the nova_t.
  *
- * - common primitive types: milliseconds_t, cmd_id_t.
+ * - common primitive types: milliseconds_t, timestamp_t, cmd_id_t.
  *
  * - data persisted on non-volatile memory between power cycles (user settings
  *   and usage counters).
@@ -24,6 +24,7 @@
  * big-endian byte order.
  * Some structs contain empty 'pad' fields: these are to ensure byte values
  * align correctly and the compiler doesn't reorder the memory structure.
+ * nova-codec.h implements this encoding.
  */
 
 #include <stdint.h>
@@ -72,6 +73,13 @@ void nova_data_set(nova_t *nova, void *new_data);
 typedef uint16_t milliseconds_t;
 typedef uint16_t cmd_id_t;
 
+/**
+ * Absolute time in milliseconds, from a free-running clock with an
+ * arbitrary epoch (e.g. power on). Wraps around every ~49 days, so
+ * compare times by subtracting them rather than with < and >.
+ */
+typedef uint32_t timestamp_t;
+
 
 // ----------------------------------------------------------------------------
 // Persistent data and settings
@@ -161,6 +169,9 @@ typedef struct counters_t
  *     when type == FLASH,   size = sizeof(app_command_header_t) + sizeof(flash_settings_t),
  *     when type == OFF,     size = sizeof(app_command_header_t),
  *     when type == TRIGGER, size = sizeof(app_command_header_t) + sizeof(flash_trigger_t))
+ *     when type == NEGOTIATE, size = sizeof(app_command_header_t) + sizeof(negotiate_t))
+ *     when type == SYNC,    size = sizeof(app_command_header_t) + sizeof(sync_t))
+ *     when type == FLASH_AT, size = sizeof(app_command_header_t) + sizeof(flash_at_t))
  */
 typedef struct app_command_t
 {
@@ -190,6 +201,44 @@ typedef struct app_command_t
       uint8_t is_pressed;
     } trigger;
 
+    /** Populated if type=NEGOTIATE: contains protocol features (app_feature). */
+    struct negotiate_t
+    {
+      /** Bitmask of app_feature values. */
+      uint8_t features;
+
+      /**
+       * How far ahead the app may send: the id of a new command must be
+       * less than window more than the id of the oldest command still
+       * waiting for its ACK (ids going up by one per command). 1 (or 0)
+       * is stop-and-wait: one command at a time.
+       */
+      uint8_t window;
+    } negotiate;
+
+    /** Populated if type=SYNC: contains the device's clock. */
+    struct sync_t
+    {
+      /**
+       * In the device's response: its clock (nova_time_now()) when it
+       * handled the request. Ignored in the request.
+       */
+      timestamp_t time;
+    } sync;
+
+    /**
+     * Populated if type=FLASH_AT: contains when to start a flash, and its
+     * brightness/timeout settings (as flash_settings_t).
+     */
+    struct flash_at_t
+    {
+      /** When to start, by the device's clock (see NOVA_CMD_SYNC). */
+      timestamp_t at;
+      milliseconds_t timeout;
+      uint8_t warm; // 0-255 (off-full)
+      uint8_t cool; // 0-255 (off-full)
+    } flash_at;
+
   } body;
 
 } app_command_t;
@@ -236,6 +285,80 @@ typedef enum
    * The command must also contain data in command.body.trigger to indicate
    * if the button is being pressed or released.
    */
-  NOVA_CMD_TRIGGER  = 4
+  NOVA_CMD_TRIGGER  = 4,
+
+  /**
+   * NEGOTIATE: Sent from app to Nova device to turn on optional protocol
+   * features (see app_feature below).
+   *
+   * The command must also contain data in command.body.negotiate with the
+   * features and window the app would like. Instead of an ACK, the device
+   * responds with a NEGOTIATE with the same id, containing the features it
+   * has turned on (those requested that it supports) and the window it
+   * has agreed to (no larger than requested). The response is sent before
+   * these take effect.
+   *
+   * With a window larger than 1, the app may keep sending commands while
+   * waiting for ACKs. Whatever the window, the app should resend any
+   * command whose ACK is overdue: the device remembers the ids of as many
+   * recent commands as the window, and ACKs a resend again without
+   * repeating the command. ACKs are always sent in the order commands
+   * were received. (Without negotiating, every command is carried out.)
+   *
+   * Features and window are reset when the app disconnects. Devices that
+   * predate this command don't respond at all, so the app should carry on
+   * without features if no response arrives.
+   */
+  NOVA_CMD_NEGOTIATE = 5,
+
+  /**
+   * SYNC: Sent from app to Nova device to read the device's clock, so
+   * the app can schedule flashes with FLASH_AT.
+   *
+   * Instead of an ACK, the device responds with a SYNC with the same id,
+   * containing its clock in command.body.sync.time. The app can take the
+   * device's clock to have read that halfway between sending the request
+   * and receiving the response, give or take half the round trip. Doing
+   * several exchanges and keeping the quickest gives a close estimate of
+   * the offset between the clocks; repeating that over time gives how
+   * fast the device's clock drifts. A resent SYNC is answered again, with
+   * the time then.
+   *
+   * Devices that predate this command don't respond at all.
+   */
+  NOVA_CMD_SYNC     = 6,
+
+  /**
+   * FLASH_AT: Sent from app to Nova device. Initiate a flash of light at
+   * a given time by the device's clock (see SYNC), e.g. so several
+   * devices fire together however long each command takes to arrive.
+   *
+   * The command must also contain data in command.body.flash_at with the
+   * time, brightness and timeout. The device ACKs it when received, and
+   * starts the flash when its clock reaches the time (immediately, if it
+   * has already passed). Times more than NOVA_FLASH_AT_MAX_AHEAD ahead,
+   * or more than NOVA_FLASH_AT_MAX_LATE ago, are ignored.
+   *
+   * Only one flash can be scheduled: a later FLASH_AT replaces it, and an
+   * OFF, or the app disconnecting, cancels it.
+   */
+  NOVA_CMD_FLASH_AT = 7
 
 } app_command_type;
+
+/**
+ * Optional protocol features, turned on by NEGOTIATE. Bitmask values of
+ * negotiate_t.features.
+ */
+typedef enum
+{
+  /**
+   * FRAMES: Instead of one command per BLE write/notification, each
+   * write/notification is a frame holding one or more commands, each
+   * prefixed with its encoded length (see nova-codec.h). Commands in a
+   * frame are processed in order, and responses to them (ACKs) are sent
+   * back together in as few frames as possible.
+   */
+  NOVA_FEATURE_FRAMES = 1 << 0
+
+} app_feature;
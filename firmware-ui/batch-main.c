@@ -0,0 +1,164 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "fleet.h"
+#include "util/rng.h"
+
+/**
+ * Batched simulation engine runner.
+ *
+ * Drives a population of devices through a seeded random sequence of
+ * batches (one event applied to a random subset of devices) using the
+ * struct-of-arrays engine (see batch.h), and the same sequence through
+ * the scalar nova.c reference (fleet devices, see fleet.h). After every
+ * batch, every device is checked to be bit-for-bit identical in both.
+ * Reports throughput of each.
+ *
+ * Usage:
+ *
+ *   firmware-batch [-d DEVICES] [-b BATCHES] [-s SEED] [-n]
+ *
+ *   -d DEVICES  number of devices (default 100000)
+ *   -b BATCHES  number of batches (default 200)
+ *   -s SEED     seed for events and masks (default 1)
+ *   -n          no reference: only run the batched engine (faster,
+ *               but nothing is validated)
+ *
+ * Exits with status 1 if any device differs.
+ */
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * Choose which devices an event applies to: all of them, about half, or
+ * about one in eight. Returns number chosen.
+ */
+static uint32_t choose_mask(uint8_t *mask, uint32_t count, uint64_t *rng)
+{
+  uint32_t density = rng_next(rng) % 3;
+  uint32_t chosen = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t bits = rng_next(rng);
+    mask[i] = density == 0 ? 1 : density == 1 ? (bits & 1) : ((bits & 7) == 0);
+    chosen += mask[i];
+  }
+  return chosen;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t devices = 100000;
+  uint32_t batches = 200;
+  uint64_t seed = 1;
+  bool reference = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      devices = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      batches = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      reference = false;
+    } else {
+      fprintf(stderr, "Usage: %s [-d DEVICES] [-b BATCHES] [-s SEED] [-n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (devices < 1) {
+    fprintf(stderr, "Bad number of devices\n");
+    return 2;
+  }
+
+  batch_t batch;
+  uint8_t *mask = malloc(devices);
+  fleet_device_t *scalar = reference ? calloc(devices, sizeof(fleet_device_t)) : NULL;
+  if (!mask || (reference && !scalar) || !batch_init(&batch, devices)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (uint32_t i = 0; reference && i < devices; i++) {
+    fleet_device_init(&scalar[i], seed, i, NULL, NULL);
+  }
+
+  printf("batch: %u devices, %u batches, seed %llu\n",
+      devices, batches, (unsigned long long)seed);
+
+  // Event sequence, shared by all devices, and which devices get them.
+  fleet_stream_t stream;
+  fleet_stream_t masks;
+  fleet_stream_init(&stream, seed, 0);
+  fleet_stream_init(&masks, seed, 1);
+  uint64_t rng = masks.rng;
+
+  uint64_t events = 0;
+  double batch_seconds = 0;
+  double scalar_seconds = 0;
+  char error[256];
+  bool ok = true;
+
+  for (uint32_t n = 0; n < batches && ok; n++) {
+    fleet_event_t event;
+    fleet_stream_next(&stream, &event);
+    uint32_t chosen = event.type == FLEET_EVENT_WAIT
+        ? (memset(mask, 1, devices), devices)
+        : choose_mask(mask, devices, &rng);
+    events += chosen;
+
+    double start = seconds_now();
+    batch_apply(&batch, &event, mask);
+    batch_seconds += seconds_now() - start;
+
+    if (!reference) {
+      continue;
+    }
+
+    start = seconds_now();
+    for (uint32_t i = 0; i < devices; i++) {
+      if (mask[i]) {
+        fleet_device_apply(&scalar[i], &event);
+      }
+    }
+    scalar_seconds += seconds_now() - start;
+
+    for (uint32_t i = 0; i < devices && ok; i++) {
+      if (!batch_compare(&batch, i, &scalar[i], error, sizeof(error))) {
+        printf("MISMATCH after batch %u (event %d): %s\n", n, event.type, error);
+        ok = false;
+      }
+    }
+  }
+
+  printf("batched: %llu events in %.3fs (%.0f events/sec)\n",
+      (unsigned long long)events, batch_seconds,
+      batch_seconds > 0 ? events / batch_seconds : 0.0);
+  if (reference) {
+    printf("scalar:  %llu events in %.3fs (%.0f events/sec)\n",
+        (unsigned long long)events, scalar_seconds,
+        scalar_seconds > 0 ? events / scalar_seconds : 0.0);
+    if (ok) {
+      printf("speedup: %.1fx, all devices identical after every batch\n",
+          batch_seconds > 0 ? scalar_seconds / batch_seconds : 0.0);
+    }
+    for (uint32_t i = 0; i < devices; i++) {
+      fleet_device_free(&scalar[i]);
+    }
+  }
+
+  batch_free(&batch);
+  free(scalar);
+  free(mask);
+  return ok ? 0 : 1;
+}
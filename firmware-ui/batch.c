@@ -0,0 +1,535 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See batch.h
+ *
+ * Each kernel below is a loop over devices. The per-device helpers mirror
+ * the functions of the same name in nova.c, but take a mask bit m and
+ * only change state where m is 1. They're written as selects rather than
+ * branches, so once inlined the loops can be vectorized.
+ */
+
+#include "batch.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-internal.h>
+
+#define COUNTER(field) (offsetof(counters_t, field) / sizeof(uint32_t))
+
+/**
+ * Is time a before time b? Copes with clock wrap-around. As nova-timers.c.
+ */
+static inline uint8_t before(timestamp_t a, timestamp_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+/**
+ * (m ? a : b) for m of 0 or 1, without a branch.
+ */
+#define SELECT(m, a, b) ((b) ^ (((a) ^ (b)) & -(m)))
+
+
+// ----------------------------------------------------------------------------
+// Per-device helpers (see nova.c)
+
+static inline void update_status_indicator(batch_t *b, uint32_t i, uint8_t m)
+{
+  uint8_t lit = (b->ble_app_connected[i] | b->ble_hid_connected[i]) & !b->is_lit[i];
+  b->connected_lit[i] = SELECT(m, lit, b->connected_lit[i]);
+}
+
+static inline void counters_changed(batch_t *b, uint32_t i, uint8_t m, timestamp_t now)
+{
+  b->counters_unsaved[i] += m & (b->counters_unsaved[i] < 0xFF);
+
+  // A flash that doesn't light never ends with flash_end().
+  uint8_t arm = m & !b->is_lit[i] & !b->counters_armed[i];
+  b->counters_deadline[i] = SELECT(arm, now + NOVA_COUNTERS_FLUSH_IDLE, b->counters_deadline[i]);
+  b->counters_armed[i] |= arm;
+  b->counters_armed_last[i] = SELECT(arm, 1, b->counters_armed_last[i]);
+}
+
+static inline void counters_flush(batch_t *b, uint32_t i, uint8_t m)
+{
+  b->counters_armed[i] &= !m;
+
+  uint8_t save = m & (b->counters_unsaved[i] > 0);
+  b->counters_saves[i] += save;
+  for (int f = 0; f < BATCH_COUNTER_FIELDS; f++) {
+    b->counters_saved[f][i] = SELECT(save, b->counters[f][i], b->counters_saved[f][i]);
+  }
+  b->counters_unsaved[i] = SELECT(save, 0, b->counters_unsaved[i]);
+}
+
+static inline void counters_idle(batch_t *b, uint32_t i, uint8_t m, timestamp_t now)
+{
+  uint8_t go = m & !b->is_lit[i] & (b->counters_unsaved[i] > 0);
+  uint8_t flush = go & (b->counters_unsaved[i] >= NOVA_COUNTERS_FLUSH_EVENTS);
+  uint8_t arm = go & !flush;
+
+  counters_flush(b, i, flush);
+
+  b->counters_deadline[i] = SELECT(arm, now + NOVA_COUNTERS_FLUSH_IDLE, b->counters_deadline[i]);
+  b->counters_armed[i] |= arm;
+  b->counters_armed_last[i] = SELECT(arm, 1, b->counters_armed_last[i]);
+}
+
+/**
+ * lit must be (settings->cool > 0 && settings->warm > 0), as in nova.c.
+ * It's the same for every device, so callers work it out once.
+ */
+static inline void flash_start(batch_t *b, uint32_t i, uint8_t m,
+    const flash_settings_t *settings, uint8_t lit, timestamp_t now)
+{
+  b->lights_warm_pwm[i] = SELECT(m, settings->warm, b->lights_warm_pwm[i]);
+  b->lights_cool_pwm[i] = SELECT(m, settings->cool, b->lights_cool_pwm[i]);
+  b->is_lit[i] = SELECT(m, lit, b->is_lit[i]);
+  update_status_indicator(b, i, m);
+
+  uint8_t arm = m & lit;
+  b->flash_deadline[i] = SELECT(arm, now + settings->timeout, b->flash_deadline[i]);
+  b->flash_armed[i] |= arm;
+  b->counters_armed_last[i] = SELECT(arm, 0, b->counters_armed_last[i]);
+}
+
+static inline void flash_end(batch_t *b, uint32_t i, uint8_t m, timestamp_t now)
+{
+  b->flash_armed[i] &= !m;
+  b->lights_warm_pwm[i] = SELECT(m, 0, b->lights_warm_pwm[i]);
+  b->lights_cool_pwm[i] = SELECT(m, 0, b->lights_cool_pwm[i]);
+  b->is_lit[i] = SELECT(m, 0, b->is_lit[i]);
+  update_status_indicator(b, i, m);
+  counters_idle(b, i, m, now);
+}
+
+/**
+ * Send TRIGGER to App, as in nova_on_button_pressdown/release().
+ */
+static inline void send_trigger(batch_t *b, uint32_t i, uint8_t m)
+{
+  b->outbound_command_id[i] += m;
+  b->triggers_sent[i] += m;
+  b->last_trigger_id[i] = SELECT(m, b->outbound_command_id[i], b->last_trigger_id[i]);
+}
+
+static inline void reset(batch_t *b, uint32_t i, uint8_t m, timestamp_t now)
+{
+  b->flash_armed[i] &= !m;
+  b->counters_armed[i] &= !m;
+
+  for (int f = 0; f < BATCH_COUNTER_FIELDS; f++) {
+    b->counters[f][i] = SELECT(m, b->counters_saved[f][i], b->counters[f][i]);
+  }
+  b->counters_unsaved[i] = SELECT(m, 0, b->counters_unsaved[i]);
+
+  b->counters[COUNTER(boot)][i] += m;
+  counters_changed(b, i, m, now);
+
+  flash_end(b, i, m, now);
+
+  b->ble_app_connected[i] = SELECT(m, 0, b->ble_app_connected[i]);
+  b->ble_hid_connected[i] = SELECT(m, 0, b->ble_hid_connected[i]);
+  b->outbound_command_id[i] = SELECT(m, 0, b->outbound_command_id[i]);
+  b->command_id_for_trigger_ack[i] = SELECT(m, 0, b->command_id_for_trigger_ack[i]);
+  update_status_indicator(b, i, m);
+}
+
+
+// ----------------------------------------------------------------------------
+// Kernels
+
+// Loops are independent per device. Tell the compiler so, as it can't
+// prove the columns don't overlap. Needs -fopenmp-simd (see Makefile),
+// otherwise these are ignored and loops just run unvectorized.
+#define PRAGMA(x) _Pragma(#x)
+#define EACH_DEVICE PRAGMA(omp simd)
+
+/**
+ * Work on a local copy of the column pointers, so the compiler knows
+ * writes to columns can't change them.
+ */
+#define COLUMNS(b, batch) batch_t columns = *(batch); batch_t *b = &columns
+
+#define MASK(i) (mask[i])
+
+#define DUE_FLASH 1
+#define DUE_COUNTERS 2
+
+static void kernel_press(batch_t *batch, const uint8_t *mask)
+{
+  COLUMNS(b, batch);
+  const flash_settings_t *preflash = &b->flash_defaults.preflash;
+  uint8_t lit = preflash->cool > 0 && preflash->warm > 0;
+  timestamp_t now = b->now;
+
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    uint8_t app = m & b->ble_app_connected[i];
+    uint8_t hid = m & !app & b->ble_hid_connected[i];
+    uint8_t none = m & !app & !hid;
+
+    flash_start(b, i, m, preflash, lit, now);
+    send_trigger(b, i, app);
+    b->counters[COUNTER(flash_button_app)][i] += app;
+    b->counters[COUNTER(flash_button_native)][i] += hid;
+    b->counters[COUNTER(flash_button_disconnected)][i] += none;
+    counters_changed(b, i, m, now);
+  }
+}
+
+static void kernel_release(batch_t *batch, const uint8_t *mask)
+{
+  COLUMNS(b, batch);
+  const flash_settings_t *regular = &b->flash_defaults.regular;
+  uint8_t lit = regular->cool > 0 && regular->warm > 0;
+  timestamp_t now = b->now;
+
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    uint8_t app = m & b->ble_app_connected[i];
+    uint8_t hid = m & !app & b->ble_hid_connected[i];
+    uint8_t none = m & !app & !hid;
+
+    flash_start(b, i, app | hid, regular, lit, now);
+    send_trigger(b, i, app);
+    b->command_id_for_trigger_ack[i] = SELECT(app, b->outbound_command_id[i], b->command_id_for_trigger_ack[i]);
+    b->hid_keys_sent[i] += 2 * hid;
+    flash_end(b, i, none, now);
+  }
+}
+
+static void kernel_connect(batch_t *batch, const uint8_t *mask, uint8_t *connected, int counter)
+{
+  COLUMNS(b, batch);
+  timestamp_t now = b->now;
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    connected[i] |= m;
+    update_status_indicator(b, i, m);
+    b->counters[counter][i] += m;
+    counters_changed(b, i, m, now);
+    counters_idle(b, i, m, now);
+  }
+}
+
+static void kernel_disconnect(batch_t *batch, const uint8_t *mask, uint8_t *connected, uint8_t *other)
+{
+  COLUMNS(b, batch);
+  timestamp_t now = b->now;
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    connected[i] &= !m;
+    update_status_indicator(b, i, m);
+    flash_end(b, i, m & !other[i], now);
+  }
+}
+
+static void kernel_ping(batch_t *batch, const uint8_t *mask)
+{
+  COLUMNS(b, batch);
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    b->acks_sent[i] += MASK(i);
+  }
+}
+
+static void kernel_flash(batch_t *batch, const uint8_t *mask, const flash_settings_t *settings)
+{
+  COLUMNS(b, batch);
+  uint8_t lit = settings->cool > 0 && settings->warm > 0;
+  timestamp_t now = b->now;
+
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    flash_start(b, i, m, settings, lit, now);
+    b->counters[COUNTER(flash_remote_app)][i] += m;
+    counters_changed(b, i, m, now);
+    b->acks_sent[i] += m;
+  }
+}
+
+static void kernel_off(batch_t *batch, const uint8_t *mask)
+{
+  COLUMNS(b, batch);
+  timestamp_t now = b->now;
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    flash_end(b, i, m, now);
+    b->acks_sent[i] += m;
+  }
+}
+
+static void kernel_ack_trigger(batch_t *batch, const uint8_t *mask)
+{
+  COLUMNS(b, batch);
+  timestamp_t now = b->now;
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t hit = MASK(i) & (b->command_id_for_trigger_ack[i] == b->last_trigger_id[i]);
+    flash_end(b, i, hit, now);
+    b->command_id_for_trigger_ack[i] = SELECT(hit, 0, b->command_id_for_trigger_ack[i]);
+  }
+}
+
+static void kernel_power_cut(batch_t *batch, const uint8_t *mask, bool warned)
+{
+  COLUMNS(b, batch);
+  timestamp_t now = b->now;
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    uint8_t m = MASK(i);
+    // nova_on_power_failing()
+    flash_end(b, i, m & warned, now);
+    counters_flush(b, i, m & warned);
+    // nova_on_reset()
+    reset(b, i, m, now);
+  }
+}
+
+/**
+ * Which timer of device i should fire next, if any are due by end? In the
+ * same order as nova_timers_expire(): earliest deadline first, and on a
+ * tie, the most recently armed.
+ */
+static inline uint8_t next_due(batch_t *b, uint32_t i, timestamp_t end)
+{
+  timestamp_t fd = b->flash_deadline[i];
+  timestamp_t cd = b->counters_deadline[i];
+  uint8_t flash_due = b->flash_armed[i] & !before(end, fd);
+  uint8_t counters_due = b->counters_armed[i] & !before(end, cd);
+
+  uint8_t flash_first = before(fd, cd) | ((fd == cd) & !b->counters_armed_last[i]);
+  uint8_t fire_flash = flash_due & ((!counters_due) | flash_first);
+  uint8_t fire_counters = counters_due & !fire_flash;
+  return fire_flash * DUE_FLASH + fire_counters * DUE_COUNTERS;
+}
+
+/**
+ * Fire all timers due by end.
+ *
+ * Finding which devices have a timer due is a vectorized scan. Typically
+ * few devices do, so they're then handled one at a time, firing each
+ * timer at its own deadline (a callback can arm another timer that's
+ * also due).
+ */
+static void kernel_wait(batch_t *batch, milliseconds_t wait)
+{
+  COLUMNS(b, batch);
+  timestamp_t end = b->now + wait;
+
+  EACH_DEVICE
+  for (uint32_t i = 0; i < b->count; i++) {
+    b->due[i] = next_due(b, i, end);
+  }
+
+  for (uint32_t i = 0; i < b->count; i++) {
+    if (!b->due[i]) {
+      continue;
+    }
+    uint8_t due;
+    while ((due = next_due(b, i, end))) {
+      if (due == DUE_FLASH) {
+        flash_end(b, i, 1, b->flash_deadline[i]);
+      } else {
+        counters_flush(b, i, 1);
+      }
+    }
+  }
+
+  batch->now = end;
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+bool batch_init(batch_t *batch, uint32_t count)
+{
+  memset(batch, 0, sizeof(batch_t));
+  batch->count = count;
+
+  // As nova_on_reset(), with no flash defaults in persistent memory.
+  batch->flash_defaults.regular.timeout = 5000;
+  batch->flash_defaults.regular.warm = 127;
+  batch->flash_defaults.regular.cool = 127;
+  batch->flash_defaults.preflash.timeout = 10000;
+  batch->flash_defaults.preflash.warm = 63;
+  batch->flash_defaults.preflash.cool = 63;
+
+  bool ok = true;
+#define COLUMN(name) ok &= (batch->name = calloc(count, sizeof(*batch->name))) != NULL
+  COLUMN(all);
+  COLUMN(due);  COLUMN(ble_app_connected);
+  COLUMN(ble_hid_connected);
+  COLUMN(is_lit);
+  COLUMN(outbound_command_id);
+  COLUMN(command_id_for_trigger_ack);
+  COLUMN(counters_unsaved);
+  COLUMN(flash_armed);
+  COLUMN(flash_deadline);
+  COLUMN(counters_armed);
+  COLUMN(counters_deadline);
+  COLUMN(counters_armed_last);
+  COLUMN(lights_warm_pwm);
+  COLUMN(lights_cool_pwm);
+  COLUMN(connected_lit);
+  COLUMN(counters_saves);
+  COLUMN(triggers_sent);
+  COLUMN(acks_sent);
+  COLUMN(hid_keys_sent);
+  COLUMN(last_trigger_id);
+  for (int f = 0; f < BATCH_COUNTER_FIELDS; f++) {
+    COLUMN(counters[f]);
+    COLUMN(counters_saved[f]);
+  }
+#undef COLUMN
+
+  if (!ok) {
+    batch_free(batch);
+    return false;
+  }
+
+  memset(batch->all, 1, count);
+  kernel_power_cut(batch, batch->all, false);
+  return true;
+}
+
+void batch_apply(batch_t *batch, const fleet_event_t *event, const uint8_t *mask)
+{
+  if (!mask) {
+    mask = batch->all;
+  }
+
+  switch (event->type) {
+    case FLEET_EVENT_WAIT:
+      kernel_wait(batch, event->wait);
+      break;
+    case FLEET_EVENT_PRESS:
+      kernel_press(batch, mask);
+      break;
+    case FLEET_EVENT_RELEASE:
+      kernel_release(batch, mask);
+      break;
+    case FLEET_EVENT_CONNECT_APP:
+      kernel_connect(batch, mask, batch->ble_app_connected, COUNTER(app_connect));
+      break;
+    case FLEET_EVENT_DISCONNECT_APP:
+      kernel_disconnect(batch, mask, batch->ble_app_connected, batch->ble_hid_connected);
+      break;
+    case FLEET_EVENT_CONNECT_HID:
+      kernel_connect(batch, mask, batch->ble_hid_connected, COUNTER(hid_connect));
+      break;
+    case FLEET_EVENT_DISCONNECT_HID:
+      kernel_disconnect(batch, mask, batch->ble_hid_connected, batch->ble_app_connected);
+      break;
+    case FLEET_EVENT_PING:
+      kernel_ping(batch, mask);
+      break;
+    case FLEET_EVENT_FLASH:
+      kernel_flash(batch, mask, &event->flash);
+      break;
+    case FLEET_EVENT_OFF:
+      kernel_off(batch, mask);
+      break;
+    case FLEET_EVENT_ACK_TRIGGER:
+      kernel_ack_trigger(batch, mask);
+      break;
+    case FLEET_EVENT_POWER_CUT:
+      kernel_power_cut(batch, mask, false);
+      break;
+    case FLEET_EVENT_POWER_FAIL:
+      kernel_power_cut(batch, mask, true);
+      break;
+    default:
+      break;
+  }
+}
+
+bool batch_compare(batch_t *batch, uint32_t index, fleet_device_t *reference,
+    char *error, int error_len)
+{
+  fake_nova_device_t *device = reference->device;
+  nova_t *nova = device->nova;
+  uint32_t i = index;
+
+#define CHECK(name, expected, actual) \
+  if ((uint64_t)(expected) != (uint64_t)(actual)) { \
+    snprintf(error, error_len, "device %u: %s is %llu, expected %llu", index, name, \
+        (unsigned long long)(actual), (unsigned long long)(expected)); \
+    return false; \
+  }
+
+  CHECK("ble_app_connected", nova->ble_app_connected, batch->ble_app_connected[i]);
+  CHECK("ble_hid_connected", nova->ble_hid_connected, batch->ble_hid_connected[i]);
+  CHECK("is_lit", nova->is_lit, batch->is_lit[i]);
+  CHECK("outbound_command_id", nova->outbound_command_id, batch->outbound_command_id[i]);
+  CHECK("command_id_for_trigger_ack", nova->command_id_for_trigger_ack, batch->command_id_for_trigger_ack[i]);
+  CHECK("counters_unsaved", nova->counters_unsaved, batch->counters_unsaved[i]);
+  for (int f = 0; f < BATCH_COUNTER_FIELDS; f++) {
+    CHECK("counters", ((uint32_t*)&nova->counters)[f], batch->counters[f][i]);
+    CHECK("counters_saved", ((uint32_t*)&device->counters_saved)[f], batch->counters_saved[f][i]);
+  }
+
+  CHECK("flash_timer.armed", nova->flash_timer.armed, batch->flash_armed[i]);
+  if (nova->flash_timer.armed) {
+    CHECK("flash_timer.deadline", nova->flash_timer.deadline, batch->flash_deadline[i]);
+  }
+  CHECK("counters_timer.armed", nova->counters_timer.armed, batch->counters_armed[i]);
+  if (nova->counters_timer.armed) {
+    CHECK("counters_timer.deadline", nova->counters_timer.deadline, batch->counters_deadline[i]);
+  }
+
+  CHECK("lights_warm_pwm", device->lights_warm_pwm, batch->lights_warm_pwm[i]);
+  CHECK("lights_cool_pwm", device->lights_cool_pwm, batch->lights_cool_pwm[i]);
+  CHECK("connected_lit", device->connected_lit, batch->connected_lit[i]);
+  CHECK("counters_saves", device->counters_saves, batch->counters_saves[i]);
+  CHECK("triggers_sent", reference->stats.triggers_sent, batch->triggers_sent[i]);
+  CHECK("acks_sent", reference->stats.acks_sent, batch->acks_sent[i]);
+  CHECK("hid_keys_sent", reference->stats.hid_keys_sent, batch->hid_keys_sent[i]);
+  CHECK("last_trigger_id", reference->last_trigger_id, batch->last_trigger_id[i]);
+
+#undef CHECK
+
+  return true;
+}
+
+void batch_free(batch_t *batch)
+{
+  free(batch->all);
+  free(batch->due);
+  free(batch->ble_app_connected);
+  free(batch->ble_hid_connected);
+  free(batch->is_lit);
+  free(batch->outbound_command_id);
+  free(batch->command_id_for_trigger_ack);
+  free(batch->counters_unsaved);
+  free(batch->flash_armed);
+  free(batch->flash_deadline);
+  free(batch->counters_armed);
+  free(batch->counters_deadline);
+  free(batch->counters_armed_last);
+  free(batch->lights_warm_pwm);
+  free(batch->lights_cool_pwm);
+  free(batch->connected_lit);
+  free(batch->counters_saves);
+  free(batch->triggers_sent);
+  free(batch->acks_sent);
+  free(batch->hid_keys_sent);
+  free(batch->last_trigger_id);
+  for (int f = 0; f < BATCH_COUNTER_FIELDS; f++) {
+    free(batch->counters[f]);
+    free(batch->counters_saved[f]);
+  }
+  memset(batch, 0, sizeof(batch_t));
+}
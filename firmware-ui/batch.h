@@ -0,0 +1,122 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Batched (struct-of-arrays) simulation engine.
+ *
+ * An alternative to the fleet simulator (fleet.h) for very large device
+ * populations. Instead of one nova_t per device, each field of nova_t
+ * (see nova-internal.h) is stored as a column: an array with one entry
+ * per device. An event is applied to many devices at once by a kernel
+ * that walks the columns, using branch-free selects instead of calling
+ * nova_on_*() for each device, so compilers can vectorize it.
+ *
+ * The kernels re-implement the logic of nova.c, so they MUST be kept in
+ * step with it. batch_compare() checks a device's columns bit-for-bit
+ * against a fleet_device_t that ran the real nova.c through the same
+ * events. firmware-batch does this after every batch.
+ *
+ * All devices share one virtual clock, and each batch applies the same
+ * event to a subset of devices (chosen by a mask), so devices still
+ * diverge over time.
+ *
+ * Not modelled (as they don't affect nova_t behavior):
+ *
+ * - The counter log and flash. Saved counters are kept as columns, as if
+ *   persistence was perfect.
+ * - Contents of commands sent. Only counts are kept.
+ * - Protocol features (NOVA_CMD_NEGOTIATE). Fleet devices never turn
+ *   them on.
+ * - Flash defaults stored in persistent memory. The fake device doesn't
+ *   store any, so all devices use the defaults from nova_on_reset().
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nova.h>
+
+#include "fleet.h"
+
+/** Number of fields in counters_t. */
+#define BATCH_COUNTER_FIELDS (sizeof(counters_t) / sizeof(uint32_t))
+
+typedef struct batch_t
+{
+  /** Number of devices (length of every column). */
+  uint32_t count;
+
+  /** Current time, shared by all devices. */
+  timestamp_t now;
+
+  /** Flash settings for button presses, shared by all devices. */
+  flash_defaults_t flash_defaults;
+
+  /** Mask selecting every device. */
+  uint8_t *all;
+
+  /** Scratch space for kernels. */
+  uint8_t *due;
+
+  // Columns mirroring struct nova_t.
+  uint8_t *ble_app_connected;
+  uint8_t *ble_hid_connected;
+  uint8_t *is_lit;
+  cmd_id_t *outbound_command_id;
+  cmd_id_t *command_id_for_trigger_ack;
+  uint32_t *counters[BATCH_COUNTER_FIELDS];
+  uint8_t *counters_unsaved;
+
+  // Logical timers (nova->flash_timer, nova->counters_timer).
+  uint8_t *flash_armed;
+  timestamp_t *flash_deadline;
+  uint8_t *counters_armed;
+  timestamp_t *counters_deadline;
+
+  /**
+   * Was the counters timer armed more recently than the flash timer?
+   * Decides which fires first if both are due at the same time (see
+   * earliest() in nova-timers.c).
+   */
+  uint8_t *counters_armed_last;
+
+  // Columns mirroring the fake device and simulated App.
+  uint8_t *lights_warm_pwm;
+  uint8_t *lights_cool_pwm;
+  uint8_t *connected_lit;
+  uint32_t *counters_saved[BATCH_COUNTER_FIELDS];
+  uint32_t *counters_saves;
+  uint32_t *triggers_sent;
+  uint32_t *acks_sent;
+  uint32_t *hid_keys_sent;
+  cmd_id_t *last_trigger_id;
+
+} batch_t;
+
+/**
+ * Allocate columns for count devices and power them all on at time 0
+ * (as nova_on_reset()). Returns false if out of memory.
+ */
+bool batch_init(batch_t *batch, uint32_t count);
+
+/**
+ * Apply event to every device whose entry in mask is 1 (mask entries
+ * must be 0 or 1). If mask is NULL, applies to all devices.
+ *
+ * FLEET_EVENT_WAIT always applies to all devices, as time is shared.
+ */
+void batch_apply(batch_t *batch, const fleet_event_t *event, const uint8_t *mask);
+
+/**
+ * Check that device index is in exactly the same state as reference,
+ * which should have been through the same events. If not, returns false
+ * and describes the first difference in error.
+ */
+bool batch_compare(batch_t *batch, uint32_t index, fleet_device_t *reference,
+    char *error, int error_len);
+
+/**
+ * Free all columns.
+ */
+void batch_free(batch_t *batch);
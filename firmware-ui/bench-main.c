@@ -0,0 +1,487 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nova-api.h>
+#include <nova-device.h>
+#include <nova-internal.h>
+
+/**
+ * Microbenchmarks of nova.c.
+ *
+ * Times the cost of nova.c paths (each App command type, frames of
+ * commands, button press/release, connect/disconnect, reset) against a
+ * stub nova-device.h that does nothing, so only the firmware itself is
+ * measured.
+ *
+ * Each benchmark is calibrated to run for about SAMPLE_MS per sample, then
+ * sampled SAMPLES times. Reported per operation:
+ *
+ *   median   median of the samples (the number to track)
+ *   min      fastest sample
+ *   mad      median absolute deviation of samples from the median, as a
+ *            percentage: how noisy the measurement was
+ *   allocs   heap allocations (the firmware should never allocate; only
+ *            counted on Linux, "-" elsewhere)
+ *
+ * Usage:
+ *
+ *   firmware-bench [-s SAMPLES] [-m SAMPLE_MS] [-f FILTER] [-o RESULTS]
+ *                  [-c BASELINE] [-t PERCENT]
+ *
+ *   -s SAMPLES    samples per benchmark (default 15)
+ *   -m SAMPLE_MS  target milliseconds per sample (default 10)
+ *   -f FILTER     only run benchmarks whose names contain FILTER
+ *   -o RESULTS    write results to file (tab separated, see below)
+ *   -c BASELINE   compare with results file from an earlier revision
+ *   -t PERCENT    with -c, median slower by more than this is a
+ *                 regression (default 10)
+ *
+ * Results files have a "#" header line, then a line per benchmark:
+ *
+ *   name  median_ns  min_ns  mad_ns  allocs_per_op  samples  ops_per_sample
+ *
+ * Exits with status 1 if the firmware allocated, or there's a regression.
+ */
+
+#define MAX_SAMPLES 101
+
+/** Largest number of ops per sample when calibrating. */
+#define MAX_OPS (1u << 26)
+
+
+// ----------------------------------------------------------------------------
+// Allocation counting
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+
+// Linked with -Wl,--wrap=malloc etc, so calls from nova.c come here.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *__wrap_malloc(size_t size)
+{
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+  allocations++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+#define ALLOCATIONS() allocations
+#else
+#define ALLOCATIONS() 0
+#endif
+
+
+// ----------------------------------------------------------------------------
+// Stub nova-device.h
+
+/** Everything the firmware passes out is folded in here, so isn't optimized away. */
+static volatile uint32_t sink;
+
+/** Device clock. */
+static timestamp_t now;
+
+void nova_load_counters(nova_t *nova, counters_t *counters)
+{
+  memset(counters, 0, sizeof(counters_t));
+}
+
+void nova_save_counters(nova_t *nova, counters_t *counters)
+{
+  sink += counters->boot;
+}
+
+void nova_load_flash_defaults(nova_t *nova, flash_defaults_t *flash_defaults)
+{
+}
+
+void nova_send_app_command(nova_t *nova, app_command_t *cmd)
+{
+  sink += cmd->header.id;
+}
+
+void nova_send_app_commands(nova_t *nova, app_command_t *cmds, uint8_t count)
+{
+  sink += count;
+}
+
+void nova_send_hid_key(nova_t *nova, char key_code)
+{
+  sink += key_code;
+}
+
+void nova_set_status_indicator(nova_t *nova, bool lit)
+{
+  sink += lit;
+}
+
+void nova_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm)
+{
+  sink += warm_pwm + cool_pwm;
+}
+
+timestamp_t nova_time_now(nova_t *nova)
+{
+  return now;
+}
+
+uint32_t nova_trace_timestamp(nova_t *nova)
+{
+  return 0;
+}
+
+void nova_timer_schedule(nova_t *nova, milliseconds_t timeout)
+{
+  sink += timeout;
+}
+
+void nova_timer_clear(nova_t *nova)
+{
+}
+
+
+// ----------------------------------------------------------------------------
+// Benchmarks
+
+static void command(nova_t *nova, uint8_t type, uint32_t i)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = type;
+  cmd.header.id = (cmd_id_t)i;
+  if (type == NOVA_CMD_FLASH) {
+    cmd.body.flash_settings.timeout = 1000;
+    cmd.body.flash_settings.warm = 255;
+    cmd.body.flash_settings.cool = 127;
+  } else if (type == NOVA_CMD_NEGOTIATE) {
+    cmd.body.negotiate.features = NOVA_FEATURE_FRAMES;
+    cmd.body.negotiate.window = NOVA_APP_WINDOW_MAX;
+  }
+  nova_on_app_command(nova, &cmd);
+}
+
+static void setup_app(nova_t *nova)
+{
+  nova_on_reset(nova);
+  nova_on_connect_app(nova);
+}
+
+static void setup_hid(nova_t *nova)
+{
+  nova_on_reset(nova);
+  nova_on_connect_hid(nova);
+}
+
+static void setup_frames(nova_t *nova)
+{
+  setup_app(nova);
+  command(nova, NOVA_CMD_NEGOTIATE, 0);
+}
+
+static void op_ack(nova_t *nova, uint32_t i)
+{
+  command(nova, NOVA_CMD_ACK, i);
+}
+
+static void op_ping(nova_t *nova, uint32_t i)
+{
+  command(nova, NOVA_CMD_PING, i);
+}
+
+static void op_flash(nova_t *nova, uint32_t i)
+{
+  command(nova, NOVA_CMD_FLASH, i);
+}
+
+static void op_off(nova_t *nova, uint32_t i)
+{
+  command(nova, NOVA_CMD_OFF, i);
+}
+
+static void op_negotiate(nova_t *nova, uint32_t i)
+{
+  command(nova, NOVA_CMD_NEGOTIATE, i);
+}
+
+static void op_frame(nova_t *nova, uint32_t i)
+{
+  app_command_t cmds[4];
+  memset(cmds, 0, sizeof(cmds));
+  for (int c = 0; c < 4; c++) {
+    cmds[c].header.type = c == 1 ? NOVA_CMD_FLASH : c == 3 ? NOVA_CMD_OFF : NOVA_CMD_PING;
+    cmds[c].header.id = (cmd_id_t)(i * 4 + c + 1);
+  }
+  cmds[1].body.flash_settings.timeout = 1000;
+  cmds[1].body.flash_settings.warm = 255;
+  nova_on_app_commands(nova, cmds, 4);
+}
+
+static void op_button(nova_t *nova, uint32_t i)
+{
+  nova_on_button_pressdown(nova);
+  now += 50;
+  nova_on_button_release(nova);
+}
+
+static void op_connect_app(nova_t *nova, uint32_t i)
+{
+  nova_on_connect_app(nova);
+  nova_on_disconnect_app(nova);
+}
+
+static void op_connect_hid(nova_t *nova, uint32_t i)
+{
+  nova_on_connect_hid(nova);
+  nova_on_disconnect_hid(nova);
+}
+
+static void op_reset(nova_t *nova, uint32_t i)
+{
+  nova_on_reset(nova);
+}
+
+typedef struct bench_t
+{
+  const char *name;
+
+  /** Called before each sample. */
+  void (*setup)(nova_t *nova);
+
+  /** One operation. i counts up from 0 within a sample. */
+  void (*op)(nova_t *nova, uint32_t i);
+
+} bench_t;
+
+static const bench_t benches[] = {
+  { "app_command/ack",         setup_app,    op_ack },
+  { "app_command/ping",        setup_app,    op_ping },
+  { "app_command/flash",       setup_app,    op_flash },
+  { "app_command/off",         setup_app,    op_off },
+  { "app_command/negotiate",   setup_app,    op_negotiate },
+  { "app_commands/frame4",     setup_frames, op_frame },
+  { "button/app",              setup_app,    op_button },
+  { "button/hid",              setup_hid,    op_button },
+  { "button/disconnected",     nova_on_reset, op_button },
+  { "connect_disconnect/app",  nova_on_reset, op_connect_app },
+  { "connect_disconnect/hid",  nova_on_reset, op_connect_hid },
+  { "reset",                   nova_on_reset, op_reset },
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+
+// ----------------------------------------------------------------------------
+// Measuring
+
+typedef struct result_t
+{
+  double median_ns;
+  double min_ns;
+  double mad_ns;
+  double allocs_per_op;
+  uint32_t samples;
+  uint32_t ops;
+} result_t;
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double median(double *values, uint32_t count)
+{
+  qsort(values, count, sizeof(double), compare_double);
+  return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * Seconds to run ops operations from a fresh setup.
+ */
+static double run_sample(nova_t *nova, const bench_t *bench, uint32_t ops)
+{
+  now = 0;
+  bench->setup(nova);
+  double start = seconds_now();
+  for (uint32_t i = 0; i < ops; i++) {
+    bench->op(nova, i);
+    now++;
+  }
+  return seconds_now() - start;
+}
+
+static void measure(nova_t *nova, const bench_t *bench, uint32_t samples, double sample_seconds, result_t *result)
+{
+  // Calibrate (which also warms up).
+  uint32_t ops = 1;
+  while (ops < MAX_OPS && run_sample(nova, bench, ops) < sample_seconds) {
+    ops *= 2;
+  }
+
+  double times[MAX_SAMPLES];
+  uint64_t allocations_before = ALLOCATIONS();
+  for (uint32_t s = 0; s < samples; s++) {
+    times[s] = run_sample(nova, bench, ops) * 1e9 / ops;
+  }
+  uint64_t allocated = ALLOCATIONS() - allocations_before;
+
+  result->samples = samples;
+  result->ops = ops;
+  result->median_ns = median(times, samples);
+  result->min_ns = times[0];
+  for (uint32_t s = 0; s < samples; s++) {
+    times[s] = times[s] > result->median_ns ? times[s] - result->median_ns : result->median_ns - times[s];
+  }
+  result->mad_ns = median(times, samples);
+  result->allocs_per_op = (double)allocated / ((double)samples * ops);
+}
+
+
+// ----------------------------------------------------------------------------
+// Results files
+
+/**
+ * Find a benchmark's median in a results file. Returns false if not there.
+ */
+static bool baseline_median(FILE *file, const char *name, double *median_ns)
+{
+  char line[256];
+  char line_name[128];
+  rewind(file);
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] != '#' && sscanf(line, "%127s %lf", line_name, median_ns) == 2
+        && strcmp(line_name, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t samples = 15;
+  uint32_t sample_ms = 10;
+  const char *filter = NULL;
+  const char *results_filename = NULL;
+  const char *baseline_filename = NULL;
+  double threshold = 10;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      samples = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      sample_ms = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      results_filename = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      baseline_filename = argv[++i];
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      threshold = strtod(argv[++i], NULL);
+    } else {
+      fprintf(stderr, "Usage: %s [-s SAMPLES] [-m SAMPLE_MS] [-f FILTER] [-o RESULTS] [-c BASELINE] [-t PERCENT]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (samples < 1 || samples > MAX_SAMPLES) {
+    fprintf(stderr, "Samples must be 1-%u\n", MAX_SAMPLES);
+    return 2;
+  }
+
+  FILE *baseline = NULL;
+  if (baseline_filename && !(baseline = fopen(baseline_filename, "r"))) {
+    perror(baseline_filename);
+    return 2;
+  }
+  FILE *results = NULL;
+  if (results_filename && !(results = fopen(results_filename, "w"))) {
+    perror(results_filename);
+    return 2;
+  }
+  if (results) {
+    fprintf(results, "# name\tmedian_ns\tmin_ns\tmad_ns\tallocs_per_op\tsamples\tops_per_sample\n");
+  }
+
+  nova_t *nova = calloc(1, sizeof(nova_t));
+  bool ok = true;
+
+  printf("%-24s %10s %10s %7s %7s%s\n", "benchmark", "median ns", "min ns", "mad", "allocs",
+      baseline ? "   vs baseline" : "");
+
+  for (uint32_t b = 0; b < BENCH_COUNT; b++) {
+    const bench_t *bench = &benches[b];
+    if (filter && !strstr(bench->name, filter)) {
+      continue;
+    }
+
+    result_t result;
+    measure(nova, bench, samples, sample_ms / 1000.0, &result);
+
+    char allocs[16] = "-";
+#ifdef BENCH_COUNT_ALLOCATIONS
+    snprintf(allocs, sizeof(allocs), "%g", result.allocs_per_op);
+#endif
+    printf("%-24s %10.1f %10.1f %6.1f%% %7s", bench->name, result.median_ns, result.min_ns,
+        result.median_ns > 0 ? 100 * result.mad_ns / result.median_ns : 0.0, allocs);
+    if (result.allocs_per_op > 0) {
+      ok = false;
+    }
+
+    double baseline_ns;
+    if (baseline && baseline_median(baseline, bench->name, &baseline_ns) && baseline_ns > 0) {
+      double change = 100 * (result.median_ns - baseline_ns) / baseline_ns;
+      bool regressed = change > threshold;
+      printf("   %+6.1f%%%s", change, regressed ? " REGRESSION" : "");
+      if (regressed) {
+        ok = false;
+      }
+    } else if (baseline) {
+      printf("   new");
+    }
+    printf("\n");
+
+    if (results) {
+      fprintf(results, "%s\t%.2f\t%.2f\t%.2f\t%g\t%u\t%u\n", bench->name, result.median_ns,
+          result.min_ns, result.mad_ns, result.allocs_per_op, result.samples, result.ops);
+    }
+  }
+
+  if (!ok) {
+    printf("FAIL: firmware allocated, or regression over %.0f%%\n", threshold);
+  }
+
+  if (results) {
+    fclose(results);
+  }
+  if (baseline) {
+    fclose(baseline);
+  }
+  free(nova);
+  return ok ? 0 : 1;
+}
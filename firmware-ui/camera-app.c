@@ -0,0 +1,289 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See camera-app.h
+ */
+
+#include "camera-app.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-codec.h>
+
+#include "ui.h"
+#include "util/rng.h"
+
+static bool load_trace(camera_latency_t *latency, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+
+  uint32_t capacity = 0;
+  char line[64];
+  while (fgets(line, sizeof(line), file)) {
+    char *end;
+    unsigned long ms = strtoul(line, &end, 10);
+    if (end == line || line[0] == '#') {
+      continue;
+    }
+    if (latency->sample_count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      uint32_t *samples = realloc(latency->samples, capacity * sizeof(uint32_t));
+      if (!samples) {
+        fclose(file);
+        return false;
+      }
+      latency->samples = samples;
+    }
+    latency->samples[latency->sample_count++] = (uint32_t)(ms > CAMERA_LATENCY_MAX ? CAMERA_LATENCY_MAX : ms);
+  }
+  fclose(file);
+
+  if (latency->sample_count == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Latency distributions
+
+bool camera_latency_parse(camera_latency_t *latency, const char *spec)
+{
+  memset(latency, 0, sizeof(camera_latency_t));
+  char *end;
+
+  if (strncmp(spec, "fixed:", 6) == 0) {
+    latency->kind = CAMERA_LATENCY_FIXED;
+    latency->median = (uint32_t)strtoul(spec + 6, &end, 10);
+    if (end == spec + 6 || *end || latency->median > CAMERA_LATENCY_MAX) {
+      errno = EINVAL;
+      return false;
+    }
+    return true;
+  }
+
+  if (strncmp(spec, "lognormal:", 10) == 0) {
+    latency->kind = CAMERA_LATENCY_LOGNORMAL;
+    latency->median = (uint32_t)strtoul(spec + 10, &end, 10);
+    if (end == spec + 10 || *end != ':' || latency->median > CAMERA_LATENCY_MAX) {
+      errno = EINVAL;
+      return false;
+    }
+    const char *sigma = end + 1;
+    latency->sigma = strtod(sigma, &end);
+    if (end == sigma || *end || latency->sigma < 0) {
+      errno = EINVAL;
+      return false;
+    }
+    return true;
+  }
+
+  if (strncmp(spec, "trace:", 6) == 0) {
+    latency->kind = CAMERA_LATENCY_TRACE;
+    if (!load_trace(latency, spec + 6)) {
+      int saved = errno;
+      camera_latency_free(latency);
+      errno = saved;
+      return false;
+    }
+    return true;
+  }
+
+  errno = EINVAL;
+  return false;
+}
+
+uint32_t camera_latency_sample(const camera_latency_t *latency, uint64_t *rng)
+{
+  switch (latency->kind) {
+
+    case CAMERA_LATENCY_LOGNORMAL:
+      {
+        // Box-Muller: a standard normal from two uniforms.
+        double u1 = rng_uniform(rng);
+        double u2 = rng_uniform(rng);
+        double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        double ms = latency->median * exp(latency->sigma * z);
+        return ms > CAMERA_LATENCY_MAX ? CAMERA_LATENCY_MAX : (uint32_t)(ms + 0.5);
+      }
+
+    case CAMERA_LATENCY_TRACE:
+      return latency->samples[rng_next(rng) % latency->sample_count];
+
+    default:
+      return latency->median;
+  }
+}
+
+void camera_latency_free(camera_latency_t *latency)
+{
+  free(latency->samples);
+  latency->samples = NULL;
+  latency->sample_count = 0;
+}
+
+
+// ----------------------------------------------------------------------------
+// ACKs
+
+/** First connection event after time. */
+static uint64_t next_connection_event(camera_app_t *app, uint64_t time)
+{
+  uint64_t interval = app->config.connection_interval;
+  return interval > 0 ? (time / interval + 1) * interval : time;
+}
+
+static void on_ack_timer(basic_timer_t *timer, void *data);
+
+static void schedule_acks(camera_app_t *app)
+{
+  if (app->ack_count == 0) {
+    basic_timer_clear(&app->device->timers, &app->ack_timer);
+    return;
+  }
+  uint64_t now = basic_clock_now(&app->device->clock);
+  uint64_t due = app->acks[0].due;
+  basic_timer_schedule(&app->device->timers, &app->ack_timer,
+      due > now ? due - now : 0, on_ack_timer, app);
+}
+
+/** Queue an ACK of id to reach the device at due, in order. */
+static void queue_ack(camera_app_t *app, cmd_id_t id, uint64_t due)
+{
+  if (app->ack_count == CAMERA_APP_MAX_ACKS) {
+    app->stats.overflows++;
+    return;
+  }
+  int i = app->ack_count;
+  while (i > 0 && app->acks[i - 1].due > due) {
+    app->acks[i] = app->acks[i - 1];
+    i--;
+  }
+  app->acks[i].id = id;
+  app->acks[i].due = due;
+  app->ack_count++;
+  schedule_acks(app);
+}
+
+static void on_ack_timer(basic_timer_t *timer, void *data)
+{
+  camera_app_t *app = (camera_app_t*)data;
+  uint64_t now = basic_clock_now(&app->device->clock);
+
+  while (app->ack_count > 0 && app->acks[0].due <= now) {
+    cmd_id_t id = app->acks[0].id;
+    app->ack_count--;
+    memmove(&app->acks[0], &app->acks[1], app->ack_count * sizeof(app->acks[0]));
+
+    if (app->in_photo && app->photo.trigger_id == id && app->photo.released_at) {
+      app->photo.acked_at = now;
+    }
+    app->stats.acks++;
+
+    app_command_t ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.header.type = NOVA_CMD_ACK;
+    ack.header.id = id;
+    uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+    ui_log("   App ACKs trigger %u", id);
+    fake_nova_device_app_write(app->device, buf, nova_codec_encode_command(&ack, buf));
+  }
+  schedule_acks(app);
+}
+
+
+// ----------------------------------------------------------------------------
+// Photos
+
+static void finish_photo(camera_app_t *app, uint64_t now)
+{
+  camera_photo_t *photo = &app->photo;
+  photo->off_at = now;
+  app->in_photo = false;
+
+  uint64_t lit = now - photo->released_at;
+  uint64_t wasted = photo->taken_at && now > photo->taken_at ? now - photo->taken_at : 0;
+  app->stats.photos++;
+  app->stats.lit += lit;
+  app->stats.wasted += wasted;
+  if (!photo->acked_at) {
+    app->stats.timeouts++;
+  }
+  if (!photo->taken_at || photo->taken_at > now) {
+    app->stats.dark++;
+  }
+  ui_log("   App photo: lit %lums, %lums after it was taken", (unsigned long)lit, (unsigned long)wasted);
+
+  if (app->on_photo) {
+    app->on_photo(app, photo, app->data);
+  }
+}
+
+static void on_app_command_sent(fake_nova_device_t *device, app_command_t *cmd, void *data)
+{
+  camera_app_t *app = (camera_app_t*)data;
+  if (cmd->header.type != NOVA_CMD_TRIGGER) {
+    return;
+  }
+  uint64_t now = basic_clock_now(&device->clock);
+  uint64_t received = next_connection_event(app, now);
+
+  if (cmd->body.trigger.is_pressed) {
+    // Pressed again before the last photo's lights went off.
+    if (app->in_photo && app->photo.released_at) {
+      finish_photo(app, now);
+    }
+    memset(&app->photo, 0, sizeof(camera_photo_t));
+    app->photo.pressed_at = now;
+    app->in_photo = true;
+    if (app->config.ack) {
+      queue_ack(app, cmd->header.id, received);
+    }
+    return;
+  }
+
+  uint32_t latency = camera_latency_sample(&app->config.latency, &app->rng);
+  uint64_t taken = received + latency;
+  if (app->in_photo) {
+    app->photo.released_at = now;
+    app->photo.taken_at = taken;
+    app->photo.trigger_id = cmd->header.id;
+  }
+  ui_log("   App takes photo in %ums", latency);
+  if (app->config.ack) {
+    queue_ack(app, cmd->header.id, next_connection_event(app, taken));
+  }
+}
+
+static void on_lights_set(fake_nova_device_t *device, uint8_t warm_pwm, uint8_t cool_pwm, void *data)
+{
+  camera_app_t *app = (camera_app_t*)data;
+  if (warm_pwm == 0 && cool_pwm == 0 && app->in_photo && app->photo.released_at) {
+    finish_photo(app, basic_clock_now(&device->clock));
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void camera_app_init(camera_app_t *app, fake_nova_device_t *device, const camera_app_config_t *config)
+{
+  memset(app, 0, sizeof(camera_app_t));
+  app->device = device;
+  app->config = *config;
+  app->rng = config->seed ? config->seed : 1;
+  app->listener.app_command_sent = on_app_command_sent;
+  app->listener.lights_set = on_lights_set;
+  app->listener.data = app;
+  fake_nova_device_add_listener(device, &app->listener);
+}
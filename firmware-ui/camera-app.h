@@ -0,0 +1,207 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Simulated Nova App taking photos when the device's button is used.
+ *
+ * When the button is released, the device switches to the regular
+ * flash and sends a TRIGGER, and keeps the lights on until the App ACKs
+ * it (having taken the photo), or the flash times out. This App ACKs
+ * each TRIGGER the way the real one would:
+ *
+ * - A TRIGGER reaches the App at the next BLE connection event, every
+ *   connection_interval (counted from time 0).
+ * - The App takes the photo, which takes a latency sampled from a
+ *   distribution (see camera_latency_t).
+ * - Its ACK reaches the device at the next connection event after that.
+ *
+ * TRIGGERs for the button being pressed are ACKed at the next connection
+ * event. With ack unset, photos are taken but never ACKed, as the
+ * simulator did before, so every flash ends by timing out.
+ *
+ * For each photo, it measures how long the regular flash was lit, and
+ * how much of that was wasted: lit after the photo was taken.
+ *
+ * Usage:
+ *
+ *   camera_app_config_t config = CAMERA_APP_DEFAULTS;
+ *   if (!camera_latency_parse(&config.latency, "lognormal:250:0.5")) {
+ *     perror("latency");
+ *   }
+ *   camera_app_t app;
+ *   camera_app_init(&app, device, &config);
+ *   ...
+ *   printf("%u photos, %lums wasted\n", app.stats.photos, app.stats.wasted);
+ *   camera_latency_free(&config.latency);
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nova.h>
+
+#include "fake-nova-device.h"
+
+/** Most ACKs waiting to be written. */
+#define CAMERA_APP_MAX_ACKS 16
+
+/** Longest latency sampled, in milliseconds. */
+#define CAMERA_LATENCY_MAX 600000
+
+typedef enum
+{
+  /** Always median. */
+  CAMERA_LATENCY_FIXED,
+
+  /** Log-normal: median, and sigma, the standard deviation of its log. */
+  CAMERA_LATENCY_LOGNORMAL,
+
+  /** Picked at random from samples, e.g. recorded in the field. */
+  CAMERA_LATENCY_TRACE
+
+} camera_latency_kind;
+
+/**
+ * Distribution of how long the App takes to take a photo, in
+ * milliseconds.
+ */
+typedef struct camera_latency_t
+{
+  camera_latency_kind kind;
+  uint32_t median;
+  double sigma;
+
+  /** Latencies to pick from (allocated), for CAMERA_LATENCY_TRACE. */
+  uint32_t *samples;
+  uint32_t sample_count;
+
+} camera_latency_t;
+
+typedef struct camera_app_config_t
+{
+  /** Milliseconds between BLE connection events. 0 for no delay. */
+  uint32_t connection_interval;
+
+  /** How long each photo takes. */
+  camera_latency_t latency;
+
+  /** ACK TRIGGERs? */
+  bool ack;
+
+  /** Seed for sampling latencies. */
+  uint64_t seed;
+
+} camera_app_config_t;
+
+/** A typical iOS connection interval, a fixed 250ms per photo. */
+#define CAMERA_APP_DEFAULTS { 30, { CAMERA_LATENCY_FIXED, 250, 0, NULL, 0 }, true, 1 }
+
+/**
+ * A photo, from the button being pressed until the lights went off.
+ * Times are from the device's clock.
+ */
+typedef struct camera_photo_t
+{
+  uint64_t pressed_at;
+  uint64_t released_at;
+
+  /** When the photo was taken (0 if not yet). */
+  uint64_t taken_at;
+
+  /** When the ACK reached the device (0 if it didn't). */
+  uint64_t acked_at;
+
+  uint64_t off_at;
+
+  /** id of the TRIGGER sent on release. */
+  cmd_id_t trigger_id;
+
+} camera_photo_t;
+
+typedef struct camera_app_stats_t
+{
+  /** Photos finished (lights off after the button was released). */
+  uint32_t photos;
+
+  /** TRIGGERs ACKed. */
+  uint32_t acks;
+
+  /** Photos whose flash timed out before the ACK reached the device. */
+  uint32_t timeouts;
+
+  /** Photos whose flash went off before the photo was taken. */
+  uint32_t dark;
+
+  /** Milliseconds of regular flash, and of it after each photo was taken. */
+  uint64_t lit;
+  uint64_t wasted;
+
+  /** ACKs dropped because too many were waiting. */
+  uint32_t overflows;
+
+} camera_app_stats_t;
+
+struct camera_app_t;
+
+/** Called as each photo finishes. */
+typedef void (*camera_app_photo_callback)(struct camera_app_t *app, const camera_photo_t *photo, void *data);
+
+typedef struct camera_app_t
+{
+  fake_nova_device_t *device;
+  camera_app_config_t config;
+  uint64_t rng;
+
+  /** ACKs waiting to be written, soonest first. */
+  struct
+  {
+    cmd_id_t id;
+    uint64_t due;
+  } acks[CAMERA_APP_MAX_ACKS];
+  uint8_t ack_count;
+  basic_timer_t ack_timer;
+
+  /** Photo in progress, if the button's been pressed. */
+  bool in_photo;
+  camera_photo_t photo;
+
+  camera_app_stats_t stats;
+
+  /** Called for each photo, if set. */
+  camera_app_photo_callback on_photo;
+  void *data;
+
+  fake_nova_device_listener_t listener;
+
+} camera_app_t;
+
+/**
+ * Parse a latency distribution:
+ *
+ *   fixed:MS                  always MS
+ *   lognormal:MEDIAN:SIGMA    log-normal with the given median (ms)
+ *   trace:FILE                picked from FILE: a latency (ms) per line,
+ *                             # for comments
+ *
+ * Returns false (with errno set) if spec isn't valid, or FILE can't be
+ * read.
+ */
+bool camera_latency_parse(camera_latency_t *latency, const char *spec);
+
+/**
+ * Sample a latency, in milliseconds, using (and updating) the xorshift
+ * state rng.
+ */
+uint32_t camera_latency_sample(const camera_latency_t *latency, uint64_t *rng);
+
+/**
+ * Free any samples.
+ */
+void camera_latency_free(camera_latency_t *latency);
+
+/**
+ * Start ACKing TRIGGERs from device. config.latency must stay allocated
+ * for as long as app is in use.
+ */
+void camera_app_init(camera_app_t *app, fake_nova_device_t *device, const camera_app_config_t *config);
@@ -0,0 +1,154 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See control.h
+ */
+
+#include "control.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ui.h"
+
+// Where sockets can't be told not to raise SIGPIPE per send (OS X), it's
+// turned off per socket instead (SO_NOSIGPIPE).
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void reply(int fd, const char *text)
+{
+  // Clients are expected to read replies. If one doesn't, and the socket
+  // buffer fills, it's dropped rather than blocking the UI.
+  if (send(fd, text, strlen(text), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    shutdown(fd, SHUT_RDWR);
+  }
+}
+
+static void run_line(control_t *control, int fd, const char *line)
+{
+  ui_log("<- control: %s", line);
+  if (scenario_step(&control->scenario, line)) {
+    reply(fd, "ok\n");
+  } else {
+    char text[SCENARIO_MAX_LINE + 16];
+    snprintf(text, sizeof(text), "FAIL: %s\n", control->scenario.error);
+    ui_log("   FAIL: %s", control->scenario.error);
+    reply(fd, text);
+  }
+}
+
+static void disconnect(control_t *control, int index)
+{
+  int fd = control->clients[index].fd;
+  event_loop_unwatch(control->loop, fd);
+  close(fd);
+  control->client_count--;
+  control->clients[index] = control->clients[control->client_count];
+}
+
+/**
+ * Read what a client sent, running each complete line.
+ */
+static void on_client(int fd, void *data)
+{
+  control_t *control = (control_t*)data;
+  int index = 0;
+  while (control->clients[index].fd != fd) {
+    index++;
+  }
+
+  char buf[SCENARIO_MAX_LINE];
+  ssize_t n = recv(fd, buf, sizeof(buf), 0);
+  if (n <= 0) {
+    disconnect(control, index);
+    return;
+  }
+
+  for (ssize_t i = 0; i < n; i++) {
+    char *line = control->clients[index].line;
+    int *len = &control->clients[index].len;
+    if (buf[i] == '\n') {
+      line[*len] = 0;
+      *len = 0;
+      run_line(control, fd, line);
+    } else if (*len < SCENARIO_MAX_LINE - 1) {
+      line[(*len)++] = buf[i];
+    }
+  }
+}
+
+static void on_connect(int fd, void *data)
+{
+  control_t *control = (control_t*)data;
+  int client = accept(fd, NULL, NULL);
+  if (client < 0) {
+    return;
+  }
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  if (control->client_count == CONTROL_MAX_CLIENTS
+      || !event_loop_watch(control->loop, client, on_client, control)) {
+    reply(client, "FAIL: too many clients\n");
+    close(client);
+    return;
+  }
+  control->clients[control->client_count].fd = client;
+  control->clients[control->client_count].len = 0;
+  control->client_count++;
+}
+
+bool control_open(control_t *control, event_loop_t *loop, fake_nova_device_t *device, const char *path)
+{
+  memset(control, 0, sizeof(control_t));
+  control->loop = loop;
+  control->fd = -1;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path) || strlen(path) >= sizeof(control->path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  strcpy(control->path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(fd, CONTROL_MAX_CLIENTS) != 0
+      || !event_loop_watch(loop, fd, on_connect, control)) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return false;
+  }
+  control->fd = fd;
+
+  scenario_init(&control->scenario, device);
+  return true;
+}
+
+void control_close(control_t *control)
+{
+  while (control->client_count > 0) {
+    disconnect(control, 0);
+  }
+  if (control->fd >= 0) {
+    event_loop_unwatch(control->loop, control->fd);
+    close(control->fd);
+    unlink(control->path);
+    control->fd = -1;
+  }
+}
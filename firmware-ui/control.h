@@ -0,0 +1,62 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Control socket, for driving a running firmware-ui from scripts.
+ *
+ * Listens on a Unix domain socket. Clients send scenario steps, one per
+ * line (see scenario.h), and each gets a line back: "ok", or "FAIL: "
+ * and the reason. Steps run against the same device as the UI, so the
+ * UI shows what they do. Since time is real, 'wait' skips time ahead
+ * (like N in the UI) rather than waiting.
+ *
+ *   $ ./firmware-ui -c nova.sock
+ *   $ printf 'connect app\npress\nexpect lights 63 63\n' | nc -U nova.sock
+ *   ok
+ *   ok
+ *   ok
+ *
+ * Sockets are watched by an event loop (see util/eventloop.h).
+ */
+
+#include <stdbool.h>
+
+#include "scenario.h"
+#include "util/eventloop.h"
+
+/** Most clients connected at once. */
+#define CONTROL_MAX_CLIENTS 4
+
+typedef struct control_t
+{
+  event_loop_t *loop;
+
+  /** Listening socket, and where it is. */
+  int fd;
+  char path[108];
+
+  /** Steps from all clients run in one scenario. */
+  scenario_t scenario;
+
+  struct
+  {
+    int fd;
+    char line[SCENARIO_MAX_LINE];
+    int len;
+  } clients[CONTROL_MAX_CLIENTS];
+  int client_count;
+
+} control_t;
+
+/**
+ * Listen on a socket at path (replacing any socket left there), for
+ * steps to run against device. Returns false (with errno set) if it
+ * can't.
+ */
+bool control_open(control_t *control, event_loop_t *loop, fake_nova_device_t *device, const char *path);
+
+/**
+ * Disconnect clients, and stop listening (removing the socket).
+ */
+void control_close(control_t *control);
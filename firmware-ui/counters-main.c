@@ -0,0 +1,380 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-counter-log.h>
+
+#include "fake-nova-device.h"
+#include "util/rng.h"
+#include "util/simflash.h"
+
+/**
+ * Counter log power cut test.
+ *
+ * Saves a seeded random stream of counter changes to a nova-counter-log.h
+ * store, in simulated flash of the fake device's size, cutting power at
+ * random flash operations (more often while erasing, or writing a
+ * snapshot, to land between its HEADER and COMMIT). After each cut, and now and then
+ * without one, the log is loaded afresh and must give back:
+ *
+ * - exactly what was last saved, if power wasn't cut during a save, or
+ * - for each counter, either what was last saved or what was being saved.
+ *
+ * Programming a word is taken to be all or nothing (power is cut before
+ * one), but erasing a page can be cut short, leaving some of it erased.
+ *
+ * Now and then the device is too busy to call nova_counter_log_idle() for
+ * a while, so the active page fills and saves have to compact inline, and
+ * counters go backwards or jump too far for an increment, which needs a
+ * snapshot. Sequence numbers start just short of wrapping around.
+ *
+ * Fails unless every page was active at some point, and there were idle
+ * compactions (each once the page was at least 75% full), inline
+ * compactions of a full page, a wrapped sequence number, and power cuts
+ * between a HEADER and its COMMIT.
+ *
+ * Usage:
+ *
+ *   firmware-counters [-n SAVES] [-c CUT] [-s SEED]
+ *
+ *   -n SAVES   saves to make (default 1000)
+ *   -c CUT     cut power at 1 in CUT flash operations, or 1 in CUT/4
+ *              erasing or writing a snapshot (default 200)
+ *   -s SEED    seed for changes and power cuts (default 1)
+ *
+ * Exits with status 1 if any check fails.
+ */
+
+#define COUNTER_FIELDS (sizeof(counters_t) / sizeof(uint32_t))
+
+/** Words in a snapshot: HEADER, BASE_HI and BASE_LO per field, COMMIT. */
+#define SNAPSHOT_WORDS (2 + 2 * COUNTER_FIELDS)
+
+typedef struct check_t
+{
+  sim_flash_t flash;
+  nova_counter_log_t log;
+  uint64_t rng;
+  uint32_t cut;
+
+  /** Where to go when power is cut. */
+  jmp_buf power_cut;
+
+  /** What was last saved, and what's being saved (if saving). */
+  counters_t saved;
+  counters_t saving;
+  bool is_saving;
+
+  /** Saves left that are too busy for nova_counter_log_idle(). */
+  uint32_t busy;
+
+  /** Page a snapshot is being written to, and how many words so far. */
+  bool is_snapshotting;
+  uint8_t snapshot_page;
+  uint16_t snapshot_words;
+
+  uint32_t saves;
+  uint32_t loads;
+  uint32_t cuts;
+  uint32_t cuts_in_snapshot;
+  uint32_t torn_erases;
+  uint32_t idle_compactions;
+  uint32_t full_compactions;
+  uint32_t snapshot_compactions;
+  uint32_t wraps;
+
+  /** Bitmask of pages that have been the active page. */
+  uint32_t pages_active;
+
+  uint32_t errors;
+
+} check_t;
+
+static check_t check;
+
+static uint32_t *counter_fields(counters_t *counters)
+{
+  return (uint32_t*)counters;
+}
+
+
+// ----------------------------------------------------------------------------
+// Flash, with power cuts (see nova-counter-log.h)
+
+/**
+ * Cut power now? 1 in check.cut, or 1 in check.cut/4 if odds are raised.
+ */
+static bool cut_now(bool raised)
+{
+  uint32_t odds = raised ? check.cut / 4 : check.cut;
+  return rng_below(&check.rng, odds > 0 ? odds : 1) == 0;
+}
+
+static void power_cut()
+{
+  check.cuts++;
+  if (check.is_snapshotting && check.snapshot_words > 0) {
+    check.cuts_in_snapshot++;
+  }
+  longjmp(check.power_cut, 1);
+}
+
+void nova_counter_log_flash_read(nova_counter_log_t *log, uint8_t page, uint16_t offset, uint8_t *buf, uint16_t len)
+{
+  sim_flash_read(&check.flash, page, offset, buf, len);
+}
+
+void nova_counter_log_flash_write(nova_counter_log_t *log, uint8_t page, uint16_t offset, const uint8_t *buf, uint16_t len)
+{
+  if (cut_now(check.is_snapshotting && check.snapshot_words > 0)) {
+    power_cut();
+  }
+  sim_flash_write(&check.flash, page, offset, buf, len);
+
+  // A snapshot starts at the beginning of a page.
+  if (offset == 0) {
+    check.is_snapshotting = true;
+    check.snapshot_page = page;
+    check.snapshot_words = 0;
+  }
+  if (check.is_snapshotting && page == check.snapshot_page
+      && ++check.snapshot_words == SNAPSHOT_WORDS) {
+    check.is_snapshotting = false;
+  }
+}
+
+void nova_counter_log_flash_erase(nova_counter_log_t *log, uint8_t page)
+{
+  // Erasing takes as long as programming a thousand words.
+  if (cut_now(true)) {
+    // Some of the page erased, some not.
+    uint8_t *memory = check.flash.memory + (size_t)page * check.flash.page_size;
+    for (uint16_t offset = 0; offset < check.flash.page_size; offset += NOVA_COUNTER_LOG_RECORD_SIZE) {
+      if (rng_below(&check.rng, 2)) {
+        memset(memory + offset, 0xFF, NOVA_COUNTER_LOG_RECORD_SIZE);
+      }
+    }
+    check.torn_erases++;
+    power_cut();
+  }
+  sim_flash_erase(&check.flash, page);
+}
+
+
+// ----------------------------------------------------------------------------
+// Checks
+
+static void note_active_page()
+{
+  if (check.log.active_page < check.log.page_count) {
+    check.pages_active |= 1 << check.log.active_page;
+  }
+}
+
+/**
+ * Power up: load the log afresh, and check it has what was saved.
+ */
+static void reload(const char *why)
+{
+  nova_counter_log_init(&check.log, FAKE_COUNTERS_FLASH_PAGE_SIZE, FAKE_COUNTERS_FLASH_PAGES, NULL);
+  counters_t loaded;
+  nova_counter_log_load(&check.log, &loaded);
+  check.loads++;
+  note_active_page();
+
+  // Until something is committed, start sequence numbers just short of
+  // wrapping around.
+  if (check.log.active_page == 0xFF) {
+    check.log.sequence = 0xFFF0;
+  }
+
+  uint32_t *got = counter_fields(&loaded);
+  uint32_t *saved = counter_fields(&check.saved);
+  uint32_t *saving = counter_fields(&check.saving);
+  for (uint8_t i = 0; i < COUNTER_FIELDS; i++) {
+    if (got[i] != saved[i] && !(check.is_saving && got[i] == saving[i])) {
+      printf("FAIL: after %s (save %u), counter %u is %u, saved %u", why, check.saves, i, got[i], saved[i]);
+      if (check.is_saving) {
+        printf(", saving %u", saving[i]);
+      }
+      printf("\n");
+      check.errors++;
+    }
+  }
+
+  // Whatever survived is what's saved now.
+  check.saved = loaded;
+  check.is_saving = false;
+  check.is_snapshotting = false;
+}
+
+/**
+ * Some changes to the counters: mostly small increments, now and then
+ * one that can only be saved as a snapshot.
+ */
+static bool change(counters_t *counters)
+{
+  uint32_t *fields = counter_fields(counters);
+  uint32_t roll = rng_below(&check.rng, 100);
+  uint8_t field = (uint8_t)rng_below(&check.rng, COUNTER_FIELDS);
+  if (roll < 2) {
+    fields[field] /= 2;
+    return true;
+  }
+  if (roll < 4) {
+    fields[field] += 0x10000 + rng_below(&check.rng, 0x10000);
+    return true;
+  }
+  uint32_t count = 1 + rng_below(&check.rng, 3);
+  for (uint32_t c = 0; c < count; c++) {
+    fields[rng_below(&check.rng, COUNTER_FIELDS)] += 1 + rng_below(&check.rng, 5);
+  }
+  return false;
+}
+
+static void save(counters_t *counters, bool snapshot)
+{
+  uint8_t page = check.log.active_page;
+  uint16_t sequence = check.log.sequence;
+
+  check.saving = *counters;
+  check.is_saving = true;
+  nova_counter_log_save(&check.log, counters);
+  check.is_saving = false;
+  check.saved = *counters;
+  check.saves++;
+
+  if (check.log.active_page != page) {
+    if (snapshot) {
+      check.snapshot_compactions++;
+    } else {
+      check.full_compactions++;
+    }
+  }
+  if (check.log.sequence < sequence) {
+    check.wraps++;
+  }
+  note_active_page();
+}
+
+static void idle()
+{
+  for (;;) {
+    uint8_t page = check.log.active_page;
+    uint16_t sequence = check.log.sequence;
+    uint16_t offset = check.log.write_offset;
+    if (!nova_counter_log_idle(&check.log)) {
+      return;
+    }
+    if (check.log.active_page != page) {
+      check.idle_compactions++;
+      if (offset < check.log.page_size / 4 * NOVA_COUNTER_LOG_COMPACT_QUARTERS) {
+        printf("FAIL: idle compaction of page %u only %u of %u bytes full\n", page, offset, check.log.page_size);
+        check.errors++;
+      }
+    }
+    if (check.log.sequence < sequence) {
+      check.wraps++;
+    }
+    note_active_page();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t saves = 1000;
+  check.cut = 200;
+  check.rng = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      saves = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      check.cut = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      check.rng = strtoull(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [-n SAVES] [-c CUT] [-s SEED]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (check.rng == 0) {
+    check.rng = 1;
+  }
+  if (check.cut == 0) {
+    check.cut = 1;
+  }
+
+  printf("counters: %u saves, %u pages of %u bytes, power cut at 1 in %u flash operations\n",
+      saves, FAKE_COUNTERS_FLASH_PAGES, FAKE_COUNTERS_FLASH_PAGE_SIZE, check.cut);
+
+  sim_flash_init(&check.flash, FAKE_COUNTERS_FLASH_PAGE_SIZE, FAKE_COUNTERS_FLASH_PAGES, NULL, NULL);
+  memset(&check.saved, 0, sizeof(counters_t));
+  reload("first power up");
+
+  counters_t counters = check.saved;
+  while (check.saves < saves) {
+    if (setjmp(check.power_cut)) {
+      reload("power cut");
+      counters = check.saved;
+      continue;
+    }
+
+    bool snapshot = change(&counters);
+    save(&counters, snapshot);
+
+    // Busy for a while now and then, too busy for maintenance.
+    if (check.busy > 0) {
+      check.busy--;
+    } else if (rng_below(&check.rng, 50) == 0) {
+      check.busy = 20 + rng_below(&check.rng, 20);
+    } else {
+      idle();
+    }
+
+    if (rng_below(&check.rng, 25) == 0) {
+      reload("restart");
+      counters = check.saved;
+    }
+  }
+  reload("last restart");
+
+  printf("  saves                 %6u\n", check.saves);
+  printf("  loads                 %6u\n", check.loads);
+  printf("  power cuts            %6u (%u between HEADER and COMMIT, %u during erase)\n",
+      check.cuts, check.cuts_in_snapshot, check.torn_erases);
+  printf("  compactions when idle %6u\n", check.idle_compactions);
+  printf("  inline, page full     %6u\n", check.full_compactions);
+  printf("  inline, snapshot      %6u\n", check.snapshot_compactions);
+  printf("  sequence wraps        %6u\n", check.wraps);
+  printf("  word writes           %6u\n", check.flash.word_writes);
+  printf("  erases per page      ");
+  for (uint8_t page = 0; page < FAKE_COUNTERS_FLASH_PAGES; page++) {
+    printf(" %u", check.flash.page_wear[page]);
+  }
+  printf("\n");
+
+  bool ok = check.errors == 0;
+  if (check.pages_active != (1u << FAKE_COUNTERS_FLASH_PAGES) - 1) {
+    printf("FAIL: not every page was active (pages 0x%x)\n", check.pages_active);
+    ok = false;
+  }
+  if (check.idle_compactions == 0 || check.full_compactions == 0) {
+    printf("FAIL: no idle compaction, or no inline compaction of a full page\n");
+    ok = false;
+  }
+  if (check.wraps == 0) {
+    printf("FAIL: sequence number didn't wrap around\n");
+    ok = false;
+  }
+  if (check.cuts_in_snapshot == 0) {
+    printf("FAIL: power never cut between HEADER and COMMIT\n");
+    ok = false;
+  }
+
+  sim_flash_free(&check.flash);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,297 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nova-api.h>
+#include <nova-codec.h>
+#include <nova-events.h>
+
+#include "fake-nova-device.h"
+#include "ui-headless.h"
+#include "util/rng.h"
+
+/**
+ * Event queue stress test.
+ *
+ * A producer thread stands in for the interrupt handlers of a real
+ * device, posting a seeded random stream of events (button presses, HID
+ * connections, App commands and frames of commands) to a nova-events.h
+ * queue as fast as it can. The main thread stands in for the main loop,
+ * dispatching them to a fake device.
+ *
+ * Every App command has the next id, so the device must ACK them in
+ * strictly increasing order, each exactly once. Frames are negotiated
+ * first, so each frame posted must come out as one notification with
+ * exactly its own ACKs: a torn or reordered frame shows up as a mismatch.
+ *
+ * Usage:
+ *
+ *   firmware-events [-n EVENTS] [-s SEED] [-v]
+ *
+ *   -n EVENTS  events to post, counting each command of a frame
+ *              (default 1000000)
+ *   -s SEED    seed for event stream (default 1)
+ *   -v         log everything (only sensible with few events)
+ *
+ * Exits with status 1 if any check fails.
+ */
+
+typedef struct stress_t
+{
+  nova_event_queue_t queue;
+  uint32_t events;
+  uint64_t rng;
+
+  /** Set by producer once everything is posted. */
+  atomic_bool done;
+
+  // Producer only.
+  cmd_id_t next_command_id;
+  bool pressed;
+  bool hid_connected;
+  uint32_t posted;
+  uint32_t commands;
+  uint32_t frames;
+  uint32_t full_waits;
+
+  /**
+   * Size of the frame starting at each command id (1 for single commands).
+   * Written by producer before posting, so visible to consumer once taken.
+   */
+  uint8_t frame_size[65536];
+
+  // Consumer only.
+  fake_nova_device_t *device;
+  fake_nova_device_listener_t listener;
+  cmd_id_t last_ack_id;
+  uint32_t acks;
+  uint32_t errors;
+
+} stress_t;
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+// ----------------------------------------------------------------------------
+// Producer (interrupts)
+
+static void random_command(stress_t *stress, app_command_t *cmd)
+{
+  static const uint8_t types[] = { NOVA_CMD_PING, NOVA_CMD_FLASH, NOVA_CMD_OFF };
+  memset(cmd, 0, sizeof(app_command_t));
+  cmd->header.type = types[rng_below(&stress->rng, 3)];
+  cmd->header.id = ++stress->next_command_id;
+  if (cmd->header.type == NOVA_CMD_FLASH) {
+    cmd->body.flash_settings.warm = (uint8_t)rng_below(&stress->rng, 256);
+    cmd->body.flash_settings.cool = (uint8_t)rng_below(&stress->rng, 256);
+    cmd->body.flash_settings.timeout = (milliseconds_t)(1 + rng_below(&stress->rng, 50));
+  }
+  stress->commands++;
+}
+
+/**
+ * Post, spinning while the queue is full (a real interrupt would drop it).
+ */
+static void post(stress_t *stress, nova_event_type type, const app_command_t *cmds, uint8_t count)
+{
+  bool waited = false;
+  while (type == NOVA_EVENT_APP_FRAME_COMMAND
+      ? !nova_events_post_app_commands(&stress->queue, cmds, count)
+      : !nova_events_post(&stress->queue, type, cmds)) {
+    waited = true;
+    sched_yield();
+  }
+  stress->full_waits += waited;
+  stress->posted += type == NOVA_EVENT_APP_FRAME_COMMAND ? count : 1;
+}
+
+static void *producer_main(void *data)
+{
+  stress_t *stress = (stress_t*)data;
+  app_command_t cmds[NOVA_CODEC_MAX_FRAME_COMMANDS];
+
+  // Connect, and negotiate frames so frame boundaries can be checked.
+  post(stress, NOVA_EVENT_CONNECT_APP, NULL, 0);
+  memset(cmds, 0, sizeof(app_command_t));
+  cmds[0].header.type = NOVA_CMD_NEGOTIATE;
+  cmds[0].header.id = ++stress->next_command_id;
+  cmds[0].body.negotiate.features = NOVA_FEATURE_FRAMES;
+  post(stress, NOVA_EVENT_APP_COMMAND, cmds, 1);
+
+  while (stress->posted < stress->events) {
+    // Rolls out of 100:
+    //   0-49   App command
+    //   50-69  frame of App commands
+    //   70-89  press or release button
+    //   90-99  HID connects or disconnects
+    uint32_t roll = rng_below(&stress->rng, 100);
+
+    if (roll < 50) {
+      random_command(stress, &cmds[0]);
+      stress->frame_size[cmds[0].header.id] = 1;
+      post(stress, NOVA_EVENT_APP_COMMAND, cmds, 1);
+    }
+    else if (roll < 70) {
+      uint8_t count = (uint8_t)(2 + rng_below(&stress->rng, NOVA_CODEC_MAX_FRAME_COMMANDS - 1));
+      for (uint8_t c = 0; c < count; c++) {
+        random_command(stress, &cmds[c]);
+      }
+      stress->frame_size[cmds[0].header.id] = count;
+      stress->frames++;
+      post(stress, NOVA_EVENT_APP_FRAME_COMMAND, cmds, count);
+    }
+    else if (roll < 90) {
+      post(stress, stress->pressed ? NOVA_EVENT_BUTTON_RELEASE : NOVA_EVENT_BUTTON_PRESSDOWN, NULL, 0);
+      stress->pressed = !stress->pressed;
+    }
+    else {
+      post(stress, stress->hid_connected ? NOVA_EVENT_DISCONNECT_HID : NOVA_EVENT_CONNECT_HID, NULL, 0);
+      stress->hid_connected = !stress->hid_connected;
+    }
+  }
+
+  atomic_store(&stress->done, true);
+  return NULL;
+}
+
+
+// ----------------------------------------------------------------------------
+// Consumer (main loop)
+
+static void on_app_notified(fake_nova_device_t *device, const uint8_t *buf, uint16_t len, void *data)
+{
+  stress_t *stress = (stress_t*)data;
+  if (!(nova_app_features(device->nova) & NOVA_FEATURE_FRAMES)) {
+    return; // Response to NEGOTIATE.
+  }
+
+  app_command_t cmds[NOVA_CODEC_MAX_FRAME_COMMANDS];
+  int count = nova_codec_decode_frame(buf, len, cmds, NOVA_CODEC_MAX_FRAME_COMMANDS);
+  if (count < 1) {
+    printf("FAIL: undecodable notification\n");
+    stress->errors++;
+    return;
+  }
+  if (cmds[0].header.type != NOVA_CMD_ACK) {
+    return; // TRIGGER.
+  }
+
+  uint8_t expected = stress->frame_size[cmds[0].header.id];
+  if (count != expected) {
+    printf("FAIL: frame from id %u has %i ACKs, expected %u\n", cmds[0].header.id, count, expected);
+    stress->errors++;
+  }
+  for (int i = 0; i < count; i++) {
+    cmd_id_t id = cmds[i].header.id;
+    if (cmds[i].header.type != NOVA_CMD_ACK || id != (cmd_id_t)(stress->last_ack_id + 1)) {
+      printf("FAIL: ACK for id %u after %u\n", id, stress->last_ack_id);
+      stress->errors++;
+    }
+    stress->last_ack_id = id;
+    stress->acks++;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  stress_t *stress = calloc(1, sizeof(stress_t));
+  stress->events = 1000000;
+  stress->rng = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      stress->events = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      stress->rng = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      ui_headless_set_verbose(true);
+    } else {
+      fprintf(stderr, "Usage: %s [-n EVENTS] [-s SEED] [-v]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (stress->events < 2) {
+    stress->events = 2;
+  }
+  if (stress->rng == 0) {
+    stress->rng = 1;
+  }
+
+  fake_nova_device_t *device = fake_nova_device_init(NULL, 0);
+  basic_clock_init_virtual(&device->clock, 0);
+  stress->device = device;
+  stress->listener.app_notified = on_app_notified;
+  stress->listener.data = stress;
+  fake_nova_device_add_listener(device, &stress->listener);
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+  fake_nova_device_idle(device);
+
+  nova_events_init(&stress->queue);
+  // Negotiation takes the first id, and isn't ACKed.
+  stress->last_ack_id = 1;
+
+  printf("events: %u events, %u slot queue\n", stress->events, NOVA_EVENT_QUEUE_SIZE);
+
+  double start = seconds_now();
+  pthread_t producer;
+  pthread_create(&producer, NULL, producer_main, stress);
+
+  uint32_t dispatched = 0;
+  uint32_t passes = 0;
+  uint8_t biggest = 0;
+  for (;;) {
+    // Check done first, so nothing posted before it was set is missed.
+    bool done = atomic_load(&stress->done);
+    uint8_t handled = nova_events_dispatch(device->nova, &stress->queue);
+    if (handled > 0) {
+      dispatched += handled;
+      passes++;
+      biggest = handled > biggest ? handled : biggest;
+      // Let FLASH timers run, and the counter log keep up.
+      basic_timer_advance(&device->timers, 1);
+      fake_nova_device_idle(device);
+    } else if (done) {
+      break;
+    } else {
+      // Nothing to do: on a device, sleep until the next interrupt.
+      sched_yield();
+    }
+  }
+
+  pthread_join(producer, NULL);
+  double elapsed = seconds_now() - start;
+
+  printf("  dispatched       %10u events in %.2fs (%.0f events/s)\n",
+      dispatched, elapsed, elapsed > 0 ? dispatched / elapsed : 0.0);
+  printf("  commands         %10u (%u in frames of 2-%u)\n",
+      stress->commands, stress->frames, NOVA_CODEC_MAX_FRAME_COMMANDS);
+  printf("  ACKs             %10u\n", stress->acks);
+  printf("  passes           %10u (%.1f events each, at most %u)\n",
+      passes, passes > 0 ? (double)dispatched / passes : 0.0, biggest);
+  printf("  queue full       %10u times\n", stress->full_waits);
+
+  bool ok = stress->errors == 0;
+  if (dispatched != stress->posted) {
+    printf("FAIL: dispatched %u of %u events\n", dispatched, stress->posted);
+    ok = false;
+  }
+  if (stress->acks != stress->commands) {
+    printf("FAIL: %u ACKs for %u commands\n", stress->acks, stress->commands);
+    ok = false;
+  }
+
+  fake_nova_device_free(device);
+  free(stress);
+  return ok ? 0 : 1;
+}
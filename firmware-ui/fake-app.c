@@ -0,0 +1,262 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See fake-app.h
+ */
+
+#include "fake-app.h"
+
+#include <string.h>
+
+#include <nova-api.h>
+
+#include "ui.h"
+#include "util/rng.h"
+
+static bool negotiating(fake_app_t *app)
+{
+  return (app->config.frames || app->config.window > 0) && !app->negotiated;
+}
+
+
+// ----------------------------------------------------------------------------
+// Receiving (device -> App)
+
+static void on_app_notified(fake_nova_device_t *device, const uint8_t *buf, uint16_t len, void *data)
+{
+  fake_app_t *app = (fake_app_t*)data;
+  if (app->inbox_count == FAKE_APP_MAX_INBOX) {
+    // Nowhere to put it: as good as lost.
+    app->stats.notifications++;
+    app->stats.lost++;
+    return;
+  }
+  int slot = (app->inbox_head + app->inbox_count) % FAKE_APP_MAX_INBOX;
+  memcpy(app->inbox[slot].bytes, buf, len);
+  app->inbox[slot].len = len;
+  app->inbox_count++;
+}
+
+static void receive_ack(fake_app_t *app, cmd_id_t id, uint64_t now)
+{
+  for (int i = 0; i < app->pending_count; i++) {
+    if (app->pending[i].id == id) {
+      app->pending_count--;
+      memmove(&app->pending[i], &app->pending[i + 1], sizeof(fake_app_pending_t) * (app->pending_count - i));
+      app->stats.acked++;
+      if (app->stats.first_ack_at == 0) {
+        app->stats.first_ack_at = now;
+      }
+      app->stats.last_ack_at = now;
+      return;
+    }
+  }
+  app->stats.duplicate_acks++;
+}
+
+static void receive_negotiate(fake_app_t *app, app_command_t *cmd)
+{
+  app->negotiated = true;
+  app->frames = cmd->body.negotiate.features & NOVA_FEATURE_FRAMES;
+  app->window = app->config.window > 0 ? cmd->body.negotiate.window : 1;
+  if (app->window > FAKE_APP_MAX_WINDOW) {
+    app->window = FAKE_APP_MAX_WINDOW;
+  }
+  ui_log("   App negotiated frames=%i, window=%u", app->frames, app->window);
+}
+
+/**
+ * Receive notifications sent since the last connection event.
+ */
+static void receive_packets(fake_app_t *app, uint64_t now)
+{
+  for (int packets = 0; packets < app->config.packets_per_event && app->inbox_count > 0; packets++) {
+    uint8_t *buf = app->inbox[app->inbox_head].bytes;
+    uint16_t len = app->inbox[app->inbox_head].len;
+    app->inbox_head = (app->inbox_head + 1) % FAKE_APP_MAX_INBOX;
+    app->inbox_count--;
+    app->stats.notifications++;
+
+    if (!negotiating(app) && rng_next(&app->rng) % 1000 < app->config.loss) {
+      app->stats.lost++;
+      continue;
+    }
+
+    app_command_t cmds[NOVA_CODEC_MAX_FRAME_COMMANDS];
+    int count = app->frames
+        ? nova_codec_decode_frame(buf, len, cmds, NOVA_CODEC_MAX_FRAME_COMMANDS)
+        : nova_codec_decode_command(buf, len, cmds) ? 1 : -1;
+    for (int i = 0; i < count; i++) {
+      if (cmds[i].header.type == NOVA_CMD_ACK) {
+        receive_ack(app, cmds[i].header.id, now);
+      } else if (cmds[i].header.type == NOVA_CMD_NEGOTIATE) {
+        receive_negotiate(app, &cmds[i]);
+      }
+    }
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Sending (App -> device)
+
+/**
+ * Next command to put in a write: the oldest overdue resend, else a new
+ * command if the window has room. Returns false if there's nothing to
+ * send. If take is false, only peeks (so the caller can check it fits).
+ */
+static bool next_command(fake_app_t *app, uint64_t now, bool take, app_command_t *cmd)
+{
+  bool resend = false;
+  memset(cmd, 0, sizeof(app_command_t));
+
+  for (int i = 0; i < app->pending_count && !resend; i++) {
+    fake_app_pending_t *pending = &app->pending[i];
+    if (now - pending->sent_at >= app->config.resend_after) {
+      cmd->header.type = pending->type;
+      cmd->header.id = pending->id;
+      if (take) {
+        pending->sent_at = now;
+        app->stats.resends++;
+      }
+      resend = true;
+    }
+  }
+
+  if (!resend) {
+    // The window is of ids: no more than window ids past the oldest
+    // command still waiting for its ACK, so the device can spot resends.
+    cmd_id_t oldest = app->pending_count > 0 ? app->pending[0].id : app->next_command_id + 1;
+    if (app->remaining == 0 || (cmd_id_t)(app->next_command_id + 1 - oldest) >= app->window) {
+      return false;
+    }
+    cmd->header.id = app->next_command_id + 1;
+    cmd->header.type = app->stats.commands % 2 == 0 ? NOVA_CMD_FLASH : NOVA_CMD_OFF;
+    if (take) {
+      app->next_command_id++;
+      app->remaining--;
+      app->stats.commands++;
+      app->stats.flashes += cmd->header.type == NOVA_CMD_FLASH;
+      fake_app_pending_t *pending = &app->pending[app->pending_count++];
+      pending->id = cmd->header.id;
+      pending->type = cmd->header.type;
+      pending->sent_at = now;
+    }
+  }
+
+  if (cmd->header.type == NOVA_CMD_FLASH) {
+    cmd->body.flash_settings.timeout = 1000;
+    cmd->body.flash_settings.warm = 255;
+    cmd->body.flash_settings.cool = 255;
+  }
+  return true;
+}
+
+static void write_packet(fake_app_t *app, const uint8_t *buf, uint16_t len)
+{
+  app->stats.writes++;
+  fake_nova_device_app_write(app->device, buf, len);
+}
+
+/**
+ * Write as many packets as allowed at this connection event.
+ */
+static void send_packets(fake_app_t *app, uint64_t now)
+{
+  uint8_t buf[NOVA_CODEC_MAX_FRAME_SIZE];
+  uint16_t len;
+  app_command_t cmds[NOVA_CODEC_MAX_FRAME_COMMANDS];
+
+  if (negotiating(app)) {
+    if (!app->negotiate_sent) {
+      memset(cmds, 0, sizeof(app_command_t));
+      cmds[0].header.type = NOVA_CMD_NEGOTIATE;
+      cmds[0].header.id = ++app->next_command_id;
+      cmds[0].body.negotiate.features = app->config.frames ? NOVA_FEATURE_FRAMES : 0;
+      cmds[0].body.negotiate.window = app->config.window;
+      write_packet(app, buf, nova_codec_encode_command(&cmds[0], buf));
+      app->negotiate_sent = true;
+    }
+    return;
+  }
+
+  for (int packets = 0; packets < app->config.packets_per_event; packets++) {
+    int count = 0;
+    uint16_t size = 0;
+    while (count < (app->frames ? NOVA_CODEC_MAX_FRAME_COMMANDS : 1)
+        && next_command(app, now, false, &cmds[count])) {
+      uint16_t more = NOVA_CODEC_FRAME_PREFIX_SIZE + nova_codec_command_size(cmds[count].header.type);
+      if (app->frames && size + more > NOVA_CODEC_MAX_FRAME_SIZE) {
+        break;
+      }
+      next_command(app, now, true, &cmds[count++]);
+      size += more;
+    }
+    if (count == 0) {
+      return;
+    }
+
+    if (app->frames) {
+      nova_codec_encode_frame(cmds, count, buf, &len);
+    } else {
+      len = nova_codec_encode_command(&cmds[0], buf);
+    }
+    write_packet(app, buf, len);
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Connection events
+
+static void on_connection_event(basic_timer_t *timer, void *data)
+{
+  fake_app_t *app = (fake_app_t*)data;
+  uint64_t now = basic_clock_now(&app->device->clock);
+
+  receive_packets(app, now);
+  send_packets(app, now);
+
+  if (!fake_app_done(app)) {
+    basic_timer_schedule(&app->device->timers, &app->connection_event,
+        app->config.connection_interval, on_connection_event, app);
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void fake_app_init(fake_app_t *app, fake_nova_device_t *device, const fake_app_config_t *config)
+{
+  memset(app, 0, sizeof(fake_app_t));
+  app->device = device;
+  app->config = *config;
+  app->rng = config->seed ? config->seed : 1;
+  app->window = 1;
+  app->listener.app_notified = on_app_notified;
+  app->listener.data = app;
+  fake_nova_device_add_listener(device, &app->listener);
+}
+
+void fake_app_start(fake_app_t *app, uint32_t commands)
+{
+  app->remaining = commands;
+  app->stats.started_at = basic_clock_now(&app->device->clock);
+
+  fake_nova_device_input(app->device, NOVA_EVENT_CONNECT_APP);
+
+  basic_timer_schedule(&app->device->timers, &app->connection_event,
+      app->config.connection_interval, on_connection_event, app);
+}
+
+bool fake_app_done(fake_app_t *app)
+{
+  return app->remaining == 0 && app->pending_count == 0 && !negotiating(app);
+}
+
+double fake_app_commands_per_second(fake_app_t *app)
+{
+  uint64_t elapsed = app->stats.last_ack_at - app->stats.started_at;
+  return elapsed > 0 ? app->stats.acked * 1000.0 / elapsed : 0.0;
+}
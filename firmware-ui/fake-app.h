@@ -0,0 +1,173 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Simulated Nova App, on the other end of a simulated BLE link to a fake
+ * device.
+ *
+ * BLE only moves data at connection events, every connection interval.
+ * At each one, the App receives up to packets_per_event notifications
+ * the device sent since the last one, and writes up to packets_per_event
+ * packets of its own, which the device handles straight away. So the
+ * quickest a command can be ACKed is one connection interval.
+ *
+ * The App sends a stream of FLASH and OFF commands, with ids up to a
+ * window ahead of the oldest one still waiting for its ACK, and resends
+ * any whose ACK doesn't arrive in time. Before starting it may NEGOTIATE frames and a window (see
+ * NOVA_CMD_NEGOTIATE in nova.h). Without negotiating, it's stop-and-wait
+ * with one command per write, as NVBluetoothNovaFlash in the iOS SDK.
+ *
+ * Notifications can be randomly lost, to exercise resends. Negotiation
+ * itself is never lost.
+ *
+ * Time comes from the device's clock, which should be virtual.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nova.h>
+#include <nova-codec.h>
+
+#include "fake-nova-device.h"
+
+/** Most commands the App can have in flight. */
+#define FAKE_APP_MAX_WINDOW 64
+
+/** Most notifications waiting to be received by the App. */
+#define FAKE_APP_MAX_INBOX 64
+
+typedef struct fake_app_config_t
+{
+  /** Milliseconds between BLE connection events. */
+  uint32_t connection_interval;
+
+  /** Most packets each way per connection event. */
+  uint8_t packets_per_event;
+
+  /** Negotiate frames (NOVA_FEATURE_FRAMES)? */
+  bool frames;
+
+  /**
+   * Window to ask for. 0 means don't negotiate a window (stop-and-wait).
+   * The device may agree to a smaller one.
+   */
+  uint8_t window;
+
+  /** Resend commands not ACKed within this many milliseconds. */
+  uint32_t resend_after;
+
+  /** Chance of each notification being lost, per thousand. */
+  uint32_t loss;
+
+  /** Seed for losses. */
+  uint64_t seed;
+
+} fake_app_config_t;
+
+/**
+ * A command sent, waiting for its ACK.
+ */
+typedef struct fake_app_pending_t
+{
+  cmd_id_t id;
+  uint8_t type;
+  uint64_t sent_at;
+} fake_app_pending_t;
+
+typedef struct fake_app_stats_t
+{
+  /** Commands sent, not counting resends. */
+  uint32_t commands;
+
+  /** FLASH commands sent, not counting resends. */
+  uint32_t flashes;
+
+  /** Commands ACKed. */
+  uint32_t acked;
+
+  /** Commands resent. */
+  uint32_t resends;
+
+  /** ACKs for commands already ACKed (e.g. resent too early). */
+  uint32_t duplicate_acks;
+
+  /** Writes (packets) sent to device. */
+  uint32_t writes;
+
+  /** Notifications (packets) received from device, or lost. */
+  uint32_t notifications;
+
+  /** Notifications lost. */
+  uint32_t lost;
+
+  /** Time first and last command were ACKed (0 if none). */
+  uint64_t first_ack_at;
+  uint64_t last_ack_at;
+
+  /** Time sending started. */
+  uint64_t started_at;
+
+} fake_app_stats_t;
+
+typedef struct fake_app_t
+{
+  fake_nova_device_t *device;
+  fake_app_config_t config;
+  uint64_t rng;
+
+  /** Commands still to send. */
+  uint32_t remaining;
+
+  /** Has a NEGOTIATE been sent, and its response received? */
+  bool negotiate_sent;
+  bool negotiated;
+
+  /** What was agreed. Window is 1 if not negotiated. */
+  bool frames;
+  uint8_t window;
+
+  cmd_id_t next_command_id;
+
+  /** Commands in flight, in order sent (so oldest id first). */
+  fake_app_pending_t pending[FAKE_APP_MAX_WINDOW];
+  uint8_t pending_count;
+
+  /** Notifications sent by device, not yet received by App. */
+  struct
+  {
+    uint8_t bytes[NOVA_CODEC_MAX_FRAME_SIZE];
+    uint16_t len;
+  } inbox[FAKE_APP_MAX_INBOX];
+  uint8_t inbox_head;
+  uint8_t inbox_count;
+
+  fake_app_stats_t stats;
+
+  basic_timer_t connection_event;
+  fake_nova_device_listener_t listener;
+
+} fake_app_t;
+
+/**
+ * Prepare app to talk to device.
+ */
+void fake_app_init(fake_app_t *app, fake_nova_device_t *device, const fake_app_config_t *config);
+
+/**
+ * Connect to device (nova_on_connect_app()), and start sending the given
+ * number of commands at connection events. Drive it by advancing the
+ * device's timers until fake_app_done().
+ */
+void fake_app_start(fake_app_t *app, uint32_t commands);
+
+/**
+ * Have all commands been sent and ACKed?
+ */
+bool fake_app_done(fake_app_t *app);
+
+/**
+ * ACKed commands per second of simulated time, since started.
+ */
+double fake_app_commands_per_second(fake_app_t *app);
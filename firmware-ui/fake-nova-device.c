@@ -11,23 +11,47 @@
 
 #include "fake-nova-device.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <nova-device.h>
 #include <nova-api.h>
+#include <nova-codec.h>
 #include <nova-internal.h>
 
 #include "util/basictimer.h"
-#include "util/file.h"
+#include "util/simflash.h"
 #include "ui.h"
 
-fake_nova_device_t *fake_nova_device_init(const char *counters_filename)
+typedef char check_storage_size[
+    FAKE_STORAGE_DEFAULTS_OFFSET + 1 + NOVA_CODEC_FLASH_DEFAULTS_SIZE <= FAKE_STORAGE_SLOT_SIZE ? 1 : -1];
+
+fake_nova_device_t *fake_nova_device_init(slab_t *slab, uint32_t slot)
 {
-  fake_nova_device_t *device = malloc(sizeof(fake_nova_device_t));
-  device->flash_timer.active = false;
-  device->counters_filename = counters_filename;
+  fake_nova_device_t *device = calloc(1, sizeof(fake_nova_device_t));
+  basic_clock_init_real(&device->clock);
+  basic_timer_queue_init(&device->timers, &device->clock);
+  device->counters_saves = 0;
+  device->counters_increments_saved = 0;
+  device->counters_worst_unsaved = 0;
+  device->counters_lost = 0;
+
+  if (slab) {
+    device->storage = slab_slot(slab, slot);
+    device->storage_slab = slab;
+  } else {
+    device->storage = malloc(FAKE_STORAGE_SLOT_SIZE);
+    memset(device->storage, 0xFF, FAKE_STORAGE_SLOT_SIZE);
+  }
+
+  sim_flash_init(&device->counters_flash,
+      FAKE_COUNTERS_FLASH_PAGE_SIZE, FAKE_COUNTERS_FLASH_PAGES, device->storage, slab);
+  nova_counter_log_init(&device->counters_log,
+      FAKE_COUNTERS_FLASH_PAGE_SIZE, FAKE_COUNTERS_FLASH_PAGES, device);
 
-  device->nova = malloc(sizeof(nova_t));
+  device->nova = calloc(1, sizeof(nova_t));
   device->nova->data = device;
 
   return device;
@@ -35,47 +59,298 @@ fake_nova_device_t *fake_nova_device_init(const char *counters_filename)
 
 void fake_nova_device_free(fake_nova_device_t *device)
 {
+  sim_flash_free(&device->counters_flash);
+  if (!device->storage_slab) {
+    free(device->storage);
+  }
   free(device->nova);
   free(device);
 }
 
+void fake_nova_device_record(fake_nova_device_t *device, recording_t *recording)
+{
+  device->recording = recording;
+}
+
+/** Something is going in or out of nova.c: note the change, and record it if recording. */
+static void record(fake_nova_device_t *device, uint8_t kind, const uint8_t *payload, uint8_t length)
+{
+  device->generation++;
+  if (device->recording) {
+    recording_write(device->recording, kind, basic_clock_now(&device->clock), payload, length);
+  }
+}
+
+static const char *input_handlers[] = {
+  "nova_on_reset",
+  "nova_on_button_pressdown",
+  "nova_on_button_release",
+  "nova_on_connect_app",
+  "nova_on_disconnect_app",
+  "nova_on_connect_hid",
+  "nova_on_disconnect_hid",
+  "nova_on_timer_complete",
+  "nova_on_power_failing",
+};
+
+void fake_nova_device_input(fake_nova_device_t *device, nova_event_type type)
+{
+  if (type >= sizeof(input_handlers) / sizeof(input_handlers[0])) {
+    return;
+  }
+  ui_log("-> %s()", input_handlers[type]);
+  record(device, type, NULL, 0);
+
+  nova_event_t event;
+  event.type = type;
+  nova_events_handle(device->nova, &event);
+}
+
+void fake_nova_device_add_listener(fake_nova_device_t *device, fake_nova_device_listener_t *listener)
+{
+  fake_nova_device_listener_t **link = &device->listeners;
+  while (*link) {
+    link = &(*link)->next;
+  }
+  listener->next = NULL;
+  *link = listener;
+}
+
+static uint32_t counters_sum(counters_t *counters)
+{
+  uint32_t sum = 0;
+  uint32_t *fields = (uint32_t*)counters;
+  for (int i = 0; i < sizeof(counters_t) / sizeof(uint32_t); i++) {
+    sum += fields[i];
+  }
+  return sum;
+}
+
+uint32_t fake_nova_device_counters_unsaved(fake_nova_device_t *device)
+{
+  return counters_sum(&device->nova->counters) - counters_sum(&device->counters_saved);
+}
+
+uint32_t fake_nova_device_saves_avoided(fake_nova_device_t *device)
+{
+  uint32_t increments = device->counters_increments_saved + fake_nova_device_counters_unsaved(device);
+  return increments > device->counters_saves ? increments - device->counters_saves : 0;
+}
+
+void fake_nova_device_power_cut(fake_nova_device_t *device, bool warned)
+{
+  if (warned) {
+    fake_nova_device_input(device, NOVA_EVENT_POWER_FAILING);
+  }
+
+  uint32_t lost = fake_nova_device_counters_unsaved(device);
+  device->counters_lost += lost;
+  device->generation++;
+  ui_log("   (power cut: %u counter increments lost)", lost);
+
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+}
+
+void fake_nova_device_idle(fake_nova_device_t *device)
+{
+  // Every point between events is somewhere power could be cut.
+  uint32_t unsaved = fake_nova_device_counters_unsaved(device);
+  if (unsaved > device->counters_worst_unsaved) {
+    device->counters_worst_unsaved = unsaved;
+    device->generation++;
+  }
+
+  while (nova_counter_log_idle(&device->counters_log)) {
+    device->generation++;
+    ui_log("   (idle: counter log maintenance, %uus)", device->counters_flash.last_op_us);
+  }
+}
+
 void nova_load_counters(nova_t *nova, counters_t *counters)
 {
   ui_log("   nova_load_counters()");
   fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
-  file_load(device->counters_filename, counters, sizeof(counters_t));
+  nova_counter_log_load(&device->counters_log, counters);
+  device->counters_saved = *counters;
+
+  uint8_t buf[NOVA_CODEC_COUNTERS_SIZE];
+  nova_codec_encode_counters(counters, buf);
+  record(device, RECORDING_LOAD_COUNTERS, buf, sizeof(buf));
 }
 
 void nova_save_counters(nova_t *nova, counters_t *counters)
 {
-  ui_log("   nova_save_counters()");
   fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
-  file_save(device->counters_filename, counters, sizeof(counters_t));
+  uint64_t busy_before = device->counters_flash.busy_us;
+
+  uint8_t buf[NOVA_CODEC_COUNTERS_SIZE];
+  nova_codec_encode_counters(counters, buf);
+  record(device, RECORDING_SAVE_COUNTERS, buf, sizeof(buf));
+
+  nova_counter_log_save(&device->counters_log, counters);
+  device->counters_saves++;
+  device->counters_increments_saved += counters_sum(counters) - counters_sum(&device->counters_saved);
+  device->counters_saved = *counters;
+  ui_log("   nova_save_counters() (flash busy %uus)",
+      (unsigned)(device->counters_flash.busy_us - busy_before));
 }
 
 void nova_load_flash_defaults(nova_t *nova, flash_defaults_t *flash_defaults)
 {
   ui_log("   nova_load_flash_defaults()");
+  fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
+
+  // If nothing is stored, flash_defaults keeps what's already in memory.
+  const uint8_t *stored = device->storage + FAKE_STORAGE_DEFAULTS_OFFSET;
+  if (stored[0] == 0) {
+    nova_codec_decode_flash_defaults(stored + 1, NOVA_CODEC_FLASH_DEFAULTS_SIZE, flash_defaults);
+  }
+
+  uint8_t buf[NOVA_CODEC_FLASH_DEFAULTS_SIZE];
+  nova_codec_encode_flash_defaults(flash_defaults, buf);
+  record(device, RECORDING_LOAD_FLASH_DEFAULTS, buf, sizeof(buf));
 }
 
-void nova_send_app_command(nova_t *nova, app_command_t *cmd)
+void fake_nova_device_store_flash_defaults(fake_nova_device_t *device, const flash_defaults_t *flash_defaults)
+{
+  uint8_t *stored = device->storage + FAKE_STORAGE_DEFAULTS_OFFSET;
+  nova_codec_encode_flash_defaults(flash_defaults, stored + 1);
+  stored[0] = 0;
+  if (device->storage_slab) {
+    slab_written(device->storage_slab);
+  }
+}
+
+/** Format bytes as hex for logging. out must have room for 3 * len + 1 chars. */
+static const char *format_bytes(const uint8_t *buf, uint16_t len, char *out)
+{
+  out[0] = 0;
+  for (uint16_t i = 0; i < len; i++) {
+    sprintf(out + i * 3, "%02X ", buf[i]);
+  }
+  if (len > 0) {
+    out[len * 3 - 1] = 0;
+  }
+  return out;
+}
+
+bool fake_nova_device_app_write(fake_nova_device_t *device, const uint8_t *buf, uint16_t len)
+{
+  char hex[3 * NOVA_CODEC_MAX_FRAME_SIZE + 1];
+  app_command_t cmds[NOVA_APP_FRAME_MAX_COMMANDS];
+  bool framed = nova_app_features(device->nova) & NOVA_FEATURE_FRAMES;
+  int count = -1;
+
+  record(device, RECORDING_APP_WRITE, buf, len <= RECORDING_MAX_PAYLOAD ? (uint8_t)len : RECORDING_MAX_PAYLOAD);
+
+  if (len <= NOVA_CODEC_MAX_FRAME_SIZE) {
+    count = framed
+        ? nova_codec_decode_frame(buf, len, cmds, NOVA_APP_FRAME_MAX_COMMANDS)
+        : nova_codec_decode_command(buf, len, cmds) ? 1 : -1;
+  }
+  if (count < 0) {
+    ui_log("-> App wrote invalid %s (%u bytes), ignored", framed ? "frame" : "command", len);
+    return false;
+  }
+
+  ui_log("-> App wrote [%s]", format_bytes(buf, len, hex));
+  if (framed) {
+    nova_on_app_commands(device->nova, cmds, (uint8_t)count);
+  } else {
+    nova_on_app_command(device->nova, cmds);
+  }
+  return true;
+}
+
+/** Log a command the firmware is sending to the App. */
+static void log_app_command(const char *func, app_command_t *cmd)
 {
   switch (cmd->header.type) {
     case NOVA_CMD_TRIGGER:
-      ui_log("   nova_send_app_command({type=TRIGGER, id=%u, is_pressed=%i})",
-          cmd->header.id, cmd->body.trigger.is_pressed);
+      ui_log("   %s({type=TRIGGER, id=%u, is_pressed=%i})",
+          func, cmd->header.id, cmd->body.trigger.is_pressed);
       break;
     case NOVA_CMD_ACK:
-      ui_log("   nova_send_app_command({type=ACK, id=%u})", cmd->header.id);
+      ui_log("   %s({type=ACK, id=%u})", func, cmd->header.id);
+      break;
+    case NOVA_CMD_NEGOTIATE:
+      ui_log("   %s({type=NEGOTIATE, id=%u, features=0x%02x, window=%u})",
+          func, cmd->header.id, cmd->body.negotiate.features, cmd->body.negotiate.window);
+      break;
+    case NOVA_CMD_SYNC:
+      ui_log("   %s({type=SYNC, id=%u, time=%u})", func, cmd->header.id, cmd->body.sync.time);
       break;
     default:
-      ui_log("   nova_send_app_command(UNEXPECTED!)", cmd->header.id);
+      ui_log("   %s(UNEXPECTED!)", func);
+  }
+}
+
+/**
+ * Send bytes over the air to the App, as a real device would, and hand
+ * listeners the bytes and the commands the App would decode from them.
+ */
+static void notify_app(fake_nova_device_t *device, const uint8_t *buf, uint16_t len, bool framed)
+{
+  char hex[3 * NOVA_CODEC_MAX_FRAME_SIZE + 1];
+  app_command_t cmds[NOVA_CODEC_MAX_FRAME_COMMANDS];
+  int count = framed
+      ? nova_codec_decode_frame(buf, len, cmds, NOVA_CODEC_MAX_FRAME_COMMANDS)
+      : nova_codec_decode_command(buf, len, cmds) ? 1 : -1;
+
+  ui_log("   notify [%s]", format_bytes(buf, len, hex));
+  record(device, RECORDING_NOTIFY_APP, buf, (uint8_t)len);
+  if (count < 0) {
+    ui_log("   notify(UNDECODABLE!)");
+    return;
+  }
+
+  for (fake_nova_device_listener_t *listener = device->listeners; listener; listener = listener->next) {
+    if (listener->app_notified) {
+      listener->app_notified(device, buf, len, listener->data);
+    }
+    for (int i = 0; i < count && listener->app_command_sent; i++) {
+      listener->app_command_sent(device, &cmds[i], listener->data);
+    }
+  }
+}
+
+void nova_send_app_command(nova_t *nova, app_command_t *cmd)
+{
+  log_app_command("nova_send_app_command", cmd);
+
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  uint16_t len = nova_codec_encode_command(cmd, buf);
+  notify_app((fake_nova_device_t*)nova_data(nova), buf, len, false);
+}
+
+void nova_send_app_commands(nova_t *nova, app_command_t *cmds, uint8_t count)
+{
+  for (uint8_t i = 0; i < count; i++) {
+    log_app_command("nova_send_app_commands", &cmds[i]);
+  }
+
+  // As few frames as possible.
+  uint8_t buf[NOVA_CODEC_MAX_FRAME_SIZE];
+  uint16_t len;
+  for (uint8_t sent = 0; sent < count; ) {
+    sent += nova_codec_encode_frame(cmds + sent, count - sent, buf, &len);
+    notify_app((fake_nova_device_t*)nova_data(nova), buf, len, true);
   }
 }
 
 void nova_send_hid_key(nova_t *nova, char key_code)
 {
   ui_log("   nova_send_hid_key(code=%#04x)", key_code);
+
+  fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
+  uint8_t code = (uint8_t)key_code;
+  record(device, RECORDING_SEND_HID_KEY, &code, 1);
+
+  for (fake_nova_device_listener_t *listener = device->listeners; listener; listener = listener->next) {
+    if (listener->hid_key_sent) {
+      listener->hid_key_sent(device, key_code, listener->data);
+    }
+  }
 }
 
 void nova_set_status_indicator(nova_t *nova, bool lit)
@@ -83,6 +358,14 @@ void nova_set_status_indicator(nova_t *nova, bool lit)
   ui_log("   nova_set_status_indicator(lit=%i)", lit);
   fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
   device->connected_lit = lit;
+  uint8_t payload = lit;
+  record(device, RECORDING_SET_STATUS_INDICATOR, &payload, 1);
+
+  for (fake_nova_device_listener_t *listener = device->listeners; listener; listener = listener->next) {
+    if (listener->status_indicator_set) {
+      listener->status_indicator_set(device, lit, listener->data);
+    }
+  }
 }
 
 void nova_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm)
@@ -91,23 +374,78 @@ void nova_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm)
   fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
   device->lights_warm_pwm = warm_pwm;
   device->lights_cool_pwm = cool_pwm;
+  uint8_t payload[2] = { warm_pwm, cool_pwm };
+  record(device, RECORDING_SET_LIGHTS, payload, 2);
+
+  for (fake_nova_device_listener_t *listener = device->listeners; listener; listener = listener->next) {
+    if (listener->lights_set) {
+      listener->lights_set(device, warm_pwm, cool_pwm, listener->data);
+    }
+  }
+}
+
+void nova_counter_log_flash_read(nova_counter_log_t *log, uint8_t page, uint16_t offset, uint8_t *buf, uint16_t len)
+{
+  fake_nova_device_t *device = (fake_nova_device_t*)log->data;
+  sim_flash_read(&device->counters_flash, page, offset, buf, len);
+}
+
+void nova_counter_log_flash_write(nova_counter_log_t *log, uint8_t page, uint16_t offset, const uint8_t *buf, uint16_t len)
+{
+  fake_nova_device_t *device = (fake_nova_device_t*)log->data;
+  sim_flash_write(&device->counters_flash, page, offset, buf, len);
+}
+
+void nova_counter_log_flash_erase(nova_counter_log_t *log, uint8_t page)
+{
+  fake_nova_device_t *device = (fake_nova_device_t*)log->data;
+  sim_flash_erase(&device->counters_flash, page);
 }
 
 void on_timer_complete(basic_timer_t *timer, void *data)
 {
-  nova_on_timer_complete((nova_t*) data);
+  fake_nova_device_t *device = (fake_nova_device_t*)nova_data((nova_t*) data);
+  fake_nova_device_input(device, NOVA_EVENT_TIMER_COMPLETE);
+}
+
+timestamp_t nova_time_now(nova_t *nova)
+{
+  fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
+  int64_t now = (int64_t)basic_clock_now(&device->clock);
+
+  // Whole milliseconds gained (or lost) by now, rounding down.
+  int64_t drift = now * device->clock_drift_ppm;
+  int64_t gained = drift >= 0 ? drift / 1000000 : -((999999 - drift) / 1000000);
+  return device->clock_epoch + (timestamp_t)(now + gained);
+}
+
+uint32_t nova_trace_timestamp(nova_t *nova)
+{
+  // Nanoseconds of real time (even with a virtual clock), as the traced
+  // paths take far less than a millisecond.
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint32_t)((uint64_t)time.tv_sec * 1000000000 + time.tv_nsec);
 }
 
 void nova_timer_schedule(nova_t *nova, milliseconds_t timeout)
 {
   ui_log("   nova_timer_schedule(timeout=%u)", timeout);
   fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
-  basic_timer_schedule(&device->flash_timer, timeout, on_timer_complete, nova);
+  uint8_t payload[2] = { timeout >> 8, timeout & 0xFF };
+  record(device, RECORDING_TIMER_SCHEDULE, payload, 2);
+
+  // The timer counts the device's milliseconds (see clock_drift_ppm).
+  // Round up, so it never fires before the device's clock gets there.
+  uint64_t rate = 1000000 + device->clock_drift_ppm;
+  uint64_t millis = ((uint64_t)timeout * 1000000 + rate - 1) / rate;
+  basic_timer_schedule(&device->timers, &device->hardware_timer, millis, on_timer_complete, nova);
 }
 
 void nova_timer_clear(nova_t *nova)
 {
   ui_log("   nova_timer_clear()");
   fake_nova_device_t *device = (fake_nova_device_t*)nova_data(nova);
-  basic_timer_clear(&device->flash_timer);
+  record(device, RECORDING_TIMER_CLEAR, NULL, 0);
+  basic_timer_clear(&device->timers, &device->hardware_timer);
 }
@@ -4,7 +4,68 @@
 
 #include <stdbool.h>
 #include <nova.h>
+#include <nova-counter-log.h>
+#include <nova-events.h>
+#include "recording.h"
 #include "util/basictimer.h"
+#include "util/simflash.h"
+#include "util/slab.h"
+
+/** Page size of simulated flash used to store usage counters. */
+#define FAKE_COUNTERS_FLASH_PAGE_SIZE 256
+
+/** Number of simulated flash pages used to store usage counters. */
+#define FAKE_COUNTERS_FLASH_PAGES 4
+
+/**
+ * A device's non-volatile storage: the usage counters flash, then flash
+ * defaults (a byte that's 0 once saved, then their wire encoding).
+ * Kept in a slot this size when persisted in a slab (see util/slab.h).
+ */
+#define FAKE_STORAGE_DEFAULTS_OFFSET (FAKE_COUNTERS_FLASH_PAGE_SIZE * FAKE_COUNTERS_FLASH_PAGES)
+#define FAKE_STORAGE_SLOT_SIZE (FAKE_STORAGE_DEFAULTS_OFFSET + 64)
+
+struct fake_nova_device_t;
+
+/**
+ * Optional callbacks to observe what the firmware sends out over BLE and
+ * does to the lights, e.g. to simulate the App or check behavior in
+ * scripted scenarios.
+ *
+ * Register with fake_nova_device_add_listener(). Any callback may be NULL.
+ */
+typedef struct fake_nova_device_listener_t
+{
+  /**
+   * Called for each command sent by nova_send_app_command() or
+   * nova_send_app_commands(), as the App would decode it from the bytes
+   * sent (see nova-codec.h).
+   */
+  void (*app_command_sent)(struct fake_nova_device_t *device, app_command_t *cmd, void *data);
+
+  /**
+   * Called for each BLE notification sent to the App, with the bytes on
+   * the wire: a command, or a frame of commands (see NOVA_FEATURE_FRAMES).
+   * Called before app_command_sent for the commands it holds.
+   */
+  void (*app_notified)(struct fake_nova_device_t *device, const uint8_t *buf, uint16_t len, void *data);
+
+  /** Called when nova_send_hid_key() is called. */
+  void (*hid_key_sent)(struct fake_nova_device_t *device, char key_code, void *data);
+
+  /** Called when nova_set_lights() is called. */
+  void (*lights_set)(struct fake_nova_device_t *device, uint8_t warm_pwm, uint8_t cool_pwm, void *data);
+
+  /** Called when nova_set_status_indicator() is called. */
+  void (*status_indicator_set)(struct fake_nova_device_t *device, bool lit, void *data);
+
+  /** Arbitrary data passed to callbacks. */
+  void *data;
+
+  /** Next listener registered on same device. */
+  struct fake_nova_device_listener_t *next;
+
+} fake_nova_device_listener_t;
 
 /**
  * Provides implementations of all Nova device functions (nova-device.h).
@@ -30,11 +91,75 @@ typedef struct fake_nova_device_t
   /** Whether connectivity indicator is lit. */
   bool connected_lit;
 
-  /** Timer used for deactivating flash. */
-  basic_timer_t flash_timer;
+  /**
+   * Where device time comes from. Real by default - switch to virtual
+   * with basic_clock_init_virtual() before nova_on_reset() to run
+   * simulations faster than real time.
+   */
+  basic_clock_t clock;
+
+  /** All simulated timers belonging to device. */
+  basic_timer_queue_t timers;
+
+  /**
+   * The single hardware compare-match timer that nova's logical timers
+   * are multiplexed onto (see nova-timers.h).
+   */
+  basic_timer_t hardware_timer;
+
+  /**
+   * How the device's own clock (nova_time_now()) differs from clock, as
+   * real devices' clocks differ from each other: it read clock_epoch when
+   * clock read 0, and gains clock_drift_ppm milliseconds every million
+   * (negative to lose them). The hardware timer runs at the same rate.
+   * Both 0 by default, which recordings assume.
+   */
+  uint32_t clock_epoch;
+  int32_t clock_drift_ppm;
+
+  /**
+   * Non-volatile storage (FAKE_STORAGE_SLOT_SIZE bytes): a slot of
+   * storage_slab, or allocated if that's NULL.
+   */
+  uint8_t *storage;
+  slab_t *storage_slab;
+
+  /** Simulated flash memory holding usage counters, in storage. */
+  sim_flash_t counters_flash;
+
+  /** Log-structured counter store, written to counters_flash. */
+  nova_counter_log_t counters_log;
+
+  /** How many times nova_save_counters() has been called. */
+  uint32_t counters_saves;
+
+  /** Counters as last loaded/saved, i.e. what's in persistent store. */
+  counters_t counters_saved;
+
+  /** Total counter increments persisted by nova_save_counters(). */
+  uint32_t counters_increments_saved;
+
+  /**
+   * Most counter increments that have been unsaved at any one time. This
+   * is the worst case loss if power had been cut at a random point.
+   */
+  uint32_t counters_worst_unsaved;
+
+  /** Counter increments actually lost to power cuts. */
+  uint32_t counters_lost;
+
+  /** Registered listeners (linked list). */
+  fake_nova_device_listener_t *listeners;
 
-  /** Path to store usage counters data. */
-  const char *counters_filename;
+  /** If set, everything in and out of nova.c is recorded here. */
+  recording_t *recording;
+
+  /**
+   * Incremented whenever anything goes in or out of nova.c, or other
+   * device state changes, so a UI only needs to repaint when it's moved
+   * on. (Doesn't include time passing.)
+   */
+  uint32_t generation;
 
 } fake_nova_device_t;
 
@@ -44,9 +169,76 @@ typedef struct fake_nova_device_t
  * This also comes with a nova_t instance which can be accessed via the nova
  * pointer in the result.
  *
- * counters_filename is a path to save usage counters data in between runs.
+ * Storage (usage counters in simulated flash, see util/simflash.h, and
+ * flash defaults) is kept in the given slot of slab, so it persists
+ * between runs. The slab's slots must be FAKE_STORAGE_SLOT_SIZE bytes.
+ * If slab is NULL, storage is in memory and starts empty.
+ */
+fake_nova_device_t *fake_nova_device_init(slab_t *slab, uint32_t slot);
+
+/**
+ * Perform background work a real device would do when idle, such as
+ * compacting the counter log. Call regularly from the main loop.
+ */
+void fake_nova_device_idle(fake_nova_device_t *device);
+
+/**
+ * Register a listener to observe the device. The listener must stay
+ * allocated for as long as the device is.
+ */
+void fake_nova_device_add_listener(fake_nova_device_t *device, fake_nova_device_listener_t *listener);
+
+/**
+ * Call the nova_on_????() handler for an input (anything but
+ * NOVA_EVENT_APP_COMMAND or NOVA_EVENT_APP_FRAME_COMMAND, for which see
+ * fake_nova_device_app_write()), logging and recording it.
+ *
+ * Inputs should always come through here (rather than calling nova.c
+ * directly) so recordings are complete.
+ */
+void fake_nova_device_input(fake_nova_device_t *device, nova_event_type type);
+
+/**
+ * Start recording everything in and out of nova.c (see recording.h).
+ * Start before the first input, so a replay starts from the same state.
+ * Pass NULL to stop. The recording must stay open while in use.
+ */
+void fake_nova_device_record(fake_nova_device_t *device, recording_t *recording);
+
+/**
+ * Simulate the App writing to the device over BLE. buf holds the bytes on
+ * the wire (see nova-codec.h): a command, or a frame of commands once the
+ * App has turned on NOVA_FEATURE_FRAMES. If valid, they're passed to
+ * nova_on_app_command() or nova_on_app_commands(). Otherwise they're
+ * ignored and false is returned.
+ */
+bool fake_nova_device_app_write(fake_nova_device_t *device, const uint8_t *buf, uint16_t len);
+
+/**
+ * Simulate power being cut and restored. Any counter increments not
+ * yet saved are lost.
+ *
+ * If warned is true, nova_on_power_failing() is called first, as a
+ * platform with a brownout detector would.
+ */
+void fake_nova_device_power_cut(fake_nova_device_t *device, bool warned);
+
+/**
+ * Save flash defaults in the device's storage, as a factory or settings
+ * tool would. nova.c loads them on its next reset.
+ */
+void fake_nova_device_store_flash_defaults(fake_nova_device_t *device, const flash_defaults_t *flash_defaults);
+
+/**
+ * How many counter increments are currently unsaved.
+ */
+uint32_t fake_nova_device_counters_unsaved(fake_nova_device_t *device);
+
+/**
+ * How many calls to nova_save_counters() were avoided by coalescing,
+ * compared to saving on every increment.
  */
-fake_nova_device_t *fake_nova_device_init(const char *counters_filename);
+uint32_t fake_nova_device_saves_avoided(fake_nova_device_t *device);
 
 /**
  * Free up fake_nova_device_t and embedded nova_t.
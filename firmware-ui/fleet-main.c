@@ -0,0 +1,209 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fleet.h"
+
+/**
+ * Fleet simulator.
+ *
+ * Runs a large fleet of fake Nova devices with randomized (but seeded)
+ * event streams across all CPU cores, then reports throughput and the
+ * distribution of outcomes across devices. See fleet.h.
+ *
+ * Usage:
+ *
+ *   firmware-fleet [-d DEVICES] [-t THREADS] [-r ROUNDS] [-e EVENTS] [-s SEED]
+ *                  [-o RECORDING] [-p STORAGE]
+ *
+ *   -d DEVICES  number of devices (default 100000)
+ *   -t THREADS  worker threads (default: number of CPUs)
+ *   -r ROUNDS   rounds to run (default 10)
+ *   -e EVENTS   events per device per round (default 100)
+ *   -s SEED     seed for event streams (default 1)
+ *   -o RECORDING  record everything the first device does, for replay with
+ *                 firmware-replay (see recording.h)
+ *   -p STORAGE  keep device storage (usage counters, flash defaults) in
+ *               a slab file, so it persists between runs (see
+ *               util/slab.h). Devices then start from where the last
+ *               run left them, rather than empty
+ *
+ * The checksum printed at the end only depends on the seed and sizes
+ * (and storage, if persisted), not the thread count, so it can be used
+ * to check determinism.
+ */
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Print min, median, 99th percentile, max and mean of one statistic
+ * over all devices. values is sorted in place.
+ */
+static void print_distribution(const char *name, uint64_t *values, uint32_t count, double scale)
+{
+  qsort(values, count, sizeof(uint64_t), compare_u64);
+  double sum = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    sum += values[i];
+  }
+  printf("  %-16s %10.1f %10.1f %10.1f %10.1f %10.2f\n", name,
+      values[0] * scale,
+      values[count / 2] * scale,
+      values[(uint32_t)((count - 1) * 0.99)] * scale,
+      values[count - 1] * scale,
+      sum / count * scale);
+}
+
+#define DISTRIBUTION(label, field, scale) \
+  do { \
+    for (uint32_t i = 0; i < count; i++) { \
+      values[i] = fleet->devices[i].stats.field; \
+    } \
+    print_distribution(label, values, count, scale); \
+  } while (0)
+
+static void print_report(fleet_t *fleet)
+{
+  uint32_t count = fleet->config.devices;
+  uint64_t *values = malloc(count * sizeof(uint64_t));
+  if (!values) {
+    return;
+  }
+
+  printf("per device:              min        p50        p99        max       mean\n");
+  DISTRIBUTION("events", events, 1);
+  DISTRIBUTION("flashes", flashes, 1);
+  DISTRIBUTION("lit seconds", lit_ms, 0.001);
+  DISTRIBUTION("triggers sent", triggers_sent, 1);
+  DISTRIBUTION("acks sent", acks_sent, 1);
+  DISTRIBUTION("hid keys sent", hid_keys_sent, 1);
+  DISTRIBUTION("counter saves", counters_saves, 1);
+  DISTRIBUTION("worst unsaved", counters_worst_unsaved, 1);
+  DISTRIBUTION("counters lost", counters_lost, 1);
+  DISTRIBUTION("page erases", page_erases, 1);
+  DISTRIBUTION("writes suppressed", writes_suppressed, 1);
+
+  free(values);
+}
+
+static bool parse_option(int argc, char **argv, int *i, const char *flag, uint64_t *result)
+{
+  if (strcmp(argv[*i], flag) != 0 || *i + 1 >= argc) {
+    return false;
+  }
+  *result = strtoull(argv[++*i], NULL, 10);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t devices = 100000;
+  uint64_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t rounds = 10;
+  uint64_t events = 100;
+  uint64_t seed = 1;
+  const char *recording_filename = NULL;
+  const char *storage_filename = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      recording_filename = argv[++i];
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      storage_filename = argv[++i];
+    } else if (!parse_option(argc, argv, &i, "-d", &devices)
+        && !parse_option(argc, argv, &i, "-t", &threads)
+        && !parse_option(argc, argv, &i, "-r", &rounds)
+        && !parse_option(argc, argv, &i, "-e", &events)
+        && !parse_option(argc, argv, &i, "-s", &seed)) {
+      fprintf(stderr, "Usage: %s [-d DEVICES] [-t THREADS] [-r ROUNDS] [-e EVENTS] [-s SEED] [-o RECORDING] [-p STORAGE]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (devices < 1 || devices > UINT32_MAX - FLEET_CHUNK * FLEET_MAX_THREADS) {
+    fprintf(stderr, "Bad number of devices\n");
+    return 2;
+  }
+
+  fleet_config_t config = {
+    .devices = (uint32_t)devices,
+    .threads = (uint32_t)threads,
+    .rounds = (uint32_t)rounds,
+    .events_per_round = (uint32_t)events,
+    .seed = seed
+  };
+
+  recording_t recording;
+  if (recording_filename) {
+    if (!recording_open(&recording, recording_filename)) {
+      perror(recording_filename);
+      return 1;
+    }
+    config.recording = &recording;
+  }
+
+  slab_t storage;
+  if (storage_filename) {
+    if (!slab_open(&storage, storage_filename, FAKE_STORAGE_SLOT_SIZE, config.devices)) {
+      perror(storage_filename);
+      return 1;
+    }
+    config.storage = &storage;
+  }
+
+  fleet_t *fleet = malloc(sizeof(fleet_t));
+  double start = seconds_now();
+  if (!fleet || !fleet_init(fleet, &config)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  double startup = seconds_now() - start;
+
+  printf("fleet: %u devices, %u threads, %u rounds x %u events, seed %llu\n",
+      fleet->config.devices, fleet->config.threads, fleet->config.rounds,
+      fleet->config.events_per_round, (unsigned long long)seed);
+  printf("startup: %.3fs\n", startup);
+
+  fleet_run(fleet);
+
+  double elapsed = fleet->elapsed_seconds;
+  printf("run: %llu events in %.3fs (%.0f events/sec), %llu chunks stolen\n",
+      (unsigned long long)fleet->events, elapsed,
+      elapsed > 0 ? fleet->events / elapsed : 0.0,
+      (unsigned long long)fleet->steals);
+
+  print_report(fleet);
+  printf("checksum: %016llx\n", (unsigned long long)fleet_checksum(fleet));
+
+  if (recording_filename) {
+    recording_close(&recording);
+    printf("recorded: %llu records of first device to %s\n",
+        (unsigned long long)recording.records, recording_filename);
+  }
+
+  if (storage_filename) {
+    slab_close(&storage);
+    printf("storage: %u writes, %u syncs to %s\n",
+        (unsigned)storage.writes, (unsigned)storage.syncs, storage_filename);
+  }
+
+  fleet_free(fleet);
+  free(fleet);
+  return 0;
+}
@@ -0,0 +1,415 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See fleet.h
+ */
+
+#include "fleet.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nova-api.h>
+#include <nova-codec.h>
+#include <nova-internal.h>
+#include <nova-shadow.h>
+
+#include "util/rng.h"
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+// ----------------------------------------------------------------------------
+// Event streams
+
+void fleet_stream_init(fleet_stream_t *stream, uint64_t seed, uint32_t index)
+{
+  // splitmix64, so neighbouring seeds/indexes give unrelated streams.
+  uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+
+  stream->rng = z ? z : 1;
+  stream->pressed = false;
+  stream->app_connected = false;
+  stream->hid_connected = false;
+}
+
+void fleet_stream_next(fleet_stream_t *stream, fleet_event_t *event)
+{
+  memset(event, 0, sizeof(fleet_event_t));
+
+  // Rolls out of 1000:
+  //   0-349    short wait
+  //   350-549  press or release button
+  //   550-599  App connects or disconnects
+  //   600-629  HID connects or disconnects
+  //   630-899  App sends a command (or short wait if not connected)
+  //   900-994  long wait (time for counters to flush)
+  //   995-997  power cut
+  //   998-999  brownout, then power cut
+  uint32_t roll = rng_below(&stream->rng, 1000);
+
+  if (roll < 350) {
+    event->type = FLEET_EVENT_WAIT;
+    event->wait = (milliseconds_t)rng_below(&stream->rng, 3000);
+  }
+  else if (roll < 550) {
+    event->type = stream->pressed ? FLEET_EVENT_RELEASE : FLEET_EVENT_PRESS;
+    stream->pressed = !stream->pressed;
+  }
+  else if (roll < 600) {
+    event->type = stream->app_connected ? FLEET_EVENT_DISCONNECT_APP : FLEET_EVENT_CONNECT_APP;
+    stream->app_connected = !stream->app_connected;
+  }
+  else if (roll < 630) {
+    event->type = stream->hid_connected ? FLEET_EVENT_DISCONNECT_HID : FLEET_EVENT_CONNECT_HID;
+    stream->hid_connected = !stream->hid_connected;
+  }
+  else if (roll < 900 && stream->app_connected) {
+    if (roll < 700) {
+      event->type = FLEET_EVENT_FLASH;
+      event->flash.warm = (uint8_t)rng_below(&stream->rng, 256);
+      event->flash.cool = (uint8_t)rng_below(&stream->rng, 256);
+      event->flash.timeout = (milliseconds_t)(100 + rng_below(&stream->rng, 5000));
+    } else if (roll < 760) {
+      event->type = FLEET_EVENT_OFF;
+    } else if (roll < 800) {
+      event->type = FLEET_EVENT_PING;
+    } else {
+      event->type = FLEET_EVENT_ACK_TRIGGER;
+    }
+  }
+  else if (roll < 900) {
+    event->type = FLEET_EVENT_WAIT;
+    event->wait = (milliseconds_t)rng_below(&stream->rng, 100);
+  }
+  else if (roll < 995) {
+    event->type = FLEET_EVENT_WAIT;
+    event->wait = (milliseconds_t)(5000 + rng_below(&stream->rng, 60000));
+  }
+  else {
+    event->type = roll < 998 ? FLEET_EVENT_POWER_CUT : FLEET_EVENT_POWER_FAIL;
+    // Everything starts again from scratch after reset.
+    stream->pressed = false;
+    stream->app_connected = false;
+    stream->hid_connected = false;
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Devices
+
+static void on_app_command_sent(fake_nova_device_t *device, app_command_t *cmd, void *data)
+{
+  fleet_device_t *fleet_device = (fleet_device_t*)data;
+  if (cmd->header.type == NOVA_CMD_TRIGGER) {
+    fleet_device->last_trigger_id = cmd->header.id;
+    fleet_device->stats.triggers_sent++;
+  } else if (cmd->header.type == NOVA_CMD_ACK) {
+    fleet_device->stats.acks_sent++;
+  }
+}
+
+static void on_hid_key_sent(fake_nova_device_t *device, char key_code, void *data)
+{
+  fleet_device_t *fleet_device = (fleet_device_t*)data;
+  fleet_device->stats.hid_keys_sent++;
+}
+
+static void on_lights_set(fake_nova_device_t *device, uint8_t warm_pwm, uint8_t cool_pwm, void *data)
+{
+  fleet_device_t *fleet_device = (fleet_device_t*)data;
+  bool lit = warm_pwm > 0 || cool_pwm > 0;
+  uint64_t now = basic_clock_now(&device->clock);
+
+  if (lit && !fleet_device->lit) {
+    fleet_device->lit_since = now;
+    fleet_device->stats.flashes++;
+  } else if (!lit && fleet_device->lit) {
+    fleet_device->stats.lit_ms += now - fleet_device->lit_since;
+  }
+  fleet_device->lit = lit;
+}
+
+static void send_app_command(fleet_device_t *fleet_device, uint8_t type, app_command_t *cmd)
+{
+  cmd->header.type = type;
+  cmd->header.__pad = 0;
+  if (type != NOVA_CMD_ACK) {
+    cmd->header.id = ++fleet_device->next_command_id;
+  }
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  uint16_t len = nova_codec_encode_command(cmd, buf);
+  fake_nova_device_app_write(fleet_device->device, buf, len);
+}
+
+void fleet_device_init(fleet_device_t *fleet_device, uint64_t seed, uint32_t index,
+    recording_t *recording, slab_t *storage)
+{
+  memset(fleet_device, 0, sizeof(fleet_device_t));
+  fleet_stream_init(&fleet_device->stream, seed, index);
+
+  fake_nova_device_t *device = fake_nova_device_init(storage, index);
+  basic_clock_init_virtual(&device->clock, 0);
+  fleet_device->device = device;
+
+  fleet_device->listener.app_command_sent = on_app_command_sent;
+  fleet_device->listener.hid_key_sent = on_hid_key_sent;
+  fleet_device->listener.lights_set = on_lights_set;
+  fleet_device->listener.data = fleet_device;
+  fake_nova_device_add_listener(device, &fleet_device->listener);
+  fake_nova_device_record(device, recording);
+
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+  fake_nova_device_idle(device);
+}
+
+void fleet_device_apply(fleet_device_t *fleet_device, const fleet_event_t *event)
+{
+  fake_nova_device_t *device = fleet_device->device;
+  app_command_t cmd;
+
+  switch (event->type) {
+    case FLEET_EVENT_WAIT:
+      basic_timer_advance(&device->timers, event->wait);
+      break;
+    case FLEET_EVENT_PRESS:
+      fake_nova_device_input(device, NOVA_EVENT_BUTTON_PRESSDOWN);
+      break;
+    case FLEET_EVENT_RELEASE:
+      fake_nova_device_input(device, NOVA_EVENT_BUTTON_RELEASE);
+      break;
+    case FLEET_EVENT_CONNECT_APP:
+      fake_nova_device_input(device, NOVA_EVENT_CONNECT_APP);
+      break;
+    case FLEET_EVENT_DISCONNECT_APP:
+      fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_APP);
+      break;
+    case FLEET_EVENT_CONNECT_HID:
+      fake_nova_device_input(device, NOVA_EVENT_CONNECT_HID);
+      break;
+    case FLEET_EVENT_DISCONNECT_HID:
+      fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_HID);
+      break;
+    case FLEET_EVENT_PING:
+      send_app_command(fleet_device, NOVA_CMD_PING, &cmd);
+      break;
+    case FLEET_EVENT_FLASH:
+      cmd.body.flash_settings = event->flash;
+      send_app_command(fleet_device, NOVA_CMD_FLASH, &cmd);
+      break;
+    case FLEET_EVENT_OFF:
+      send_app_command(fleet_device, NOVA_CMD_OFF, &cmd);
+      break;
+    case FLEET_EVENT_ACK_TRIGGER:
+      cmd.header.id = fleet_device->last_trigger_id;
+      send_app_command(fleet_device, NOVA_CMD_ACK, &cmd);
+      break;
+    case FLEET_EVENT_POWER_CUT:
+      fake_nova_device_power_cut(device, false);
+      break;
+    case FLEET_EVENT_POWER_FAIL:
+      fake_nova_device_power_cut(device, true);
+      break;
+    default:
+      break;
+  }
+
+  fake_nova_device_idle(device);
+}
+
+void fleet_device_free(fleet_device_t *fleet_device)
+{
+  if (fleet_device->device) {
+    fake_nova_device_free(fleet_device->device);
+    fleet_device->device = NULL;
+  }
+}
+
+static uint32_t power_on(fleet_t *fleet, fleet_device_t *fleet_device)
+{
+  uint32_t index = (uint32_t)(fleet_device - fleet->devices);
+  fleet_device_init(fleet_device, fleet->config.seed, index,
+      index == 0 ? fleet->config.recording : NULL, fleet->config.storage);
+  return 0;
+}
+
+static uint32_t run_round(fleet_t *fleet, fleet_device_t *fleet_device)
+{
+  fake_nova_device_t *device = fleet_device->device;
+  fleet_event_t event;
+
+  for (uint32_t i = 0; i < fleet->config.events_per_round; i++) {
+    fleet_stream_next(&fleet_device->stream, &event);
+    fleet_device_apply(fleet_device, &event);
+  }
+
+  fleet_device_stats_t *stats = &fleet_device->stats;
+  stats->events += fleet->config.events_per_round;
+  stats->counters_saves = device->counters_saves;
+  stats->counters_worst_unsaved = device->counters_worst_unsaved;
+  stats->counters_lost = device->counters_lost;
+  stats->page_erases = device->counters_flash.page_erases;
+  stats->writes_suppressed = nova_shadow_suppressed(device->nova);
+  return fleet->config.events_per_round;
+}
+
+
+// ----------------------------------------------------------------------------
+// Workers
+
+/**
+ * Claim the next chunk of a worker's range. Returns false if the range
+ * is used up.
+ */
+static bool claim(fleet_worker_t *worker, uint32_t *begin, uint32_t *end)
+{
+  uint32_t next = atomic_fetch_add(&worker->next, FLEET_CHUNK);
+  if (next >= worker->end) {
+    return false;
+  }
+  *begin = next;
+  *end = next + FLEET_CHUNK < worker->end ? next + FLEET_CHUNK : worker->end;
+  return true;
+}
+
+static void run_chunk(fleet_worker_t *worker, uint32_t begin, uint32_t end)
+{
+  fleet_t *fleet = worker->fleet;
+  for (uint32_t i = begin; i < end; i++) {
+    worker->events += fleet->pass(fleet, &fleet->devices[i]);
+  }
+}
+
+static void *worker_main(void *data)
+{
+  fleet_worker_t *worker = (fleet_worker_t*)data;
+  fleet_t *fleet = worker->fleet;
+  uint32_t threads = fleet->config.threads;
+  uint32_t begin, end;
+
+  // Own range first...
+  while (claim(worker, &begin, &end)) {
+    run_chunk(worker, begin, end);
+  }
+
+  // ...then help everyone else.
+  for (uint32_t i = 1; i < threads; i++) {
+    fleet_worker_t *victim = &fleet->workers[(worker->index + i) % threads];
+    while (claim(victim, &begin, &end)) {
+      run_chunk(worker, begin, end);
+      worker->steals++;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Apply pass to every device, using all worker threads.
+ */
+static void run_pass(fleet_t *fleet, uint32_t (*pass)(fleet_t *fleet, fleet_device_t *device))
+{
+  uint32_t threads = fleet->config.threads;
+  uint64_t devices = fleet->config.devices;
+
+  fleet->pass = pass;
+  for (uint32_t i = 0; i < threads; i++) {
+    fleet_worker_t *worker = &fleet->workers[i];
+    worker->fleet = fleet;
+    worker->index = i;
+    worker->events = 0;
+    worker->steals = 0;
+    atomic_store(&worker->next, (uint32_t)(devices * i / threads));
+    worker->end = (uint32_t)(devices * (i + 1) / threads);
+  }
+
+  // The calling thread acts as worker 0.
+  for (uint32_t i = 1; i < threads; i++) {
+    pthread_create(&fleet->workers[i].thread, NULL, worker_main, &fleet->workers[i]);
+  }
+  worker_main(&fleet->workers[0]);
+  for (uint32_t i = 1; i < threads; i++) {
+    pthread_join(fleet->workers[i].thread, NULL);
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+bool fleet_init(fleet_t *fleet, const fleet_config_t *config)
+{
+  memset(fleet, 0, sizeof(fleet_t));
+  fleet->config = *config;
+  if (fleet->config.threads < 1) {
+    fleet->config.threads = 1;
+  }
+  if (fleet->config.threads > FLEET_MAX_THREADS) {
+    fleet->config.threads = FLEET_MAX_THREADS;
+  }
+
+  fleet->devices = calloc(config->devices, sizeof(fleet_device_t));
+  if (!fleet->devices) {
+    return false;
+  }
+
+  run_pass(fleet, power_on);
+  return true;
+}
+
+void fleet_run(fleet_t *fleet)
+{
+  double start = seconds_now();
+  for (uint32_t round = 0; round < fleet->config.rounds; round++) {
+    run_pass(fleet, run_round);
+    for (uint32_t i = 0; i < fleet->config.threads; i++) {
+      fleet->events += fleet->workers[i].events;
+      fleet->steals += fleet->workers[i].steals;
+    }
+  }
+  fleet->elapsed_seconds += seconds_now() - start;
+}
+
+static uint64_t hash_mix(uint64_t hash, uint64_t value)
+{
+  hash ^= value + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+  return hash;
+}
+
+uint64_t fleet_checksum(fleet_t *fleet)
+{
+  uint64_t hash = 0;
+  for (uint32_t i = 0; i < fleet->config.devices; i++) {
+    fleet_device_stats_t *stats = &fleet->devices[i].stats;
+    hash = hash_mix(hash, stats->events);
+    hash = hash_mix(hash, stats->triggers_sent);
+    hash = hash_mix(hash, stats->acks_sent);
+    hash = hash_mix(hash, stats->hid_keys_sent);
+    hash = hash_mix(hash, stats->flashes);
+    hash = hash_mix(hash, stats->lit_ms);
+    hash = hash_mix(hash, stats->counters_saves);
+    hash = hash_mix(hash, stats->counters_worst_unsaved);
+    hash = hash_mix(hash, stats->counters_lost);
+    hash = hash_mix(hash, stats->page_erases);
+  }
+  return hash;
+}
+
+void fleet_free(fleet_t *fleet)
+{
+  for (uint32_t i = 0; i < fleet->config.devices; i++) {
+    fleet_device_free(&fleet->devices[i]);
+  }
+  free(fleet->devices);
+  fleet->devices = NULL;
+}
@@ -0,0 +1,263 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Fleet simulator.
+ *
+ * Hosts a large number of independent fake Nova devices (each with its
+ * own nova_t, virtual clock and in-memory flash) and drives each with a
+ * randomized stream of events: button presses, App/HID connections,
+ * commands from the App, time passing and power cuts.
+ *
+ * Streams are seeded per device, so a run is exactly reproducible from
+ * its seed regardless of how many threads execute it.
+ *
+ * The fleet runs in rounds. In each round, every device processes the
+ * same number of events. Devices are split into equal ranges, one per
+ * worker thread, and each worker claims chunks of its own range. Workers
+ * that finish early steal chunks from the others, so a few slow devices
+ * (e.g. ones busy compacting flash) don't hold up a whole round.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nova.h>
+
+#include "fake-nova-device.h"
+
+/** Devices claimed by a worker at a time. */
+#define FLEET_CHUNK 64
+
+/** Upper limit on worker threads. */
+#define FLEET_MAX_THREADS 256
+
+/**
+ * Kinds of event in a device's stream.
+ */
+typedef enum
+{
+  FLEET_EVENT_WAIT,
+  FLEET_EVENT_PRESS,
+  FLEET_EVENT_RELEASE,
+  FLEET_EVENT_CONNECT_APP,
+  FLEET_EVENT_DISCONNECT_APP,
+  FLEET_EVENT_CONNECT_HID,
+  FLEET_EVENT_DISCONNECT_HID,
+  FLEET_EVENT_PING,
+  FLEET_EVENT_FLASH,
+  FLEET_EVENT_OFF,
+  FLEET_EVENT_ACK_TRIGGER,
+  FLEET_EVENT_POWER_CUT,
+  FLEET_EVENT_POWER_FAIL,
+  FLEET_EVENT_TYPES
+} fleet_event_type;
+
+/**
+ * A single event for a device.
+ */
+typedef struct fleet_event_t
+{
+  fleet_event_type type;
+
+  /** FLEET_EVENT_WAIT: how long. */
+  milliseconds_t wait;
+
+  /** FLEET_EVENT_FLASH: settings sent by App. */
+  flash_settings_t flash;
+
+} fleet_event_t;
+
+/**
+ * Generates a device's event stream.
+ *
+ * Remembers just enough about what it has generated so far to keep the
+ * stream plausible (e.g. no release without a press, no commands from
+ * an App that isn't connected).
+ */
+typedef struct fleet_stream_t
+{
+  /** xorshift64* PRNG state. Never zero. */
+  uint64_t rng;
+
+  bool pressed;
+  bool app_connected;
+  bool hid_connected;
+
+} fleet_stream_t;
+
+/**
+ * Outcome of running a single device.
+ */
+typedef struct fleet_device_stats_t
+{
+  /** Events processed. */
+  uint32_t events;
+
+  /** Commands sent to App. */
+  uint32_t triggers_sent;
+  uint32_t acks_sent;
+
+  /** Keys sent over HID. */
+  uint32_t hid_keys_sent;
+
+  /** Times the main lights were switched on. */
+  uint32_t flashes;
+
+  /** Total time main lights were on (virtual milliseconds). */
+  uint64_t lit_ms;
+
+  /** Counter persistence, copied from fake_nova_device_t. */
+  uint32_t counters_saves;
+  uint32_t counters_worst_unsaved;
+  uint32_t counters_lost;
+
+  /** Flash page erases by the counter store. */
+  uint32_t page_erases;
+
+  /** Redundant lights/status/timer calls skipped (see nova-shadow.h). */
+  uint32_t writes_suppressed;
+
+} fleet_device_stats_t;
+
+/**
+ * A device in the fleet.
+ */
+typedef struct fleet_device_t
+{
+  fake_nova_device_t *device;
+  fleet_stream_t stream;
+
+  /** Commands sent by simulated App. */
+  cmd_id_t next_command_id;
+
+  /** Most recent TRIGGER sent by the device, to ACK. */
+  cmd_id_t last_trigger_id;
+
+  /** When the main lights were last switched on, if lit. */
+  uint64_t lit_since;
+  bool lit;
+
+  fleet_device_stats_t stats;
+
+  fake_nova_device_listener_t listener;
+
+} fleet_device_t;
+
+/**
+ * How to run the fleet.
+ */
+typedef struct fleet_config_t
+{
+  uint32_t devices;
+  uint32_t threads;
+  uint32_t rounds;
+  uint32_t events_per_round;
+  uint64_t seed;
+
+  /** If set, the first device is recorded here (see recording.h). */
+  recording_t *recording;
+
+  /**
+   * If set, device storage persists here, device N in slot N (see
+   * util/slab.h). Must have at least as many slots as devices.
+   */
+  slab_t *storage;
+} fleet_config_t;
+
+/**
+ * Per-worker chunk claiming state. Aligned to its own cache line so
+ * workers don't contend on each other's counters.
+ */
+typedef struct fleet_worker_t
+{
+  struct fleet_t *fleet;
+  uint32_t index;
+  pthread_t thread;
+
+  /** Next device in this worker's range not yet claimed. */
+  _Alignas(64) atomic_uint next;
+
+  /** End of this worker's range (exclusive). */
+  uint32_t end;
+
+  /** Totals, written only by the owning worker. */
+  uint64_t events;
+  uint64_t steals;
+
+} fleet_worker_t;
+
+/**
+ * The whole fleet.
+ */
+typedef struct fleet_t
+{
+  fleet_config_t config;
+  fleet_device_t *devices;
+  fleet_worker_t workers[FLEET_MAX_THREADS];
+
+  /**
+   * What workers do to each device in the current pass (power on, or run
+   * a round). Returns number of events processed.
+   */
+  uint32_t (*pass)(struct fleet_t *fleet, fleet_device_t *device);
+
+  /** Totals over all rounds run so far. */
+  uint64_t events;
+  uint64_t steals;
+  double elapsed_seconds;
+
+} fleet_t;
+
+/**
+ * Seed a stream. Each (seed, index) pair gives a distinct stream.
+ */
+void fleet_stream_init(fleet_stream_t *stream, uint64_t seed, uint32_t index);
+
+/**
+ * Produce the next event in a stream.
+ */
+void fleet_stream_next(fleet_stream_t *stream, fleet_event_t *event);
+
+/**
+ * Create a single device and power it on, with its stream seeded for
+ * position index in a fleet. If recording is set, everything the device
+ * does is recorded there (see recording.h). If storage is set, the
+ * device's storage is its slot index there (see util/slab.h).
+ */
+void fleet_device_init(fleet_device_t *fleet_device, uint64_t seed, uint32_t index,
+    recording_t *recording, slab_t *storage);
+
+/**
+ * Apply an event to a single device, then let it do idle work.
+ */
+void fleet_device_apply(fleet_device_t *fleet_device, const fleet_event_t *event);
+
+/**
+ * Free a single device.
+ */
+void fleet_device_free(fleet_device_t *fleet_device);
+
+/**
+ * Allocate and power on all devices. Returns false if out of memory.
+ */
+bool fleet_init(fleet_t *fleet, const fleet_config_t *config);
+
+/**
+ * Run all rounds.
+ */
+void fleet_run(fleet_t *fleet);
+
+/**
+ * Hash of every device's outcome. Equal for equal seeds, whatever the
+ * thread count.
+ */
+uint64_t fleet_checksum(fleet_t *fleet);
+
+/**
+ * Free all devices.
+ */
+void fleet_free(fleet_t *fleet);
@@ -0,0 +1,535 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See gatt-bridge.h
+ */
+
+#include "gatt-bridge.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <nova-codec.h>
+#include <nova-internal.h>
+
+#include "ui.h"
+#include "util/rng.h"
+
+// Where sockets can't be told not to raise SIGPIPE per send (OS X), it's
+// turned off per socket instead (SO_NOSIGPIPE).
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef char check_value_size[NOVA_CODEC_COUNTERS_SIZE <= GATT_MAX_VALUE
+    && NOVA_CODEC_FLASH_DEFAULTS_SIZE <= GATT_MAX_VALUE
+    && NOVA_CODEC_MAX_FRAME_SIZE <= GATT_MAX_VALUE ? 1 : -1];
+
+static uint64_t now(gatt_bridge_t *bridge)
+{
+  return basic_clock_now(&bridge->device->clock);
+}
+
+
+// ----------------------------------------------------------------------------
+// Link
+
+static void schedule_connection_event(gatt_bridge_t *bridge);
+
+static gatt_packet_t *queue_head(gatt_link_queue_t *queue)
+{
+  return &queue->packets[queue->head];
+}
+
+static void queue_pop(gatt_link_queue_t *queue)
+{
+  queue->head = (uint8_t)((queue->head + 1) % GATT_LINK_QUEUE);
+  queue->count--;
+}
+
+/**
+ * Put a packet on the link, arriving after latency and jitter, but never
+ * before one sent earlier (the link layer keeps packets in order).
+ * Returns false if the queue is full.
+ */
+static bool link_send(gatt_bridge_t *bridge, gatt_link_queue_t *queue,
+    uint8_t op, uint16_t handle, const uint8_t *value, uint8_t len)
+{
+  if (queue->count == GATT_LINK_QUEUE) {
+    return false;
+  }
+  uint64_t due = now(bridge) + bridge->link.latency;
+  if (bridge->link.jitter > 0) {
+    due += rng_next(&bridge->rng) % (bridge->link.jitter + 1);
+  }
+  if (queue->count > 0) {
+    gatt_packet_t *last = &queue->packets[(queue->head + queue->count - 1) % GATT_LINK_QUEUE];
+    due = due > last->due ? due : last->due;
+  }
+
+  gatt_packet_t *packet = &queue->packets[(queue->head + queue->count) % GATT_LINK_QUEUE];
+  packet->due = due;
+  packet->op = op;
+  packet->handle = handle;
+  packet->len = len;
+  if (len > 0) {
+    memcpy(packet->value, value, len);
+  }
+  queue->count++;
+
+  schedule_connection_event(bridge);
+  return true;
+}
+
+/** Is a notification or write without response lost? */
+static bool link_loses(gatt_bridge_t *bridge)
+{
+  if (bridge->link.loss > 0 && rng_next(&bridge->rng) % 1000 < bridge->link.loss) {
+    bridge->stats.lost++;
+    return true;
+  }
+  return false;
+}
+
+
+// ----------------------------------------------------------------------------
+// Client
+
+static void on_client(int fd, void *data);
+
+static void disconnect(gatt_bridge_t *bridge)
+{
+  if (bridge->client < 0) {
+    return;
+  }
+  event_loop_unwatch(bridge->loop, bridge->client);
+  close(bridge->client);
+  bridge->client = -1;
+  bridge->to_device.count = 0;
+  bridge->to_client.count = 0;
+  basic_timer_clear(&bridge->device->timers, &bridge->connection_event);
+  ui_log("<- gatt: client disconnected");
+
+  if (bridge->subscribed) {
+    bridge->subscribed = false;
+    fake_nova_device_input(bridge->device, NOVA_EVENT_DISCONNECT_APP);
+  }
+}
+
+/**
+ * Write a packet to the client. If it isn't reading them, and the socket
+ * buffer is full, it's disconnected rather than blocking.
+ */
+static void client_send(gatt_bridge_t *bridge, const gatt_packet_t *packet)
+{
+  uint8_t buf[GATT_PACKET_HEADER_SIZE + GATT_MAX_VALUE];
+  uint16_t len = GATT_PACKET_HEADER_SIZE - 2 + packet->len;
+  buf[0] = (uint8_t)len;
+  buf[1] = (uint8_t)(len >> 8);
+  buf[2] = packet->op;
+  buf[3] = (uint8_t)packet->handle;
+  buf[4] = (uint8_t)(packet->handle >> 8);
+  memcpy(buf + GATT_PACKET_HEADER_SIZE, packet->value, packet->len);
+
+  ssize_t size = GATT_PACKET_HEADER_SIZE + packet->len;
+  if (send(bridge->client, buf, (size_t)size, MSG_DONTWAIT | MSG_NOSIGNAL) != size) {
+    disconnect(bridge);
+    return;
+  }
+  bridge->stats.sent++;
+}
+
+/** Stop or start reading from the client, as the link fills and drains. */
+static void set_reading(gatt_bridge_t *bridge, bool reading)
+{
+  if (bridge->client < 0 || reading == bridge->reading) {
+    return;
+  }
+  if (reading) {
+    if (!event_loop_watch(bridge->loop, bridge->client, on_client, bridge)) {
+      disconnect(bridge);
+      return;
+    }
+  } else {
+    event_loop_unwatch(bridge->loop, bridge->client);
+  }
+  bridge->reading = reading;
+}
+
+/**
+ * A whole packet has been read from the client: put it on the link.
+ */
+static void client_received(gatt_bridge_t *bridge)
+{
+  bridge->stats.received++;
+  uint8_t op = bridge->in[2];
+  uint16_t handle = (uint16_t)(bridge->in[3] | (bridge->in[4] << 8));
+  uint8_t len = (uint8_t)(bridge->in_len - GATT_PACKET_HEADER_SIZE);
+  if (op == GATT_OP_WRITE_CMD && link_loses(bridge)) {
+    return;
+  }
+  link_send(bridge, &bridge->to_device, op, handle, bridge->in + GATT_PACKET_HEADER_SIZE, len);
+}
+
+/**
+ * Read as many packets as the link has room for.
+ */
+static void on_client(int fd, void *data)
+{
+  gatt_bridge_t *bridge = (gatt_bridge_t*)data;
+  while (bridge->client >= 0 && bridge->to_device.count < GATT_LINK_QUEUE) {
+    // The length first, then the rest of the packet.
+    uint16_t want = 2;
+    if (bridge->in_len >= 2) {
+      want = (uint16_t)(2 + (bridge->in[0] | (bridge->in[1] << 8)));
+      if (want < GATT_PACKET_HEADER_SIZE || want > sizeof(bridge->in)) {
+        ui_log("<- gatt: bad packet length %u", want - 2);
+        disconnect(bridge);
+        return;
+      }
+    }
+
+    ssize_t n = recv(fd, bridge->in + bridge->in_len, want - bridge->in_len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      disconnect(bridge);
+      return;
+    }
+    bridge->in_len += (uint16_t)n;
+
+    if (bridge->in_len >= GATT_PACKET_HEADER_SIZE && bridge->in_len == want) {
+      client_received(bridge);
+      bridge->in_len = 0;
+    }
+  }
+  set_reading(bridge, false);
+}
+
+static void on_connect(int fd, void *data)
+{
+  gatt_bridge_t *bridge = (gatt_bridge_t*)data;
+  int client = accept(fd, NULL, NULL);
+  if (client < 0) {
+    return;
+  }
+  // One central at a time.
+  if (bridge->client >= 0) {
+    close(client);
+    return;
+  }
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  if (!bridge->path[0]) {
+    int nodelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  }
+
+  bridge->client = client;
+  bridge->in_len = 0;
+  bridge->reading = false;
+  bridge->anchor = now(bridge);
+  bridge->last_event = bridge->anchor;
+  bridge->stats.connections++;
+  set_reading(bridge, true);
+  ui_log("<- gatt: client connected");
+}
+
+
+// ----------------------------------------------------------------------------
+// Device
+
+static void respond(gatt_bridge_t *bridge, uint8_t op, uint16_t handle, const uint8_t *value, uint8_t len)
+{
+  if (!link_send(bridge, &bridge->to_client, op, handle, value, len)) {
+    bridge->stats.overflows++;
+  }
+}
+
+static void respond_error(gatt_bridge_t *bridge, const gatt_packet_t *request, uint8_t error)
+{
+  if (request->op == GATT_OP_WRITE_CMD) {
+    return;
+  }
+  uint8_t value[2] = { request->op, error };
+  respond(bridge, GATT_OP_ERROR, request->handle, value, sizeof(value));
+}
+
+static void device_write(gatt_bridge_t *bridge, const gatt_packet_t *packet)
+{
+  fake_nova_device_t *device = bridge->device;
+  flash_defaults_t flash_defaults;
+
+  switch (packet->handle) {
+
+    case GATT_HANDLE_REQUEST:
+      // Invalid commands are ignored by the device, but the write succeeds.
+      fake_nova_device_app_write(device, packet->value, packet->len);
+      break;
+
+    case GATT_HANDLE_RESPONSE:
+      if (packet->len != 2) {
+        respond_error(bridge, packet, GATT_ERROR_INVALID_LENGTH);
+        return;
+      }
+      if ((packet->value[0] & 1) && !bridge->subscribed) {
+        bridge->subscribed = true;
+        fake_nova_device_input(device, NOVA_EVENT_CONNECT_APP);
+      } else if (!(packet->value[0] & 1) && bridge->subscribed) {
+        bridge->subscribed = false;
+        fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_APP);
+      }
+      break;
+
+    case GATT_HANDLE_FLASH_DEFAULTS:
+      if (!nova_codec_decode_flash_defaults(packet->value, packet->len, &flash_defaults)) {
+        respond_error(bridge, packet, GATT_ERROR_INVALID_LENGTH);
+        return;
+      }
+      fake_nova_device_store_flash_defaults(device, &flash_defaults);
+      break;
+
+    case GATT_HANDLE_COUNTERS:
+      respond_error(bridge, packet, GATT_ERROR_WRITE_NOT_PERMITTED);
+      return;
+
+    default:
+      respond_error(bridge, packet, GATT_ERROR_INVALID_HANDLE);
+      return;
+  }
+
+  if (packet->op == GATT_OP_WRITE_REQ) {
+    respond(bridge, GATT_OP_WRITE_RSP, packet->handle, NULL, 0);
+  }
+}
+
+static void device_read(gatt_bridge_t *bridge, const gatt_packet_t *packet)
+{
+  nova_t *nova = bridge->device->nova;
+  uint8_t value[GATT_MAX_VALUE];
+
+  switch (packet->handle) {
+
+    case GATT_HANDLE_FLASH_DEFAULTS:
+      nova_codec_encode_flash_defaults(&nova->flash_defaults, value);
+      respond(bridge, GATT_OP_READ_RSP, packet->handle, value, NOVA_CODEC_FLASH_DEFAULTS_SIZE);
+      break;
+
+    case GATT_HANDLE_COUNTERS:
+      nova_codec_encode_counters(&nova->counters, value);
+      respond(bridge, GATT_OP_READ_RSP, packet->handle, value, NOVA_CODEC_COUNTERS_SIZE);
+      break;
+
+    case GATT_HANDLE_REQUEST:
+    case GATT_HANDLE_RESPONSE:
+      respond_error(bridge, packet, GATT_ERROR_READ_NOT_PERMITTED);
+      break;
+
+    default:
+      respond_error(bridge, packet, GATT_ERROR_INVALID_HANDLE);
+      break;
+  }
+}
+
+/**
+ * A packet from the client has arrived at the device.
+ */
+static void device_received(gatt_bridge_t *bridge, const gatt_packet_t *packet)
+{
+  switch (packet->op) {
+    case GATT_OP_WRITE_REQ:
+    case GATT_OP_WRITE_CMD:
+      device_write(bridge, packet);
+      break;
+    case GATT_OP_READ_REQ:
+      device_read(bridge, packet);
+      break;
+    default:
+      respond_error(bridge, packet, GATT_ERROR_REQUEST_NOT_SUPPORTED);
+      break;
+  }
+}
+
+static void on_app_notified(fake_nova_device_t *device, const uint8_t *buf, uint16_t len, void *data)
+{
+  gatt_bridge_t *bridge = (gatt_bridge_t*)data;
+  if (bridge->client < 0 || !bridge->subscribed || link_loses(bridge)) {
+    return;
+  }
+  if (!link_send(bridge, &bridge->to_client, GATT_OP_NOTIFY, GATT_HANDLE_RESPONSE, buf, (uint8_t)len)) {
+    bridge->stats.overflows++;
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Connection events
+
+/**
+ * Carry packets that are due, up to packets_per_event each way. Packets
+ * to the client go first, so responses to requests carried now go at
+ * the next event at the earliest.
+ */
+static void on_connection_event(basic_timer_t *timer, void *data)
+{
+  gatt_bridge_t *bridge = (gatt_bridge_t*)data;
+  uint64_t time = now(bridge);
+  uint32_t most = bridge->link.packets_per_event ? bridge->link.packets_per_event : GATT_LINK_QUEUE;
+  bool carried = false;
+
+  for (uint32_t i = 0; i < most && bridge->client >= 0 && bridge->to_client.count > 0
+      && queue_head(&bridge->to_client)->due <= time; i++) {
+    gatt_packet_t packet = *queue_head(&bridge->to_client);
+    queue_pop(&bridge->to_client);
+    client_send(bridge, &packet);
+    carried = true;
+  }
+
+  for (uint32_t i = 0; i < most && bridge->client >= 0 && bridge->to_device.count > 0
+      && queue_head(&bridge->to_device)->due <= time; i++) {
+    gatt_packet_t packet = *queue_head(&bridge->to_device);
+    queue_pop(&bridge->to_device);
+    device_received(bridge, &packet);
+    carried = true;
+  }
+
+  if (carried) {
+    bridge->stats.events++;
+  }
+  uint64_t interval = bridge->link.connection_interval;
+  if (interval > 0) {
+    bridge->last_event = bridge->anchor + (time - bridge->anchor) / interval * interval;
+  }
+  if (bridge->client >= 0 && bridge->to_device.count < GATT_LINK_QUEUE) {
+    set_reading(bridge, true);
+  }
+  schedule_connection_event(bridge);
+}
+
+/**
+ * Schedule the first connection event at or after the earliest packet
+ * is due, if any are waiting. Connection events are only needed when
+ * something is to be carried, so an idle link costs no wakeups.
+ */
+static void schedule_connection_event(gatt_bridge_t *bridge)
+{
+  uint64_t due = UINT64_MAX;
+  if (bridge->to_client.count > 0) {
+    due = queue_head(&bridge->to_client)->due;
+  }
+  if (bridge->to_device.count > 0 && queue_head(&bridge->to_device)->due < due) {
+    due = queue_head(&bridge->to_device)->due;
+  }
+  if (due == UINT64_MAX || bridge->client < 0) {
+    return;
+  }
+
+  uint64_t interval = bridge->link.connection_interval;
+  uint64_t at = due;
+  if (interval > 0) {
+    uint64_t since = due > bridge->anchor ? due - bridge->anchor : 0;
+    at = bridge->anchor + (since + interval - 1) / interval * interval;
+    // Anything arriving during (or late for) an event waits for the next.
+    if (at <= bridge->last_event) {
+      at = bridge->last_event + interval;
+    }
+  }
+  uint64_t time = now(bridge);
+  basic_timer_schedule(&bridge->device->timers, &bridge->connection_event,
+      at > time ? at - time : 0, on_connection_event, bridge);
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+/**
+ * Bind fd to address: a path, or tcp:PORT on localhost.
+ */
+static bool bind_address(gatt_bridge_t *bridge, const char *address, int *fd)
+{
+  if (strncmp(address, "tcp:", 4) == 0) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)strtoul(address + 4, NULL, 10));
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    return *fd >= 0
+        && setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0
+        && bind(*fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(address) >= sizeof(addr.sun_path) || strlen(address) >= sizeof(bridge->path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr.sun_path, address);
+  *fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (*fd < 0) {
+    return false;
+  }
+  unlink(address);
+  if (bind(*fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    return false;
+  }
+  strcpy(bridge->path, address);
+  return true;
+}
+
+bool gatt_bridge_open(gatt_bridge_t *bridge, event_loop_t *loop, fake_nova_device_t *device,
+    const char *address, const gatt_link_config_t *link)
+{
+  memset(bridge, 0, sizeof(gatt_bridge_t));
+  bridge->device = device;
+  bridge->loop = loop;
+  bridge->link = *link;
+  bridge->rng = link->seed ? link->seed : 1;
+  bridge->fd = -1;
+  bridge->client = -1;
+
+  int fd = -1;
+  if (!bind_address(bridge, address, &fd)
+      || listen(fd, 1) != 0
+      || !event_loop_watch(loop, fd, on_connect, bridge)) {
+    int saved = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    errno = saved;
+    return false;
+  }
+  bridge->fd = fd;
+
+  bridge->listener.app_notified = on_app_notified;
+  bridge->listener.data = bridge;
+  fake_nova_device_add_listener(device, &bridge->listener);
+  return true;
+}
+
+void gatt_bridge_close(gatt_bridge_t *bridge)
+{
+  disconnect(bridge);
+  if (bridge->fd >= 0) {
+    event_loop_unwatch(bridge->loop, bridge->fd);
+    close(bridge->fd);
+    if (bridge->path[0]) {
+      unlink(bridge->path);
+    }
+    bridge->fd = -1;
+  }
+}
@@ -0,0 +1,204 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Stand-in for the BLE GATT server of a Nova, so real clients (host
+ * tools, protocol implementations) can talk to a fake device over a
+ * local socket instead of a radio.
+ *
+ * The Nova service (EFF0) has these characteristics. The handle of each
+ * is its 16 bit UUID:
+ *
+ *   EFF1  request         write (with or without response): a command,
+ *                         or a frame of commands (see nova-codec.h)
+ *   EFF2  response        notify: commands sent to the App. Write 01 00
+ *                         to subscribe (the App connecting), 00 00 to
+ *                         unsubscribe, like its client configuration
+ *                         descriptor
+ *   EFF3  flash defaults  read, write (saved in storage, used from the
+ *                         next reset, see nova-codec.h for the layout)
+ *   EFF4  counters        read (see nova-codec.h for the layout)
+ *
+ * Packets borrow their opcodes from ATT, each prefixed by its length:
+ *
+ *   LL LL  OP  HH HH  VALUE...
+ *
+ *   LL LL  bytes that follow (3 + length of value), little endian
+ *   OP     GATT_OP_* below
+ *   HH HH  handle, little endian
+ *
+ * Requests get a response, or an error whose value is the request's
+ * opcode and a GATT_ERROR_* code. Only one client can connect at a time;
+ * disconnecting unsubscribes.
+ *
+ * Packets go over a simulated link (see gatt_link_config_t): both ways,
+ * they take latency plus some jitter, and are then only carried at the
+ * next connection event, a few per event. Notifications and writes
+ * without response may be lost. Timing comes from the device's timers,
+ * which must use a real clock, driven by an event loop (see
+ * util/eventloop.h).
+ *
+ * Usage:
+ *
+ *   gatt_bridge_t bridge;
+ *   gatt_link_config_t link = GATT_LINK_DEFAULTS;
+ *   if (!gatt_bridge_open(&bridge, &loop, device, "nova.sock", &link)) {
+ *     perror("nova.sock");
+ *   }
+ *   ...
+ *   gatt_bridge_close(&bridge);
+ *
+ * Addresses are a path for a Unix domain socket, or tcp:PORT to listen
+ * on localhost.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fake-nova-device.h"
+#include "util/eventloop.h"
+
+#define GATT_HANDLE_REQUEST        0xEFF1
+#define GATT_HANDLE_RESPONSE       0xEFF2
+#define GATT_HANDLE_FLASH_DEFAULTS 0xEFF3
+#define GATT_HANDLE_COUNTERS       0xEFF4
+
+#define GATT_OP_ERROR        0x01
+#define GATT_OP_READ_REQ     0x0A
+#define GATT_OP_READ_RSP     0x0B
+#define GATT_OP_WRITE_REQ    0x12
+#define GATT_OP_WRITE_RSP    0x13
+#define GATT_OP_NOTIFY       0x1B
+#define GATT_OP_WRITE_CMD    0x52
+
+#define GATT_ERROR_INVALID_HANDLE  0x01
+#define GATT_ERROR_READ_NOT_PERMITTED 0x02
+#define GATT_ERROR_WRITE_NOT_PERMITTED 0x03
+#define GATT_ERROR_REQUEST_NOT_SUPPORTED 0x06
+#define GATT_ERROR_INVALID_LENGTH 0x0D
+
+/** Largest value of a characteristic (counters are 28 bytes). */
+#define GATT_MAX_VALUE 32
+
+/** Bytes before the value: length, opcode, handle. */
+#define GATT_PACKET_HEADER_SIZE 5
+
+/** Most packets waiting on the link, each way. */
+#define GATT_LINK_QUEUE 64
+
+typedef struct gatt_link_config_t
+{
+  /** Milliseconds between connection events. 0 to carry packets as soon as they're due. */
+  uint32_t connection_interval;
+
+  /** Most packets each way per connection event. 0 for no limit. */
+  uint8_t packets_per_event;
+
+  /** Milliseconds each packet takes, before waiting for a connection event. */
+  uint32_t latency;
+
+  /** Up to this many more milliseconds, at random. */
+  uint32_t jitter;
+
+  /** Chance of each notification or write without response being lost, per thousand. */
+  uint32_t loss;
+
+  /** Seed for jitter and losses. */
+  uint64_t seed;
+
+} gatt_link_config_t;
+
+/** A typical iOS connection: 30ms interval, 4 packets per event. */
+#define GATT_LINK_DEFAULTS { 30, 4, 0, 0, 0, 1 }
+
+/** A packet on the link. */
+typedef struct gatt_packet_t
+{
+  uint64_t due;
+  uint8_t op;
+  uint16_t handle;
+  uint8_t value[GATT_MAX_VALUE];
+  uint8_t len;
+} gatt_packet_t;
+
+/** Packets on the link one way, oldest first. */
+typedef struct gatt_link_queue_t
+{
+  gatt_packet_t packets[GATT_LINK_QUEUE];
+  uint8_t head;
+  uint8_t count;
+} gatt_link_queue_t;
+
+typedef struct gatt_bridge_stats_t
+{
+  /** Packets received from clients, and sent to them. */
+  uint32_t received;
+  uint32_t sent;
+
+  /** Notifications and writes without response lost on the link. */
+  uint32_t lost;
+
+  /** Notifications and responses dropped because the link queue was full. */
+  uint32_t overflows;
+
+  /** Connection events that carried something. */
+  uint32_t events;
+
+  /** Clients connected. */
+  uint32_t connections;
+
+} gatt_bridge_stats_t;
+
+typedef struct gatt_bridge_t
+{
+  fake_nova_device_t *device;
+  event_loop_t *loop;
+  gatt_link_config_t link;
+  uint64_t rng;
+
+  /** Listening socket, and its path if a Unix domain socket (else empty). */
+  int fd;
+  char path[108];
+
+  /** Connected client (-1 if none), and the partial packet read from it. */
+  int client;
+  uint8_t in[GATT_PACKET_HEADER_SIZE + GATT_MAX_VALUE];
+  uint16_t in_len;
+
+  /** Whether reading from the client, which pauses while the link is full. */
+  bool reading;
+
+  /** Client subscribed to EFF2 (so the App is connected). */
+  bool subscribed;
+
+  /** When the client connected: connection events are every interval after. */
+  uint64_t anchor;
+
+  /** Packets on their way to the device, and to the client. */
+  gatt_link_queue_t to_device;
+  gatt_link_queue_t to_client;
+
+  /** Next connection event that will carry something, if any is due. */
+  basic_timer_t connection_event;
+
+  /** When the last connection event was (on the interval). */
+  uint64_t last_event;
+
+  gatt_bridge_stats_t stats;
+
+  fake_nova_device_listener_t listener;
+
+} gatt_bridge_t;
+
+/**
+ * Listen for a client at address, to talk to device over the given link.
+ * Returns false (with errno set) if it can't.
+ */
+bool gatt_bridge_open(gatt_bridge_t *bridge, event_loop_t *loop, fake_nova_device_t *device,
+    const char *address, const gatt_link_config_t *link);
+
+/**
+ * Disconnect any client (unsubscribing), and stop listening.
+ */
+void gatt_bridge_close(gatt_bridge_t *bridge);
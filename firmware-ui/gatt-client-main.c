@@ -0,0 +1,436 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <nova-codec.h>
+
+#include "gatt-bridge.h"
+
+/**
+ * GATT stand-in client check.
+ *
+ * Connects to firmware-gatt (see gatt-bridge.h) as a client would, and
+ * checks what comes back, packet by packet:
+ *
+ * - Error responses: reading EFF1 and EFF2, writing EFF4, a handle that
+ *   doesn't exist, an opcode that isn't supported, and values of the
+ *   wrong length.
+ * - Subscribing to EFF2 (the App connecting), and reading EFF3 and EFF4,
+ *   which must decode, and count the connection.
+ * - PINGs written with response: each gets a write response, and the
+ *   ACK notified.
+ * - A storm of PINGs written without response: every ACK must come
+ *   back, or with -x (the stand-in's link losing packets), some but not
+ *   all of them.
+ * - After unsubscribing, writes still get a response, but nothing is
+ *   notified.
+ *
+ * Usage:
+ *
+ *   firmware-gatt-client [-c ADDRESS] [-n COUNT] [-x]
+ *
+ *   -c ADDRESS  Unix socket path, or tcp:PORT (default nova.sock)
+ *   -n COUNT    PINGs written without response (default 200)
+ *   -x          the link is lossy
+ *
+ * Exits with status 1 if any check fails.
+ */
+
+/** Keep trying to connect for this long, while the stand-in starts. */
+#define CONNECT_RETRY_MS 2000
+
+/** Longest wait for an expected packet. */
+#define RESPONSE_TIMEOUT_MS 2000
+
+/** How long to wait for stragglers, or for packets that shouldn't come. */
+#define QUIET_MS 300
+
+typedef struct client_t
+{
+  int fd;
+  cmd_id_t last_id;
+
+  /** How many times each id has been ACKed. */
+  uint8_t acked[65536];
+
+  uint32_t checks;
+  uint32_t errors;
+
+} client_t;
+
+static client_t client;
+
+static uint64_t millis_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void fail(const char *what, const char *detail)
+{
+  printf("FAIL: %s: %s\n", what, detail);
+  client.errors++;
+}
+
+
+// ----------------------------------------------------------------------------
+// Packets
+
+static bool connect_to(const char *address)
+{
+  if (strncmp(address, "tcp:", 4) == 0) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)strtoul(address + 4, NULL, 10));
+    client.fd = socket(AF_INET, SOCK_STREAM, 0);
+    return client.fd >= 0 && connect(client.fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(address) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr.sun_path, address);
+  client.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  return client.fd >= 0 && connect(client.fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+}
+
+static void send_packet(uint8_t op, uint16_t handle, const uint8_t *value, uint8_t len)
+{
+  uint8_t buf[GATT_PACKET_HEADER_SIZE + GATT_MAX_VALUE];
+  uint16_t size = GATT_PACKET_HEADER_SIZE - 2 + len;
+  buf[0] = (uint8_t)size;
+  buf[1] = (uint8_t)(size >> 8);
+  buf[2] = op;
+  buf[3] = (uint8_t)handle;
+  buf[4] = (uint8_t)(handle >> 8);
+  if (len > 0) {
+    memcpy(buf + GATT_PACKET_HEADER_SIZE, value, len);
+  }
+  if (send(client.fd, buf, GATT_PACKET_HEADER_SIZE + len, 0) != GATT_PACKET_HEADER_SIZE + len) {
+    perror("send");
+    exit(1);
+  }
+}
+
+/**
+ * Read exactly len bytes, waiting until deadline. Returns false if they
+ * didn't all come in time.
+ */
+static bool read_fully(uint8_t *buf, uint16_t len, uint64_t deadline)
+{
+  uint16_t got = 0;
+  while (got < len) {
+    uint64_t now = millis_now();
+    struct pollfd pfd = { client.fd, POLLIN, 0 };
+    if (now >= deadline || poll(&pfd, 1, (int)(deadline - now)) <= 0) {
+      return false;
+    }
+    ssize_t n = recv(client.fd, buf + got, len - got, 0);
+    if (n <= 0) {
+      fprintf(stderr, "disconnected\n");
+      exit(1);
+    }
+    got += (uint16_t)n;
+  }
+  return true;
+}
+
+/**
+ * Take the next packet from the stand-in, waiting up to timeout ms.
+ * ACK notifications are noted and skipped, unless want_notify.
+ */
+static bool receive(gatt_packet_t *packet, uint32_t timeout, bool want_notify)
+{
+  uint64_t deadline = millis_now() + timeout;
+  for (;;) {
+    uint8_t header[GATT_PACKET_HEADER_SIZE];
+    if (!read_fully(header, 2, deadline)) {
+      return false;
+    }
+    uint16_t size = (uint16_t)(header[0] | (header[1] << 8));
+    if (size < GATT_PACKET_HEADER_SIZE - 2 || size - 3 > GATT_MAX_VALUE) {
+      fprintf(stderr, "bad packet length %u\n", size);
+      exit(1);
+    }
+    // The rest is already on its way.
+    if (!read_fully(header + 2, GATT_PACKET_HEADER_SIZE - 2, deadline + RESPONSE_TIMEOUT_MS)
+        || !read_fully(packet->value, (uint16_t)(size - 3), deadline + RESPONSE_TIMEOUT_MS)) {
+      fprintf(stderr, "packet cut short\n");
+      exit(1);
+    }
+    packet->op = header[2];
+    packet->handle = (uint16_t)(header[3] | (header[4] << 8));
+    packet->len = (uint8_t)(size - 3);
+
+    app_command_t cmd;
+    if (packet->op == GATT_OP_NOTIFY && packet->handle == GATT_HANDLE_RESPONSE
+        && nova_codec_decode_command(packet->value, packet->len, &cmd)
+        && cmd.header.type == NOVA_CMD_ACK) {
+      client.acked[cmd.header.id]++;
+      if (!want_notify) {
+        continue;
+      }
+    }
+    return true;
+  }
+}
+
+/**
+ * Expect the next packet (other than ACK notifications) to be op on
+ * handle. Returns its value length, or -1.
+ */
+static int expect(const char *what, uint8_t op, uint16_t handle, gatt_packet_t *packet)
+{
+  client.checks++;
+  gatt_packet_t got;
+  packet = packet ? packet : &got;
+  if (!receive(packet, RESPONSE_TIMEOUT_MS, false)) {
+    fail(what, "no response");
+    return -1;
+  }
+  if (packet->op != op || packet->handle != handle) {
+    char detail[80];
+    snprintf(detail, sizeof(detail), "got op %02X handle %04X, not op %02X handle %04X",
+        packet->op, packet->handle, op, handle);
+    fail(what, detail);
+    return -1;
+  }
+  return packet->len;
+}
+
+static void expect_error(const char *what, uint8_t request_op, uint16_t handle, uint8_t error)
+{
+  gatt_packet_t packet;
+  if (expect(what, GATT_OP_ERROR, handle, &packet) < 0) {
+    return;
+  }
+  if (packet.len != 2 || packet.value[0] != request_op || packet.value[1] != error) {
+    char detail[80];
+    snprintf(detail, sizeof(detail), "error %02X for op %02X, not %02X for %02X",
+        packet.len == 2 ? packet.value[1] : 0, packet.len == 2 ? packet.value[0] : 0, error, request_op);
+    fail(what, detail);
+  }
+}
+
+/**
+ * Expect nothing more (but ACK notifications) for a while.
+ */
+static void expect_quiet(const char *what)
+{
+  gatt_packet_t packet;
+  client.checks++;
+  if (receive(&packet, QUIET_MS, false)) {
+    char detail[80];
+    snprintf(detail, sizeof(detail), "unexpected op %02X handle %04X", packet.op, packet.handle);
+    fail(what, detail);
+  }
+}
+
+static cmd_id_t write_ping(uint8_t op)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_PING;
+  cmd.header.id = ++client.last_id;
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  send_packet(op, GATT_HANDLE_REQUEST, buf, (uint8_t)nova_codec_encode_command(&cmd, buf));
+  return cmd.header.id;
+}
+
+static void subscribe(bool on)
+{
+  uint8_t value[2] = { on ? 1 : 0, 0 };
+  send_packet(GATT_OP_WRITE_REQ, GATT_HANDLE_RESPONSE, value, sizeof(value));
+  expect(on ? "subscribe" : "unsubscribe", GATT_OP_WRITE_RSP, GATT_HANDLE_RESPONSE, NULL);
+}
+
+
+// ----------------------------------------------------------------------------
+// Checks
+
+static void check_errors()
+{
+  uint8_t value[GATT_MAX_VALUE];
+  memset(value, 0, sizeof(value));
+
+  send_packet(GATT_OP_READ_REQ, GATT_HANDLE_REQUEST, NULL, 0);
+  expect_error("read EFF1", GATT_OP_READ_REQ, GATT_HANDLE_REQUEST, GATT_ERROR_READ_NOT_PERMITTED);
+
+  send_packet(GATT_OP_READ_REQ, GATT_HANDLE_RESPONSE, NULL, 0);
+  expect_error("read EFF2", GATT_OP_READ_REQ, GATT_HANDLE_RESPONSE, GATT_ERROR_READ_NOT_PERMITTED);
+
+  send_packet(GATT_OP_WRITE_REQ, GATT_HANDLE_COUNTERS, value, NOVA_CODEC_COUNTERS_SIZE);
+  expect_error("write EFF4", GATT_OP_WRITE_REQ, GATT_HANDLE_COUNTERS, GATT_ERROR_WRITE_NOT_PERMITTED);
+
+  send_packet(GATT_OP_READ_REQ, 0x1234, NULL, 0);
+  expect_error("read unknown handle", GATT_OP_READ_REQ, 0x1234, GATT_ERROR_INVALID_HANDLE);
+
+  send_packet(GATT_OP_WRITE_REQ, 0x1234, value, 1);
+  expect_error("write unknown handle", GATT_OP_WRITE_REQ, 0x1234, GATT_ERROR_INVALID_HANDLE);
+
+  // Read By Type Request: an ATT opcode the stand-in doesn't do.
+  send_packet(0x08, GATT_HANDLE_COUNTERS, NULL, 0);
+  expect_error("unsupported opcode", 0x08, GATT_HANDLE_COUNTERS, GATT_ERROR_REQUEST_NOT_SUPPORTED);
+
+  send_packet(GATT_OP_WRITE_REQ, GATT_HANDLE_RESPONSE, value, 1);
+  expect_error("write EFF2 short", GATT_OP_WRITE_REQ, GATT_HANDLE_RESPONSE, GATT_ERROR_INVALID_LENGTH);
+
+  send_packet(GATT_OP_WRITE_REQ, GATT_HANDLE_FLASH_DEFAULTS, value, NOVA_CODEC_FLASH_DEFAULTS_SIZE - 1);
+  expect_error("write EFF3 short", GATT_OP_WRITE_REQ, GATT_HANDLE_FLASH_DEFAULTS, GATT_ERROR_INVALID_LENGTH);
+
+  // Nothing answers a write without response, not even an error.
+  send_packet(GATT_OP_WRITE_CMD, GATT_HANDLE_COUNTERS, value, NOVA_CODEC_COUNTERS_SIZE);
+  expect_quiet("write EFF4 without response");
+}
+
+static void check_reads()
+{
+  gatt_packet_t packet;
+  flash_defaults_t defaults;
+  counters_t counters;
+
+  send_packet(GATT_OP_READ_REQ, GATT_HANDLE_FLASH_DEFAULTS, NULL, 0);
+  if (expect("read EFF3", GATT_OP_READ_RSP, GATT_HANDLE_FLASH_DEFAULTS, &packet) >= 0
+      && !nova_codec_decode_flash_defaults(packet.value, packet.len, &defaults)) {
+    fail("read EFF3", "doesn't decode");
+  }
+
+  send_packet(GATT_OP_READ_REQ, GATT_HANDLE_COUNTERS, NULL, 0);
+  if (expect("read EFF4", GATT_OP_READ_RSP, GATT_HANDLE_COUNTERS, &packet) >= 0) {
+    if (!nova_codec_decode_counters(packet.value, packet.len, &counters)) {
+      fail("read EFF4", "doesn't decode");
+    } else if (counters.app_connect == 0) {
+      fail("read EFF4", "subscribing didn't count as the App connecting");
+    }
+  }
+}
+
+static void check_pings()
+{
+  for (int i = 0; i < 10; i++) {
+    cmd_id_t id = write_ping(GATT_OP_WRITE_REQ);
+    expect("PING write", GATT_OP_WRITE_RSP, GATT_HANDLE_REQUEST, NULL);
+
+    // The ACK is notified when the write arrives, so before its response.
+    client.checks++;
+    if (!client.acked[id]) {
+      gatt_packet_t packet;
+      receive(&packet, RESPONSE_TIMEOUT_MS, true);
+    }
+    if (client.acked[id] != 1) {
+      fail("PING", client.acked[id] ? "ACKed more than once" : "not ACKed");
+    }
+  }
+}
+
+static void check_storm(uint32_t count, bool lossy)
+{
+  cmd_id_t first = client.last_id + 1;
+  for (uint32_t i = 0; i < count; i++) {
+    write_ping(GATT_OP_WRITE_CMD);
+  }
+
+  // Wait for all of them, or until the ACKs stop coming.
+  uint32_t acked = 0;
+  uint64_t quiet_until = millis_now() + RESPONSE_TIMEOUT_MS;
+  while (acked < count && millis_now() < quiet_until) {
+    gatt_packet_t packet;
+    if (receive(&packet, QUIET_MS, true)) {
+      quiet_until = millis_now() + QUIET_MS;
+      if (packet.op != GATT_OP_NOTIFY) {
+        fail("write without response", "got a response");
+      }
+    }
+    acked = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      acked += client.acked[(cmd_id_t)(first + i)] > 0;
+    }
+  }
+
+  printf("  %u PINGs written without response, %u ACKed\n", count, acked);
+  client.checks++;
+  if (lossy && (acked == 0 || acked == count)) {
+    fail("lossy writes without response", acked ? "nothing lost" : "nothing ACKed");
+  } else if (!lossy && acked != count) {
+    fail("writes without response", "some not ACKed");
+  }
+}
+
+static void check_unsubscribed()
+{
+  subscribe(false);
+  cmd_id_t id = write_ping(GATT_OP_WRITE_REQ);
+  expect("PING write unsubscribed", GATT_OP_WRITE_RSP, GATT_HANDLE_REQUEST, NULL);
+  expect_quiet("PING unsubscribed");
+  if (client.acked[id]) {
+    fail("PING unsubscribed", "ACK notified");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *address = "nova.sock";
+  uint32_t count = 200;
+  bool lossy = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      address = argv[++i];
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-x") == 0) {
+      lossy = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-c ADDRESS] [-n COUNT] [-x]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (count == 0 || count > 10000) {
+    fprintf(stderr, "%s: need 1-10000 PINGs\n", argv[0]);
+    return 2;
+  }
+
+  // The stand-in may still be starting.
+  uint64_t give_up = millis_now() + CONNECT_RETRY_MS;
+  while (!connect_to(address)) {
+    if ((errno != ENOENT && errno != ECONNREFUSED) || millis_now() > give_up) {
+      perror(address);
+      return 1;
+    }
+    close(client.fd);
+    usleep(10000);
+  }
+
+  printf("gatt client: %s%s\n", address, lossy ? ", lossy link" : "");
+
+  // Unsubscribed, the device isn't connected to the App.
+  check_errors();
+  subscribe(true);
+  check_reads();
+  if (!lossy) {
+    check_pings();
+  }
+  check_storm(count, lossy);
+  check_unsubscribed();
+
+  close(client.fd);
+  printf("  %u checks, %u failed\n", client.checks, client.errors);
+  return client.errors == 0 ? 0 : 1;
+}
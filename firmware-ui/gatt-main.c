@@ -0,0 +1,133 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-api.h>
+
+#include "fake-nova-device.h"
+#include "gatt-bridge.h"
+#include "ui-headless.h"
+#include "util/eventloop.h"
+
+/**
+ * Headless GATT stand-in.
+ *
+ * Runs a fake device, in real time, behind a GATT bridge (see
+ * gatt-bridge.h), so clients can connect to it over a local socket as
+ * if it were a Nova over BLE. Runs until interrupted, then prints what
+ * went over the link.
+ *
+ * Usage:
+ *
+ *   firmware-gatt [-l ADDRESS] [-i INTERVAL] [-p PACKETS] [-L LATENCY]
+ *                 [-j JITTER] [-x LOSS] [-s SEED] [-o STORAGE] [-v]
+ *
+ *   -l ADDRESS   Unix socket path, or tcp:PORT (default nova.sock)
+ *   -i INTERVAL  connection interval, ms (default 30, 0 for none)
+ *   -p PACKETS   packets each way per connection event (default 4,
+ *                0 for no limit)
+ *   -L LATENCY   latency of each packet, ms (default 0)
+ *   -j JITTER    up to this much more latency, ms (default 0)
+ *   -x LOSS      notifications and writes without response lost, per
+ *                thousand (default 0)
+ *   -s SEED      seed for jitter and losses (default 1)
+ *   -o STORAGE   keep device storage in slot 0 of a slab file (see
+ *                util/slab.h), rather than in memory
+ *   -v           log everything the device does
+ */
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+  stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+  const char *address = "nova.sock";
+  const char *storage_file = NULL;
+  gatt_link_config_t link = GATT_LINK_DEFAULTS;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      address = argv[++i];
+    } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      link.connection_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      link.packets_per_event = (uint8_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+      link.latency = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      link.jitter = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+      link.loss = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      link.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      storage_file = argv[++i];
+    } else if (strcmp(argv[i], "-v") == 0) {
+      ui_headless_set_verbose(true);
+    } else {
+      fprintf(stderr, "Usage: %s [-l ADDRESS] [-i INTERVAL] [-p PACKETS] [-L LATENCY]\n", argv[0]);
+      fprintf(stderr, "       %*s [-j JITTER] [-x LOSS] [-s SEED] [-o STORAGE] [-v]\n", (int)strlen(argv[0]), "");
+      return 2;
+    }
+  }
+
+  slab_t storage;
+  if (storage_file && !slab_open(&storage, storage_file, FAKE_STORAGE_SLOT_SIZE, 1)) {
+    perror(storage_file);
+    return 1;
+  }
+  fake_nova_device_t *device = fake_nova_device_init(storage_file ? &storage : NULL, 0);
+
+  event_loop_t loop;
+  if (!event_loop_init(&loop, &device->timers)) {
+    perror("event loop");
+    return 1;
+  }
+
+  gatt_bridge_t bridge;
+  if (!gatt_bridge_open(&bridge, &loop, device, address, &link)) {
+    perror(address);
+    return 1;
+  }
+
+  // Interrupt waiting (no SA_RESTART) to stop.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+  fprintf(stderr, "listening on %s\n", address);
+
+  while (!stopping) {
+    fake_nova_device_idle(device);
+    event_loop_wait(&loop, -1);
+  }
+
+  gatt_bridge_close(&bridge);
+  fake_nova_device_input(device, NOVA_EVENT_POWER_FAILING);
+
+  printf("gatt: %u connections, %u packets received, %u sent, %u lost, %u dropped, %u connection events\n",
+      bridge.stats.connections, bridge.stats.received, bridge.stats.sent, bridge.stats.lost,
+      bridge.stats.overflows, bridge.stats.events);
+  printf("timers: %u fired, p50 <%luus, p99 <%luus, max %luus late, %u wakeups\n",
+      loop.lateness.count,
+      (unsigned long)event_loop_lateness_percentile(&loop.lateness, 0.5),
+      (unsigned long)event_loop_lateness_percentile(&loop.lateness, 0.99),
+      (unsigned long)loop.lateness.max, loop.wakeups);
+
+  event_loop_free(&loop);
+  fake_nova_device_free(device);
+  if (storage_file) {
+    slab_close(&storage);
+  }
+  return 0;
+}
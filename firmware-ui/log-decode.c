@@ -0,0 +1,82 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See log-decode.h
+ */
+
+#include "log-decode.h"
+
+#include <string.h>
+
+typedef struct message_info_t
+{
+  const char *name;
+  const char *format;
+} message_info_t;
+
+#define MESSAGE_INFO(name, format) { #name, format },
+
+static const message_info_t messages[] = {
+  NOVA_LOG_MESSAGES(MESSAGE_INFO)
+};
+
+#undef MESSAGE_INFO
+
+const char *log_decode_name(uint8_t message)
+{
+  return message < NOVA_LOG_MESSAGE_COUNT ? messages[message].name : NULL;
+}
+
+const char *log_decode_format(uint8_t message)
+{
+  return message < NOVA_LOG_MESSAGE_COUNT ? messages[message].format : NULL;
+}
+
+void log_decode_print(FILE *out, const nova_log_record_t *record)
+{
+  const char *format = log_decode_format(record->message);
+  if (!format) {
+    fprintf(out, "unknown message %u (a=%u, b=%u)\n", record->message, record->a, record->b);
+    return;
+  }
+
+  for (const char *c = format; *c; c++) {
+    if (strncmp(c, "{a}", 3) == 0) {
+      fprintf(out, "%u", record->a);
+      c += 2;
+    } else if (strncmp(c, "{b}", 3) == 0) {
+      fprintf(out, "%u", record->b);
+      c += 2;
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('\n', out);
+}
+
+void log_decode_print_table(FILE *out)
+{
+  for (int message = 0; message < NOVA_LOG_MESSAGE_COUNT; message++) {
+    fprintf(out, "%d\t%s\t%s\n", message, messages[message].name, messages[message].format);
+  }
+}
+
+bool log_decode_write(FILE *out, const nova_log_record_t *record)
+{
+  uint8_t bytes[LOG_DECODE_RECORD_SIZE] = {
+    record->message, record->a, (uint8_t)record->b, (uint8_t)(record->b >> 8)
+  };
+  return fwrite(bytes, sizeof(bytes), 1, out) == 1;
+}
+
+bool log_decode_read(FILE *in, nova_log_record_t *record)
+{
+  uint8_t bytes[LOG_DECODE_RECORD_SIZE];
+  if (fread(bytes, sizeof(bytes), 1, in) != 1) {
+    return false;
+  }
+  record->message = bytes[0];
+  record->a = bytes[1];
+  record->b = (uint16_t)(bytes[2] | (bytes[3] << 8));
+  return true;
+}
@@ -0,0 +1,53 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Host side of nova.c's tokenized debug log (see nova-log.h).
+ *
+ * The device only stores records of a message id and two raw values.
+ * This expands NOVA_LOG_MESSAGES into a string table, indexed by id, and
+ * turns records back into the messages they stand for.
+ *
+ * Records are saved in files as 4 bytes each: message id, a, then b
+ * (little-endian), the same as the device would send them.
+ *
+ * Usage:
+ *
+ *   nova_log_record_t record;
+ *   while (nova_log_take(nova, &record)) {
+ *     log_decode_print(stdout, &record);  // "flash on, warm 63 cool 63"
+ *   }
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <nova-log.h>
+
+/** Bytes per record in a file. */
+#define LOG_DECODE_RECORD_SIZE 4
+
+/**
+ * Name and format of a message (see NOVA_LOG_MESSAGES), or NULL if the
+ * id is unknown (e.g. a log from newer firmware).
+ */
+const char *log_decode_name(uint8_t message);
+const char *log_decode_format(uint8_t message);
+
+/**
+ * Print the message a record stands for, and a newline.
+ */
+void log_decode_print(FILE *out, const nova_log_record_t *record);
+
+/**
+ * Print the string table: a line per message of id, name and format,
+ * separated by tabs.
+ */
+void log_decode_print_table(FILE *out);
+
+/**
+ * Write/read a record to/from a file. Reading returns false at the end.
+ */
+bool log_decode_write(FILE *out, const nova_log_record_t *record);
+bool log_decode_read(FILE *in, nova_log_record_t *record);
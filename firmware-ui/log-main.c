@@ -0,0 +1,130 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-internal.h>
+#include <nova-log.h>
+
+#include "fleet.h"
+#include "log-decode.h"
+#include "ui-headless.h"
+
+/**
+ * Tokenized log tool.
+ *
+ * Runs a fake device (built with NOVA_LOG) through a random but seeded
+ * stream of events, as used by the fleet simulator (see fleet.h), taking
+ * log records after each event, as a device would when idle. Prints the
+ * messages they stand for, and optionally saves the raw records, as the
+ * device would send them, to decode later.
+ *
+ * Usage:
+ *
+ *   firmware-log [-e EVENTS] [-s SEED] [-o LOG] [-q]
+ *   firmware-log -r LOG
+ *   firmware-log -t
+ *
+ *   -e EVENTS  events to run (default 1000)
+ *   -s SEED    seed for event stream (default 1)
+ *   -o LOG     save raw records to LOG
+ *   -q         don't print messages, just the summary
+ *   -r LOG     print the messages in a saved LOG instead
+ *   -t         print the string table instead
+ *
+ * Exits with status 1 if any records were lost.
+ */
+
+#ifndef NOVA_LOG
+#error firmware-log must be built with -DNOVA_LOG
+#endif
+
+static int decode(const char *filename)
+{
+  FILE *in = fopen(filename, "rb");
+  if (!in) {
+    perror(filename);
+    return 1;
+  }
+  nova_log_record_t record;
+  while (log_decode_read(in, &record)) {
+    log_decode_print(stdout, &record);
+  }
+  fclose(in);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t events = 1000;
+  uint64_t seed = 1;
+  const char *output = NULL;
+  bool quiet = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      events = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "-q") == 0) {
+      quiet = true;
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      return decode(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      log_decode_print_table(stdout);
+      return 0;
+    } else {
+      fprintf(stderr, "Usage: %s [-e EVENTS] [-s SEED] [-o LOG] [-q]\n", argv[0]);
+      fprintf(stderr, "       %s -r LOG\n", argv[0]);
+      fprintf(stderr, "       %s -t\n", argv[0]);
+      return 2;
+    }
+  }
+
+  FILE *out = NULL;
+  if (output && !(out = fopen(output, "wb"))) {
+    perror(output);
+    return 1;
+  }
+
+  fleet_device_t fleet_device;
+  fleet_device_init(&fleet_device, seed, 0, NULL, NULL);
+  nova_t *nova = fleet_device.device->nova;
+
+  fleet_event_t event;
+  nova_log_record_t record;
+  for (uint32_t i = 0; i <= events; i++) {
+    if (i > 0) {
+      fleet_stream_next(&fleet_device.stream, &event);
+      fleet_device_apply(&fleet_device, &event);
+    }
+    while (nova_log_take(nova, &record)) {
+      if (!quiet) {
+        log_decode_print(stdout, &record);
+      }
+      if (out && !log_decode_write(out, &record)) {
+        perror(output);
+        return 1;
+      }
+    }
+  }
+
+  printf("log: %u events, %u records (%u bytes), %u lost (%u record buffer)\n",
+      events, nova->log.written, nova->log.written * LOG_DECODE_RECORD_SIZE,
+      nova->log.lost, NOVA_LOG_SIZE);
+
+  bool ok = true;
+  if (nova->log.lost > 0) {
+    printf("FAIL: log records lost, increase NOVA_LOG_SIZE\n");
+    ok = false;
+  }
+
+  if (out) {
+    fclose(out);
+  }
+  fleet_device_free(&fleet_device);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,329 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See log-store.h
+ */
+
+#include "log-store.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef char check_ring_size[(LOG_STORE_RING_SIZE & (LOG_STORE_RING_SIZE - 1)) == 0 ? 1 : -1];
+
+#define RING_MASK (LOG_STORE_RING_SIZE - 1)
+
+static void segment_filename(log_store_t *log, uint32_t segment, char *out, size_t size)
+{
+  snprintf(out, size, "%s.%u", log->path, segment);
+}
+
+
+// ----------------------------------------------------------------------------
+// Writer thread
+
+/**
+ * Start the next segment (the first if none yet), deleting the oldest
+ * if too many. Returns false if it can't be created.
+ */
+static bool next_segment(log_store_t *log, uint64_t first_seq)
+{
+  char filename[1024];
+  uint32_t segment = log->file ? log->segment + 1 : 0;
+
+  if (log->file) {
+    fclose(log->file);
+  }
+  segment_filename(log, segment, filename, sizeof(filename));
+  log->file = fopen(filename, "w");
+  if (!log->file) {
+    return false;
+  }
+
+  pthread_mutex_lock(&log->lock);
+  log->segment = segment;
+  log->segment_size = 0;
+  log->segment_first[segment % LOG_STORE_SEGMENTS] = first_seq;
+  uint32_t drop = segment >= LOG_STORE_SEGMENTS ? segment - LOG_STORE_SEGMENTS + 1 : 0;
+  while (log->oldest_segment < drop) {
+    segment_filename(log, log->oldest_segment++, filename, sizeof(filename));
+    unlink(filename);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return true;
+}
+
+static void index_add(log_store_t *log, uint64_t seq)
+{
+  pthread_mutex_lock(&log->lock);
+  if (log->index_count == log->index_capacity) {
+    log->index_capacity = log->index_capacity ? log->index_capacity * 2 : 1024;
+    log->index = realloc(log->index, log->index_capacity * sizeof(log_store_position_t));
+  }
+  log->index[log->index_count].segment = log->segment;
+  log->index[log->index_count].offset = log->segment_size;
+  log->index_count++;
+  pthread_mutex_unlock(&log->lock);
+}
+
+static void *writer_main(void *data)
+{
+  log_store_t *log = (log_store_t*)data;
+
+  for (;;) {
+    pthread_mutex_lock(&log->lock);
+    while (log->written == log->appended && !log->stopping) {
+      pthread_cond_wait(&log->wake_writer, &log->lock);
+    }
+    uint64_t from = log->written;
+    uint64_t to = log->appended;
+    bool stopping = log->stopping;
+    pthread_mutex_unlock(&log->lock);
+
+    if (from == to && stopping) {
+      break;
+    }
+
+    // Messages from..to won't be overwritten until written moves on, so
+    // can be read without the lock.
+    for (uint64_t seq = from; seq < to; seq++) {
+      if (seq % LOG_STORE_INDEX_STRIDE == 0) {
+        // Segments only start at indexed messages, so an index entry is
+        // never in a deleted segment while the messages after it aren't.
+        if (log->segment_size >= LOG_STORE_SEGMENT_SIZE) {
+          next_segment(log, seq);
+        }
+        index_add(log, seq);
+      }
+      if (log->file) {
+        int len = fprintf(log->file, "%s\n", log->ring[seq & RING_MASK]);
+        log->segment_size += len > 0 ? (uint32_t)len : 0;
+      }
+    }
+    if (log->file) {
+      fflush(log->file);
+    }
+
+    pthread_mutex_lock(&log->lock);
+    log->written = to;
+    pthread_cond_signal(&log->wake_appender);
+    pthread_mutex_unlock(&log->lock);
+  }
+  return NULL;
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+log_store_t *log_store_open(const char *path)
+{
+  log_store_t *log = calloc(1, sizeof(log_store_t));
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->wake_writer, NULL);
+  pthread_cond_init(&log->wake_appender, NULL);
+
+  if (!path) {
+    return log;
+  }
+
+  // Delete segments left by an earlier run.
+  log->path = strdup(path);
+  char filename[1024];
+  for (uint32_t segment = 0; ; segment++) {
+    segment_filename(log, segment, filename, sizeof(filename));
+    if (unlink(filename) != 0) {
+      break;
+    }
+  }
+
+  if (!next_segment(log, 0)) {
+    log_store_close(log);
+    return NULL;
+  }
+  pthread_create(&log->writer, NULL, writer_main, log);
+  return log;
+}
+
+void log_store_vappend(log_store_t *log, const char *format, va_list args)
+{
+  pthread_mutex_lock(&log->lock);
+  if (log->path) {
+    while (log->appended - log->written >= LOG_STORE_RING_SIZE) {
+      pthread_cond_wait(&log->wake_appender, &log->lock);
+    }
+  }
+  pthread_mutex_unlock(&log->lock);
+
+  // Only this thread changes appended, and the writer is done with the
+  // slot, so it can be filled without the lock.
+  char *msg = log->ring[log->appended & RING_MASK];
+  vsnprintf(msg, LOG_STORE_MSG_LEN, format, args);
+  for (char *c = msg; *c; c++) {
+    if (*c == '\n') {
+      *c = ' ';
+    }
+  }
+
+  pthread_mutex_lock(&log->lock);
+  log->appended++;
+  if (!log->path) {
+    log->written = log->appended;
+  }
+  pthread_cond_signal(&log->wake_writer);
+  pthread_mutex_unlock(&log->lock);
+}
+
+void log_store_append(log_store_t *log, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  log_store_vappend(log, format, args);
+  va_end(args);
+}
+
+uint64_t log_store_count(log_store_t *log)
+{
+  return log->appended;
+}
+
+uint64_t log_store_oldest(log_store_t *log)
+{
+  uint64_t in_ring = log->appended > LOG_STORE_RING_SIZE ? log->appended - LOG_STORE_RING_SIZE : 0;
+  if (!log->path) {
+    return in_ring;
+  }
+  pthread_mutex_lock(&log->lock);
+  uint64_t on_disk = log->segment_first[log->oldest_segment % LOG_STORE_SEGMENTS];
+  pthread_mutex_unlock(&log->lock);
+  return on_disk < in_ring ? on_disk : in_ring;
+}
+
+/**
+ * Read the next line from the reader, moving on to the next segment at
+ * the end of one. Returns false at the end of what's been written.
+ */
+static bool read_line(log_store_t *log, char *out, size_t size)
+{
+  char line[LOG_STORE_MSG_LEN + 1];
+  // The segment may have grown since the reader last hit the end of it.
+  clearerr(log->reader);
+  while (!fgets(line, sizeof(line), log->reader)) {
+    char filename[1024];
+    FILE *next;
+    pthread_mutex_lock(&log->lock);
+    bool last = log->reader_segment >= log->segment;
+    pthread_mutex_unlock(&log->lock);
+    segment_filename(log, log->reader_segment + 1, filename, sizeof(filename));
+    if (last || !(next = fopen(filename, "r"))) {
+      return false;
+    }
+    fclose(log->reader);
+    log->reader = next;
+    log->reader_segment++;
+  }
+  line[strcspn(line, "\n")] = 0;
+  snprintf(out, size, "%s", line);
+  log->reader_seq++;
+  return true;
+}
+
+/**
+ * Read message seq from the files.
+ */
+static bool read_written(log_store_t *log, uint64_t seq, char *out, size_t size)
+{
+  if (!log->reader || log->reader_seq != seq) {
+    // Seek to the indexed message at or before seq, then read forwards.
+    pthread_mutex_lock(&log->lock);
+    uint64_t entry = seq / LOG_STORE_INDEX_STRIDE;
+    bool indexed = entry < log->index_count && log->index[entry].segment >= log->oldest_segment;
+    log_store_position_t position = indexed ? log->index[entry] : (log_store_position_t){ 0, 0 };
+    pthread_mutex_unlock(&log->lock);
+    if (!indexed) {
+      return false;
+    }
+
+    char filename[1024];
+    if (log->reader) {
+      fclose(log->reader);
+    }
+    segment_filename(log, position.segment, filename, sizeof(filename));
+    log->reader = fopen(filename, "r");
+    if (!log->reader || fseek(log->reader, position.offset, SEEK_SET) != 0) {
+      return false;
+    }
+    log->reader_segment = position.segment;
+    log->reader_seq = entry * LOG_STORE_INDEX_STRIDE;
+
+    char skipped[LOG_STORE_MSG_LEN];
+    while (log->reader_seq < seq) {
+      if (!read_line(log, skipped, sizeof(skipped))) {
+        return false;
+      }
+    }
+  }
+  return read_line(log, out, size);
+}
+
+bool log_store_get(log_store_t *log, uint64_t seq, char *out, size_t size)
+{
+  if (seq >= log->appended) {
+    return false;
+  }
+  if (log->appended - seq <= LOG_STORE_RING_SIZE) {
+    snprintf(out, size, "%s", log->ring[seq & RING_MASK]);
+    return true;
+  }
+  return log->path && read_written(log, seq, out, size);
+}
+
+int64_t log_store_search(log_store_t *log, const char *text, uint64_t before)
+{
+  char msg[LOG_STORE_MSG_LEN];
+  uint64_t oldest = log_store_oldest(log);
+  if (before > log->appended) {
+    before = log->appended;
+  }
+
+  // A block of messages at a time, from the latest, reading each forwards.
+  while (before > oldest) {
+    uint64_t from = (before - 1) / LOG_STORE_INDEX_STRIDE * LOG_STORE_INDEX_STRIDE;
+    if (from < oldest) {
+      from = oldest;
+    }
+    int64_t found = -1;
+    for (uint64_t seq = from; seq < before; seq++) {
+      if (log_store_get(log, seq, msg, sizeof(msg)) && strstr(msg, text)) {
+        found = (int64_t)seq;
+      }
+    }
+    if (found >= 0) {
+      return found;
+    }
+    before = from;
+  }
+  return -1;
+}
+
+void log_store_close(log_store_t *log)
+{
+  if (log->path && log->file) {
+    pthread_mutex_lock(&log->lock);
+    log->stopping = true;
+    pthread_cond_signal(&log->wake_writer);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+    fclose(log->file);
+  }
+  if (log->reader) {
+    fclose(log->reader);
+  }
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->wake_writer);
+  pthread_cond_destroy(&log->wake_appender);
+  free(log->index);
+  free(log->path);
+  free(log);
+}
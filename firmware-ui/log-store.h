@@ -0,0 +1,157 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Debug log history, for the UI's log window.
+ *
+ * Messages are numbered from 0 in the order appended (their "seq") and go
+ * into a ring buffer, so appending costs the same however long the
+ * history is. A background thread streams them out of the ring to files,
+ * so nothing is lost when the ring wraps around, and older messages can
+ * still be read back (e.g. to scroll back or search through the log).
+ *
+ * Files are segments, named PATH.0, PATH.1, ... each holding a line per
+ * message. A new segment is started once one reaches
+ * LOG_STORE_SEGMENT_SIZE bytes, and only the last LOG_STORE_SEGMENTS
+ * are kept. An index of where every LOG_STORE_INDEX_STRIDE'th message
+ * is in the files lets any message be found without scanning them.
+ *
+ * If the writer falls a whole ring behind, appending waits for it.
+ *
+ * Appending and reading must be done from the same thread.
+ *
+ * Usage:
+ *
+ *   log_store_t *log = log_store_open("firmware-ui.log");
+ *   log_store_append(log, "pressed %s", "button");
+ *
+ *   char line[LOG_STORE_MSG_LEN];
+ *   log_store_get(log, 0, line, sizeof(line));   // "pressed button"
+ *
+ *   log_store_close(log);
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** Longest message, including terminator. Longer ones are truncated. */
+#define LOG_STORE_MSG_LEN 100
+
+/** Messages held in memory. Must be a power of 2. */
+#ifndef LOG_STORE_RING_SIZE
+#define LOG_STORE_RING_SIZE 4096
+#endif
+
+/** Messages per index entry. */
+#define LOG_STORE_INDEX_STRIDE 64
+
+/** Size a segment file grows to before the next is started. */
+#ifndef LOG_STORE_SEGMENT_SIZE
+#define LOG_STORE_SEGMENT_SIZE (1 << 20)
+#endif
+
+/** Segment files kept. Older ones are deleted. */
+#ifndef LOG_STORE_SEGMENTS
+#define LOG_STORE_SEGMENTS 8
+#endif
+
+/** Where an indexed message starts in the files. */
+typedef struct log_store_position_t
+{
+  uint32_t segment;
+  uint32_t offset;
+} log_store_position_t;
+
+typedef struct log_store_t
+{
+  /** Recent messages: seq is at ring[seq % LOG_STORE_RING_SIZE]. */
+  char ring[LOG_STORE_RING_SIZE][LOG_STORE_MSG_LEN];
+
+  /** Messages appended, and written to file (or dropped if no files). */
+  uint64_t appended;
+  uint64_t written;
+
+  /** Guards appended, written, index and the segment fields below. */
+  pthread_mutex_t lock;
+
+  /** Signalled when there's something to write, or space in ring. */
+  pthread_cond_t wake_writer;
+  pthread_cond_t wake_appender;
+
+  pthread_t writer;
+  bool stopping;
+
+  /** Segments are path.N. NULL if not writing files. */
+  char *path;
+
+  /** Segment being written, and its size so far (writer only). */
+  FILE *file;
+  uint32_t segment;
+  uint32_t segment_size;
+
+  /** Oldest segment kept, and seq of the first message in each kept. */
+  uint32_t oldest_segment;
+  uint64_t segment_first[LOG_STORE_SEGMENTS];
+
+  /**
+   * Position of every LOG_STORE_INDEX_STRIDE'th message: message
+   * n * LOG_STORE_INDEX_STRIDE is at index[n]. Grows as needed.
+   */
+  log_store_position_t *index;
+  uint64_t index_count;
+  uint64_t index_capacity;
+
+  /** Reading older messages: open segment, and seq of next line in it. */
+  FILE *reader;
+  uint32_t reader_segment;
+  uint64_t reader_seq;
+
+} log_store_t;
+
+/**
+ * Create a log store, writing to segments named path.N (any existing
+ * ones are deleted). If path is NULL, only the ring is kept. Returns NULL
+ * if the first segment can't be created.
+ */
+log_store_t *log_store_open(const char *path);
+
+/**
+ * Append a message, printf() style. Newlines are replaced by spaces.
+ */
+void log_store_append(log_store_t *log, const char *format, ...);
+void log_store_vappend(log_store_t *log, const char *format, va_list args);
+
+/**
+ * Number of messages ever appended, i.e. the seq of the next one.
+ */
+uint64_t log_store_count(log_store_t *log);
+
+/**
+ * seq of the oldest message that can still be read.
+ */
+uint64_t log_store_oldest(log_store_t *log);
+
+/**
+ * Copy message seq into out. Returns false if it's not (or no longer)
+ * available.
+ *
+ * Recent messages come from the ring. Older ones are read from the
+ * files, which is fastest when reading forwards.
+ */
+bool log_store_get(log_store_t *log, uint64_t seq, char *out, size_t size);
+
+/**
+ * Find the latest message before seq containing text. Returns its seq,
+ * or -1 if there isn't one.
+ */
+int64_t log_store_search(log_store_t *log, const char *text, uint64_t before);
+
+/**
+ * Write out everything appended, stop the writer and free the store.
+ */
+void log_store_close(log_store_t *log);
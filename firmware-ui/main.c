@@ -2,11 +2,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <nova-api.h>
+#include <nova-codec.h>
 
+#include "camera-app.h"
+#include "control.h"
+#include "gatt-bridge.h"
 #include "ui.h"
 #include "util/basictimer.h"
+#include "util/eventloop.h"
 
 /**
  * This is a standalone program that embeds the Nova shared firmware code
@@ -16,135 +23,276 @@
  * Use it to manually interact with the shared firmware code and see
  * how it responds.
  *
+ * Usage:
+ *
+ *   firmware-ui [-o RECORDING] [-c SOCKET] [-g ADDRESS] [-a LATENCY]
+ *
+ *   -o FILE     record the session, for replay with firmware-replay
+ *               (see recording.h)
+ *   -c SOCKET   listen for scenario steps on a Unix socket (see control.h)
+ *   -g ADDRESS  serve the device's GATT characteristics to a client, on
+ *               a Unix socket path or tcp:PORT, over a link with the
+ *               default timing (see gatt-bridge.h)
+ *   -a LATENCY  the App ACKs TRIGGERs, taking LATENCY to take each photo
+ *               (see camera-app.h): fixed:MS, lognormal:MEDIAN:SIGMA or
+ *               trace:FILE. Default lognormal:250:0.5, or none with -g
+ *               (the client is the App). "none" to not ACK
+ *
+ * The process sleeps in an event loop (see util/eventloop.h) until a key
+ * is pressed, a control or GATT client sends something, or the next
+ * timer expires. While timers are running, it also wakes every
+ * TIMER_REPAINT_MS to repaint their countdown.
+ *
  * See README for more details.
  */
 
 // TODO: Allow UI to change (and save) flash_defaults
-// TODO: Simulate App ACKing trigger
 
-int main(int argc, char **argv)
+/** How often to repaint timers counting down. */
+#define TIMER_REPAINT_MS 100
+
+static fake_nova_device_t *device;
+static nova_t *nova;
+
+/** Set when the user quits. */
+static bool quitting;
+
+/** Simulate the App sending cmd, encoded as it would be over BLE. */
+static void send_app_command(fake_nova_device_t *device, app_command_t *cmd)
 {
-  // Setup fake Nova device. See fake-nova-device.h.
-  // Usage counters saved in file "counters.data".
-  fake_nova_device_t *device = fake_nova_device_init("counters.data");
-  nova_t* nova = device->nova;
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  uint16_t len = nova_codec_encode_command(cmd, buf);
+  fake_nova_device_app_write(device, buf, len);
+}
 
+/**
+ * Carry out what the user asked for.
+ */
+static void handle_action(ui_action action)
+{
   // For simulating commands from the App.
-  cmd_id_t id = 0;
+  static cmd_id_t id = 0;
   app_command_t cmd;
 
+  switch (action) {
+
+    case UI_ACTION_QUIT:
+      quitting = true;
+      break;
+
+    case UI_ACTION_RESET:
+      fake_nova_device_power_cut(device, false);
+      break;
+
+    case UI_ACTION_BROWNOUT:
+      fake_nova_device_power_cut(device, true);
+      break;
+
+    case UI_ACTION_TOGGLE_APP:
+      // Toggle APP connectivity.
+      if (!nova_is_ble_app_connected(nova)) {
+        fake_nova_device_input(device, NOVA_EVENT_CONNECT_APP);
+      } else {
+        fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_APP);
+      }
+      break;
+
+    case UI_ACTION_TOGGLE_HID:
+      // Toggle HID connectivity.
+      if (!nova_is_ble_hid_connected(nova)) {
+        fake_nova_device_input(device, NOVA_EVENT_CONNECT_HID);
+      } else {
+        fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_HID);
+      }
+      break;
+
+    case UI_ACTION_APP_PING:
+      // Simulate PING from App.
+      if (nova_is_ble_app_connected(nova)) {
+        cmd.header.type = NOVA_CMD_PING;
+        cmd.header.id = ++id;
+        ui_log("-> nova_on_app_command({type=PING, id=%u})", cmd.header.id);
+        send_app_command(device, &cmd);
+      }
+      break;
+
+    case UI_ACTION_APP_FLASH:
+      // Simulate FLASH from App.
+      if (nova_is_ble_app_connected(nova)) {
+        cmd.header.type = NOVA_CMD_FLASH;
+        cmd.header.id = ++id;
+        cmd.body.flash_settings.timeout = 5000;
+        cmd.body.flash_settings.warm = 255;
+        cmd.body.flash_settings.cool = 127;
+        ui_log("-> nova_on_app_command({type=FLASH, id=%u, flash_settings={timeout=%u, warm=%u, cool=%u}})",
+            cmd.header.id, cmd.body.flash_settings.timeout, cmd.body.flash_settings.warm, cmd.body.flash_settings.cool);
+        send_app_command(device, &cmd);
+      }
+      break;
+
+    case UI_ACTION_APP_OFF:
+      // Simulate OFF from app.
+      if (nova_is_ble_app_connected(nova)) {
+        cmd.header.type = NOVA_CMD_OFF;
+        cmd.header.id = ++id;
+        ui_log("-> nova_on_app_command({type=OFF, id=%u})", cmd.header.id);
+        send_app_command(device, &cmd);
+      }
+      break;
+
+    case UI_ACTION_TRIGGER_PRESSDOWN:
+      // Simulate user pressing down on trigger button.
+      fake_nova_device_input(device, NOVA_EVENT_BUTTON_PRESSDOWN);
+      break;
+
+    case UI_ACTION_TRIGGER_RELEASE:
+      // Simulate user releasing trigger button.
+      fake_nova_device_input(device, NOVA_EVENT_BUTTON_RELEASE);
+      break;
+
+    case UI_ACTION_SKIP_TO_TIMER:
+      // Fast forward time, rather than waiting.
+      if (basic_timer_queue_active(&device->timers)) {
+        ui_log("   (skipping %lums)", (unsigned long)basic_timer_queue_next(&device->timers));
+        basic_timer_advance_to_next(&device->timers);
+      }
+      break;
+
+    case UI_ACTION_NO_OP:
+      // Not a key for the device (or handled by the UI itself).
+      break;
+
+  }
+}
+
+/** A key is waiting on stdin. */
+static void on_key(int fd, void *data)
+{
+  handle_action(ui_get_action(0));
+}
+
+int main(int argc, char **argv)
+{
+  const char *recording_file = NULL;
+  const char *control_socket = NULL;
+  const char *gatt_address = NULL;
+  const char *camera_latency = NULL;
+  bool camera_latency_set = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      recording_file = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      control_socket = argv[++i];
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      gatt_address = argv[++i];
+    } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      camera_latency = argv[++i];
+      camera_latency_set = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-o RECORDING] [-c SOCKET] [-g ADDRESS] [-a LATENCY]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (!camera_latency_set) {
+    camera_latency = gatt_address ? NULL : "lognormal:250:0.5";
+  } else if (strcmp(camera_latency, "none") == 0) {
+    camera_latency = NULL;
+  }
+
+  // Setup fake Nova device. See fake-nova-device.h.
+  // Usage counters saved in simulated flash, in slot 0 of "devices.slab".
+  slab_t storage;
+  if (!slab_open(&storage, "devices.slab", FAKE_STORAGE_SLOT_SIZE, 1)) {
+    perror("devices.slab");
+    return 1;
+  }
+  device = fake_nova_device_init(&storage, 0);
+  nova = device->nova;
+
+  // Optionally record everything, from the start.
+  recording_t recording;
+  if (recording_file) {
+    if (!recording_open(&recording, recording_file)) {
+      perror(recording_file);
+      return 1;
+    }
+    fake_nova_device_record(device, &recording);
+  }
+
+  // Sleep until a key is pressed or a timer is due.
+  event_loop_t loop;
+  if (!event_loop_init(&loop, &device->timers)
+      || !event_loop_watch(&loop, STDIN_FILENO, on_key, NULL)) {
+    perror("event loop");
+    return 1;
+  }
+
+  // Optionally take steps from control clients too.
+  control_t control;
+  if (control_socket && !control_open(&control, &loop, device, control_socket)) {
+    perror(control_socket);
+    return 1;
+  }
+
+  // Optionally let a client in as the App, over a simulated link.
+  gatt_bridge_t gatt;
+  gatt_link_config_t link = GATT_LINK_DEFAULTS;
+  if (gatt_address && !gatt_bridge_open(&gatt, &loop, device, gatt_address, &link)) {
+    perror(gatt_address);
+    return 1;
+  }
+
+  // Optionally have the App take photos when triggered, and ACK.
+  camera_app_t camera;
+  camera_app_config_t camera_config = CAMERA_APP_DEFAULTS;
+  if (camera_latency) {
+    if (!camera_latency_parse(&camera_config.latency, camera_latency)) {
+      perror(camera_latency);
+      return 1;
+    }
+    camera_app_init(&camera, device, &camera_config);
+  }
+
   // Setup UI.
   ui_init(nova, device);
+  ui_show_event_loop(&loop);
 
   // Reset Nova firmware.
-  ui_log("-> nova_on_reset()");
-  nova_on_reset(nova);
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
 
   // Main loop...
-  for(;;) {
+  while (!quitting) {
 
-    // Run timer callbacks if its time has expired.
-    basic_timer_tick(&device->flash_timer);
+    // Background work, e.g. flash maintenance.
+    fake_nova_device_idle(device);
 
     // Paint UI.
     ui_refresh();
 
-    // Await action from user interface.
-    // If timer is active, only wait a short while so the UI can be regularly
-    // repainted to show timer countdown progress.
-    // If timer is not active, give it more time so we don't repaint too often.
-    int key_timeout = device->flash_timer.active ? 100 : 1000;
-    ui_action action = ui_get_action(key_timeout);
-
-    // Handle user action.
-    switch (action) {
-
-      case UI_ACTION_QUIT:
-        goto quit;
-
-      case UI_ACTION_RESET:
-        ui_log("-> nova_on_reset()");
-        nova_on_reset(nova);
-        break;
-
-      case UI_ACTION_TOGGLE_APP:
-        // Toggle APP connectivity.
-        if (!nova_is_ble_app_connected(nova)) {
-          ui_log("-> nova_on_connect_app()");
-          nova_on_connect_app(nova);
-        } else {
-          ui_log("-> nova_on_disconnect_app()");
-          nova_on_disconnect_app(nova);
-        }
-        break;
-
-      case UI_ACTION_TOGGLE_HID:
-        // Toggle HID connectivity.
-        if (!nova_is_ble_hid_connected(nova)) {
-          ui_log("-> nova_on_connect_hid()");
-          nova_on_connect_hid(nova);
-        } else {
-          ui_log("-> nova_on_disconnect_hid()");
-          nova_on_disconnect_hid(nova);
-        }
-        break;
-
-      case UI_ACTION_APP_PING:
-        // Simulate PING from App.
-        if (nova_is_ble_app_connected(nova)) {
-          cmd.header.type = NOVA_CMD_PING;
-          cmd.header.id = ++id;
-          ui_log("-> nova_on_app_command({type=PING, id=%u})", cmd.header.id);
-          nova_on_app_command(nova, &cmd);
-        }
-        break;
-
-      case UI_ACTION_APP_FLASH:
-        // Simulate FLASH from App.
-        if (nova_is_ble_app_connected(nova)) {
-          cmd.header.type = NOVA_CMD_FLASH;
-          cmd.header.id = ++id;
-          cmd.body.flash_settings.timeout = 5000;
-          cmd.body.flash_settings.warm = 255;
-          cmd.body.flash_settings.cool = 127;
-          ui_log("-> nova_on_app_command({type=FLASH, id=%u, flash_settings={timeout=%u, warm=%u, cool=%u}})",
-              cmd.header.id, cmd.body.flash_settings.timeout, cmd.body.flash_settings.warm, cmd.body.flash_settings.cool);
-          nova_on_app_command(nova, &cmd);
-        }
-        break;
-
-      case UI_ACTION_APP_OFF:
-        // Simulate OFF from app.
-        if (nova_is_ble_app_connected(nova)) {
-          cmd.header.type = NOVA_CMD_OFF;
-          cmd.header.id = ++id;
-          ui_log("-> nova_on_app_command({type=OFF, id=%u})", cmd.header.id);
-          nova_on_app_command(nova, &cmd);
-        }
-        break;
-
-      case UI_ACTION_TRIGGER_PRESSDOWN:
-        // Simulate user pressing down on trigger button.
-        ui_log("-> nova_on_button_pressdown()");
-        nova_on_button_pressdown(nova);
-        break;
-
-      case UI_ACTION_TRIGGER_RELEASE:
-        // Simulate user releasing trigger button.
-        ui_log("-> nova_on_button_release()");
-        nova_on_button_release(nova);
-        break;
-
-      case UI_ACTION_NO_OP:
-        // Nothing happened in alloted time. Try again.
-        break;
-
-    }
+    // Handle keys, control steps and timers as they happen. Timers
+    // counting down are repainted regularly; otherwise, when idle,
+    // don't wake up at all.
+    int max_wait = basic_timer_queue_active(&device->timers) ? TIMER_REPAINT_MS : -1;
+    event_loop_wait(&loop, max_wait);
   }
 
-quit:
+  // Treat quitting as a controlled power down, so counters are kept.
+  fake_nova_device_input(device, NOVA_EVENT_POWER_FAILING);
+
   // Cleanup.
+  if (control_socket) {
+    control_close(&control);
+  }
+  if (gatt_address) {
+    gatt_bridge_close(&gatt);
+  }
   ui_finish();
+  event_loop_free(&loop);
+  if (recording_file) {
+    recording_close(&recording);
+  }
   fake_nova_device_free(device);
+  camera_latency_free(&camera_config.latency);
+  slab_close(&storage);
   return 0;
 }
@@ -0,0 +1,218 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-api.h>
+#include <nova-internal.h>
+
+#include "camera-app.h"
+#include "fake-nova-device.h"
+#include "ui-headless.h"
+
+/**
+ * Light wasted per photo.
+ *
+ * Takes photos with the device's button, in virtual time, with a
+ * simulated App (see camera-app.h) that takes each photo in a latency
+ * sampled from a distribution, then ACKs the TRIGGER so the device turns
+ * the flash off. Runs the same photos twice: without the App ACKing (as
+ * the simulator did before, so every flash times out), and with.
+ *
+ * Reports how long the regular flash was lit per photo, and how much of
+ * that was wasted (after the photo was taken).
+ *
+ * Usage:
+ *
+ *   firmware-photo [-n PHOTOS] [-a LATENCY] [-i INTERVAL] [-H HOLD]
+ *                  [-g GAP] [-s SEED] [-v]
+ *
+ *   -n PHOTOS    photos to take (default 1000)
+ *   -a LATENCY   how long the App takes to take a photo (default
+ *                lognormal:250:0.5), one of:
+ *                  fixed:MS
+ *                  lognormal:MEDIAN:SIGMA
+ *                  trace:FILE  (a latency in ms per line)
+ *   -i INTERVAL  BLE connection interval, ms (default 30)
+ *   -H HOLD      how long the button is held, ms (default 500)
+ *   -g GAP       time between photos, ms (default 10000)
+ *   -s SEED      seed for latencies (default 1)
+ *   -v           log everything (only sensible with few photos)
+ *
+ * Exits with status 1 if the App didn't end a flash it should have.
+ */
+
+typedef struct run_t
+{
+  uint64_t *lit;
+  uint64_t *wasted;
+  uint32_t count;
+
+  /** Photos taken while the flash was on, but whose ACK didn't end it. */
+  uint32_t missed;
+
+  uint32_t regular_timeout;
+} run_t;
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Print min, median, 99th percentile, max and mean. values is sorted in
+ * place.
+ */
+static void print_distribution(const char *name, uint64_t *values, uint32_t count)
+{
+  if (count == 0) {
+    printf("  %-16s (none)\n", name);
+    return;
+  }
+  qsort(values, count, sizeof(uint64_t), compare_u64);
+  double sum = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    sum += values[i];
+  }
+  printf("  %-16s %8lu %8lu %8lu %8lu %10.1f\n", name,
+      (unsigned long)values[0],
+      (unsigned long)values[count / 2],
+      (unsigned long)values[(uint32_t)((count - 1) * 0.99)],
+      (unsigned long)values[count - 1],
+      sum / count);
+}
+
+static void on_photo(camera_app_t *app, const camera_photo_t *photo, void *data)
+{
+  run_t *run = (run_t*)data;
+  run->lit[run->count] = photo->off_at - photo->released_at;
+  run->wasted[run->count] = photo->off_at > photo->taken_at ? photo->off_at - photo->taken_at : 0;
+  run->count++;
+
+  // The ACK should have got there before the flash timed out.
+  uint64_t interval = app->config.connection_interval;
+  uint64_t ack_due = interval > 0 ? (photo->taken_at / interval + 1) * interval : photo->taken_at;
+  if (app->config.ack && ack_due < photo->released_at + run->regular_timeout && !photo->acked_at) {
+    run->missed++;
+  }
+}
+
+/**
+ * Take photos with a fresh device, and a camera App configured as given.
+ */
+static camera_app_stats_t take_photos(run_t *run, const camera_app_config_t *config,
+    uint32_t photos, uint32_t hold, uint32_t gap)
+{
+  fake_nova_device_t *device = fake_nova_device_init(NULL, 0);
+  basic_clock_init_virtual(&device->clock, 0);
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+  run->regular_timeout = device->nova->flash_defaults.regular.timeout;
+
+  camera_app_t *app = malloc(sizeof(camera_app_t));
+  camera_app_init(app, device, config);
+  app->on_photo = on_photo;
+  app->data = run;
+
+  fake_nova_device_input(device, NOVA_EVENT_CONNECT_APP);
+
+  for (uint32_t i = 0; i < photos; i++) {
+    fake_nova_device_input(device, NOVA_EVENT_BUTTON_PRESSDOWN);
+    basic_timer_advance(&device->timers, hold);
+    fake_nova_device_input(device, NOVA_EVENT_BUTTON_RELEASE);
+    while (app->stats.photos == i && basic_timer_advance_to_next(&device->timers)) {
+      fake_nova_device_idle(device);
+    }
+    basic_timer_advance(&device->timers, gap);
+    fake_nova_device_idle(device);
+  }
+
+  camera_app_stats_t stats = app->stats;
+  free(app);
+  fake_nova_device_free(device);
+  return stats;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t photos = 1000;
+  uint32_t hold = 500;
+  uint32_t gap = 10000;
+  const char *spec = "lognormal:250:0.5";
+  camera_app_config_t config = CAMERA_APP_DEFAULTS;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      photos = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      spec = argv[++i];
+    } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      config.connection_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+      hold = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      gap = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      config.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      ui_headless_set_verbose(true);
+    } else {
+      fprintf(stderr, "Usage: %s [-n PHOTOS] [-a LATENCY] [-i INTERVAL] [-H HOLD]\n", argv[0]);
+      fprintf(stderr, "       %*s [-g GAP] [-s SEED] [-v]\n", (int)strlen(argv[0]), "");
+      return 2;
+    }
+  }
+
+  if (!camera_latency_parse(&config.latency, spec)) {
+    perror(spec);
+    return 2;
+  }
+
+  printf("photo: %u photos, %s to take each, %ums connection interval, %ums hold\n\n",
+      photos, spec, config.connection_interval, hold);
+
+  run_t runs[2];
+  camera_app_stats_t stats[2];
+  for (int r = 0; r < 2; r++) {
+    memset(&runs[r], 0, sizeof(run_t));
+    runs[r].lit = malloc((photos + 1) * sizeof(uint64_t));
+    runs[r].wasted = malloc((photos + 1) * sizeof(uint64_t));
+    config.ack = r == 1;
+    stats[r] = take_photos(&runs[r], &config, photos, hold, gap);
+  }
+
+  printf("%-18s %8s %8s %8s %8s %10s\n", "", "min", "p50", "p99", "max", "mean");
+  printf("lit (ms)\n");
+  print_distribution("no ACK (before)", runs[0].lit, runs[0].count);
+  print_distribution("ACK", runs[1].lit, runs[1].count);
+  printf("wasted (ms)\n");
+  print_distribution("no ACK (before)", runs[0].wasted, runs[0].count);
+  print_distribution("ACK", runs[1].wasted, runs[1].count);
+
+  printf("\n%-18s %8s %8s %8s %12s\n", "", "photos", "timeouts", "dark", "wasted (s)");
+  printf("  %-16s %8u %8u %8u %12.1f\n", "no ACK (before)",
+      stats[0].photos, stats[0].timeouts, stats[0].dark, stats[0].wasted / 1000.0);
+  printf("  %-16s %8u %8u %8u %12.1f\n", "ACK",
+      stats[1].photos, stats[1].timeouts, stats[1].dark, stats[1].wasted / 1000.0);
+
+  bool ok = true;
+  for (int r = 0; r < 2; r++) {
+    if (stats[r].photos != photos) {
+      printf("FAIL: %u of %u photos finished\n", stats[r].photos, photos);
+      ok = false;
+    }
+  }
+  if (runs[1].missed > 0) {
+    printf("FAIL: %u flashes not ended by the App's ACK\n", runs[1].missed);
+    ok = false;
+  }
+
+  for (int r = 0; r < 2; r++) {
+    free(runs[r].lit);
+    free(runs[r].wasted);
+  }
+  camera_latency_free(&config.latency);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-api.h>
+#include <nova-internal.h>
+
+#include "fake-app.h"
+#include "fake-nova-device.h"
+#include "ui-headless.h"
+
+/**
+ * Command pipelining throughput comparison.
+ *
+ * Runs a simulated App (see fake-app.h) sending a stream of FLASH/OFF
+ * commands to a fake device over a simulated BLE link, in virtual time,
+ * with different protocol settings:
+ *
+ * - stop-and-wait: one command per write, one in flight (NVCodecV2)
+ * - windows of 2, 4 and 8 commands in flight (NOVA_CMD_NEGOTIATE)
+ * - the same, with frames (NOVA_FEATURE_FRAMES)
+ *
+ * and reports commands ACKed per second of simulated time for each.
+ *
+ * Also checks every command was ACKed, and when a window was negotiated,
+ * that no resent command was carried out twice.
+ *
+ * Usage:
+ *
+ *   firmware-pipeline [-c COMMANDS] [-i INTERVAL] [-p PACKETS] [-l LOSS]
+ *                     [-s SEED] [-v]
+ *
+ *   -c COMMANDS  commands to send in each run (default 10000)
+ *   -i INTERVAL  BLE connection interval, ms (default 30)
+ *   -p PACKETS   packets each way per connection event (default 4)
+ *   -l LOSS      notifications lost, per thousand (default 0)
+ *   -s SEED      seed for losses (default 1)
+ *   -v           log everything (only sensible with few commands)
+ *
+ * Exits with status 1 if any check fails.
+ */
+
+/** Resend commands not ACKed within this many connection intervals. */
+#define RESEND_INTERVALS 4
+
+typedef struct run_t
+{
+  const char *name;
+  bool frames;
+  uint8_t window;
+} run_t;
+
+static const run_t runs[] = {
+  { "stop-and-wait",  false, 0 },
+  { "window 2",       false, 2 },
+  { "window 4",       false, 4 },
+  { "window 8",       false, 8 },
+  { "frames",         true,  1 },
+  { "frames+window 4", true, 4 },
+  { "frames+window 8", true, 8 },
+};
+
+int main(int argc, char **argv)
+{
+  uint32_t commands = 10000;
+  fake_app_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.connection_interval = 30;
+  config.packets_per_event = 4;
+  config.seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      commands = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      config.connection_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      config.packets_per_event = (uint8_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      config.loss = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      config.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      ui_headless_set_verbose(true);
+    } else {
+      fprintf(stderr, "Usage: %s [-c COMMANDS] [-i INTERVAL] [-p PACKETS] [-l LOSS] [-s SEED] [-v]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (config.connection_interval < 1 || config.packets_per_event < 1 || config.loss >= 1000) {
+    fprintf(stderr, "Bad link settings\n");
+    return 2;
+  }
+  config.resend_after = RESEND_INTERVALS * config.connection_interval;
+
+  printf("pipeline: %u commands, %ums connection interval, %u packets/event, %.1f%% loss\n\n",
+      commands, config.connection_interval, config.packets_per_event, config.loss / 10.0);
+  printf("%-16s %6s %12s %8s %8s %8s %8s %8s\n",
+      "", "window", "commands/s", "speedup", "writes", "notifs", "resends", "repeats");
+
+  double baseline = 0;
+  bool ok = true;
+
+  for (int r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+    fake_nova_device_t *device = fake_nova_device_init(NULL, 0);
+    basic_clock_init_virtual(&device->clock, 0);
+    fake_nova_device_input(device, NOVA_EVENT_RESET);
+
+    fake_app_t *app = malloc(sizeof(fake_app_t));
+    config.frames = runs[r].frames;
+    config.window = runs[r].window;
+    fake_app_init(app, device, &config);
+    fake_app_start(app, commands);
+
+    while (!fake_app_done(app) && basic_timer_advance_to_next(&device->timers)) {
+      fake_nova_device_idle(device);
+    }
+
+    double rate = fake_app_commands_per_second(app);
+    if (r == 0) {
+      baseline = rate;
+    }
+
+    // FLASH commands carried out more than once (because of resends).
+    uint32_t repeats = device->nova->counters.flash_remote_app - app->stats.flashes;
+
+    printf("%-16s %6u %12.1f %7.1fx %8u %8u %8u %8u\n",
+        runs[r].name, app->window, rate, baseline > 0 ? rate / baseline : 0.0,
+        app->stats.writes, app->stats.notifications, app->stats.resends, repeats);
+
+    if (!fake_app_done(app) || app->stats.acked != commands) {
+      printf("FAIL %s: %u of %u commands ACKed\n", runs[r].name, app->stats.acked, commands);
+      ok = false;
+    }
+    if (app->negotiated && runs[r].window > 0 && repeats > 0) {
+      printf("FAIL %s: %u resent commands carried out again\n", runs[r].name, repeats);
+      ok = false;
+    }
+
+    free(app);
+    fake_nova_device_free(device);
+  }
+
+  return ok ? 0 : 1;
+}
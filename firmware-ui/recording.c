@@ -0,0 +1,264 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See recording.h
+ */
+
+#include "recording.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nova-events.h>
+
+
+// ----------------------------------------------------------------------------
+// Writing
+
+bool recording_open(recording_t *recording, const char *filename)
+{
+  memset(recording, 0, sizeof(recording_t));
+  recording->file = fopen(filename, "wb");
+  if (!recording->file) {
+    return false;
+  }
+  fwrite(RECORDING_MAGIC, 1, RECORDING_MAGIC_SIZE, recording->file);
+  return true;
+}
+
+void recording_write(recording_t *recording, uint8_t kind, uint64_t time, const uint8_t *payload, uint8_t length)
+{
+  uint8_t header[1 + 10 + 1];
+  int size = 0;
+
+  header[size++] = kind;
+  uint64_t delta = time - recording->time;
+  do {
+    header[size++] = (uint8_t)((delta & 0x7F) | (delta >= 0x80 ? 0x80 : 0));
+    delta >>= 7;
+  } while (delta > 0);
+  header[size++] = length;
+
+  fwrite(header, 1, size, recording->file);
+  if (length > 0) {
+    fwrite(payload, 1, length, recording->file);
+  }
+  recording->time = time;
+  recording->records++;
+}
+
+void recording_close(recording_t *recording)
+{
+  if (recording->file) {
+    fclose(recording->file);
+    recording->file = NULL;
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Reading
+
+bool recording_map(recording_reader_t *reader, const char *filename)
+{
+  memset(reader, 0, sizeof(recording_reader_t));
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size < RECORDING_MAGIC_SIZE) {
+    close(fd);
+    errno = 0;
+    return false;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  // Read front to back, once.
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  reader->data = data;
+  reader->size = (size_t)st.st_size;
+  if (memcmp(reader->data, RECORDING_MAGIC, RECORDING_MAGIC_SIZE) != 0) {
+    recording_unmap(reader);
+    errno = 0;
+    return false;
+  }
+  reader->offset = RECORDING_MAGIC_SIZE;
+  return true;
+}
+
+/**
+ * Decode the record at offset, without moving. Returns the offset of the
+ * one after, or 0 at the end (or if corrupt).
+ */
+static size_t decode(recording_reader_t *reader, recording_record_t *record)
+{
+  const uint8_t *data = reader->data;
+  size_t size = reader->size;
+  size_t offset = reader->offset;
+
+  if (offset >= size) {
+    return 0;
+  }
+  record->kind = data[offset++];
+
+  uint64_t delta = 0;
+  for (int shift = 0; ; shift += 7) {
+    if (offset >= size || shift > 63) {
+      reader->corrupt = true;
+      return 0;
+    }
+    uint8_t byte = data[offset++];
+    delta |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  record->time = reader->time + delta;
+
+  if (offset >= size || data[offset] > RECORDING_MAX_PAYLOAD || offset + 1 + data[offset] > size) {
+    reader->corrupt = true;
+    return 0;
+  }
+  record->length = data[offset++];
+  record->payload = data + offset;
+  return offset + record->length;
+}
+
+bool recording_next(recording_reader_t *reader, recording_record_t *record)
+{
+  size_t next = decode(reader, record);
+  if (next == 0) {
+    return false;
+  }
+  reader->offset = next;
+  reader->time = record->time;
+  reader->records++;
+  return true;
+}
+
+bool recording_peek(recording_reader_t *reader, recording_record_t *record)
+{
+  return decode(reader, record) != 0;
+}
+
+void recording_unmap(recording_reader_t *reader)
+{
+  if (reader->data) {
+    munmap((void*)reader->data, reader->size);
+    reader->data = NULL;
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Formatting
+
+static const char *input_names[] = {
+  "RESET",
+  "BUTTON_PRESSDOWN",
+  "BUTTON_RELEASE",
+  "CONNECT_APP",
+  "DISCONNECT_APP",
+  "CONNECT_HID",
+  "DISCONNECT_HID",
+  "TIMER_COMPLETE",
+  "POWER_FAILING",
+};
+
+typedef char check_input_names[sizeof(input_names) / sizeof(input_names[0]) == NOVA_EVENT_APP_COMMAND ? 1 : -1];
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static void format_bytes(const recording_record_t *record, char *out, size_t size)
+{
+  size_t used = strlen(out);
+  snprintf(out + used, size - used, " [");
+  for (uint8_t i = 0; i < record->length; i++) {
+    used = strlen(out);
+    snprintf(out + used, size - used, i == 0 ? "%02X" : " %02X", record->payload[i]);
+  }
+  used = strlen(out);
+  snprintf(out + used, size - used, "]");
+}
+
+static void format_counters(const recording_record_t *record, char *out, size_t size)
+{
+  size_t used = strlen(out);
+  snprintf(out + used, size - used, " {");
+  for (uint8_t i = 0; i + 4 <= record->length; i += 4) {
+    used = strlen(out);
+    snprintf(out + used, size - used, i == 0 ? "%u" : ", %u", get_u32(record->payload + i));
+  }
+  used = strlen(out);
+  snprintf(out + used, size - used, "}");
+}
+
+void recording_format(const recording_record_t *record, char *out, size_t size)
+{
+  const uint8_t *p = record->payload;
+  uint8_t len = record->length;
+
+  if (record->kind < sizeof(input_names) / sizeof(input_names[0])) {
+    snprintf(out, size, "%s", input_names[record->kind]);
+    return;
+  }
+
+  switch (record->kind) {
+    case RECORDING_APP_WRITE:
+      snprintf(out, size, "APP_WRITE");
+      format_bytes(record, out, size);
+      break;
+    case RECORDING_LOAD_COUNTERS:
+      snprintf(out, size, "LOAD_COUNTERS");
+      format_counters(record, out, size);
+      break;
+    case RECORDING_LOAD_FLASH_DEFAULTS:
+      snprintf(out, size, "LOAD_FLASH_DEFAULTS");
+      format_bytes(record, out, size);
+      break;
+    case RECORDING_SET_LIGHTS:
+      snprintf(out, size, "SET_LIGHTS warm=%u cool=%u", len > 0 ? p[0] : 0, len > 1 ? p[1] : 0);
+      break;
+    case RECORDING_SET_STATUS_INDICATOR:
+      snprintf(out, size, "SET_STATUS_INDICATOR lit=%u", len > 0 ? p[0] : 0);
+      break;
+    case RECORDING_NOTIFY_APP:
+      snprintf(out, size, "NOTIFY_APP");
+      format_bytes(record, out, size);
+      break;
+    case RECORDING_SEND_HID_KEY:
+      snprintf(out, size, "SEND_HID_KEY code=0x%02x", len > 0 ? p[0] : 0);
+      break;
+    case RECORDING_TIMER_SCHEDULE:
+      snprintf(out, size, "TIMER_SCHEDULE timeout=%u", len > 1 ? (p[0] << 8) | p[1] : 0);
+      break;
+    case RECORDING_TIMER_CLEAR:
+      snprintf(out, size, "TIMER_CLEAR");
+      break;
+    case RECORDING_SAVE_COUNTERS:
+      snprintf(out, size, "SAVE_COUNTERS");
+      format_counters(record, out, size);
+      break;
+    default:
+      snprintf(out, size, "UNKNOWN(0x%02x)", record->kind);
+      format_bytes(record, out, size);
+  }
+}
@@ -0,0 +1,176 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Binary recordings of everything that goes in and out of nova.c on a
+ * fake device, so a run can be replayed exactly (see replay-main.c).
+ *
+ * A fake device records (see fake_nova_device_record()):
+ *
+ * - inputs: each nova_on_????() call (as a nova_event_type, see
+ *   nova-events.h) and each write from the App (the bytes on the wire).
+ * - values read: what nova_load_counters() and nova_load_flash_defaults()
+ *   handed back, so replay doesn't need the device's flash.
+ * - outputs: each nova-device.h call the firmware makes, with its
+ *   arguments (lights, status indicator, notifications to the App as
+ *   bytes on the wire, HID keys, hardware timer, counters saved).
+ *
+ * File format: the 8 byte magic "NOVAREC1", then records until the end of
+ * the file. Each record is:
+ *
+ *   kind       1 byte, recording_kind
+ *   time       unsigned LEB128 varint: device clock milliseconds since the
+ *              previous record (since 0 for the first)
+ *   length     1 byte, of payload
+ *   payload    length bytes, depending on kind (multi-byte values are
+ *              big-endian, as nova-codec.h)
+ *
+ * Most records are 3 to 6 bytes.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RECORDING_MAGIC "NOVAREC1"
+#define RECORDING_MAGIC_SIZE 8
+
+/** Largest payload of any record. */
+#define RECORDING_MAX_PAYLOAD 32
+
+typedef enum
+{
+  // Inputs 0x00-0x0F are nova_event_type values (without payload),
+  // e.g. NOVA_EVENT_BUTTON_PRESSDOWN.
+
+  /** Input: App wrote to device. Payload: bytes on the wire. */
+  RECORDING_APP_WRITE = 0x10,
+
+  /** Read: payload as nova_codec_encode_counters(). */
+  RECORDING_LOAD_COUNTERS = 0x40,
+
+  /** Read: payload as nova_codec_encode_flash_defaults(). */
+  RECORDING_LOAD_FLASH_DEFAULTS = 0x41,
+
+  /** Output: payload warm, cool. */
+  RECORDING_SET_LIGHTS = 0x80,
+
+  /** Output: payload lit. */
+  RECORDING_SET_STATUS_INDICATOR = 0x81,
+
+  /** Output: notification to App. Payload: bytes on the wire. */
+  RECORDING_NOTIFY_APP = 0x82,
+
+  /** Output: payload key code. */
+  RECORDING_SEND_HID_KEY = 0x83,
+
+  /** Output: payload timeout (2 bytes). */
+  RECORDING_TIMER_SCHEDULE = 0x84,
+
+  /** Output: no payload. */
+  RECORDING_TIMER_CLEAR = 0x85,
+
+  /** Output: payload as nova_codec_encode_counters(). */
+  RECORDING_SAVE_COUNTERS = 0x86
+
+} recording_kind;
+
+/** Is kind an input (a nova_event_type, or RECORDING_APP_WRITE)? */
+#define RECORDING_IS_INPUT(kind) ((kind) <= RECORDING_APP_WRITE)
+
+/** Is kind an output, compared on replay? */
+#define RECORDING_IS_OUTPUT(kind) (((kind) & 0x80) != 0)
+
+typedef struct recording_record_t
+{
+  uint8_t kind;
+
+  /** Device clock, milliseconds. */
+  uint64_t time;
+
+  uint8_t length;
+  const uint8_t *payload;
+
+} recording_record_t;
+
+
+// ----------------------------------------------------------------------------
+// Writing
+
+typedef struct recording_t
+{
+  FILE *file;
+
+  /** Time of last record written. */
+  uint64_t time;
+
+  /** Records written. */
+  uint64_t records;
+
+} recording_t;
+
+/**
+ * Create file and write the header. Returns false (with errno set) if
+ * the file can't be created.
+ */
+bool recording_open(recording_t *recording, const char *filename);
+
+/**
+ * Append a record. Records must be written in time order.
+ */
+void recording_write(recording_t *recording, uint8_t kind, uint64_t time, const uint8_t *payload, uint8_t length);
+
+/**
+ * Flush and close the file.
+ */
+void recording_close(recording_t *recording);
+
+
+// ----------------------------------------------------------------------------
+// Reading
+
+typedef struct recording_reader_t
+{
+  /** Whole file, memory mapped. */
+  const uint8_t *data;
+  size_t size;
+
+  /** Offset of next record. */
+  size_t offset;
+
+  /** Time of last record read. */
+  uint64_t time;
+
+  /** Records read. */
+  uint64_t records;
+
+  /** Set if a truncated or malformed record was found. */
+  bool corrupt;
+
+} recording_reader_t;
+
+/**
+ * Memory map a recording for reading. Returns false (with errno set) if
+ * it can't be opened, or (with errno 0) if it's not a recording.
+ */
+bool recording_map(recording_reader_t *reader, const char *filename);
+
+/**
+ * Read the next record, or return false at the end of the recording (or
+ * if it's corrupt). record->payload points into the mapped file.
+ */
+bool recording_next(recording_reader_t *reader, recording_record_t *record);
+
+/**
+ * Look at the next record without moving past it.
+ */
+bool recording_peek(recording_reader_t *reader, recording_record_t *record);
+
+void recording_unmap(recording_reader_t *reader);
+
+/**
+ * Describe a record as text, e.g. "SET_LIGHTS warm=255 cool=127".
+ */
+void recording_format(const recording_record_t *record, char *out, size_t size);
@@ -0,0 +1,329 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nova-api.h>
+#include <nova-codec.h>
+#include <nova-device.h>
+#include <nova-events.h>
+#include <nova-internal.h>
+
+#include "recording.h"
+
+/**
+ * Recording replayer.
+ *
+ * Re-runs a recording (see recording.h) against nova.c as fast as
+ * possible, and reports every difference between what the firmware does
+ * now and what it did when recorded: e.g. to check a change to nova.c
+ * doesn't change behavior, or to step through a run that went wrong.
+ *
+ * Instead of a fake device, this has its own minimal implementation of
+ * nova-device.h, driven by the recording: inputs are passed to nova.c at
+ * their recorded times, values it reads (counters and flash defaults)
+ * come from the recording, and each call it makes must match the next
+ * recorded output exactly (arguments and time).
+ *
+ * Usage:
+ *
+ *   firmware-replay [-d] [-m MAX] RECORDING
+ *
+ *   -d      dump the recording as text, without replaying
+ *   -m MAX  print at most MAX differences (default 10)
+ *
+ * Exits with status 1 if there are any differences.
+ */
+
+typedef struct replay_t
+{
+  recording_reader_t reader;
+  nova_t nova;
+
+  /** Time of input being replayed. */
+  uint64_t now;
+
+  uint64_t inputs;
+  uint64_t outputs;
+  uint64_t differences;
+  uint64_t max_differences;
+
+} replay_t;
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * Report the recorded output expected, and what nova.c actually did
+ * (either may be NULL if missing).
+ */
+static void difference(replay_t *replay, const recording_record_t *expected, const recording_record_t *actual)
+{
+  char expected_text[256] = "nothing";
+  char actual_text[256] = "nothing";
+
+  replay->differences++;
+  if (replay->differences > replay->max_differences) {
+    return;
+  }
+  if (expected) {
+    recording_format(expected, expected_text, sizeof(expected_text));
+  }
+  if (actual) {
+    recording_format(actual, actual_text, sizeof(actual_text));
+  }
+  printf("record %llu at %llums: expected %s, got %s\n",
+      (unsigned long long)replay->reader.records, (unsigned long long)replay->now,
+      expected_text, actual_text);
+}
+
+/**
+ * Check a call nova.c made matches the next recorded output.
+ */
+static void output(nova_t *nova, uint8_t kind, const uint8_t *payload, uint8_t length)
+{
+  replay_t *replay = (replay_t*)nova_data(nova);
+  recording_record_t actual = { kind, replay->now, length, payload };
+  recording_record_t expected;
+
+  replay->outputs++;
+  if (!recording_peek(&replay->reader, &expected) || !RECORDING_IS_OUTPUT(expected.kind)) {
+    // Extra call: leave the recording where it is.
+    difference(replay, NULL, &actual);
+    return;
+  }
+
+  recording_next(&replay->reader, &expected);
+  if (expected.kind != kind || expected.length != length || expected.time != replay->now
+      || memcmp(expected.payload, payload, length) != 0) {
+    difference(replay, &expected, &actual);
+  }
+}
+
+/**
+ * Get a value nova.c reads from the device, as recorded. Returns NULL if
+ * the recording doesn't have it next.
+ */
+static const uint8_t *read_value(nova_t *nova, uint8_t kind, uint8_t length)
+{
+  replay_t *replay = (replay_t*)nova_data(nova);
+  recording_record_t expected;
+  if (recording_peek(&replay->reader, &expected) && expected.kind == kind && expected.length == length) {
+    recording_next(&replay->reader, &expected);
+    return expected.payload;
+  }
+
+  recording_record_t actual = { kind, replay->now, 0, NULL };
+  difference(replay, recording_peek(&replay->reader, &expected) ? &expected : NULL, &actual);
+  return NULL;
+}
+
+
+// ----------------------------------------------------------------------------
+// nova-device.h
+
+void nova_load_counters(nova_t *nova, counters_t *counters)
+{
+  const uint8_t *buf = read_value(nova, RECORDING_LOAD_COUNTERS, NOVA_CODEC_COUNTERS_SIZE);
+  memset(counters, 0, sizeof(counters_t));
+  if (buf) {
+    nova_codec_decode_counters(buf, NOVA_CODEC_COUNTERS_SIZE, counters);
+  }
+}
+
+void nova_save_counters(nova_t *nova, counters_t *counters)
+{
+  uint8_t buf[NOVA_CODEC_COUNTERS_SIZE];
+  nova_codec_encode_counters(counters, buf);
+  output(nova, RECORDING_SAVE_COUNTERS, buf, sizeof(buf));
+}
+
+void nova_load_flash_defaults(nova_t *nova, flash_defaults_t *flash_defaults)
+{
+  const uint8_t *buf = read_value(nova, RECORDING_LOAD_FLASH_DEFAULTS, NOVA_CODEC_FLASH_DEFAULTS_SIZE);
+  if (buf) {
+    nova_codec_decode_flash_defaults(buf, NOVA_CODEC_FLASH_DEFAULTS_SIZE, flash_defaults);
+  }
+}
+
+void nova_send_app_command(nova_t *nova, app_command_t *cmd)
+{
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  uint16_t len = nova_codec_encode_command(cmd, buf);
+  output(nova, RECORDING_NOTIFY_APP, buf, (uint8_t)len);
+}
+
+void nova_send_app_commands(nova_t *nova, app_command_t *cmds, uint8_t count)
+{
+  // As few frames as possible, as fake-nova-device.c.
+  uint8_t buf[NOVA_CODEC_MAX_FRAME_SIZE];
+  uint16_t len;
+  for (uint8_t sent = 0; sent < count; ) {
+    sent += nova_codec_encode_frame(cmds + sent, count - sent, buf, &len);
+    output(nova, RECORDING_NOTIFY_APP, buf, (uint8_t)len);
+  }
+}
+
+void nova_send_hid_key(nova_t *nova, char key_code)
+{
+  uint8_t code = (uint8_t)key_code;
+  output(nova, RECORDING_SEND_HID_KEY, &code, 1);
+}
+
+void nova_set_status_indicator(nova_t *nova, bool lit)
+{
+  uint8_t payload = lit;
+  output(nova, RECORDING_SET_STATUS_INDICATOR, &payload, 1);
+}
+
+void nova_set_lights(nova_t *nova, uint8_t warm_pwm, uint8_t cool_pwm)
+{
+  uint8_t payload[2] = { warm_pwm, cool_pwm };
+  output(nova, RECORDING_SET_LIGHTS, payload, 2);
+}
+
+timestamp_t nova_time_now(nova_t *nova)
+{
+  replay_t *replay = (replay_t*)nova_data(nova);
+  return (timestamp_t)replay->now;
+}
+
+uint32_t nova_trace_timestamp(nova_t *nova)
+{
+  return 0;
+}
+
+void nova_timer_schedule(nova_t *nova, milliseconds_t timeout)
+{
+  uint8_t payload[2] = { timeout >> 8, timeout & 0xFF };
+  output(nova, RECORDING_TIMER_SCHEDULE, payload, 2);
+}
+
+void nova_timer_clear(nova_t *nova)
+{
+  output(nova, RECORDING_TIMER_CLEAR, NULL, 0);
+}
+
+
+// ----------------------------------------------------------------------------
+// Replay
+
+/**
+ * Pass a recorded App write to nova.c, as fake_nova_device_app_write().
+ */
+static void app_write(nova_t *nova, const uint8_t *buf, uint16_t len)
+{
+  app_command_t cmds[NOVA_APP_FRAME_MAX_COMMANDS];
+  bool framed = nova_app_features(nova) & NOVA_FEATURE_FRAMES;
+  int count = -1;
+
+  if (len <= NOVA_CODEC_MAX_FRAME_SIZE) {
+    count = framed
+        ? nova_codec_decode_frame(buf, len, cmds, NOVA_APP_FRAME_MAX_COMMANDS)
+        : nova_codec_decode_command(buf, len, cmds) ? 1 : -1;
+  }
+  if (count < 0) {
+    return;
+  }
+  if (framed) {
+    nova_on_app_commands(nova, cmds, (uint8_t)count);
+  } else {
+    nova_on_app_command(nova, cmds);
+  }
+}
+
+static void run(replay_t *replay)
+{
+  recording_record_t record;
+  while (recording_next(&replay->reader, &record)) {
+    replay->now = record.time;
+
+    if (record.kind == RECORDING_APP_WRITE) {
+      replay->inputs++;
+      app_write(&replay->nova, record.payload, record.length);
+    }
+    else if (RECORDING_IS_INPUT(record.kind) && record.kind < NOVA_EVENT_APP_COMMAND) {
+      replay->inputs++;
+      nova_event_t event;
+      event.type = record.kind;
+      nova_events_handle(&replay->nova, &event);
+    }
+    else {
+      // Recorded, but nova.c didn't do it this time.
+      difference(replay, &record, NULL);
+    }
+  }
+}
+
+static void dump(replay_t *replay)
+{
+  recording_record_t record;
+  char text[256];
+  while (recording_next(&replay->reader, &record)) {
+    recording_format(&record, text, sizeof(text));
+    printf("%10llu %s%s\n", (unsigned long long)record.time,
+        RECORDING_IS_INPUT(record.kind) ? "-> " : "   ", text);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  bool dump_only = false;
+  uint64_t max_differences = 10;
+  int arg = 1;
+
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "-d") == 0) {
+      dump_only = true;
+    } else if (strcmp(argv[arg], "-m") == 0 && arg + 1 < argc) {
+      max_differences = strtoull(argv[++arg], NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if (arg != argc - 1) {
+    fprintf(stderr, "Usage: %s [-d] [-m MAX] RECORDING\n", argv[0]);
+    return 2;
+  }
+  const char *filename = argv[arg];
+
+  replay_t *replay = calloc(1, sizeof(replay_t));
+  replay->max_differences = max_differences;
+  replay->nova.data = replay;
+
+  if (!recording_map(&replay->reader, filename)) {
+    fprintf(stderr, "%s: %s\n", filename, errno ? strerror(errno) : "not a recording");
+    return 1;
+  }
+
+  if (dump_only) {
+    dump(replay);
+  } else {
+    double start = seconds_now();
+    run(replay);
+    double elapsed = seconds_now() - start;
+
+    printf("replay: %llu records (%llu inputs, %llu outputs) in %.3fs (%.0f records/sec)\n",
+        (unsigned long long)replay->reader.records, (unsigned long long)replay->inputs,
+        (unsigned long long)replay->outputs, elapsed,
+        elapsed > 0 ? replay->reader.records / elapsed : 0.0);
+    printf("differences: %llu\n", (unsigned long long)replay->differences);
+  }
+
+  bool corrupt = replay->reader.corrupt;
+  if (corrupt) {
+    printf("FAIL: recording is corrupt after %llu records\n", (unsigned long long)replay->reader.records);
+  }
+  bool ok = !corrupt && replay->differences == 0;
+
+  recording_unmap(&replay->reader);
+  free(replay);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scenario.h"
+#include "ui-headless.h"
+
+/**
+ * Headless scenario runner.
+ *
+ * Runs scripted scenarios (see scenario.h) against the fake Nova device,
+ * using virtual time so they execute as fast as possible. Intended for
+ * regression testing in CI.
+ *
+ * Usage:
+ *
+ *   firmware-scenario [-v] [-n REPEAT] FILE...
+ *
+ *   -v          print device log while running
+ *   -n REPEAT   run each scenario REPEAT times (to measure throughput)
+ *
+ * Exits with status 1 if any scenario fails.
+ */
+
+static double seconds_now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  int repeat = 1;
+  int first_file = 1;
+
+  for (; first_file < argc && argv[first_file][0] == '-'; first_file++) {
+    if (strcmp(argv[first_file], "-v") == 0) {
+      ui_headless_set_verbose(true);
+    } else if (strcmp(argv[first_file], "-n") == 0 && first_file + 1 < argc) {
+      repeat = atoi(argv[++first_file]);
+    } else {
+      break;
+    }
+  }
+
+  if (first_file >= argc || repeat < 1) {
+    fprintf(stderr, "Usage: %s [-v] [-n REPEAT] FILE...\n", argv[0]);
+    return 2;
+  }
+
+  int runs = 0;
+  int failures = 0;
+  char error[512];
+  double start = seconds_now();
+
+  for (int i = first_file; i < argc; i++) {
+    bool ok = true;
+    for (int n = 0; n < repeat && ok; n++) {
+      ok = scenario_run_file(argv[i], error, sizeof(error));
+      runs++;
+    }
+    if (ok) {
+      printf("PASS %s\n", argv[i]);
+    } else {
+      printf("FAIL %s\n", error);
+      failures++;
+    }
+  }
+
+  double elapsed = seconds_now() - start;
+  printf("%d scenarios, %d failed, %d runs in %.3fs (%.0f runs/sec)\n",
+      argc - first_file, failures, runs, elapsed, elapsed > 0 ? runs / elapsed : 0.0);
+
+  return failures ? 1 : 0;
+}
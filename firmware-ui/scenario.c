@@ -0,0 +1,509 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See scenario.h for the scenario file format.
+ */
+
+#include "scenario.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-api.h>
+#include <nova-codec.h>
+#include <nova-internal.h>
+#include <nova-timers.h>
+
+#include "ui.h"
+
+#define MAX_WORDS 24
+
+// Stop 'wait timers' from running forever if timers keep re-arming.
+#define MAX_WAIT_TIMERS 10000
+
+/**
+ * Maps counter names used in scenarios to fields of counters_t.
+ */
+static const struct
+{
+  const char *name;
+  size_t offset;
+} counter_names[] = {
+  { "boot",                      offsetof(counters_t, boot) },
+  { "app_connect",               offsetof(counters_t, app_connect) },
+  { "hid_connect",               offsetof(counters_t, hid_connect) },
+  { "flash_button_app",          offsetof(counters_t, flash_button_app) },
+  { "flash_button_native",       offsetof(counters_t, flash_button_native) },
+  { "flash_button_disconnected", offsetof(counters_t, flash_button_disconnected) },
+  { "flash_remote_app",          offsetof(counters_t, flash_remote_app) },
+};
+
+
+// ----------------------------------------------------------------------------
+// Observing device output
+
+static void on_app_command_sent(fake_nova_device_t *device, app_command_t *cmd, void *data)
+{
+  scenario_t *scenario = (scenario_t*)data;
+  if (cmd->header.type == NOVA_CMD_TRIGGER) {
+    scenario->last_trigger_id = cmd->header.id;
+  }
+  if (scenario->sent_count < SCENARIO_MAX_SENT) {
+    scenario->sent[scenario->sent_count++] = *cmd;
+  }
+}
+
+static void on_app_notified(fake_nova_device_t *device, const uint8_t *buf, uint16_t len, void *data)
+{
+  scenario_t *scenario = (scenario_t*)data;
+  if (scenario->notified_count < SCENARIO_MAX_SENT) {
+    memcpy(scenario->notified[scenario->notified_count].bytes, buf, len);
+    scenario->notified[scenario->notified_count].len = len;
+    scenario->notified_count++;
+  }
+}
+
+static void on_hid_key_sent(fake_nova_device_t *device, char key_code, void *data)
+{
+  scenario_t *scenario = (scenario_t*)data;
+  if (scenario->hid_key_count < SCENARIO_MAX_SENT) {
+    scenario->hid_keys[scenario->hid_key_count++] = key_code;
+  }
+}
+
+static app_command_t pop_sent(scenario_t *scenario)
+{
+  app_command_t cmd = scenario->sent[0];
+  scenario->sent_count--;
+  memmove(&scenario->sent[0], &scenario->sent[1], sizeof(app_command_t) * scenario->sent_count);
+  return cmd;
+}
+
+static char pop_hid_key(scenario_t *scenario)
+{
+  char key_code = scenario->hid_keys[0];
+  scenario->hid_key_count--;
+  memmove(&scenario->hid_keys[0], &scenario->hid_keys[1], scenario->hid_key_count);
+  return key_code;
+}
+
+
+// ----------------------------------------------------------------------------
+// Helpers
+
+static bool fail(scenario_t *scenario, const char *msg, ...)
+{
+  va_list vargs;
+  va_start(vargs, msg);
+  vsnprintf(scenario->error, sizeof(scenario->error), msg, vargs);
+  va_end(vargs);
+  return false;
+}
+
+static bool parse_number(const char *word, long *result)
+{
+  char *end;
+  *result = strtol(word, &end, 0);
+  return *word && !*end;
+}
+
+static bool is(const char *word, const char *expected)
+{
+  return word && strcmp(word, expected) == 0;
+}
+
+static void send_app_command(scenario_t *scenario, uint8_t type, app_command_t *cmd)
+{
+  cmd->header.type = type;
+  cmd->header.__pad = 0;
+  if (type != NOVA_CMD_ACK) {
+    cmd->header.id = ++scenario->next_command_id;
+  }
+  uint8_t buf[NOVA_CODEC_MAX_FRAME_SIZE];
+  uint16_t len;
+  if (nova_app_features(scenario->device->nova) & NOVA_FEATURE_FRAMES) {
+    nova_codec_encode_frame(cmd, 1, buf, &len);
+  } else {
+    len = nova_codec_encode_command(cmd, buf);
+  }
+  fake_nova_device_app_write(scenario->device, buf, len);
+}
+
+/**
+ * Parse words as hex bytes (e.g. "02 00 00 0A"). Returns number of
+ * bytes, or -1 if any word isn't a byte or there are too many.
+ */
+static int parse_bytes(char **words, int count, uint8_t *buf, int max)
+{
+  if (count > max) {
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    char *end;
+    unsigned long value = strtoul(words[i], &end, 16);
+    if (!*words[i] || *end || value > 0xFF) {
+      return -1;
+    }
+    buf[i] = (uint8_t)value;
+  }
+  return count;
+}
+
+static nova_timer_t *timer_named(scenario_t *scenario, const char *name)
+{
+  nova_t *nova = scenario->device->nova;
+  if (is(name, "flash")) {
+    return &nova->flash_timer;
+  }
+  if (is(name, "counters")) {
+    return &nova->counters_timer;
+  }
+  if (is(name, "flash_at")) {
+    return &nova->flash_at_timer;
+  }
+  return NULL;
+}
+
+static uint32_t *counter_named(scenario_t *scenario, const char *name)
+{
+  for (int i = 0; i < sizeof(counter_names) / sizeof(counter_names[0]); i++) {
+    if (is(name, counter_names[i].name)) {
+      return (uint32_t*)((char*)&scenario->device->nova->counters + counter_names[i].offset);
+    }
+  }
+  return NULL;
+}
+
+
+// ----------------------------------------------------------------------------
+// Steps
+
+static bool step_event(scenario_t *scenario, char **words, int count)
+{
+  fake_nova_device_t *device = scenario->device;
+  app_command_t cmd;
+  uint8_t buf[MAX_WORDS];
+  int len;
+  long a, b, c, d;
+
+  if (is(words[0], "reset") && count == 1) {
+    fake_nova_device_input(device, NOVA_EVENT_RESET);
+  }
+  else if (is(words[0], "power") && count == 2 && (is(words[1], "cut") || is(words[1], "fail"))) {
+    fake_nova_device_power_cut(device, is(words[1], "fail"));
+  }
+  else if (is(words[0], "connect") && count == 2 && is(words[1], "app")) {
+    fake_nova_device_input(device, NOVA_EVENT_CONNECT_APP);
+  }
+  else if (is(words[0], "connect") && count == 2 && is(words[1], "hid")) {
+    fake_nova_device_input(device, NOVA_EVENT_CONNECT_HID);
+  }
+  else if (is(words[0], "disconnect") && count == 2 && is(words[1], "app")) {
+    fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_APP);
+  }
+  else if (is(words[0], "disconnect") && count == 2 && is(words[1], "hid")) {
+    fake_nova_device_input(device, NOVA_EVENT_DISCONNECT_HID);
+  }
+  else if (is(words[0], "press") && count == 1) {
+    fake_nova_device_input(device, NOVA_EVENT_BUTTON_PRESSDOWN);
+  }
+  else if (is(words[0], "release") && count == 1) {
+    fake_nova_device_input(device, NOVA_EVENT_BUTTON_RELEASE);
+  }
+  else if (is(words[0], "ping") && count == 1) {
+    send_app_command(scenario, NOVA_CMD_PING, &cmd);
+  }
+  else if (is(words[0], "off") && count == 1) {
+    send_app_command(scenario, NOVA_CMD_OFF, &cmd);
+  }
+  else if (is(words[0], "flash") && count == 4
+      && parse_number(words[1], &a) && parse_number(words[2], &b) && parse_number(words[3], &c)) {
+    cmd.body.flash_settings.warm = (uint8_t)a;
+    cmd.body.flash_settings.cool = (uint8_t)b;
+    cmd.body.flash_settings.timeout = (milliseconds_t)c;
+    send_app_command(scenario, NOVA_CMD_FLASH, &cmd);
+  }
+  else if (is(words[0], "flash") && count == 6 && is(words[1], "at") && parse_number(words[2], &d)
+      && parse_number(words[3], &a) && parse_number(words[4], &b) && parse_number(words[5], &c)) {
+    cmd.body.flash_at.at = (timestamp_t)d;
+    cmd.body.flash_at.warm = (uint8_t)a;
+    cmd.body.flash_at.cool = (uint8_t)b;
+    cmd.body.flash_at.timeout = (milliseconds_t)c;
+    send_app_command(scenario, NOVA_CMD_FLASH_AT, &cmd);
+  }
+  else if (is(words[0], "sync") && count == 1) {
+    cmd.body.sync.time = 0;
+    send_app_command(scenario, NOVA_CMD_SYNC, &cmd);
+  }
+  else if (is(words[0], "ack") && count == 2 && is(words[1], "trigger")) {
+    cmd.header.id = scenario->last_trigger_id;
+    send_app_command(scenario, NOVA_CMD_ACK, &cmd);
+  }
+  else if (is(words[0], "ack") && count == 2 && parse_number(words[1], &a)) {
+    cmd.header.id = (cmd_id_t)a;
+    send_app_command(scenario, NOVA_CMD_ACK, &cmd);
+  }
+  else if (is(words[0], "negotiate") && (count == 2 || (count == 3 && parse_number(words[2], &a)))
+      && (is(words[1], "frames") || is(words[1], "none"))) {
+    cmd.body.negotiate.features = is(words[1], "frames") ? NOVA_FEATURE_FRAMES : 0;
+    cmd.body.negotiate.window = count == 3 ? (uint8_t)a : 1;
+    send_app_command(scenario, NOVA_CMD_NEGOTIATE, &cmd);
+  }
+  else if (is(words[0], "store") && count == 8 && is(words[1], "defaults")) {
+    long values[6];
+    for (int i = 0; i < 6; i++) {
+      if (!parse_number(words[i + 2], &values[i])) {
+        return fail(scenario, "bad number: %s", words[i + 2]);
+      }
+    }
+    flash_defaults_t defaults;
+    defaults.regular.warm = (uint8_t)values[0];
+    defaults.regular.cool = (uint8_t)values[1];
+    defaults.regular.timeout = (milliseconds_t)values[2];
+    defaults.preflash.warm = (uint8_t)values[3];
+    defaults.preflash.cool = (uint8_t)values[4];
+    defaults.preflash.timeout = (milliseconds_t)values[5];
+    fake_nova_device_store_flash_defaults(device, &defaults);
+  }
+  else if (is(words[0], "write") && count > 1
+      && (len = parse_bytes(words + 1, count - 1, buf, sizeof(buf))) > 0) {
+    fake_nova_device_app_write(device, buf, (uint16_t)len);
+  }
+  else if (is(words[0], "wait") && count == 2 && is(words[1], "timers")) {
+    for (int i = 0; basic_timer_advance_to_next(&device->timers); i++) {
+      if (i == MAX_WAIT_TIMERS) {
+        return fail(scenario, "timers still active after %d expiries", MAX_WAIT_TIMERS);
+      }
+    }
+  }
+  else if (is(words[0], "wait") && count == 2 && parse_number(words[1], &a) && a >= 0) {
+    basic_timer_advance(&device->timers, (uint64_t)a);
+  }
+  else {
+    return fail(scenario, "unknown step");
+  }
+
+  fake_nova_device_idle(device);
+  return true;
+}
+
+static bool step_expect(scenario_t *scenario, char **words, int count)
+{
+  fake_nova_device_t *device = scenario->device;
+  nova_t *nova = device->nova;
+  long a, b;
+
+  if (is(words[1], "lights") && count == 4 && parse_number(words[2], &a) && parse_number(words[3], &b)) {
+    if (device->lights_warm_pwm != a || device->lights_cool_pwm != b) {
+      return fail(scenario, "expected lights %ld %ld, got %u %u",
+          a, b, device->lights_warm_pwm, device->lights_cool_pwm);
+    }
+  }
+  else if (is(words[1], "status") && count == 3 && (is(words[2], "on") || is(words[2], "off"))) {
+    if (device->connected_lit != is(words[2], "on")) {
+      return fail(scenario, "expected status %s", words[2]);
+    }
+  }
+  else if (is(words[1], "timer") && count == 4 && timer_named(scenario, words[2])) {
+    nova_timer_t *timer = timer_named(scenario, words[2]);
+    if (is(words[3], "off")) {
+      if (nova_timer_is_armed(timer)) {
+        return fail(scenario, "expected %s timer off, got %ums",
+            words[2], nova_timer_remaining(nova, timer));
+      }
+    } else if (parse_number(words[3], &a)) {
+      if (!nova_timer_is_armed(timer)) {
+        return fail(scenario, "expected %s timer %ldms, got off", words[2], a);
+      }
+      if (nova_timer_remaining(nova, timer) != a) {
+        return fail(scenario, "expected %s timer %ldms, got %ums",
+            words[2], a, nova_timer_remaining(nova, timer));
+      }
+    } else {
+      return fail(scenario, "unknown step");
+    }
+  }
+  else if (is(words[1], "counter") && count == 4 && counter_named(scenario, words[2])
+      && parse_number(words[3], &a)) {
+    uint32_t value = *counter_named(scenario, words[2]);
+    if (value != a) {
+      return fail(scenario, "expected counter %s %ld, got %u", words[2], a, value);
+    }
+  }
+  else if (is(words[1], "unsaved") && count == 3 && parse_number(words[2], &a)) {
+    if (fake_nova_device_counters_unsaved(device) != a) {
+      return fail(scenario, "expected %ld unsaved, got %u", a, fake_nova_device_counters_unsaved(device));
+    }
+  }
+  else if (is(words[1], "saves") && count == 3 && parse_number(words[2], &a)) {
+    if (device->counters_saves != a) {
+      return fail(scenario, "expected %ld saves, got %u", a, device->counters_saves);
+    }
+  }
+  else if (is(words[1], "sent") && count == 3 && is(words[2], "none")) {
+    if (scenario->sent_count > 0) {
+      return fail(scenario, "expected nothing sent, got command type %u", scenario->sent[0].header.type);
+    }
+  }
+  else if (is(words[1], "sent") && count == 4 && is(words[2], "ack") && parse_number(words[3], &a)) {
+    if (scenario->sent_count == 0) {
+      return fail(scenario, "expected ACK %ld, nothing sent", a);
+    }
+    app_command_t cmd = pop_sent(scenario);
+    if (cmd.header.type != NOVA_CMD_ACK || cmd.header.id != a) {
+      return fail(scenario, "expected ACK %ld, got type %u id %u", a, cmd.header.type, cmd.header.id);
+    }
+  }
+  else if (is(words[1], "sent") && count == 4 && is(words[2], "trigger")
+      && (is(words[3], "pressed") || is(words[3], "released"))) {
+    if (scenario->sent_count == 0) {
+      return fail(scenario, "expected TRIGGER, nothing sent");
+    }
+    app_command_t cmd = pop_sent(scenario);
+    if (cmd.header.type != NOVA_CMD_TRIGGER) {
+      return fail(scenario, "expected TRIGGER, got type %u", cmd.header.type);
+    }
+    if (cmd.body.trigger.is_pressed != is(words[3], "pressed")) {
+      return fail(scenario, "expected TRIGGER %s", words[3]);
+    }
+  }
+  else if (is(words[1], "sent") && count > 3 && is(words[2], "bytes")) {
+    uint8_t expected[NOVA_CODEC_MAX_COMMAND_SIZE];
+    uint8_t actual[NOVA_CODEC_MAX_COMMAND_SIZE];
+    int expected_len = parse_bytes(words + 3, count - 3, expected, sizeof(expected));
+    if (expected_len < 0) {
+      return fail(scenario, "unknown assertion");
+    }
+    if (scenario->sent_count == 0) {
+      return fail(scenario, "expected bytes sent, nothing sent");
+    }
+    app_command_t cmd = pop_sent(scenario);
+    uint16_t actual_len = nova_codec_encode_command(&cmd, actual);
+    if (actual_len != expected_len || memcmp(actual, expected, actual_len) != 0) {
+      return fail(scenario, "expected %d bytes sent, got %u bytes of command type %u id %u",
+          expected_len, actual_len, cmd.header.type, cmd.header.id);
+    }
+  }
+  else if (is(words[1], "notified") && count == 3 && is(words[2], "none")) {
+    if (scenario->notified_count > 0) {
+      return fail(scenario, "expected nothing notified, got %u bytes", scenario->notified[0].len);
+    }
+  }
+  else if (is(words[1], "notified") && count > 2) {
+    uint8_t expected[NOVA_CODEC_MAX_FRAME_SIZE];
+    int expected_len = parse_bytes(words + 2, count - 2, expected, sizeof(expected));
+    if (expected_len < 0) {
+      return fail(scenario, "unknown assertion");
+    }
+    if (scenario->notified_count == 0) {
+      return fail(scenario, "expected notification, nothing sent");
+    }
+    uint16_t actual_len = scenario->notified[0].len;
+    bool same = actual_len == expected_len
+        && memcmp(scenario->notified[0].bytes, expected, actual_len) == 0;
+    scenario->notified_count--;
+    memmove(&scenario->notified[0], &scenario->notified[1],
+        sizeof(scenario->notified[0]) * scenario->notified_count);
+    if (!same) {
+      return fail(scenario, "expected %d byte notification, got different %u bytes",
+          expected_len, actual_len);
+    }
+  }
+  else if (is(words[1], "hid") && count == 3 && is(words[2], "none")) {
+    if (scenario->hid_key_count > 0) {
+      return fail(scenario, "expected no HID keys, got %#04x", scenario->hid_keys[0]);
+    }
+  }
+  else if (is(words[1], "hid") && count == 3 && parse_number(words[2], &a)) {
+    if (scenario->hid_key_count == 0) {
+      return fail(scenario, "expected HID key %#04lx, nothing sent", a);
+    }
+    char key_code = pop_hid_key(scenario);
+    if (key_code != a) {
+      return fail(scenario, "expected HID key %#04lx, got %#04x", a, key_code);
+    }
+  }
+  else {
+    return fail(scenario, "unknown assertion");
+  }
+
+  return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void scenario_init(scenario_t *scenario, fake_nova_device_t *device)
+{
+  memset(scenario, 0, sizeof(scenario_t));
+  scenario->device = device;
+  scenario->listener.app_command_sent = on_app_command_sent;
+  scenario->listener.app_notified = on_app_notified;
+  scenario->listener.hid_key_sent = on_hid_key_sent;
+  scenario->listener.data = scenario;
+  fake_nova_device_add_listener(device, &scenario->listener);
+}
+
+bool scenario_step(scenario_t *scenario, const char *line)
+{
+  char buf[SCENARIO_MAX_LINE];
+  char *words[MAX_WORDS];
+  int count = 0;
+
+  strncpy(buf, line, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+
+  // Strip comments and split into words.
+  char *comment = strchr(buf, '#');
+  if (comment) {
+    *comment = 0;
+  }
+  for (char *word = strtok(buf, " \t\r\n"); word && count < MAX_WORDS; word = strtok(NULL, " \t\r\n")) {
+    words[count++] = word;
+  }
+
+  if (count == 0) {
+    return true;
+  }
+  if (is(words[0], "expect") && count > 1) {
+    return step_expect(scenario, words, count);
+  }
+  return step_event(scenario, words, count);
+}
+
+bool scenario_run_file(const char *filename, char *error, int error_len)
+{
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    snprintf(error, error_len, "%s: cannot open", filename);
+    return false;
+  }
+
+  fake_nova_device_t *device = fake_nova_device_init(NULL, 0);
+  basic_clock_init_virtual(&device->clock, 0);
+
+  scenario_t *scenario = malloc(sizeof(scenario_t));
+  scenario_init(scenario, device);
+
+  // Device is powered on before the first step.
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+
+  bool ok = true;
+  char line[SCENARIO_MAX_LINE];
+  for (int line_number = 1; fgets(line, sizeof(line), file); line_number++) {
+    if (!scenario_step(scenario, line)) {
+      snprintf(error, error_len, "%s:%d: %s", filename, line_number, scenario->error);
+      ok = false;
+      break;
+    }
+  }
+
+  fclose(file);
+  free(scenario);
+  fake_nova_device_free(device);
+  return ok;
+}
@@ -0,0 +1,145 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Scripted scenarios for driving the fake Nova device.
+ *
+ * A scenario is a text file with one step per line. Steps either cause
+ * something to happen to the device, or assert something about its
+ * state. Time is virtual, so scenarios run as fast as possible with
+ * exact, reproducible timing.
+ *
+ * Blank lines and lines starting with # are ignored.
+ *
+ * Events:
+ *
+ *   reset                        power on (nova_on_reset)
+ *   power cut                    power lost without warning, then restored
+ *   power fail                   brownout warning (nova_on_power_failing),
+ *                                then power cut
+ *   connect app|hid              App/HID subscribes
+ *   disconnect app|hid           App/HID unsubscribes
+ *   press                        trigger button pressed down
+ *   release                      trigger button released
+ *   ping                         App sends PING (App commands are
+ *                                encoded as bytes on the wire, and
+ *                                decoded by the device)
+ *   flash WARM COOL TIMEOUT      App sends FLASH
+ *   flash at TIME WARM COOL TIMEOUT
+ *                                App sends FLASH_AT, for when the
+ *                                device's clock reads TIME
+ *   sync                         App sends SYNC
+ *   off                          App sends OFF
+ *   ack ID                       App sends ACK for command ID
+ *   ack trigger                  App sends ACK for most recent TRIGGER
+ *   negotiate frames|none [WINDOW]
+ *                                App sends NEGOTIATE to turn frames
+ *                                (NOVA_FEATURE_FRAMES) on or off, asking
+ *                                for a window (default 1). Once frames
+ *                                are on, App commands are sent in frames
+ *   write HEX...                 App writes raw bytes (e.g. 01 00 00 2A),
+ *                                ignored by the device unless they're a
+ *                                valid command, or frame once frames are
+ *                                on (see nova-codec.h)
+ *   store defaults WARM COOL TIMEOUT PREWARM PRECOOL PRETIMEOUT
+ *                                flash defaults (regular, then preflash)
+ *                                saved in device storage, used from the
+ *                                next reset
+ *   wait MS                      time passes, firing any timers due
+ *   wait timers                  time passes until no timers are left
+ *
+ * Assertions:
+ *
+ *   expect lights WARM COOL      PWM of main lights
+ *   expect status on|off         status indicator LED
+ *   expect timer flash|counters|flash_at MS|off
+ *                                milliseconds until logical timer fires
+ *   expect counter NAME VALUE    usage counter (field of counters_t)
+ *   expect unsaved N             counter increments not yet saved
+ *   expect saves N               calls to nova_save_counters()
+ *   expect sent ack ID           oldest unchecked command sent to App
+ *   expect sent trigger pressed|released
+ *   expect sent bytes HEX...     oldest unchecked command, as bytes on
+ *                                the wire
+ *   expect sent none             no unchecked commands sent to App
+ *   expect notified HEX...       oldest unchecked BLE notification sent
+ *                                to App (a command, or a frame)
+ *   expect notified none         no unchecked notifications
+ *   expect hid CODE              oldest unchecked HID key sent
+ *   expect hid none              no unchecked HID keys sent
+ */
+
+#include <stdbool.h>
+
+#include <nova.h>
+#include <nova-codec.h>
+
+#include "fake-nova-device.h"
+
+/** How many sent commands/keys/notifications can be waiting to be checked. */
+#define SCENARIO_MAX_SENT 16
+
+/** Maximum length of a line in a scenario file. */
+#define SCENARIO_MAX_LINE 256
+
+/**
+ * State of a running scenario.
+ */
+typedef struct scenario_t
+{
+  /** Device the scenario drives. */
+  fake_nova_device_t *device;
+
+  /** id of the next command sent by simulated App. */
+  cmd_id_t next_command_id;
+
+  /** id of most recent TRIGGER sent by the device. */
+  cmd_id_t last_trigger_id;
+
+  /** Commands sent to App, not yet checked by 'expect sent'. */
+  app_command_t sent[SCENARIO_MAX_SENT];
+  int sent_count;
+
+  /** BLE notifications sent to App, not yet checked by 'expect notified'. */
+  struct
+  {
+    uint8_t bytes[NOVA_CODEC_MAX_FRAME_SIZE];
+    uint16_t len;
+  } notified[SCENARIO_MAX_SENT];
+  int notified_count;
+
+  /** HID keys sent, not yet checked by 'expect hid'. */
+  char hid_keys[SCENARIO_MAX_SENT];
+  int hid_key_count;
+
+  /** Observes device output. */
+  fake_nova_device_listener_t listener;
+
+  /** Description of why the last step failed. */
+  char error[SCENARIO_MAX_LINE];
+
+} scenario_t;
+
+/**
+ * Prepare scenario to drive device. The device should be using a virtual
+ * clock (see basic_clock_init_virtual()).
+ */
+void scenario_init(scenario_t *scenario, fake_nova_device_t *device);
+
+/**
+ * Execute a single line of a scenario.
+ *
+ * Returns false if the step failed (e.g. an assertion didn't hold or the
+ * line couldn't be parsed), with the reason in scenario->error.
+ */
+bool scenario_step(scenario_t *scenario, const char *line);
+
+/**
+ * Run a whole scenario file against a fresh device with a virtual clock
+ * and in-memory flash.
+ *
+ * Returns false if any step fails. The failing line number and reason
+ * are written to error.
+ */
+bool scenario_run_file(const char *filename, char *error, int error_len);
@@ -0,0 +1,379 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-api.h>
+#include <nova-codec.h>
+#include <nova-host-clock.h>
+
+#include "fake-nova-device.h"
+#include "ui-headless.h"
+#include "util/rng.h"
+
+/**
+ * Firing skew across devices.
+ *
+ * An App flashes many devices for the same moment, in virtual time. Each
+ * device is on its own BLE link, with its own latency (plus jitter on
+ * every packet), and has its own clock: started at a random time, and
+ * running fast or slow by up to some parts per million. Four ways are
+ * compared:
+ *
+ * - FLASH, sent to every device at once: each lights when it arrives.
+ * - FLASH_AT, for what the device's clock will read at that moment,
+ *   estimated from the last SYNC: the device's clock read halfway
+ *   through the round trip.
+ * - FLASH_AT, estimated from every SYNC: the offset from the quickest
+ *   round trips, as the host SDK does (see nova-host-clock.h).
+ * - The same, plus the drift: the slope of a line fitted through them.
+ *
+ * Reports the skew (last device to light minus the first), and how far
+ * devices were from the moment intended.
+ *
+ * Usage:
+ *
+ *   firmware-sync [-n DEVICES] [-l MIN:MAX] [-j JITTER] [-d PPM]
+ *                 [-S SYNCS] [-I SPACING] [-A AHEAD] [-s SEED] [-m MAX] [-v]
+ *
+ *   -n DEVICES   devices to flash (default 100)
+ *   -l MIN:MAX   one way latency of each device's link, ms, picked
+ *                between MIN and MAX (default 10:150)
+ *   -j JITTER    up to this much more on each packet, ms (default 10)
+ *   -d PPM       most a device's clock drifts, parts per million
+ *                (default 250, an uncalibrated RC oscillator)
+ *   -S SYNCS     SYNC exchanges with each device (default 32)
+ *   -I SPACING   time between SYNCs, ms (default 2000)
+ *   -A AHEAD     time from the last SYNC to the flash, ms (default 30000)
+ *   -s SEED      seed for links and clocks (default 1)
+ *   -m MAX       exit with status 1 if FLASH_AT, with the drift, skews
+ *                by more than MAX ms
+ *   -v           log everything (only sensible with few devices)
+ *
+ * Also exits with status 1 if any device didn't light.
+ */
+
+/** Most SYNC exchanges with a device (all are kept for estimates). */
+#define MAX_SYNCS NOVA_HOST_CLOCK_SAMPLES
+
+/** FLASH_AT is sent this long before the flash (more than any latency). */
+#define LEAD 1000
+
+/** Time between flashes, and how long each lasts. */
+#define GAP 2000
+#define FLASH_TIMEOUT 100
+
+typedef enum
+{
+  PHASE_FLASH,
+  PHASE_LAST_SYNC,
+  PHASE_OFFSET,
+  PHASE_DRIFT,
+  PHASES
+} phase;
+
+static const char *phase_names[PHASES] = {
+  "FLASH (now)",
+  "FLASH_AT, last SYNC",
+  "FLASH_AT, offset",
+  "FLASH_AT, + drift",
+};
+
+typedef struct link_t
+{
+  fake_nova_device_t *device;
+  uint64_t *rng;
+
+  /** One way latency, and most jitter added to it, ms. */
+  uint32_t latency;
+  uint32_t jitter;
+
+  /** When the last packet to the device arrived (the link keeps order). */
+  uint64_t arrived;
+
+  /** Time in the device's last SYNC response. */
+  timestamp_t synced;
+
+  /** When the lights came on for each phase (0 if they didn't). */
+  phase phase;
+  uint64_t lit_at[PHASES];
+
+  fake_nova_device_listener_t listener;
+
+} link_t;
+
+
+// ----------------------------------------------------------------------------
+// Link
+
+static void advance_to(fake_nova_device_t *device, uint64_t time)
+{
+  uint64_t now = basic_clock_now(&device->clock);
+  if (time > now) {
+    basic_timer_advance(&device->timers, time - now);
+  }
+  fake_nova_device_idle(device);
+}
+
+/** Time for a packet to go one way. */
+static uint32_t one_way(link_t *link)
+{
+  return link->latency + rng_between(link->rng, 0, link->jitter);
+}
+
+/**
+ * Send cmd from the App at time sent, and run the device until it
+ * arrives. Returns when it arrived.
+ */
+static uint64_t send(link_t *link, uint64_t sent, uint8_t type, app_command_t *cmd)
+{
+  static cmd_id_t last_id;
+  cmd->header.type = type;
+  cmd->header.__pad = 0;
+  cmd->header.id = ++last_id;
+
+  uint64_t arrives = sent + one_way(link);
+  if (arrives < link->arrived) {
+    arrives = link->arrived;
+  }
+  link->arrived = arrives;
+
+  advance_to(link->device, arrives);
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  fake_nova_device_app_write(link->device, buf, nova_codec_encode_command(cmd, buf));
+  return arrives;
+}
+
+static void on_app_command_sent(fake_nova_device_t *device, app_command_t *cmd, void *data)
+{
+  link_t *link = (link_t*)data;
+  if (cmd->header.type == NOVA_CMD_SYNC) {
+    link->synced = cmd->body.sync.time;
+  }
+}
+
+static void on_lights_set(fake_nova_device_t *device, uint8_t warm_pwm, uint8_t cool_pwm, void *data)
+{
+  link_t *link = (link_t*)data;
+  if ((warm_pwm || cool_pwm) && !link->lit_at[link->phase]) {
+    link->lit_at[link->phase] = basic_clock_now(&device->clock);
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Runs
+
+typedef struct options_t
+{
+  uint32_t devices;
+  uint32_t latency_min;
+  uint32_t latency_max;
+  uint32_t jitter;
+  uint32_t drift;
+  uint32_t syncs;
+  uint32_t spacing;
+  uint32_t ahead;
+  uint64_t seed;
+} options_t;
+
+/**
+ * Sync with a fresh device and flash it each way, filling in lit_at.
+ * All devices are flashed for the same moments, which are returned in
+ * targets.
+ */
+static void run_device(const options_t *options, uint32_t index, uint64_t *rng,
+    uint64_t lit_at[PHASES], uint64_t targets[PHASES])
+{
+  fake_nova_device_t *device = fake_nova_device_init(NULL, 0);
+  basic_clock_init_virtual(&device->clock, 0);
+
+  // The first device's clock wraps around while syncing.
+  device->clock_epoch = index == 0 ? (timestamp_t)(0 - options->spacing) : (timestamp_t)rng_next(rng);
+  device->clock_drift_ppm = (int32_t)rng_between(rng, 0, 2 * options->drift) - (int32_t)options->drift;
+
+  link_t link;
+  memset(&link, 0, sizeof(link_t));
+  link.device = device;
+  link.rng = rng;
+  link.latency = rng_between(rng, options->latency_min, options->latency_max);
+  link.jitter = options->jitter;
+  link.listener.app_command_sent = on_app_command_sent;
+  link.listener.lights_set = on_lights_set;
+  link.listener.data = &link;
+  fake_nova_device_add_listener(device, &link.listener);
+
+  fake_nova_device_input(device, NOVA_EVENT_RESET);
+  fake_nova_device_input(device, NOVA_EVENT_CONNECT_APP);
+
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+
+  // The response goes out when the SYNC arrives. The App's clock is
+  // true time here.
+  static nova_host_clock_t clock;
+  static nova_host_clock_t last_sync;
+  nova_host_clock_init(&clock);
+  nova_host_clock_init(&last_sync);
+  uint64_t time = 1000;
+  for (uint32_t i = 0; i < options->syncs; i++, time += options->spacing) {
+    uint64_t received = send(&link, time, NOVA_CMD_SYNC, &cmd) + one_way(&link);
+    nova_host_clock_add(&clock, time, received, link.synced);
+    if (i + 1 == options->syncs) {
+      nova_host_clock_add(&last_sync, time, received, link.synced);
+    }
+  }
+  uint64_t last = time - options->spacing;
+
+  // Each FLASH_AT a little later than the last, so they don't overlap.
+  cmd.body.flash_at.warm = 255;
+  cmd.body.flash_at.cool = 255;
+  cmd.body.flash_at.timeout = FLASH_TIMEOUT;
+  uint64_t target = last + options->ahead;
+  for (phase p = PHASE_LAST_SYNC; p < PHASES; p++, target += GAP) {
+    targets[p] = target;
+    nova_host_clock_device_time(p == PHASE_LAST_SYNC ? &last_sync : &clock, target,
+        p == PHASE_DRIFT, &cmd.body.flash_at.at);
+    link.phase = p;
+    send(&link, target - LEAD, NOVA_CMD_FLASH_AT, &cmd);
+    advance_to(device, target + GAP - LEAD);
+  }
+
+  targets[PHASE_FLASH] = target;
+  cmd.body.flash_settings.warm = 255;
+  cmd.body.flash_settings.cool = 255;
+  cmd.body.flash_settings.timeout = FLASH_TIMEOUT;
+  link.phase = PHASE_FLASH;
+  send(&link, target, NOVA_CMD_FLASH, &cmd);
+  advance_to(device, target + GAP);
+
+  memcpy(lit_at, link.lit_at, sizeof(link.lit_at));
+  fake_nova_device_free(device);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+  options_t options = { 100, 10, 150, 10, 250, 32, 2000, 30000, 1 };
+  int64_t max_skew = -1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      options.devices = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      char *end;
+      options.latency_min = (uint32_t)strtoul(argv[++i], &end, 10);
+      options.latency_max = *end == ':' ? (uint32_t)strtoul(end + 1, NULL, 10) : options.latency_min;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      options.jitter = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      options.drift = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+      options.syncs = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+      options.spacing = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+      options.ahead = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      options.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      max_skew = strtoll(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      ui_headless_set_verbose(true);
+    } else {
+      fprintf(stderr, "Usage: %s [-n DEVICES] [-l MIN:MAX] [-j JITTER] [-d PPM]\n", argv[0]);
+      fprintf(stderr, "       %*s [-S SYNCS] [-I SPACING] [-A AHEAD] [-s SEED] [-m MAX] [-v]\n",
+          (int)strlen(argv[0]), "");
+      return 2;
+    }
+  }
+
+  if (options.devices == 0 || options.syncs == 0 || options.syncs > MAX_SYNCS
+      || options.latency_min > options.latency_max
+      || options.latency_max + options.jitter >= LEAD || options.ahead < LEAD
+      || options.drift >= 1000000) {
+    fprintf(stderr, "%s: need 1-%u SYNCs, latency + jitter under %ums, ahead at least %ums\n",
+        argv[0], MAX_SYNCS, LEAD, LEAD);
+    return 2;
+  }
+
+  printf("sync: %u devices, links %u-%ums + up to %ums jitter, clocks up to %uppm off,\n",
+      options.devices, options.latency_min, options.latency_max, options.jitter, options.drift);
+  printf("      %u SYNCs %ums apart, flashing %ums after the last\n\n",
+      options.syncs, options.spacing, options.ahead);
+
+  uint64_t *lit_at[PHASES];
+  for (int p = 0; p < PHASES; p++) {
+    lit_at[p] = malloc(options.devices * sizeof(uint64_t));
+  }
+
+  uint64_t rng = options.seed ? options.seed : 1;
+  uint64_t targets[PHASES];
+  uint32_t dark[PHASES] = { 0 };
+  for (uint32_t d = 0; d < options.devices; d++) {
+    uint64_t device_lit_at[PHASES];
+    run_device(&options, d, &rng, device_lit_at, targets);
+    for (int p = 0; p < PHASES; p++) {
+      lit_at[p][d] = device_lit_at[p];
+      if (!device_lit_at[p]) {
+        dark[p]++;
+      }
+    }
+  }
+
+  // How far each device lit from the moment intended, in ms.
+  printf("%-22s %8s %8s %8s %8s\n", "", "skew", "p50", "p99", "max");
+  printf("  %-20s %8s %8s %8s %8s\n", "", "", "|error|", "|error|", "|error|");
+  uint64_t skews[PHASES];
+  uint64_t *errors = malloc(options.devices * sizeof(uint64_t));
+  for (int p = 0; p < PHASES; p++) {
+    uint64_t first = UINT64_MAX;
+    uint64_t latest = 0;
+    uint32_t count = 0;
+    for (uint32_t d = 0; d < options.devices; d++) {
+      uint64_t lit = lit_at[p][d];
+      if (!lit) {
+        continue;
+      }
+      first = lit < first ? lit : first;
+      latest = lit > latest ? lit : latest;
+      errors[count++] = lit > targets[p] ? lit - targets[p] : targets[p] - lit;
+    }
+    if (count == 0) {
+      printf("  %-20s (none lit)\n", phase_names[p]);
+      skews[p] = UINT64_MAX;
+      continue;
+    }
+    qsort(errors, count, sizeof(uint64_t), compare_u64);
+    skews[p] = latest - first;
+    printf("  %-20s %8lu %8lu %8lu %8lu\n", phase_names[p], (unsigned long)skews[p],
+        (unsigned long)errors[count / 2],
+        (unsigned long)errors[(uint32_t)((count - 1) * 0.99)],
+        (unsigned long)errors[count - 1]);
+  }
+
+  bool ok = true;
+  for (int p = 0; p < PHASES; p++) {
+    if (dark[p] > 0) {
+      printf("FAIL: %u of %u devices didn't light for %s\n", dark[p], options.devices, phase_names[p]);
+      ok = false;
+    }
+  }
+  if (max_skew >= 0 && skews[PHASE_DRIFT] > (uint64_t)max_skew) {
+    printf("FAIL: skew of %s over %ldms\n", phase_names[PHASE_DRIFT], (long)max_skew);
+    ok = false;
+  }
+
+  free(errors);
+  for (int p = 0; p < PHASES; p++) {
+    free(lit_at[p]);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "recording.h"
+#include "timeline.h"
+
+/**
+ * Timeline exporter.
+ *
+ * Converts a recording (see recording.h, e.g. from firmware-fleet -o) to
+ * Chrome trace event JSON, to open in chrome://tracing or
+ * https://ui.perfetto.dev. See timeline.h for the tracks.
+ *
+ * The recording is read through a memory map and the trace is written as
+ * it goes, so recordings of any length can be exported.
+ *
+ * Usage:
+ *
+ *   firmware-timeline [-o FILE] RECORDING
+ *
+ *   -o FILE  write trace to FILE (default: stdout)
+ */
+
+int main(int argc, char **argv)
+{
+  const char *out_filename = NULL;
+  int arg = 1;
+
+  if (arg + 1 < argc && strcmp(argv[arg], "-o") == 0) {
+    out_filename = argv[arg + 1];
+    arg += 2;
+  }
+  if (arg != argc - 1) {
+    fprintf(stderr, "Usage: %s [-o FILE] RECORDING\n", argv[0]);
+    return 2;
+  }
+  const char *filename = argv[arg];
+
+  recording_reader_t reader;
+  if (!recording_map(&reader, filename)) {
+    fprintf(stderr, "%s: %s\n", filename, errno ? strerror(errno) : "not a recording");
+    return 1;
+  }
+
+  FILE *out = out_filename ? fopen(out_filename, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "%s: %s\n", out_filename, strerror(errno));
+    recording_unmap(&reader);
+    return 1;
+  }
+
+  timeline_t timeline;
+  recording_record_t record;
+  timeline_begin(&timeline, out);
+  while (recording_next(&reader, &record)) {
+    timeline_add(&timeline, &record);
+  }
+  timeline_end(&timeline);
+
+  bool ok = !reader.corrupt && !ferror(out);
+  if (out_filename) {
+    ok = fclose(out) == 0 && ok;
+    fprintf(stderr, "timeline: %llu records, %llu trace events to %s\n",
+        (unsigned long long)reader.records, (unsigned long long)timeline.events, out_filename);
+  }
+  if (reader.corrupt) {
+    fprintf(stderr, "FAIL: recording is corrupt after %llu records\n", (unsigned long long)reader.records);
+  }
+
+  recording_unmap(&reader);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,274 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See timeline.h
+ */
+
+#include "timeline.h"
+
+#include <stdarg.h>
+
+#include <nova-codec.h>
+#include <nova-events.h>
+#include <nova-internal.h>
+
+/** Track (trace event "tid") of each kind of record. */
+typedef enum
+{
+  TRACK_BUTTON = 1,
+  TRACK_TIMER,
+  TRACK_APP,
+  TRACK_TO_APP,
+  TRACK_HID,
+  TRACK_DEVICE,
+  TRACK_COUNT
+} track;
+
+static const char *track_names[TRACK_COUNT] = {
+  NULL,
+  "button",
+  "timer",
+  "App",
+  "to App",
+  "HID",
+  "device",
+};
+
+static const char *command_names[] = {
+  "ACK",
+  "PING",
+  "FLASH",
+  "OFF",
+  "TRIGGER",
+  "NEGOTIATE",
+  "SYNC",
+  "FLASH_AT",
+};
+
+
+// ----------------------------------------------------------------------------
+// Trace events
+
+/**
+ * Write a trace event: phase is one of the trace event format's "ph"
+ * values, and args (if not NULL) a printf format for the members of its
+ * "args" object.
+ */
+static void event(timeline_t *timeline, char phase, track track, const char *name, const char *args, ...)
+{
+  FILE *out = timeline->out;
+
+  fprintf(out, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%llu",
+      timeline->events == 0 ? "" : ",\n", phase, track,
+      (unsigned long long)timeline->time * 1000);
+  if (name) {
+    fprintf(out, ",\"name\":\"%s\"", name);
+  }
+  if (phase == 'i') {
+    fputs(",\"s\":\"t\"", out);
+  }
+  if (args) {
+    va_list ap;
+    va_start(ap, args);
+    fputs(",\"args\":{", out);
+    vfprintf(out, args, ap);
+    fputc('}', out);
+    va_end(ap);
+  }
+  fputc('}', out);
+  timeline->events++;
+}
+
+static void span_end(timeline_t *timeline, bool *open, track track, const char *why)
+{
+  if (*open) {
+    event(timeline, 'E', track, NULL, why ? "\"end\":\"%s\"" : NULL, why);
+    *open = false;
+  }
+}
+
+static void span_begin(timeline_t *timeline, bool *open, track track, const char *name)
+{
+  span_end(timeline, open, track, NULL);
+  event(timeline, 'B', track, name, NULL);
+  *open = true;
+}
+
+
+// ----------------------------------------------------------------------------
+// Commands
+
+static void command(timeline_t *timeline, track track, const app_command_t *cmd)
+{
+  const char *name = cmd->header.type < sizeof(command_names) / sizeof(command_names[0])
+      ? command_names[cmd->header.type] : "UNKNOWN";
+
+  switch (cmd->header.type) {
+    case NOVA_CMD_FLASH:
+      event(timeline, 'i', track, name, "\"id\":%u,\"timeout\":%u,\"warm\":%u,\"cool\":%u",
+          cmd->header.id, cmd->body.flash_settings.timeout,
+          cmd->body.flash_settings.warm, cmd->body.flash_settings.cool);
+      break;
+    case NOVA_CMD_TRIGGER:
+      event(timeline, 'i', track, name, "\"id\":%u,\"is_pressed\":%u",
+          cmd->header.id, cmd->body.trigger.is_pressed);
+      break;
+    case NOVA_CMD_NEGOTIATE:
+      event(timeline, 'i', track, name, "\"id\":%u,\"features\":%u,\"window\":%u",
+          cmd->header.id, cmd->body.negotiate.features, cmd->body.negotiate.window);
+      break;
+    case NOVA_CMD_SYNC:
+      event(timeline, 'i', track, name, "\"id\":%u,\"time\":%u",
+          cmd->header.id, cmd->body.sync.time);
+      break;
+    case NOVA_CMD_FLASH_AT:
+      event(timeline, 'i', track, name, "\"id\":%u,\"at\":%u,\"timeout\":%u,\"warm\":%u,\"cool\":%u",
+          cmd->header.id, cmd->body.flash_at.at, cmd->body.flash_at.timeout,
+          cmd->body.flash_at.warm, cmd->body.flash_at.cool);
+      break;
+    default:
+      event(timeline, 'i', track, name, "\"id\":%u", cmd->header.id);
+  }
+}
+
+/**
+ * Decode the bytes on the wire to or from the App, as nova.c would at the
+ * time: in frames once NOVA_FEATURE_FRAMES is negotiated.
+ */
+static void commands(timeline_t *timeline, track track, const recording_record_t *record)
+{
+  app_command_t cmds[NOVA_APP_FRAME_MAX_COMMANDS];
+  int count = -1;
+
+  if (record->length <= NOVA_CODEC_MAX_FRAME_SIZE) {
+    count = timeline->framed
+        ? nova_codec_decode_frame(record->payload, record->length, cmds, NOVA_APP_FRAME_MAX_COMMANDS)
+        : nova_codec_decode_command(record->payload, record->length, cmds) ? 1 : -1;
+  }
+  if (count < 0) {
+    event(timeline, 'i', track, "invalid", "\"bytes\":%u", record->length);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    command(timeline, track, &cmds[i]);
+  }
+
+  // The device's NEGOTIATE response is the last thing sent before features
+  // change.
+  for (int i = 0; track == TRACK_TO_APP && i < count; i++) {
+    if (cmds[i].header.type == NOVA_CMD_NEGOTIATE) {
+      timeline->framed = cmds[i].body.negotiate.features & NOVA_FEATURE_FRAMES;
+    }
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Records
+
+void timeline_begin(timeline_t *timeline, FILE *out)
+{
+  timeline->out = out;
+  timeline->events = 0;
+  timeline->time = 0;
+  timeline->button_down = false;
+  timeline->timer_scheduled = false;
+  timeline->app_connected = false;
+  timeline->hid_connected = false;
+  timeline->framed = false;
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+  event(timeline, 'M', 0, "process_name", "\"name\":\"nova\"");
+  for (int track = 1; track < TRACK_COUNT; track++) {
+    event(timeline, 'M', track, "thread_name", "\"name\":\"%s\"", track_names[track]);
+    event(timeline, 'M', track, "thread_sort_index", "\"sort_index\":%d", track);
+  }
+}
+
+void timeline_add(timeline_t *timeline, const recording_record_t *record)
+{
+  const uint8_t *p = record->payload;
+  uint8_t len = record->length;
+
+  timeline->time = record->time;
+
+  switch (record->kind) {
+    case NOVA_EVENT_RESET:
+      span_end(timeline, &timeline->button_down, TRACK_BUTTON, "reset");
+      span_end(timeline, &timeline->app_connected, TRACK_APP, "reset");
+      span_end(timeline, &timeline->hid_connected, TRACK_HID, "reset");
+      timeline->framed = false;
+      event(timeline, 'i', TRACK_DEVICE, "reset", NULL);
+      break;
+    case NOVA_EVENT_BUTTON_PRESSDOWN:
+      span_begin(timeline, &timeline->button_down, TRACK_BUTTON, "pressed");
+      break;
+    case NOVA_EVENT_BUTTON_RELEASE:
+      span_end(timeline, &timeline->button_down, TRACK_BUTTON, NULL);
+      break;
+    case NOVA_EVENT_CONNECT_APP:
+      span_begin(timeline, &timeline->app_connected, TRACK_APP, "connected");
+      timeline->framed = false;
+      break;
+    case NOVA_EVENT_DISCONNECT_APP:
+      span_end(timeline, &timeline->app_connected, TRACK_APP, NULL);
+      timeline->framed = false;
+      break;
+    case NOVA_EVENT_CONNECT_HID:
+      span_begin(timeline, &timeline->hid_connected, TRACK_HID, "connected");
+      break;
+    case NOVA_EVENT_DISCONNECT_HID:
+      span_end(timeline, &timeline->hid_connected, TRACK_HID, NULL);
+      break;
+    case NOVA_EVENT_TIMER_COMPLETE:
+      span_end(timeline, &timeline->timer_scheduled, TRACK_TIMER, "fired");
+      break;
+    case NOVA_EVENT_POWER_FAILING:
+      event(timeline, 'i', TRACK_DEVICE, "power failing", NULL);
+      break;
+    case RECORDING_APP_WRITE:
+      commands(timeline, TRACK_APP, record);
+      break;
+    case RECORDING_LOAD_COUNTERS:
+      event(timeline, 'i', TRACK_DEVICE, "load counters", NULL);
+      break;
+    case RECORDING_LOAD_FLASH_DEFAULTS:
+      event(timeline, 'i', TRACK_DEVICE, "load flash defaults", NULL);
+      break;
+    case RECORDING_SET_LIGHTS:
+      event(timeline, 'C', TRACK_DEVICE, "lights", "\"warm\":%u,\"cool\":%u",
+          len > 0 ? p[0] : 0, len > 1 ? p[1] : 0);
+      break;
+    case RECORDING_SET_STATUS_INDICATOR:
+      event(timeline, 'C', TRACK_DEVICE, "status indicator", "\"lit\":%u", len > 0 ? p[0] : 0);
+      break;
+    case RECORDING_NOTIFY_APP:
+      commands(timeline, TRACK_TO_APP, record);
+      break;
+    case RECORDING_SEND_HID_KEY:
+      event(timeline, 'i', TRACK_HID, "key", "\"code\":%u", len > 0 ? p[0] : 0);
+      break;
+    case RECORDING_TIMER_SCHEDULE:
+      span_end(timeline, &timeline->timer_scheduled, TRACK_TIMER, "rescheduled");
+      event(timeline, 'B', TRACK_TIMER, "scheduled", "\"timeout\":%u",
+          len > 1 ? (p[0] << 8) | p[1] : 0);
+      timeline->timer_scheduled = true;
+      break;
+    case RECORDING_TIMER_CLEAR:
+      span_end(timeline, &timeline->timer_scheduled, TRACK_TIMER, "cleared");
+      break;
+    case RECORDING_SAVE_COUNTERS:
+      event(timeline, 'i', TRACK_DEVICE, "save counters", NULL);
+      break;
+  }
+}
+
+void timeline_end(timeline_t *timeline)
+{
+  span_end(timeline, &timeline->button_down, TRACK_BUTTON, NULL);
+  span_end(timeline, &timeline->timer_scheduled, TRACK_TIMER, NULL);
+  span_end(timeline, &timeline->app_connected, TRACK_APP, NULL);
+  span_end(timeline, &timeline->hid_connected, TRACK_HID, NULL);
+  fputs("\n]}\n", timeline->out);
+}
@@ -0,0 +1,70 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Export of recordings (see recording.h) as Chrome trace event JSON, to
+ * see how lights, timers and BLE traffic overlap on a timeline in
+ * chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Feed records in order to timeline_add(). Each is written out straight
+ * away, so memory use doesn't grow with the length of the recording.
+ *
+ * Tracks:
+ *
+ * - lights:           counter, warm and cool PWM.
+ * - status indicator: counter, lit or not.
+ * - button:           spans while pressed down.
+ * - timer:            spans while the hardware timer is scheduled, ending
+ *                     when it fires, is cleared or is rescheduled.
+ * - App:              spans while connected, and each command written
+ *                     by the App (decoded from frames once negotiated).
+ * - to App:           each command sent to the App.
+ * - HID:              spans while connected, and each key sent.
+ * - device:           reset, power failing, counters loaded and saved.
+ *
+ * Times are device clock milliseconds (exported as microseconds, as the
+ * format requires).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "recording.h"
+
+typedef struct timeline_t
+{
+  FILE *out;
+
+  /** Trace events written. */
+  uint64_t events;
+
+  /** Time of last record added. */
+  uint64_t time;
+
+  /** Whether spans are open on the button, timer, App and HID tracks. */
+  bool button_down;
+  bool timer_scheduled;
+  bool app_connected;
+  bool hid_connected;
+
+  /** Whether commands to/from the App are in frames (NOVA_FEATURE_FRAMES). */
+  bool framed;
+
+} timeline_t;
+
+/**
+ * Start writing a trace to out.
+ */
+void timeline_begin(timeline_t *timeline, FILE *out);
+
+/**
+ * Write the trace events for the next record.
+ */
+void timeline_add(timeline_t *timeline, const recording_record_t *record);
+
+/**
+ * Close any open spans and finish the trace. Doesn't close out.
+ */
+void timeline_end(timeline_t *timeline);
@@ -0,0 +1,115 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nova-internal.h>
+#include <nova-trace.h>
+
+#include "fleet.h"
+#include "trace.h"
+#include "ui-headless.h"
+
+/**
+ * Latency tracer.
+ *
+ * Runs a fake device (built with NOVA_TRACE) through a random but seeded
+ * stream of events, as used by the fleet simulator (see fleet.h), taking
+ * trace records after each event. Prints a latency histogram for each
+ * path in trace.h, and optionally every record.
+ *
+ * Times are real nanoseconds spent in nova.c and the fake device's
+ * nova-device.h functions (which include logging and listeners).
+ *
+ * Usage:
+ *
+ *   firmware-trace [-e EVENTS] [-s SEED] [-d]
+ *
+ *   -e EVENTS  events to run (default 100000)
+ *   -s SEED    seed for event stream (default 1)
+ *   -d         dump every trace record
+ *
+ * Exits with status 1 if any trace records were lost, or no samples were
+ * taken for a path.
+ */
+
+#ifndef NOVA_TRACE
+#error firmware-trace must be built with -DNOVA_TRACE
+#endif
+
+/**
+ * Take all trace records, following them (and printing them if dump).
+ */
+static void take_records(nova_t *nova, trace_paths_t *paths, bool dump, int *depth)
+{
+  nova_trace_record_t record;
+  while (nova_trace_take(nova, &record)) {
+    uint8_t phase = record.point & NOVA_TRACE_PHASE_MASK;
+    if (phase == NOVA_TRACE_EXIT && *depth > 0) {
+      (*depth)--;
+    }
+    if (dump) {
+      trace_print_record(stdout, &record, *depth);
+    }
+    if (phase == NOVA_TRACE_ENTER) {
+      (*depth)++;
+    }
+    trace_paths_add(paths, &record);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t events = 100000;
+  uint64_t seed = 1;
+  bool dump = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      events = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      dump = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-e EVENTS] [-s SEED] [-d]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  trace_paths_t paths;
+  trace_paths_init(&paths);
+  int depth = 0;
+
+  fleet_device_t fleet_device;
+  fleet_device_init(&fleet_device, seed, 0, NULL, NULL);
+  nova_t *nova = fleet_device.device->nova;
+  take_records(nova, &paths, dump, &depth);
+
+  fleet_event_t event;
+  for (uint32_t i = 0; i < events; i++) {
+    fleet_stream_next(&fleet_device.stream, &event);
+    fleet_device_apply(&fleet_device, &event);
+    take_records(nova, &paths, dump, &depth);
+  }
+
+  printf("trace: %u events, %u records, %u lost (%u record buffer)\n\n",
+      events, nova->trace.written, nova->trace.lost, NOVA_TRACE_SIZE);
+  trace_paths_print(stdout, &paths);
+
+  bool ok = true;
+  if (nova->trace.lost > 0) {
+    printf("FAIL: trace records lost, increase NOVA_TRACE_SIZE\n");
+    ok = false;
+  }
+  for (int path = 0; path < TRACE_PATH_COUNT; path++) {
+    if (paths.histograms[path].count == 0) {
+      printf("FAIL: no samples for a path\n");
+      ok = false;
+    }
+  }
+
+  fleet_device_free(&fleet_device);
+  return ok ? 0 : 1;
+}
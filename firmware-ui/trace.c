@@ -0,0 +1,230 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See trace.h
+ */
+
+#include "trace.h"
+
+#include <string.h>
+
+#include <nova.h>
+
+typedef struct point_info_t
+{
+  const char *name;
+  const char *a;
+  const char *b;
+} point_info_t;
+
+#define POINT_INFO(name, a, b) { #name, #a, #b },
+
+static const point_info_t points[] = {
+  NOVA_TRACE_POINTS(POINT_INFO)
+};
+
+#undef POINT_INFO
+
+static const char *path_names[TRACE_PATH_COUNT] = {
+  "press -> lights",
+  "FLASH -> ACK",
+  "release -> TRIGGER",
+};
+
+
+// ----------------------------------------------------------------------------
+// Histograms
+
+static void histogram_add(trace_histogram_t *histogram, uint32_t value)
+{
+  if (histogram->count == 0 || value < histogram->min) {
+    histogram->min = value;
+  }
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+  histogram->count++;
+  histogram->sum += value;
+
+  int bucket = 0;
+  while (bucket < 32 && value >= ((uint32_t)1 << bucket)) {
+    bucket++;
+  }
+  histogram->buckets[bucket]++;
+}
+
+/**
+ * Upper bound of the bucket holding the given fraction of values.
+ */
+static uint64_t histogram_percentile(const trace_histogram_t *histogram, double fraction)
+{
+  uint32_t target = (uint32_t)(histogram->count * fraction);
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < 33; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen > target) {
+      return (uint64_t)1 << bucket;
+    }
+  }
+  return histogram->max;
+}
+
+static void histogram_print(FILE *out, const char *name, const trace_histogram_t *histogram)
+{
+  fprintf(out, "%s: %u samples", name, histogram->count);
+  if (histogram->count == 0) {
+    fprintf(out, "\n\n");
+    return;
+  }
+  fprintf(out, ", min %u, mean %.0f, p50 <%llu, p99 <%llu, max %u\n",
+      histogram->min, (double)histogram->sum / histogram->count,
+      (unsigned long long)histogram_percentile(histogram, 0.5),
+      (unsigned long long)histogram_percentile(histogram, 0.99),
+      histogram->max);
+
+  uint32_t most = 0;
+  for (int bucket = 0; bucket < 33; bucket++) {
+    most = histogram->buckets[bucket] > most ? histogram->buckets[bucket] : most;
+  }
+  for (int bucket = 0; bucket < 33; bucket++) {
+    uint32_t count = histogram->buckets[bucket];
+    if (count == 0) {
+      continue;
+    }
+    uint64_t low = bucket == 0 ? 0 : (uint64_t)1 << (bucket - 1);
+    uint64_t high = (uint64_t)1 << bucket;
+    int bar = (int)((uint64_t)count * 40 / most);
+    fprintf(out, "  %10llu - %-10llu %10u %.*s\n",
+        (unsigned long long)low, (unsigned long long)high, count,
+        bar > 0 ? bar : 1, "########################################");
+  }
+  fprintf(out, "\n");
+}
+
+
+// ----------------------------------------------------------------------------
+// Paths
+
+void trace_paths_init(trace_paths_t *paths)
+{
+  memset(paths, 0, sizeof(trace_paths_t));
+}
+
+static void queue_path(trace_paths_t *paths, trace_path path, uint32_t at)
+{
+  if (paths->queued_count == TRACE_MAX_PENDING) {
+    return;
+  }
+  paths->queued[paths->queued_count].path = path;
+  paths->queued[paths->queued_count].at = at;
+  paths->queued_count++;
+}
+
+static void flash_received(trace_paths_t *paths, uint16_t id, uint32_t at)
+{
+  if (paths->flash_count == TRACE_MAX_PENDING) {
+    // Forget the oldest (its ACK record was probably lost).
+    memmove(&paths->flashes[0], &paths->flashes[1], sizeof(paths->flashes[0]) * --paths->flash_count);
+  }
+  paths->flashes[paths->flash_count].id = id;
+  paths->flashes[paths->flash_count].at = at;
+  paths->flash_count++;
+}
+
+static void ack_queued(trace_paths_t *paths, uint16_t id)
+{
+  for (int i = 0; i < paths->flash_count; i++) {
+    if (paths->flashes[i].id == id) {
+      queue_path(paths, TRACE_PATH_FLASH_ACK, paths->flashes[i].at);
+      paths->flash_count--;
+      memmove(&paths->flashes[i], &paths->flashes[i + 1], sizeof(paths->flashes[0]) * (paths->flash_count - i));
+      return;
+    }
+  }
+}
+
+void trace_paths_add(trace_paths_t *paths, const nova_trace_record_t *record)
+{
+  uint8_t point = record->point & ~NOVA_TRACE_PHASE_MASK;
+  uint8_t phase = record->point & NOVA_TRACE_PHASE_MASK;
+  uint32_t now = record->timestamp;
+
+  if (phase == NOVA_TRACE_ENTER) {
+    if (point == NOVA_TRACE_ON_RESET) {
+      // Anything in progress was cut off.
+      paths->pressing = false;
+      paths->releasing = false;
+      paths->flash_count = 0;
+      paths->queued_count = 0;
+    }
+    else if (point == NOVA_TRACE_ON_BUTTON_PRESSDOWN) {
+      paths->pressing = true;
+      paths->press_at = now;
+    }
+    else if (point == NOVA_TRACE_ON_BUTTON_RELEASE) {
+      paths->releasing = true;
+      paths->release_at = now;
+    }
+    else if (point == NOVA_TRACE_ON_APP_COMMAND && record->a == NOVA_CMD_FLASH) {
+      flash_received(paths, record->b, now);
+    }
+  }
+
+  else if (phase == NOVA_TRACE_INSTANT && point == NOVA_TRACE_APP_QUEUED) {
+    if (record->a == NOVA_CMD_ACK) {
+      ack_queued(paths, record->b);
+    } else if (record->a == NOVA_CMD_TRIGGER && paths->releasing) {
+      queue_path(paths, TRACE_PATH_RELEASE_TRIGGER, paths->release_at);
+    }
+  }
+
+  else if (phase == NOVA_TRACE_EXIT) {
+    if (point == NOVA_TRACE_SET_LIGHTS && paths->pressing) {
+      histogram_add(&paths->histograms[TRACE_PATH_PRESS_LIGHTS], now - paths->press_at);
+      paths->pressing = false;
+    }
+    else if (point == NOVA_TRACE_SEND_APP_COMMAND || point == NOVA_TRACE_SEND_APP_COMMANDS) {
+      // Everything queued so far has gone.
+      for (int i = 0; i < paths->queued_count; i++) {
+        histogram_add(&paths->histograms[paths->queued[i].path], now - paths->queued[i].at);
+      }
+      paths->queued_count = 0;
+    }
+    else if (point == NOVA_TRACE_ON_BUTTON_PRESSDOWN) {
+      paths->pressing = false;
+    }
+    else if (point == NOVA_TRACE_ON_BUTTON_RELEASE) {
+      paths->releasing = false;
+    }
+  }
+}
+
+void trace_paths_print(FILE *out, const trace_paths_t *paths)
+{
+  for (int path = 0; path < TRACE_PATH_COUNT; path++) {
+    histogram_print(out, path_names[path], &paths->histograms[path]);
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Records
+
+void trace_print_record(FILE *out, const nova_trace_record_t *record, int depth)
+{
+  uint8_t point = record->point & ~NOVA_TRACE_PHASE_MASK;
+  uint8_t phase = record->point & NOVA_TRACE_PHASE_MASK;
+  const char *name = point < NOVA_TRACE_POINT_COUNT ? points[point].name : "?";
+
+  fprintf(out, "%10u %*s%s %s", record->timestamp, depth * 2, "",
+      phase == NOVA_TRACE_ENTER ? ">" : phase == NOVA_TRACE_EXIT ? "<" : "*", name);
+  if (phase != NOVA_TRACE_EXIT && point < NOVA_TRACE_POINT_COUNT) {
+    if (strcmp(points[point].a, "-") != 0) {
+      fprintf(out, " %s=%u", points[point].a, record->a);
+    }
+    if (strcmp(points[point].b, "-") != 0) {
+      fprintf(out, " %s=%u", points[point].b, record->b);
+    }
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,100 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Analysis of nova.c trace records (see nova-trace.h).
+ *
+ * Feed records in order (as taken with nova_trace_take()) to
+ * trace_paths_add(), which follows them through the firmware and times
+ * each of these paths into a histogram:
+ *
+ * - press -> lights:    nova_on_button_pressdown() called, until its
+ *                       nova_set_lights() returns.
+ * - FLASH -> ACK:       nova_on_app_command() called with FLASH, until
+ *                       the nova_send_app_command(s)() carrying its ACK
+ *                       returns.
+ * - release -> TRIGGER: nova_on_button_release() called, until the
+ *                       nova_send_app_command(s)() carrying the TRIGGER
+ *                       returns.
+ *
+ * Times are in the units of nova_trace_timestamp() (nanoseconds for the
+ * fake device).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <nova-trace.h>
+
+typedef enum
+{
+  TRACE_PATH_PRESS_LIGHTS,
+  TRACE_PATH_FLASH_ACK,
+  TRACE_PATH_RELEASE_TRIGGER,
+  TRACE_PATH_COUNT
+} trace_path;
+
+/** Most FLASH commands, or commands queued for the App, followed at once. */
+#define TRACE_MAX_PENDING 8
+
+/**
+ * Histogram with power of 2 buckets: bucket n holds values below 2^n
+ * (and at least 2^(n-1)).
+ */
+typedef struct trace_histogram_t
+{
+  uint32_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+  uint32_t buckets[33];
+} trace_histogram_t;
+
+typedef struct trace_paths_t
+{
+  trace_histogram_t histograms[TRACE_PATH_COUNT];
+
+  /** Inside nova_on_button_pressdown(), before lights set. */
+  bool pressing;
+  uint32_t press_at;
+
+  /** Inside nova_on_button_release(). */
+  bool releasing;
+  uint32_t release_at;
+
+  /** FLASH commands received, whose ACK isn't queued yet. */
+  struct
+  {
+    uint16_t id;
+    uint32_t at;
+  } flashes[TRACE_MAX_PENDING];
+  uint8_t flash_count;
+
+  /** Commands queued for the App, on a path waiting for them to be sent. */
+  struct
+  {
+    trace_path path;
+    uint32_t at;
+  } queued[TRACE_MAX_PENDING];
+  uint8_t queued_count;
+
+} trace_paths_t;
+
+void trace_paths_init(trace_paths_t *paths);
+
+/**
+ * Follow the next record.
+ */
+void trace_paths_add(trace_paths_t *paths, const nova_trace_record_t *record);
+
+/**
+ * Print a histogram for each path.
+ */
+void trace_paths_print(FILE *out, const trace_paths_t *paths);
+
+/**
+ * Print one record as a line of text, indented by depth.
+ */
+void trace_print_record(FILE *out, const nova_trace_record_t *record, int depth);
@@ -0,0 +1,32 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See ui-headless.h
+ */
+
+#include "ui-headless.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "ui.h"
+
+static bool verbose = false;
+
+void ui_headless_set_verbose(bool verbose_val)
+{
+  verbose = verbose_val;
+}
+
+void ui_log(const char *msg, ...)
+{
+  if (!verbose) {
+    return;
+  }
+
+  va_list vargs;
+  va_start(vargs, msg);
+  vprintf(msg, vargs);
+  va_end(vargs);
+  putchar('\n');
+}
@@ -0,0 +1,18 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Headless replacement for the NCURSES UI (ui.c), for programs that drive
+ * the fake device without a screen (e.g. the scenario runner).
+ *
+ * Only implements ui_log() from ui.h. Log messages are discarded unless
+ * verbose mode is on, in which case they're printed to stdout.
+ */
+
+#include <stdbool.h>
+
+/**
+ * Turn printing of log messages on or off (default off).
+ */
+void ui_headless_set_verbose(bool verbose);
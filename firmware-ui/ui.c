@@ -12,6 +12,7 @@
  */
 
 #include "ui.h"
+#include "log-store.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -19,11 +20,18 @@
 #include <ncurses.h>
 
 #include <nova-internal.h>
+#include <nova-timers.h>
 
 #define boolstr(x) x ? "yes" : "no"
 
 #define LOG_ITEMS 47
-#define LOG_MSG_LEN 100
+#define LOG_FILE "firmware-ui.log"
+#define SEARCH_LEN 60
+
+// Smallest terminal the windows below fit in (help ends at row 65, the
+// log at column 164).
+#define MIN_LINES 65
+#define MIN_COLS 164
 
 static nova_t *nova;
 static fake_nova_device_t *device;
@@ -35,7 +43,61 @@ static WINDOW *window_state;
 static WINDOW *window_help;
 static WINDOW *window_log;
 
-static char log_buffer[LOG_ITEMS][LOG_MSG_LEN];
+/** Every message logged, recent ones in memory, the rest in LOG_FILE.N. */
+static log_store_t *log_store;
+
+/** Messages logged when the log window was last painted. */
+static uint64_t log_shown;
+
+/**
+ * Scrollback: whether the log window is showing older messages rather
+ * than following new ones, and if so the seq after the last one shown.
+ * The last search, and the message it found (-1 if none) to highlight.
+ */
+static bool log_scrolled;
+static uint64_t log_view_end;
+static char log_search[SEARCH_LEN];
+static int64_t log_match = -1;
+static bool log_not_found;
+
+/** Scrolling or searching changed what the log window shows. */
+static bool log_moved;
+
+/**
+ * Windows are only repainted when what they show has changed, so
+ * refreshing is cheap when idle and little is sent to the terminal.
+ * Whether anything has been painted yet, and device->generation when
+ * last painted.
+ */
+static bool painted;
+static uint32_t painted_generation;
+
+/** What the timer window shows (it changes with time, not generation). */
+typedef struct timer_view_t
+{
+  bool active;
+  uint64_t remaining;
+  uint64_t timeout;
+} timer_view_t;
+
+#define TIMER_VIEWS 4
+
+static timer_view_t timers_shown[TIMER_VIEWS];
+
+/** Event loop whose timer lateness is shown, if any. */
+static const event_loop_t *event_loop;
+
+/** Event loop figures in the timer window. */
+typedef struct event_loop_view_t
+{
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t max;
+  uint32_t fired;
+  uint32_t wakeups;
+} event_loop_view_t;
+
+static event_loop_view_t event_loop_shown;
 
 #define STYLE_NORMAL 1
 #define STYLE_FRAME 2
@@ -52,8 +114,9 @@ void ui_init(nova_t *nova_val, fake_nova_device_t *device_val)
   nova = nova_val;
   device = device_val;
 
-  for (int i = 0; i < LOG_ITEMS; i++) {
-    log_buffer[i][0] = 0;
+  log_store = log_store_open(LOG_FILE);
+  if (!log_store) {
+    log_store = log_store_open(NULL);
   }
 
   initscr();
@@ -62,6 +125,14 @@ void ui_init(nova_t *nova_val, fake_nova_device_t *device_val)
   cbreak();
   start_color();
 
+  if (LINES < MIN_LINES || COLS < MIN_COLS) {
+    int lines = LINES, cols = COLS;
+    endwin();
+    fprintf(stderr, "firmware-ui needs a terminal at least %dx%d, this one is %dx%d\n",
+        MIN_COLS, MIN_LINES, cols, lines);
+    exit(1);
+  }
+
   init_pair(STYLE_NORMAL, COLOR_WHITE, COLOR_BLACK);
   init_pair(STYLE_FRAME, COLOR_MAGENTA, COLOR_BLACK);
   init_pair(STYLE_TITLE, COLOR_YELLOW, COLOR_BLACK);
@@ -71,11 +142,22 @@ void ui_init(nova_t *nova_val, fake_nova_device_t *device_val)
   init_pair(STYLE_TIMER, COLOR_RED, COLOR_RED);
 
   window_hardware = newwin(5, 60, 1, 1);
-  window_timer = newwin(3, 60, 7, 1);
-  window_counters = newwin(9, 60, 11, 1);
-  window_state = newwin(19, 60, 21, 1);
-  window_help = newwin(9, 60, 41, 1);
+  window_timer = newwin(8, 60, 7, 1);
+  window_counters = newwin(15, 60, 16, 1);
+  window_state = newwin(19, 60, 32, 1);
+  window_help = newwin(13, 60, 52, 1);
   window_log = newwin(LOG_ITEMS + 2, 100, 1, 64);
+
+  // New log messages scroll the lines between the borders up.
+  scrollok(window_log, TRUE);
+  wsetscrreg(window_log, 1, LOG_ITEMS);
+
+  // getch() refreshes stdscr if touched, which would blank the windows
+  // over it that aren't repainted every time (e.g. help).
+  refresh();
+
+  painted = false;
+  log_shown = log_store_count(log_store);
 }
 
 void ui_finish()
@@ -87,22 +169,78 @@ void ui_finish()
   delwin(window_log);
   delwin(window_help);
   endwin();
+  log_store_close(log_store);
+  log_store = NULL;
 }
 
-void ui_log(const char *msg, ...)
+void ui_show_event_loop(const event_loop_t *loop)
 {
-  // move everything along in the log items
-  memcpy(log_buffer[1], log_buffer[0], sizeof(char[LOG_MSG_LEN]) * (LOG_ITEMS - 1));
+  event_loop = loop;
+}
 
-  // format from var-args
+void ui_log(const char *msg, ...)
+{
+  if (!log_store) {
+    return;
+  }
   va_list vargs;
   va_start(vargs, msg);
-  char formatted[LOG_MSG_LEN];
-  vsprintf(formatted, msg, vargs);
+  log_store_vappend(log_store, msg, vargs);
   va_end(vargs);
+}
 
-  // set front of array
-  strncpy(log_buffer[0], formatted, sizeof(char[LOG_MSG_LEN]));
+/**
+ * Show the LOG_ITEMS messages before end, or follow new ones if end is
+ * the latest.
+ */
+static void scroll_log_to(uint64_t end)
+{
+  uint64_t count = log_store_count(log_store);
+  uint64_t earliest = log_store_oldest(log_store) + LOG_ITEMS;
+  if (end < earliest) {
+    end = earliest;
+  }
+  log_scrolled = end < count;
+  log_view_end = end;
+  log_not_found = false;
+  log_moved = true;
+}
+
+/**
+ * Prompt for text on the log window's bottom border, and find the latest
+ * message containing it before the one found last (or the bottom line).
+ * Empty text repeats the last search.
+ */
+static void search_log()
+{
+  char text[SEARCH_LEN];
+  int line = LOG_ITEMS + 1;
+
+  wattron(window_log, COLOR_PAIR(STYLE_TITLE));
+  mvwprintw(window_log, line, 1, " search: ");
+  wattroff(window_log, COLOR_PAIR(STYLE_TITLE));
+  echo();
+  curs_set(TRUE);
+  timeout(-1);
+  wgetnstr(window_log, text, sizeof(text) - 1);
+  noecho();
+  curs_set(FALSE);
+
+  if (text[0]) {
+    strcpy(log_search, text);
+    log_match = -1;
+  }
+  if (log_search[0]) {
+    uint64_t before = log_match >= 0 ? (uint64_t)log_match
+        : log_scrolled ? log_view_end : log_store_count(log_store);
+    int64_t found = log_store_search(log_store, log_search, before);
+    log_not_found = found < 0;
+    if (found >= 0) {
+      log_match = found;
+      scroll_log_to((uint64_t)found + LOG_ITEMS / 2 + 1);
+    }
+  }
+  log_moved = true;
 }
 
 ui_action ui_get_action(int timeout)
@@ -110,6 +248,17 @@ ui_action ui_get_action(int timeout)
   timeout(timeout);
   int c = getch();
   switch (c) {
+    case '[':
+      scroll_log_to((log_scrolled ? log_view_end : log_store_count(log_store)) - LOG_ITEMS);
+      return UI_ACTION_NO_OP;
+    case ']':
+      if (log_scrolled) {
+        scroll_log_to(log_view_end + LOG_ITEMS);
+      }
+      return UI_ACTION_NO_OP;
+    case '/':
+      search_log();
+      return UI_ACTION_NO_OP;
     case 'q':
     case 'Q':
       return UI_ACTION_QUIT;
@@ -122,6 +271,9 @@ ui_action ui_get_action(int timeout)
     case 'r':
     case 'R':
       return UI_ACTION_RESET;
+    case 'b':
+    case 'B':
+      return UI_ACTION_BROWNOUT;
     case 'p':
     case 'P':
       return UI_ACTION_APP_PING;
@@ -133,6 +285,9 @@ ui_action ui_get_action(int timeout)
       return UI_ACTION_TRIGGER_PRESSDOWN;
     case '5':
       return UI_ACTION_TRIGGER_RELEASE;
+    case 'n':
+    case 'N':
+      return UI_ACTION_SKIP_TO_TIMER;
     default:
       return UI_ACTION_NO_OP;
   }
@@ -160,21 +315,73 @@ void render_hardware(WINDOW *win)
   wattroff(win, COLOR_PAIR(STYLE_COOL));
 }
 
-void render_timer(WINDOW* win)
+void render_timer_line(WINDOW* win, int line, const char *name, bool active, uint64_t remaining, uint64_t timeout)
 {
-  if (device->flash_timer.active) {
-    // flash_timer.scheduled
-    mvwprintw(win, 1, 2, "flash timer   : [                    ] %ums",
-        device->flash_timer.remaining);
+  if (active) {
+    mvwprintw(win, line, 2, "%-14s: [                    ] %lums", name, (unsigned long)remaining);
     wattron(win, COLOR_PAIR(STYLE_TIMER));
-    for (int i = 0; i < 20.0 * ((float)device->flash_timer.remaining / (float)device->flash_timer.timeout); i++) {
-      mvwprintw(win, 1, 19 + i, "#");
+    for (int i = 0; timeout > 0 && i < 20 && i < 20.0 * ((float)remaining / (float)timeout); i++) {
+      mvwprintw(win, line, 19 + i, "#");
     }
     wattroff(win, COLOR_PAIR(STYLE_TIMER));
   }
   else {
-    mvwprintw(win, 1, 2, "flash timer   : inactive");
+    mvwprintw(win, line, 2, "%-14s: inactive", name);
+  }
+}
+
+/**
+ * Get what the timer window would show now.
+ */
+static void view_timers(timer_view_t views[TIMER_VIEWS])
+{
+  memset(views, 0, sizeof(timer_view_t) * TIMER_VIEWS);
+
+  // Logical timers inside nova_t.
+  nova_timer_t *logical[] = { &nova->flash_timer, &nova->flash_at_timer, &nova->counters_timer };
+  for (int i = 0; i < 3; i++) {
+    views[i].active = nova_timer_is_armed(logical[i]);
+    views[i].remaining = views[i].active ? nova_timer_remaining(nova, logical[i]) : 0;
+    views[i].timeout = views[i].active ? nova_timer_timeout(logical[i]) : 0;
+  }
+
+  // The single hardware timer they're multiplexed onto.
+  views[3].active = device->hardware_timer.active;
+  views[3].remaining = views[3].active ? device->hardware_timer.remaining : 0;
+  views[3].timeout = views[3].active ? device->hardware_timer.timeout : 0;
+}
+
+/**
+ * Get what the timer window would show of the event loop now.
+ */
+static void view_event_loop(event_loop_view_t *view)
+{
+  memset(view, 0, sizeof(event_loop_view_t));
+  if (event_loop) {
+    view->fired = event_loop->lateness.count;
+    view->p50 = event_loop_lateness_percentile(&event_loop->lateness, 0.5);
+    view->p99 = event_loop_lateness_percentile(&event_loop->lateness, 0.99);
+    view->max = event_loop->lateness.max;
+    view->wakeups = event_loop->wakeups;
+  }
+}
+
+void render_timer(WINDOW* win)
+{
+  static const char *names[TIMER_VIEWS] = { "flash timer", "flash at timer", "counters timer", "hardware timer" };
+  for (int i = 0; i < TIMER_VIEWS; i++) {
+    render_timer_line(win, i + 1, names[i], timers_shown[i].active,
+        timers_shown[i].remaining, timers_shown[i].timeout);
+  }
+  if (event_loop_shown.fired > 0) {
+    mvwprintw(win, TIMER_VIEWS + 1, 2, "%-14s: p50 <%luus p99 <%luus max %luus", "fired late",
+        (unsigned long)event_loop_shown.p50, (unsigned long)event_loop_shown.p99,
+        (unsigned long)event_loop_shown.max);
+  } else {
+    mvwprintw(win, TIMER_VIEWS + 1, 2, "%-14s: -", "fired late");
   }
+  mvwprintw(win, TIMER_VIEWS + 2, 2, "%-14s: %lu (%lu timers fired)", "wakeups",
+      (unsigned long)event_loop_shown.wakeups, (unsigned long)event_loop_shown.fired);
 }
 
 void render_counters(WINDOW *win)
@@ -187,6 +394,19 @@ void render_counters(WINDOW *win)
   mvwprintw(win, line++, 2, "flash_button_native ....... = %lu", nova->counters.flash_button_native);
   mvwprintw(win, line++, 2, "flash_button_disconnected . = %lu", nova->counters.flash_button_disconnected);
   mvwprintw(win, line++, 2, "flash_remote_app .......... = %lu", nova->counters.flash_remote_app);
+  line++;
+  mvwprintw(win, line++, 2, "saves: %u (%u avoided), unsaved: %u (worst case %u)",
+      device->counters_saves, fake_nova_device_saves_avoided(device),
+      fake_nova_device_counters_unsaved(device), device->counters_worst_unsaved);
+  mvwprintw(win, line++, 2, "increments lost to power cuts: %u", device->counters_lost);
+  mvwprintw(win, line++, 2, "flash words written: %u, pages erased: %u",
+      device->counters_flash.word_writes, device->counters_flash.page_erases);
+  mvwprintw(win, line++, 2, "flash busy: %lums (last op %uus), active page: %u",
+      (unsigned long)(device->counters_flash.busy_us / 1000), device->counters_flash.last_op_us,
+      device->counters_log.active_page);
+  mvwprintw(win, line++, 2, "page wear: %u %u %u %u",
+      device->counters_flash.page_wear[0], device->counters_flash.page_wear[1],
+      device->counters_flash.page_wear[2], device->counters_flash.page_wear[3]);
 }
 
 void render_state(WINDOW *win)
@@ -214,44 +434,130 @@ void render_state(WINDOW *win)
 void render_help(WINDOW* win)
 {
   int line = 1;
-  mvwprintw(win, line++, 2, "R     : reset (power on)");
+  mvwprintw(win, line++, 2, "R     : reset (power cut, unsaved counters lost)");
+  mvwprintw(win, line++, 2, "B     : brownout (power failing warning, then reset)");
   mvwprintw(win, line++, 2, "A     : toggle BLE App connectivity");
   mvwprintw(win, line++, 2, "H     : toggle BLE HID connectivity");
   mvwprintw(win, line++, 2, "P     : simulate PING from App");
   mvwprintw(win, line++, 2, "1, 2  : simulate FLASH, OFF from App");
   mvwprintw(win, line++, 2, "4, 5  : simulate trigger button PRESS, RELEASE");
+  mvwprintw(win, line++, 2, "N     : skip time ahead to next timer");
+  mvwprintw(win, line++, 2, "[, ]  : scroll debug log back, forward");
+  mvwprintw(win, line++, 2, "/     : search debug log back (empty repeats)");
   mvwprintw(win, line++, 2, "Q     : quit");
 }
 
 void render_log(WINDOW* win)
 {
+  uint64_t end = log_scrolled ? log_view_end : log_store_count(log_store);
+  char msg[LOG_STORE_MSG_LEN];
   for (int i = 0; i < LOG_ITEMS; i++) {
-    mvwprintw(win, i + 1, 2, log_buffer[LOG_ITEMS - i - 1]);
+    uint64_t back = (uint64_t)(LOG_ITEMS - i);
+    if (back > end || !log_store_get(log_store, end - back, msg, sizeof(msg))) {
+      continue;
+    }
+    bool match = (int64_t)(end - back) == log_match;
+    if (match) {
+      wattron(win, A_REVERSE);
+    }
+    mvwprintw(win, i + 1, 2, "%s", msg);
+    if (match) {
+      wattroff(win, A_REVERSE);
+    }
   }
 }
 
+/**
+ * Repaint a whole window: frame, title and contents.
+ */
+static void render(WINDOW *win, void (*render_func)(WINDOW *win), const char *title)
+{
+  werase(win);
+  wattron(win, COLOR_PAIR(STYLE_FRAME));
+  box(win, 0, 0);
+  wattroff(win, COLOR_PAIR(STYLE_FRAME));
+  wattron(win, COLOR_PAIR(STYLE_TITLE));
+  mvwprintw(win, 0, 1, " %s ", title);
+  wattroff(win, COLOR_PAIR(STYLE_TITLE));
+  wattron(win, COLOR_PAIR(STYLE_NORMAL));
+  render_func(win);
+  wattroff(win, COLOR_PAIR(STYLE_NORMAL));
+  wnoutrefresh(win);
+}
+
+/**
+ * Add lines logged since last shown to the bottom of the log window,
+ * scrolling the rest up, rather than repainting it all.
+ */
+static void render_log_added(WINDOW *win, uint32_t added)
+{
+  int width = getmaxx(win);
+  uint64_t count = log_store_count(log_store);
+  char msg[LOG_STORE_MSG_LEN];
+  wscrl(win, (int)added);
+  for (uint32_t i = 0; i < added; i++) {
+    int line = LOG_ITEMS - (int)i;
+    log_store_get(log_store, count - 1 - i, msg, sizeof(msg));
+    // Scrolling blanks the new lines, frame included. (Drawn as lines, as
+    // a character in the last column would scroll again.)
+    wattron(win, COLOR_PAIR(STYLE_FRAME));
+    mvwvline(win, line, 0, ACS_VLINE, 1);
+    mvwvline(win, line, width - 1, ACS_VLINE, 1);
+    wattroff(win, COLOR_PAIR(STYLE_FRAME));
+    wattron(win, COLOR_PAIR(STYLE_NORMAL));
+    mvwprintw(win, line, 2, "%s", msg);
+    wattroff(win, COLOR_PAIR(STYLE_NORMAL));
+  }
+  wnoutrefresh(win);
+}
+
 void ui_refresh()
 {
-  #define render(win, render_func, title) {\
-      wclear(win); \
-      wattron(win, COLOR_PAIR(STYLE_FRAME)); \
-      box(win, 0, 0); \
-      wattroff(win, COLOR_PAIR(STYLE_FRAME)); \
-      wattron(win, COLOR_PAIR(STYLE_TITLE)); \
-      mvwprintw(win, 0, 1, " %s ", title); \
-      wattroff(win, COLOR_PAIR(STYLE_TITLE)); \
-      wattron(win, COLOR_PAIR(STYLE_NORMAL)); \
-      render_func(win); \
-      wattroff(win, COLOR_PAIR(STYLE_NORMAL)); \
-      wnoutrefresh(win); \
-    }
+  bool changed = !painted || device->generation != painted_generation;
 
-  render(window_hardware, render_hardware, "HARDWARE");
-  render(window_timer, render_timer, "TIMER");
-  render(window_counters, render_counters, "COUNTERS");
-  render(window_state, render_state, "INTERNAL STATE");
-  render(window_help, render_help, "HELP");
-  render(window_log, render_log, "DEBUG LOG");
+  if (!painted) {
+    render(window_help, render_help, "HELP");
+  }
+
+  if (changed) {
+    render(window_hardware, render_hardware, "HARDWARE");
+    render(window_counters, render_counters, "COUNTERS");
+    render(window_state, render_state, "INTERNAL STATE");
+  }
+
+  // Timers count down between changes.
+  timer_view_t timers[TIMER_VIEWS];
+  event_loop_view_t loop;
+  view_timers(timers);
+  view_event_loop(&loop);
+  if (changed || memcmp(timers, timers_shown, sizeof(timers)) != 0
+      || memcmp(&loop, &event_loop_shown, sizeof(loop)) != 0) {
+    memcpy(timers_shown, timers, sizeof(timers));
+    event_loop_shown = loop;
+    render(window_timer, render_timer, "TIMER");
+  }
+
+  // While scrolled back, new messages don't change what's shown.
+  uint64_t count = log_store_count(log_store);
+  uint64_t added = log_scrolled ? 0 : count - log_shown;
+  if (!painted || log_moved || added >= LOG_ITEMS) {
+    char title[SEARCH_LEN + 40];
+    if (log_not_found) {
+      snprintf(title, sizeof(title), "DEBUG LOG: not found: %s", log_search);
+    } else if (log_scrolled) {
+      snprintf(title, sizeof(title), "DEBUG LOG: %lu to %lu of %lu (] for latest)",
+          (unsigned long)(log_view_end - LOG_ITEMS + 1), (unsigned long)log_view_end, (unsigned long)count);
+    } else {
+      snprintf(title, sizeof(title), "DEBUG LOG");
+    }
+    render(window_log, render_log, title);
+    log_moved = false;
+  } else if (added > 0) {
+    render_log_added(window_log, (uint32_t)added);
+  }
+  log_shown = count;
 
+  painted = true;
+  painted_generation = device->generation;
   doupdate();
 }
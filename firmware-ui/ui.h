@@ -12,6 +12,7 @@
  */
 
 #include "fake-nova-device.h"
+#include "util/eventloop.h"
 
 #include <nova.h>
 
@@ -25,13 +26,15 @@ typedef enum
   UI_ACTION_NO_OP,
   UI_ACTION_QUIT,
   UI_ACTION_RESET,
+  UI_ACTION_BROWNOUT,
   UI_ACTION_TOGGLE_APP,
   UI_ACTION_TOGGLE_HID,
   UI_ACTION_APP_PING,
   UI_ACTION_APP_FLASH,
   UI_ACTION_APP_OFF,
   UI_ACTION_TRIGGER_PRESSDOWN,
-  UI_ACTION_TRIGGER_RELEASE
+  UI_ACTION_TRIGGER_RELEASE,
+  UI_ACTION_SKIP_TO_TIMER
 } ui_action;
 
 /**
@@ -45,12 +48,20 @@ void ui_init(nova_t *nova, fake_nova_device_t *device);
 void ui_finish();
 
 /**
- * Refresh all data on UI screen.
+ * Refresh data on UI screen: repaints whatever has changed since the
+ * last call (see fake_nova_device_t.generation), so it's cheap when
+ * nothing has.
  *
  * Call this regularly.
  */
 void ui_refresh();
 
+/**
+ * Show how late the event loop fires timers, and how often it wakes up,
+ * in the timer window. loop must stay valid while the UI is.
+ */
+void ui_show_event_loop(const event_loop_t *loop);
+
 /**
  * Append a log message to the UI screen.
  *
@@ -8,74 +8,203 @@
 
 #include <stddef.h>
 
-uint64_t millis_now();
+static void reset(basic_timer_t *timer)
+{
+  timer->active = false;
+  timer->callback = NULL;
+  timer->data = NULL;
+  timer->expires = 0;
+  timer->timeout = 0;
+  timer->remaining = 0;
+  timer->next = NULL;
+}
+
+/**
+ * Remove timer from queue (if it's in it).
+ */
+static void unlink(basic_timer_queue_t *queue, basic_timer_t *timer)
+{
+  for (basic_timer_t **link = &queue->head; *link; link = &(*link)->next) {
+    if (*link == timer) {
+      *link = timer->next;
+      timer->next = NULL;
+      return;
+    }
+  }
+}
+
+static uint64_t monotonic_micros_now();
+
+void basic_clock_init_real(basic_clock_t *clock)
+{
+  clock->mode = BASIC_CLOCK_REAL;
+  clock->now = 0;
+  clock->offset = 0;
+}
+
+void basic_clock_init_virtual(basic_clock_t *clock, uint64_t start)
+{
+  clock->mode = BASIC_CLOCK_VIRTUAL;
+  clock->now = start;
+  clock->offset = 0;
+}
+
+uint64_t basic_clock_now(basic_clock_t *clock)
+{
+  if (clock->mode == BASIC_CLOCK_VIRTUAL) {
+    return clock->now;
+  }
+  return monotonic_micros_now() / 1000 + clock->offset;
+}
+
+uint64_t basic_clock_now_micros(basic_clock_t *clock)
+{
+  if (clock->mode == BASIC_CLOCK_VIRTUAL) {
+    return clock->now * 1000;
+  }
+  return monotonic_micros_now() + clock->offset * 1000;
+}
+
+void basic_clock_skip(basic_clock_t *clock, uint64_t millis)
+{
+  if (clock->mode == BASIC_CLOCK_VIRTUAL) {
+    clock->now += millis;
+  } else {
+    clock->offset += millis;
+  }
+}
+
+void basic_timer_queue_init(basic_timer_queue_t *queue, basic_clock_t *clock)
+{
+  queue->head = NULL;
+  queue->clock = clock;
+}
 
-void basic_timer_schedule(basic_timer_t *timer, uint64_t timeout, basic_timer_callback callback, void *data)
+void basic_timer_schedule(basic_timer_queue_t *queue, basic_timer_t *timer,
+    uint64_t timeout, basic_timer_callback callback, void *data)
 {
+  if (timer->active) {
+    unlink(queue, timer);
+  }
+
   timer->active = true;
   timer->callback = callback;
   timer->data = data;
-  timer->expires = millis_now() + (uint64_t)timeout;
+  timer->expires = basic_clock_now(queue->clock) + (uint64_t)timeout;
   timer->timeout = timeout;
   timer->remaining = timeout;
+
+  // Insert in expiry order, after any timers expiring at the same time.
+  basic_timer_t **link = &queue->head;
+  while (*link && (*link)->expires <= timer->expires) {
+    link = &(*link)->next;
+  }
+  timer->next = *link;
+  *link = timer;
 }
 
-void basic_timer_clear(basic_timer_t *timer)
+void basic_timer_clear(basic_timer_queue_t *queue, basic_timer_t *timer)
 {
-  timer->active = false;
-  timer->callback = NULL;
-  timer->data = NULL;
-  timer->expires = 0;
-  timer->timeout = 0;
-  timer->remaining = 0;
+  if (timer->active) {
+    unlink(queue, timer);
+  }
+  reset(timer);
 }
 
-void basic_timer_tick(basic_timer_t *timer)
+void basic_timer_tick(basic_timer_queue_t *queue)
 {
-  if (timer->active) {
-    uint64_t now = millis_now();
-    if (now >= timer->expires) {
-      timer->callback(timer, timer->data);
-      basic_timer_clear(timer);
-    } else {
-      timer->remaining = (timer->expires - now);
+  uint64_t now = basic_clock_now(queue->clock);
+
+  while (queue->head && now >= queue->head->expires) {
+    basic_timer_t *timer = queue->head;
+    basic_timer_callback callback = timer->callback;
+    void *data = timer->data;
+
+    // Clear before running callback, as it may reschedule the timer.
+    queue->head = timer->next;
+    reset(timer);
+    callback(timer, data);
+  }
+
+  for (basic_timer_t *timer = queue->head; timer; timer = timer->next) {
+    timer->remaining = timer->expires - now;
+  }
+}
+
+bool basic_timer_queue_active(basic_timer_queue_t *queue)
+{
+  return queue->head != NULL;
+}
+
+uint64_t basic_timer_queue_next(basic_timer_queue_t *queue)
+{
+  uint64_t now = basic_clock_now(queue->clock);
+  return queue->head->expires > now ? queue->head->expires - now : 0;
+}
+
+void basic_timer_advance(basic_timer_queue_t *queue, uint64_t millis)
+{
+  uint64_t target = basic_clock_now(queue->clock) + millis;
+
+  // Step through each expiry in turn. Callbacks may schedule new timers
+  // that also expire before the target.
+  while (queue->head && queue->head->expires <= target) {
+    uint64_t now = basic_clock_now(queue->clock);
+    if (queue->head->expires > now) {
+      basic_clock_skip(queue->clock, queue->head->expires - now);
     }
+    basic_timer_tick(queue);
   }
+
+  uint64_t now = basic_clock_now(queue->clock);
+  if (target > now) {
+    basic_clock_skip(queue->clock, target - now);
+  }
+  basic_timer_tick(queue);
+}
+
+bool basic_timer_advance_to_next(basic_timer_queue_t *queue)
+{
+  if (!queue->head) {
+    return false;
+  }
+  basic_timer_advance(queue, basic_timer_queue_next(queue));
+  return true;
 }
 
 // ---- Platform specific time functions ----
 
 #ifdef __MACH__ // Mac OS X
 
-  #include <sys/time.h>
+  #include <mach/mach_time.h>
 
-  uint64_t millis_now()
+  static uint64_t monotonic_micros_now()
   {
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    return (time.tv_sec * 1000) + (time.tv_usec / 1000);
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+      mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
   }
 
 #elif _WIN32 // Windows
 
   #include "windows.h"
 
-  uint64_t millis_now()
+  static uint64_t monotonic_micros_now()
   {
-    SYSTEMTIME time;
-    GetSystemTime(&time);
-    return (time.wSeconds * 1000) + time.wMilliseconds;
+    return GetTickCount64() * 1000;
   }
 
 #else // Linux
 
   #include <time.h>
 
-  uint64_t millis_now()
+  static uint64_t monotonic_micros_now()
   {
     struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
-    return (time.tv_sec * 1000) + round(time.tv_nsec / 1000000);
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t)time.tv_sec * 1000000) + (time.tv_nsec / 1000);
   }
 
 #endif
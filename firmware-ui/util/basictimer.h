@@ -3,20 +3,37 @@
 #pragma once
 
 /**
- * A very basic mechanism for scheduling a callback to run after elapsed
+ * A very basic mechanism for scheduling callbacks to run after elapsed
  * milliseconds.
  *
- * This is not particulary precise, but good enough for humans.
+ * Any number of timers can be scheduled at once. They're kept in a
+ * basic_timer_queue_t, sorted by expiry time.
+ *
+ * Time comes from a basic_clock_t, which is either:
+ *
+ * - real: the system's monotonic clock (CLOCK_MONOTONIC on Linux). Not
+ *   particulary precise, but good enough for humans.
+ *
+ * - virtual: time stands still until explicitly advanced with
+ *   basic_timer_advance() or basic_timer_advance_to_next(), which jump
+ *   straight to each timer's expiry and fire it at exactly the right
+ *   time. Use this for scripted simulations that should run as fast as
+ *   possible with reproducible timing.
  *
  * Usage:
  *
- *   // Step 1: Create a basic_timer_t. Keep it around for as long as any
- *   //         timers are running.
+ *   // Step 1: Create a clock, a basic_timer_queue_t, and a basic_timer_t
+ *   //         for each thing you want to schedule. Keep them around for
+ *   //         as long as any timers are running.
+ *   basic_clock_t my_clock;
+ *   basic_timer_queue_t my_queue;
  *   basic_timer_t my_timer;
+ *   basic_clock_init_real(&my_clock);
+ *   basic_timer_queue_init(&my_queue, &my_clock);
  *
  *   // Step 2: Define your callback. This will be called when your timer
  *   //         expires.
- *   void some_callback(basic_timer *timer, void *data)
+ *   void some_callback(basic_timer_t *timer, void *data)
  *   {
  *     printf("this is called later\n");
  *   }
@@ -25,16 +42,16 @@
  *   //         from now. The final arg (NULL) is arbitrary data you can pass
  *   //         to the callback.
  *   void somewhere_else() {
- *     basic_timer_schedule(my_timer, 2000, some_callback, NULL);
+ *     basic_timer_schedule(&my_queue, &my_timer, 2000, some_callback, NULL);
  *   }
  *
  *   // Step 4: In your main loop, regularly call basic_timer_tick(), which
- *   //         will check if your timer has expired and trigger the callback
- *   //         if necessary.
+ *   //         will check if any timers have expired and trigger the
+ *   //         callbacks if necessary.
  *   int main() {
  *     for(;;) {
  *       // do some work
- *       basic_timer_tick(my_timer); // non-blocking
+ *       basic_timer_tick(&my_queue); // non-blocking
  *     }
  *   }
  */
@@ -44,6 +61,56 @@
 
 struct basic_timer_t;
 
+/**
+ * Where time comes from. See above.
+ */
+typedef enum
+{
+  BASIC_CLOCK_REAL,
+  BASIC_CLOCK_VIRTUAL
+} basic_clock_mode;
+
+/**
+ * A source of time, in milliseconds.
+ */
+typedef struct basic_clock_t
+{
+  basic_clock_mode mode;
+
+  /** Current time, if virtual. */
+  uint64_t now;
+
+  /** Time skipped ahead with basic_clock_skip(), if real. */
+  uint64_t offset;
+
+} basic_clock_t;
+
+/**
+ * Initialize clock to follow the system's monotonic clock.
+ */
+void basic_clock_init_real(basic_clock_t *clock);
+
+/**
+ * Initialize clock to virtual time, starting at start.
+ */
+void basic_clock_init_virtual(basic_clock_t *clock, uint64_t start);
+
+/**
+ * Current time in milliseconds.
+ */
+uint64_t basic_clock_now(basic_clock_t *clock);
+
+/**
+ * Current time in microseconds (on the same scale, so milliseconds from
+ * basic_clock_now() * 1000).
+ */
+uint64_t basic_clock_now_micros(basic_clock_t *clock);
+
+/**
+ * Move clock forwards. Works for real clocks too (time jumps ahead).
+ */
+void basic_clock_skip(basic_clock_t *clock, uint64_t millis);
+
 /**
  * Timer callback function, triggered when timer expires.
  *
@@ -77,26 +144,76 @@ typedef struct basic_timer_t
   /** Arbitrary user data to pass to callback function. */
   void *data;
 
+  /** Next timer in queue (expiring at the same time or later). */
+  struct basic_timer_t *next;
+
 } basic_timer_t;
 
+/**
+ * Set of scheduled timers, sorted by expiry.
+ */
+typedef struct basic_timer_queue_t
+{
+  /** Timer that will expire first, or NULL if none are active. */
+  basic_timer_t *head;
+
+  /** Where time comes from. */
+  basic_clock_t *clock;
+
+} basic_timer_queue_t;
+
+/**
+ * Initialize an empty queue, using clock for time.
+ */
+void basic_timer_queue_init(basic_timer_queue_t *queue, basic_clock_t *clock);
+
 /**
  * Schedule a callback to be run in the future.
  *
- * Timeout is in milliseconds.
+ * Timeout is in milliseconds. If the timer is already scheduled, it's
+ * rescheduled.
  *
  * If data is provided, it will be passed to callback. Use NULL if not needed.
  */
-void basic_timer_schedule(basic_timer_t *timer, uint64_t timeout, basic_timer_callback callback, void *data);
+void basic_timer_schedule(basic_timer_queue_t *queue, basic_timer_t *timer,
+    uint64_t timeout, basic_timer_callback callback, void *data);
 
 /**
  * If a timer was previously scheduled, unschedule it.
  *
  * There's no harm in calling this if nothing is scheduled - it's a no-op.
  */
-void basic_timer_clear(basic_timer_t *timer);
+void basic_timer_clear(basic_timer_queue_t *queue, basic_timer_t *timer);
+
+/**
+ * Call this regularly in your main run loop - it will check if any timers
+ * need to be fired and do so, in order of expiry.
+ *
+ * Callbacks may schedule or clear timers (including the one that fired).
+ */
+void basic_timer_tick(basic_timer_queue_t *queue);
 
 /**
- * Call this regularly in your main run loop - it will check if the timer needs to be fired
- * and do so if necessary.
+ * Are any timers active?
+ */
+bool basic_timer_queue_active(basic_timer_queue_t *queue);
+
+/**
+ * Milliseconds until the next timer expires. Only valid if
+ * basic_timer_queue_active().
+ */
+uint64_t basic_timer_queue_next(basic_timer_queue_t *queue);
+
+/**
+ * Move the clock forwards by millis, firing every timer that expires
+ * along the way at exactly its expiry time (in order).
+ */
+void basic_timer_advance(basic_timer_queue_t *queue, uint64_t millis);
+
+/**
+ * Move the clock straight to the next timer expiry and fire it (and any
+ * others expiring at the same time).
+ *
+ * Returns false (and does nothing) if no timers are active.
  */
-void basic_timer_tick(basic_timer_t *timer);
+bool basic_timer_advance_to_next(basic_timer_queue_t *queue);
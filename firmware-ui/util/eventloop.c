@@ -0,0 +1,266 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See eventloop.h for usage.
+ */
+
+#include "eventloop.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+static bool platform_init(event_loop_t *loop);
+static bool platform_watch(event_loop_t *loop, int fd);
+static void platform_unwatch(event_loop_t *loop, int fd);
+static void platform_wait(event_loop_t *loop, int max_wait);
+static void platform_free(event_loop_t *loop);
+
+bool event_loop_init(event_loop_t *loop, basic_timer_queue_t *timers)
+{
+  memset(loop, 0, sizeof(event_loop_t));
+  loop->timers = timers;
+  loop->epoll_fd = -1;
+  loop->timer_fd = -1;
+  return platform_init(loop);
+}
+
+bool event_loop_watch(event_loop_t *loop, int fd, event_loop_callback callback, void *data)
+{
+  if (loop->watch_count == EVENT_LOOP_MAX_WATCHES) {
+    errno = ENOSPC;
+    return false;
+  }
+  if (!platform_watch(loop, fd)) {
+    return false;
+  }
+  loop->watches[loop->watch_count].fd = fd;
+  loop->watches[loop->watch_count].callback = callback;
+  loop->watches[loop->watch_count].data = data;
+  loop->watch_count++;
+  return true;
+}
+
+void event_loop_unwatch(event_loop_t *loop, int fd)
+{
+  for (int i = 0; i < loop->watch_count; i++) {
+    if (loop->watches[i].fd == fd) {
+      platform_unwatch(loop, fd);
+      loop->watch_count--;
+      memmove(&loop->watches[i], &loop->watches[i + 1], sizeof(loop->watches[0]) * (loop->watch_count - i));
+      return;
+    }
+  }
+}
+
+/**
+ * Run the callback for fd, if it's still watched (an earlier callback
+ * may have unwatched it).
+ */
+static void dispatch(event_loop_t *loop, int fd)
+{
+  for (int i = 0; i < loop->watch_count; i++) {
+    if (loop->watches[i].fd == fd) {
+      loop->watches[i].callback(fd, loop->watches[i].data);
+      return;
+    }
+  }
+}
+
+static void lateness_add(event_loop_lateness_t *lateness, uint64_t value)
+{
+  if (value > lateness->max) {
+    lateness->max = value;
+  }
+  lateness->count++;
+
+  int bucket = 0;
+  while (bucket < 32 && value >= ((uint64_t)1 << bucket)) {
+    bucket++;
+  }
+  lateness->buckets[bucket]++;
+}
+
+uint64_t event_loop_lateness_percentile(const event_loop_lateness_t *lateness, double fraction)
+{
+  uint32_t target = (uint32_t)(lateness->count * fraction);
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < 33; bucket++) {
+    seen += lateness->buckets[bucket];
+    if (seen > target) {
+      return (uint64_t)1 << bucket;
+    }
+  }
+  return lateness->max;
+}
+
+/**
+ * Note how late each expired timer is, then fire them.
+ */
+static void fire_timers(event_loop_t *loop)
+{
+  basic_timer_queue_t *timers = loop->timers;
+  uint64_t now = basic_clock_now_micros(timers->clock);
+  for (basic_timer_t *timer = timers->head; timer && timer->expires * 1000 <= now; timer = timer->next) {
+    lateness_add(&loop->lateness, now - timer->expires * 1000);
+  }
+  basic_timer_tick(timers);
+}
+
+void event_loop_wait(event_loop_t *loop, int max_wait)
+{
+  platform_wait(loop, max_wait);
+  loop->wakeups++;
+  fire_timers(loop);
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+  platform_free(loop);
+  loop->watch_count = 0;
+}
+
+// ---- Platform specific waiting ----
+
+#ifdef __linux__
+
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+
+  static bool platform_init(event_loop_t *loop)
+  {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+      return false;
+    }
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd < 0 || !platform_watch(loop, loop->timer_fd)) {
+      int saved = errno;
+      platform_free(loop);
+      errno = saved;
+      return false;
+    }
+    return true;
+  }
+
+  static bool platform_watch(event_loop_t *loop, int fd)
+  {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+  }
+
+  static void platform_unwatch(event_loop_t *loop, int fd)
+  {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  }
+
+  /**
+   * Arm the timerfd for the next timer expiry (0 for none), if it isn't
+   * already. Real basic clocks follow CLOCK_MONOTONIC, skipped ahead by
+   * offset, so expiry maps to an absolute time on it.
+   */
+  static void arm(event_loop_t *loop, uint64_t expires)
+  {
+    uint64_t offset = loop->timers->clock->offset;
+    uint64_t at = expires == 0 ? 0 : expires > offset ? expires - offset : 1;
+    if (at == loop->armed) {
+      return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)(at / 1000);
+    spec.it_value.tv_nsec = (long)(at % 1000) * 1000000;
+    timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    loop->armed = at;
+  }
+
+  static void platform_wait(event_loop_t *loop, int max_wait)
+  {
+    basic_timer_queue_t *timers = loop->timers;
+    arm(loop, timers->head ? timers->head->expires : 0);
+
+    struct epoll_event events[EVENT_LOOP_MAX_WATCHES + 1];
+    int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_WATCHES + 1, max_wait);
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == loop->timer_fd) {
+        // Expired, so disarmed. Timers are fired by the caller.
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+          loop->armed = 0;
+        }
+      } else {
+        dispatch(loop, fd);
+      }
+    }
+  }
+
+  static void platform_free(event_loop_t *loop)
+  {
+    if (loop->timer_fd >= 0) {
+      close(loop->timer_fd);
+      loop->timer_fd = -1;
+    }
+    if (loop->epoll_fd >= 0) {
+      close(loop->epoll_fd);
+      loop->epoll_fd = -1;
+    }
+  }
+
+#else // poll() fallback
+
+  #include <poll.h>
+
+  static bool platform_init(event_loop_t *loop)
+  {
+    return true;
+  }
+
+  static bool platform_watch(event_loop_t *loop, int fd)
+  {
+    return true;
+  }
+
+  static void platform_unwatch(event_loop_t *loop, int fd)
+  {
+  }
+
+  static void platform_wait(event_loop_t *loop, int max_wait)
+  {
+    // Wake no earlier than the next expiry: round up to the millisecond.
+    basic_timer_queue_t *timers = loop->timers;
+    int timeout = max_wait;
+    if (timers->head) {
+      uint64_t now = basic_clock_now_micros(timers->clock);
+      uint64_t due = timers->head->expires * 1000;
+      uint64_t wait = due > now ? (due - now + 999) / 1000 : 0;
+      if (timeout < 0 || wait < (uint64_t)timeout) {
+        timeout = (int)wait;
+      }
+    }
+
+    struct pollfd fds[EVENT_LOOP_MAX_WATCHES];
+    int count = loop->watch_count;
+    for (int i = 0; i < count; i++) {
+      fds[i].fd = loop->watches[i].fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(fds, (nfds_t)count, timeout) <= 0) {
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      if (fds[i].revents) {
+        dispatch(loop, fds[i].fd);
+      }
+    }
+  }
+
+  static void platform_free(event_loop_t *loop)
+  {
+  }
+
+#endif
@@ -0,0 +1,127 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Runs a program from events: file descriptors becoming readable, and
+ * timers in a basic_timer_queue_t (see basictimer.h) expiring.
+ *
+ * The process sleeps until one of them happens, rather than waking up
+ * regularly to check. On Linux, it waits in epoll, with a timerfd armed
+ * to the exact moment the next timer expires (on the monotonic clock),
+ * so timers fire to within the scheduler's accuracy. Elsewhere it falls
+ * back to poll(), with a timeout rounded up to the next millisecond.
+ *
+ * How late each timer fires, after its expiry, is measured and kept in
+ * a histogram.
+ *
+ * The timer queue must use a real clock (see basic_clock_init_real()).
+ *
+ * Usage:
+ *
+ *   void on_input(int fd, void *data)
+ *   {
+ *     char buf[64];
+ *     read(fd, buf, sizeof(buf));
+ *   }
+ *
+ *   event_loop_t loop;
+ *   if (!event_loop_init(&loop, &my_queue)
+ *       || !event_loop_watch(&loop, STDIN_FILENO, on_input, NULL)) {
+ *     perror("event loop");
+ *   }
+ *   for(;;) {
+ *     event_loop_wait(&loop, -1); // runs on_input() and timer callbacks
+ *   }
+ *   event_loop_free(&loop);
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "basictimer.h"
+
+/** Most file descriptors watched at once. */
+#ifndef EVENT_LOOP_MAX_WATCHES
+#define EVENT_LOOP_MAX_WATCHES 16
+#endif
+
+/**
+ * Called when fd is readable (or closed by the other end). Must read
+ * something, or it's called again straight away.
+ */
+typedef void (*event_loop_callback)(int fd, void *data);
+
+/**
+ * How late timers fired, in microseconds after expiry. Power of 2
+ * buckets: bucket n holds values below 2^n (and at least 2^(n-1)).
+ */
+typedef struct event_loop_lateness_t
+{
+  uint32_t count;
+  uint64_t max;
+  uint32_t buckets[33];
+} event_loop_lateness_t;
+
+typedef struct event_loop_t
+{
+  /** Timers to fire. */
+  basic_timer_queue_t *timers;
+
+  struct
+  {
+    int fd;
+    event_loop_callback callback;
+    void *data;
+  } watches[EVENT_LOOP_MAX_WATCHES];
+  int watch_count;
+
+  /**
+   * epoll instance and timerfd (Linux only), and the monotonic time in
+   * milliseconds it's armed to (0 if not).
+   */
+  int epoll_fd;
+  int timer_fd;
+  uint64_t armed;
+
+  /** Times the process woke up from waiting. */
+  uint32_t wakeups;
+
+  event_loop_lateness_t lateness;
+
+} event_loop_t;
+
+/**
+ * Initialize a loop that fires timers in queue. Returns false (with
+ * errno set) if the epoll instance or timerfd can't be created.
+ */
+bool event_loop_init(event_loop_t *loop, basic_timer_queue_t *timers);
+
+/**
+ * Call callback whenever fd is readable. Returns false (with errno set)
+ * if it can't be watched, or EVENT_LOOP_MAX_WATCHES are already.
+ */
+bool event_loop_watch(event_loop_t *loop, int fd, event_loop_callback callback, void *data);
+
+/**
+ * Stop watching fd (before closing it). May be called from callbacks.
+ */
+void event_loop_unwatch(event_loop_t *loop, int fd);
+
+/**
+ * Sleep until a watched fd is readable, the next timer expires, or
+ * max_wait milliseconds pass (-1 to wait for ever). Then run the
+ * callbacks of readable fds, and of timers that have expired.
+ */
+void event_loop_wait(event_loop_t *loop, int max_wait);
+
+/**
+ * Percentile (0 to 1) of timer lateness, as the upper bound of the
+ * bucket it falls in, in microseconds.
+ */
+uint64_t event_loop_lateness_percentile(const event_loop_lateness_t *lateness, double fraction);
+
+/**
+ * Close the epoll instance and timerfd. Watched fds are left open.
+ */
+void event_loop_free(event_loop_t *loop);
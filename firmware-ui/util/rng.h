@@ -0,0 +1,48 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Small, fast, seedable pseudo random numbers (xorshift64*), for
+ * simulations that must be reproducible from a seed. Not for anything
+ * that needs to be unpredictable.
+ *
+ * The state is a single uint64_t, which must not be 0.
+ *
+ * Usage:
+ *
+ *   uint64_t rng = seed ? seed : 1;
+ *   uint32_t roll = rng_below(&rng, 100);           // 0-99
+ *   uint32_t latency = rng_between(&rng, 10, 150);  // 10-150
+ *   double u = rng_uniform(&rng);                   // (0, 1]
+ */
+
+#include <stdint.h>
+
+static inline uint64_t rng_next(uint64_t *rng)
+{
+  uint64_t x = *rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *rng = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/** Uniform in [0, limit). */
+static inline uint32_t rng_below(uint64_t *rng, uint32_t limit)
+{
+  return (uint32_t)((rng_next(rng) >> 32) % limit);
+}
+
+/** Uniform in [min, max]. */
+static inline uint32_t rng_between(uint64_t *rng, uint32_t min, uint32_t max)
+{
+  return min + (uint32_t)((rng_next(rng) >> 32) % ((uint64_t)max - min + 1));
+}
+
+/** Uniform in (0, 1]. */
+static inline double rng_uniform(uint64_t *rng)
+{
+  return ((rng_next(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
@@ -0,0 +1,77 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See simflash.h for usage.
+ */
+
+#include "simflash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t flash_size(sim_flash_t *flash)
+{
+  return (size_t)flash->page_size * flash->page_count;
+}
+
+static void persist(sim_flash_t *flash)
+{
+  if (flash->slab) {
+    slab_written(flash->slab);
+  }
+}
+
+void sim_flash_init(sim_flash_t *flash, uint16_t page_size, uint8_t page_count, uint8_t *memory, slab_t *slab)
+{
+  memset(flash, 0, sizeof(sim_flash_t));
+  flash->page_size = page_size;
+  flash->page_count = page_count;
+  flash->slab = slab;
+  flash->memory = memory;
+  if (!memory) {
+    flash->memory = malloc(flash_size(flash));
+    flash->memory_owned = true;
+    memset(flash->memory, 0xFF, flash_size(flash));
+  }
+}
+
+void sim_flash_free(sim_flash_t *flash)
+{
+  if (flash->memory_owned) {
+    free(flash->memory);
+  }
+  flash->memory = NULL;
+}
+
+void sim_flash_read(sim_flash_t *flash, uint8_t page, uint16_t offset, uint8_t *buf, uint16_t len)
+{
+  memcpy(buf, flash->memory + (size_t)page * flash->page_size + offset, len);
+}
+
+void sim_flash_write(sim_flash_t *flash, uint8_t page, uint16_t offset, const uint8_t *buf, uint16_t len)
+{
+  uint8_t *dest = flash->memory + (size_t)page * flash->page_size + offset;
+  for (uint16_t i = 0; i < len; i++) {
+    // Programming can only clear bits.
+    dest[i] &= buf[i];
+  }
+
+  uint16_t words = (len + 3) / 4;
+  flash->word_writes += words;
+  flash->last_op_us = words * SIM_FLASH_WORD_WRITE_US;
+  flash->busy_us += flash->last_op_us;
+  persist(flash);
+}
+
+void sim_flash_erase(sim_flash_t *flash, uint8_t page)
+{
+  memset(flash->memory + (size_t)page * flash->page_size, 0xFF, flash->page_size);
+
+  flash->page_erases++;
+  if (page < SIM_FLASH_MAX_PAGES) {
+    flash->page_wear[page]++;
+  }
+  flash->last_op_us = SIM_FLASH_PAGE_ERASE_US;
+  flash->busy_us += flash->last_op_us;
+  persist(flash);
+}
@@ -0,0 +1,79 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Simulated NOR flash memory.
+ *
+ * Behaves like the flash on a real device: it's divided into pages, a page
+ * must be erased (all bytes set to 0xFF) before being reused, and writes
+ * can only clear bits.
+ *
+ * Every operation is counted, and a simple timing model (based on CC2541
+ * datasheet figures) accumulates how long the flash would have kept the
+ * CPU busy, so different persistence strategies can be compared.
+ *
+ * Contents can be kept in a slot of a slab file (see slab.h), to persist
+ * between runs.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "slab.h"
+
+/** Simulated time to program one 4 byte word, in microseconds. */
+#define SIM_FLASH_WORD_WRITE_US 20
+
+/** Simulated time to erase a page, in microseconds. */
+#define SIM_FLASH_PAGE_ERASE_US 20000
+
+/** Maximum number of pages tracked for wear statistics. */
+#define SIM_FLASH_MAX_PAGES 8
+
+typedef struct sim_flash_t
+{
+  /** Raw contents, page_size * page_count bytes. */
+  uint8_t *memory;
+
+  uint16_t page_size;
+  uint8_t page_count;
+
+  /** Slab memory is in, told of every write. NULL if not persisted. */
+  slab_t *slab;
+
+  /** Whether memory was allocated by sim_flash_init(). */
+  bool memory_owned;
+
+  /** How many times words have been programmed. */
+  uint32_t word_writes;
+
+  /** How many pages have been erased. */
+  uint32_t page_erases;
+
+  /** How many erase cycles each page has seen (wear). */
+  uint32_t page_wear[SIM_FLASH_MAX_PAGES];
+
+  /** Total simulated time spent writing/erasing. */
+  uint64_t busy_us;
+
+  /** Simulated duration of the most recent write or erase. */
+  uint32_t last_op_us;
+
+} sim_flash_t;
+
+/**
+ * Initialize flash, with contents in memory (page_size * page_count
+ * bytes, e.g. a slot of slab), which are kept as they are. If memory is
+ * NULL, contents are allocated and start fully erased.
+ */
+void sim_flash_init(sim_flash_t *flash, uint16_t page_size, uint8_t page_count, uint8_t *memory, slab_t *slab);
+
+/**
+ * Free memory used by flash (not a slab's).
+ */
+void sim_flash_free(sim_flash_t *flash);
+
+void sim_flash_read(sim_flash_t *flash, uint8_t page, uint16_t offset, uint8_t *buf, uint16_t len);
+void sim_flash_write(sim_flash_t *flash, uint8_t page, uint16_t offset, const uint8_t *buf, uint16_t len);
+void sim_flash_erase(sim_flash_t *flash, uint8_t page);
@@ -0,0 +1,134 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See slab.h for usage.
+ */
+
+#include "slab.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Start of the file. Values are in host byte order, as the file is only
+ * for the machine running the simulation.
+ */
+typedef struct slab_header_t
+{
+  char magic[8];
+  uint32_t slot_size;
+  uint32_t slot_count;
+} slab_header_t;
+
+typedef char check_header_size[sizeof(slab_header_t) <= SLAB_HEADER_SIZE ? 1 : -1];
+
+static size_t file_size(uint32_t slot_size, uint32_t slot_count)
+{
+  return SLAB_HEADER_SIZE + (size_t)slot_size * slot_count;
+}
+
+/** Close fd, keeping errno, and fail. */
+static bool fail(int fd)
+{
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return false;
+}
+
+bool slab_open(slab_t *slab, const char *filename, uint32_t slot_size, uint32_t slot_count)
+{
+  memset(slab, 0, sizeof(slab_t));
+  slab->fd = -1;
+  slab->sync_every = SLAB_SYNC_WRITES;
+
+  int fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Check what's there already, if anything.
+  struct stat st;
+  slab_header_t header;
+  uint32_t existing = 0;
+  if (fstat(fd, &st) != 0) {
+    return fail(fd);
+  }
+  if (st.st_size > 0) {
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, SLAB_MAGIC, sizeof(header.magic)) != 0
+        || header.slot_size != slot_size
+        || (size_t)st.st_size < file_size(header.slot_size, header.slot_count)) {
+      errno = EINVAL;
+      return fail(fd);
+    }
+    existing = header.slot_count;
+  }
+
+  // Grow if needed. New space reads as zeros until filled in below.
+  if (slot_count < existing) {
+    slot_count = existing;
+  }
+  size_t size = file_size(slot_size, slot_count);
+  if ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0) {
+    return fail(fd);
+  }
+
+  uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    return fail(fd);
+  }
+
+  if (existing < slot_count) {
+    memset(base + file_size(slot_size, existing), 0xFF, (size_t)slot_size * (slot_count - existing));
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SLAB_MAGIC, sizeof(header.magic));
+    header.slot_size = slot_size;
+    header.slot_count = slot_count;
+    memcpy(base, &header, sizeof(header));
+  }
+
+  slab->base = base;
+  slab->size = size;
+  slab->fd = fd;
+  slab->slot_size = slot_size;
+  slab->slot_count = slot_count;
+  return true;
+}
+
+uint8_t *slab_slot(slab_t *slab, uint32_t index)
+{
+  return slab->base + SLAB_HEADER_SIZE + (size_t)slab->slot_size * index;
+}
+
+void slab_written(slab_t *slab)
+{
+  unsigned writes = atomic_fetch_add_explicit(&slab->writes, 1, memory_order_relaxed) + 1;
+  if (slab->sync_every > 0 && writes % slab->sync_every == 0) {
+    msync(slab->base, slab->size, MS_ASYNC);
+    atomic_fetch_add_explicit(&slab->syncs, 1, memory_order_relaxed);
+  }
+}
+
+void slab_sync(slab_t *slab)
+{
+  msync(slab->base, slab->size, MS_SYNC);
+  atomic_fetch_add_explicit(&slab->syncs, 1, memory_order_relaxed);
+}
+
+void slab_close(slab_t *slab)
+{
+  if (slab->base) {
+    slab_sync(slab);
+    munmap(slab->base, slab->size);
+    slab->base = NULL;
+  }
+  if (slab->fd >= 0) {
+    close(slab->fd);
+    slab->fd = -1;
+  }
+}
@@ -0,0 +1,97 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Persistent storage for many simulated devices in a single file.
+ *
+ * The file holds a short header and then a number of fixed size slots,
+ * one per device, and is mapped into memory. Devices read and write
+ * their slot in place, like the flash memory it stands in for, so
+ * persisting costs no system calls.
+ *
+ * Changes reach the file as the kernel writes back dirty pages (even if
+ * the program crashes). To bound how much could be lost if the machine
+ * itself goes down, msync() is called after every sync_every writes (as
+ * noted with slab_written()), and by slab_sync() and slab_close().
+ *
+ * New slots start with every byte 0xFF, like erased flash.
+ *
+ * Slots may be written from different threads, as long as no two write
+ * the same slot.
+ *
+ * Usage:
+ *
+ *   slab_t slab;
+ *   if (!slab_open(&slab, "devices.slab", 1024, 100)) {
+ *     perror("devices.slab");
+ *   }
+ *   uint8_t *slot = slab_slot(&slab, 42);
+ *   slot[0] = 0;
+ *   slab_written(&slab);
+ *   slab_close(&slab);
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Identifies a slab file (and its version). */
+#define SLAB_MAGIC "NOVASLB1"
+
+/** Bytes before the first slot. */
+#define SLAB_HEADER_SIZE 64
+
+/** Default writes between msync() calls. */
+#ifndef SLAB_SYNC_WRITES
+#define SLAB_SYNC_WRITES 1024
+#endif
+
+typedef struct slab_t
+{
+  /** The mapped file: header, then slots. */
+  uint8_t *base;
+  size_t size;
+  int fd;
+
+  uint32_t slot_size;
+  uint32_t slot_count;
+
+  /** Writes between msync() calls. 0 to only sync explicitly. */
+  uint32_t sync_every;
+
+  /** Writes noted so far, and msync() calls made. */
+  atomic_uint writes;
+  atomic_uint syncs;
+
+} slab_t;
+
+/**
+ * Open (creating if needed) a slab file with at least slot_count slots
+ * of slot_size bytes, growing it if it has fewer. Returns false (with
+ * errno set) if it can't be opened or mapped, or is not a slab file of
+ * the same slot size.
+ */
+bool slab_open(slab_t *slab, const char *filename, uint32_t slot_size, uint32_t slot_count);
+
+/**
+ * Memory of a slot, slot_size bytes. index must be < slot_count.
+ */
+uint8_t *slab_slot(slab_t *slab, uint32_t index);
+
+/**
+ * Note that a slot has been written, calling msync() (without waiting
+ * for it) if sync_every writes have been noted since the last.
+ */
+void slab_written(slab_t *slab);
+
+/**
+ * Write everything to the file, and wait for it.
+ */
+void slab_sync(slab_t *slab);
+
+/**
+ * Sync, and unmap and close the file.
+ */
+void slab_close(slab_t *slab);
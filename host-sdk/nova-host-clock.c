@@ -0,0 +1,104 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See nova-host-clock.h
+ */
+
+#include "nova-host-clock.h"
+
+#include <string.h>
+
+static const nova_host_sync_sample_t *at(const nova_host_clock_t *clock, uint16_t index)
+{
+  return &clock->samples[(clock->head + index) % NOVA_HOST_CLOCK_SAMPLES];
+}
+
+/**
+ * How far ahead of the App's clock the device's was, by a sample: its
+ * time, less the middle of the round trip. Copes with the device's
+ * clock wrapping around.
+ */
+static double sample_offset(const nova_host_sync_sample_t *sample)
+{
+  return (double)(int32_t)(sample->time - (timestamp_t)sample->sent)
+      - (sample->received - sample->sent) / 2.0;
+}
+
+static double sample_middle(const nova_host_sync_sample_t *sample)
+{
+  return (sample->sent + sample->received) / 2.0;
+}
+
+static uint64_t round_trip(const nova_host_sync_sample_t *sample)
+{
+  return sample->received - sample->sent;
+}
+
+static int64_t round_nearest(double x)
+{
+  return (int64_t)(x < 0 ? x - 0.5 : x + 0.5);
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void nova_host_clock_init(nova_host_clock_t *clock)
+{
+  memset(clock, 0, sizeof(nova_host_clock_t));
+}
+
+void nova_host_clock_add(nova_host_clock_t *clock, uint64_t sent, uint64_t received, timestamp_t time)
+{
+  nova_host_sync_sample_t *sample = &clock->samples[(clock->head + clock->count) % NOVA_HOST_CLOCK_SAMPLES];
+  sample->sent = sent;
+  sample->received = received;
+  sample->time = time;
+  if (clock->count < NOVA_HOST_CLOCK_SAMPLES) {
+    clock->count++;
+  } else {
+    clock->head = (clock->head + 1) % NOVA_HOST_CLOCK_SAMPLES;
+  }
+}
+
+bool nova_host_clock_device_time(const nova_host_clock_t *clock, uint64_t t, bool with_drift, timestamp_t *time)
+{
+  uint32_t count = clock->count;
+  if (count == 0) {
+    return false;
+  }
+
+  // The quickest round trip of each run (whose offset is least skewed
+  // by jitter).
+  const nova_host_sync_sample_t *best[NOVA_HOST_CLOCK_WINDOWS];
+  uint32_t windows = count < NOVA_HOST_CLOCK_WINDOWS ? count : NOVA_HOST_CLOCK_WINDOWS;
+  for (uint32_t w = 0; w < windows; w++) {
+    best[w] = NULL;
+    for (uint32_t i = w * count / windows; i < (w + 1) * count / windows; i++) {
+      if (!best[w] || round_trip(at(clock, i)) < round_trip(best[w])) {
+        best[w] = at(clock, i);
+      }
+    }
+  }
+
+  double mean_middle = 0;
+  double mean_offset = 0;
+  for (uint32_t w = 0; w < windows; w++) {
+    mean_middle += sample_middle(best[w]) / windows;
+    mean_offset += sample_offset(best[w]) / windows;
+  }
+
+  // Least squares slope of offset against time.
+  double covariance = 0;
+  double variance = 0;
+  for (uint32_t w = 0; w < windows; w++) {
+    double dm = sample_middle(best[w]) - mean_middle;
+    covariance += dm * (sample_offset(best[w]) - mean_offset);
+    variance += dm * dm;
+  }
+  double drift = with_drift && variance > 0 ? covariance / variance : 0;
+
+  double offset = mean_offset + drift * (t - mean_middle);
+  *time = (timestamp_t)(t + round_nearest(offset));
+  return true;
+}
@@ -0,0 +1,87 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Estimates what a device's clock reads (see NOVA_CMD_SYNC in nova.h),
+ * to schedule flashes by it with FLASH_AT.
+ *
+ * Each SYNC exchange is a sample: when the App sent it and got the
+ * answer, by its own clock, and the time the device answered with. The
+ * device read its clock somewhere in the round trip, assumed the middle,
+ * so the quickest round trips say the most. Samples are split into
+ * NOVA_HOST_CLOCK_WINDOWS runs, in the order taken, and the quickest of
+ * each is kept: the offset between the clocks is their mean, and the
+ * drift (how much faster or slower the device's clock runs) the slope
+ * of a least squares line through them.
+ *
+ * Only the last NOVA_HOST_CLOCK_SAMPLES samples are kept. Spread them
+ * out over time for the drift to show.
+ *
+ * nova-host.h keeps one per device, filled by nova_host_sync().
+ *
+ * Usage:
+ *
+ *   nova_host_clock_t clock;
+ *   nova_host_clock_init(&clock);
+ *   nova_host_clock_add(&clock, sent, received, device_time);  // per SYNC
+ *   timestamp_t at;
+ *   if (nova_host_clock_device_time(&clock, now() + 5000, true, &at)) {
+ *     // FLASH_AT at, to flash in 5 seconds
+ *   }
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nova.h>
+
+/** Most SYNC samples kept. */
+#ifndef NOVA_HOST_CLOCK_SAMPLES
+#define NOVA_HOST_CLOCK_SAMPLES 256
+#endif
+
+/** Samples are split into this many runs, keeping the quickest of each. */
+#ifndef NOVA_HOST_CLOCK_WINDOWS
+#define NOVA_HOST_CLOCK_WINDOWS 8
+#endif
+
+/** A SYNC exchange. */
+typedef struct nova_host_sync_sample_t
+{
+  /** When the SYNC was sent, and its answer received, by the App's clock (ms). */
+  uint64_t sent;
+  uint64_t received;
+
+  /** The device's clock in its answer. */
+  timestamp_t time;
+
+} nova_host_sync_sample_t;
+
+typedef struct nova_host_clock_t
+{
+  /** Ring of samples, oldest first from head. */
+  nova_host_sync_sample_t samples[NOVA_HOST_CLOCK_SAMPLES];
+  uint16_t head;
+  uint16_t count;
+
+} nova_host_clock_t;
+
+/**
+ * Initialize clock with no samples (e.g. to forget a device that may
+ * have restarted).
+ */
+void nova_host_clock_init(nova_host_clock_t *clock);
+
+/**
+ * Add a SYNC exchange, sent and received at App times (ms), answered
+ * with the device's time. Replaces the oldest if full.
+ */
+void nova_host_clock_add(nova_host_clock_t *clock, uint64_t sent, uint64_t received, timestamp_t time);
+
+/**
+ * Estimate what the device's clock reads at App time t (ms), into time.
+ * If with_drift, takes into account the device's clock running fast or
+ * slow. Returns false if there are no samples.
+ */
+bool nova_host_clock_device_time(const nova_host_clock_t *clock, uint64_t t, bool with_drift, timestamp_t *time);
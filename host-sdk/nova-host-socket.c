@@ -0,0 +1,201 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See nova-host-socket.h
+ */
+
+#include "nova-host-socket.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Where sockets can't be told not to raise SIGPIPE per send (OS X), it's
+// turned off per socket instead (SO_NOSIGPIPE).
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Write a whole packet. Blocks while the stand-in isn't reading, which it
+ * doesn't while its link is full.
+ */
+static bool send_packet(nova_host_socket_t *sock, uint8_t op, uint16_t handle, const uint8_t *value, uint16_t len)
+{
+  if (len > NOVA_HOST_MAX_VALUE) {
+    errno = EMSGSIZE;
+    return false;
+  }
+  uint8_t buf[NOVA_HOST_PACKET_HEADER_SIZE + NOVA_HOST_MAX_VALUE];
+  uint16_t size = NOVA_HOST_PACKET_HEADER_SIZE - 2 + len;
+  buf[0] = (uint8_t)size;
+  buf[1] = (uint8_t)(size >> 8);
+  buf[2] = op;
+  buf[3] = (uint8_t)handle;
+  buf[4] = (uint8_t)(handle >> 8);
+  if (len > 0) {
+    memcpy(buf + NOVA_HOST_PACKET_HEADER_SIZE, value, len);
+  }
+
+  size_t total = NOVA_HOST_PACKET_HEADER_SIZE + len;
+  size_t done = 0;
+  while (done < total) {
+    ssize_t n = send(sock->fd, buf + done, total - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += (size_t)n;
+  }
+  sock->stats.sent++;
+  return true;
+}
+
+static bool write_request(void *context, const uint8_t *buf, uint16_t len)
+{
+  nova_host_socket_t *sock = (nova_host_socket_t*)context;
+  uint8_t op = sock->with_response ? NOVA_HOST_OP_WRITE_REQ : NOVA_HOST_OP_WRITE_CMD;
+  return send_packet(sock, op, NOVA_HOST_HANDLE_REQUEST, buf, len);
+}
+
+/**
+ * A whole packet has been read.
+ */
+static void received(nova_host_socket_t *sock, nova_host_t *host, uint64_t now)
+{
+  uint8_t op = sock->in[2];
+  uint16_t handle = (uint16_t)(sock->in[3] | (sock->in[4] << 8));
+  const uint8_t *value = sock->in + NOVA_HOST_PACKET_HEADER_SIZE;
+  uint16_t len = sock->in_len - NOVA_HOST_PACKET_HEADER_SIZE;
+
+  switch (op) {
+    case NOVA_HOST_OP_NOTIFY:
+      if (handle == NOVA_HOST_HANDLE_RESPONSE) {
+        sock->stats.notifications++;
+        nova_host_received(host, now, value, len);
+      }
+      break;
+    case NOVA_HOST_OP_WRITE_RSP:
+      sock->stats.responses++;
+      break;
+    case NOVA_HOST_OP_ERROR:
+      sock->stats.errors++;
+      break;
+  }
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+bool nova_host_socket_connect(nova_host_socket_t *sock, const char *address)
+{
+  memset(sock, 0, sizeof(nova_host_socket_t));
+  sock->with_response = true;
+
+  int fd;
+  int result;
+  if (strncmp(address, "tcp:", 4) == 0) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)strtoul(address + 4, NULL, 10));
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return false;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  } else {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return false;
+    }
+    strcpy(addr.sun_path, address);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return false;
+    }
+    result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  }
+
+  if (result != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return false;
+  }
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  sock->fd = fd;
+  return true;
+}
+
+bool nova_host_socket_subscribe(nova_host_socket_t *sock)
+{
+  const uint8_t enable[2] = { 0x01, 0x00 };
+  return send_packet(sock, NOVA_HOST_OP_WRITE_REQ, NOVA_HOST_HANDLE_RESPONSE, enable, sizeof(enable));
+}
+
+nova_host_transport_t nova_host_socket_transport(nova_host_socket_t *sock)
+{
+  nova_host_transport_t transport;
+  transport.write = write_request;
+  transport.context = sock;
+  return transport;
+}
+
+bool nova_host_socket_receive(nova_host_socket_t *sock, nova_host_t *host, uint64_t now)
+{
+  for (;;) {
+    // The length first, then the rest of the packet.
+    uint16_t want = 2;
+    if (sock->in_len >= 2) {
+      want = (uint16_t)(2 + (sock->in[0] | (sock->in[1] << 8)));
+      if (want < NOVA_HOST_PACKET_HEADER_SIZE || want > sizeof(sock->in)) {
+        errno = EPROTO;
+        return false;
+      }
+    }
+
+    ssize_t n = recv(sock->fd, sock->in + sock->in_len, want - sock->in_len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sock->in_len += (uint16_t)n;
+
+    if (sock->in_len >= NOVA_HOST_PACKET_HEADER_SIZE && sock->in_len == want) {
+      received(sock, host, now);
+      sock->in_len = 0;
+    }
+  }
+}
+
+void nova_host_socket_close(nova_host_socket_t *sock)
+{
+  if (sock->fd >= 0) {
+    close(sock->fd);
+    sock->fd = -1;
+  }
+}
@@ -0,0 +1,111 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Transport for nova-host.h to the simulator's GATT stand-in (see
+ * firmware-ui/gatt-bridge.h, which documents the packets), over a Unix
+ * domain socket or TCP on localhost.
+ *
+ * Writes go to the request characteristic (EFF1), with response unless
+ * with_response is cleared (writes without response may be lost, if the
+ * link is lossy). Notifications from the response characteristic (EFF2)
+ * are passed to nova_host_received().
+ *
+ * Usage:
+ *
+ *   nova_host_socket_t sock;
+ *   if (!nova_host_socket_connect(&sock, "nova.sock")
+ *       || !nova_host_socket_subscribe(&sock)) {
+ *     perror("nova.sock");
+ *   }
+ *   nova_host_transport_t transport = nova_host_socket_transport(&sock);
+ *   nova_host_init(&host, &transport, &config);
+ *   nova_host_connected(&host, now());
+ *   ...
+ *   // when sock.fd is readable:
+ *   if (!nova_host_socket_receive(&sock, &host, now())) {
+ *     nova_host_disconnected(&host);
+ *   }
+ *   ...
+ *   nova_host_socket_close(&sock);
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nova-host.h"
+
+// As firmware-ui/gatt-bridge.h.
+#define NOVA_HOST_HANDLE_REQUEST  0xEFF1
+#define NOVA_HOST_HANDLE_RESPONSE 0xEFF2
+
+#define NOVA_HOST_OP_ERROR     0x01
+#define NOVA_HOST_OP_WRITE_REQ 0x12
+#define NOVA_HOST_OP_WRITE_RSP 0x13
+#define NOVA_HOST_OP_NOTIFY    0x1B
+#define NOVA_HOST_OP_WRITE_CMD 0x52
+
+/** Bytes before the value of a packet: length, opcode, handle. */
+#define NOVA_HOST_PACKET_HEADER_SIZE 5
+
+/** Largest value of a packet. */
+#define NOVA_HOST_MAX_VALUE 32
+
+typedef struct nova_host_socket_stats_t
+{
+  /** Packets written. */
+  uint32_t sent;
+
+  /** Notifications received from EFF2. */
+  uint32_t notifications;
+
+  /** Write responses, and errors, received. */
+  uint32_t responses;
+  uint32_t errors;
+
+} nova_host_socket_stats_t;
+
+typedef struct nova_host_socket_t
+{
+  int fd;
+
+  /** Write commands with response (the default), or without. */
+  bool with_response;
+
+  /** Partial packet read. */
+  uint8_t in[NOVA_HOST_PACKET_HEADER_SIZE + NOVA_HOST_MAX_VALUE];
+  uint16_t in_len;
+
+  nova_host_socket_stats_t stats;
+
+} nova_host_socket_t;
+
+/**
+ * Connect to address: a path for a Unix domain socket, or tcp:PORT on
+ * localhost. Returns false (with errno set) if it can't.
+ */
+bool nova_host_socket_connect(nova_host_socket_t *sock, const char *address);
+
+/**
+ * Subscribe to notifications from EFF2, which connects the App. Returns
+ * false (with errno set) if the write fails.
+ */
+bool nova_host_socket_subscribe(nova_host_socket_t *sock);
+
+/**
+ * Transport writing commands to EFF1 through sock.
+ */
+nova_host_transport_t nova_host_socket_transport(nova_host_socket_t *sock);
+
+/**
+ * Read whatever has arrived, without blocking, passing notifications to
+ * host. Returns false if the socket was closed, or the stand-in sent
+ * something that isn't a packet.
+ */
+bool nova_host_socket_receive(nova_host_socket_t *sock, nova_host_t *host, uint64_t now);
+
+/**
+ * Disconnect.
+ */
+void nova_host_socket_close(nova_host_socket_t *sock);
@@ -0,0 +1,323 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+/**
+ * See nova-host.h
+ */
+
+#include "nova-host.h"
+
+#include <string.h>
+
+#include <nova-codec.h>
+
+static nova_host_command_t *at(nova_host_t *host, uint16_t index)
+{
+  return &host->queue[(host->head + index) % NOVA_HOST_QUEUE];
+}
+
+static void write_command(nova_host_t *host, const app_command_t *cmd)
+{
+  uint8_t buf[NOVA_CODEC_MAX_COMMAND_SIZE];
+  uint16_t len = nova_codec_encode_command(cmd, buf);
+  host->transport.write(host->transport.context, buf, len);
+  host->stats.writes++;
+}
+
+/**
+ * Write waiting commands, as far as the window allows: the id of each
+ * must be less than window more than the oldest still waiting for its
+ * ACK.
+ */
+static void pump(nova_host_t *host, uint64_t now)
+{
+  if (!host->connected || host->negotiating) {
+    return;
+  }
+  while (host->sent_count < host->count) {
+    nova_host_command_t *next = at(host, host->sent_count);
+    if (host->sent_count > 0
+        && (cmd_id_t)(next->cmd.header.id - at(host, 0)->cmd.header.id) >= host->window) {
+      return;
+    }
+    write_command(host, &next->cmd);
+    next->sent_at = now;
+    next->resent_at = now;
+    host->sent_count++;
+  }
+}
+
+/**
+ * Take the command at index out of the queue, and tell its callback.
+ */
+static void finish(nova_host_t *host, uint16_t index, bool acked)
+{
+  nova_host_command_t done = *at(host, index);
+  if (index == 0) {
+    host->head = (host->head + 1) % NOVA_HOST_QUEUE;
+  } else {
+    for (uint16_t i = index; i + 1 < host->count; i++) {
+      *at(host, i) = *at(host, i + 1);
+    }
+  }
+  host->count--;
+  if (index < host->sent_count) {
+    host->sent_count--;
+  }
+
+  if (acked) {
+    host->stats.acked++;
+  } else {
+    host->stats.failed++;
+  }
+  if (done.callback) {
+    done.callback(host, done.cmd.header.id, acked, done.data);
+  }
+}
+
+static bool queue(nova_host_t *host, uint64_t now, app_command_t *cmd, nova_host_callback callback, void *data)
+{
+  if (!host->connected || host->count == NOVA_HOST_QUEUE) {
+    return false;
+  }
+  cmd->header.id = ++host->last_id;
+
+  nova_host_command_t *entry = at(host, host->count);
+  memset(entry, 0, sizeof(nova_host_command_t));
+  entry->cmd = *cmd;
+  entry->callback = callback;
+  entry->data = data;
+  host->count++;
+  host->stats.queued++;
+
+  pump(host, now);
+  return true;
+}
+
+static void write_negotiate(nova_host_t *host)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_NEGOTIATE;
+  cmd.header.id = host->negotiate_id;
+  cmd.body.negotiate.features = 0;
+  cmd.body.negotiate.window = host->config.window;
+  write_command(host, &cmd);
+}
+
+static void negotiated(nova_host_t *host, uint64_t now, uint8_t window)
+{
+  host->negotiating = false;
+  host->window = window < 1 ? 1 : window > host->config.window ? host->config.window : window;
+  pump(host, now);
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+
+void nova_host_init(nova_host_t *host, const nova_host_transport_t *transport, const nova_host_config_t *config)
+{
+  memset(host, 0, sizeof(nova_host_t));
+  host->transport = *transport;
+  host->config = *config;
+  if (host->config.window > NOVA_HOST_MAX_WINDOW) {
+    host->config.window = NOVA_HOST_MAX_WINDOW;
+  }
+  host->window = 1;
+}
+
+void nova_host_connected(nova_host_t *host, uint64_t now)
+{
+  host->connected = true;
+  host->window = 1;
+  nova_host_clock_init(&host->clock);
+  if (host->config.window > 1) {
+    host->negotiating = true;
+    host->negotiate_id = ++host->last_id;
+    write_negotiate(host);
+    host->negotiate_sent_at = now;
+    host->negotiate_resent_at = now;
+  }
+  pump(host, now);
+}
+
+void nova_host_disconnected(nova_host_t *host)
+{
+  host->connected = false;
+  host->negotiating = false;
+  host->sent_count = 0;
+  while (host->count > 0) {
+    finish(host, 0, false);
+  }
+}
+
+bool nova_host_ping(nova_host_t *host, uint64_t now, nova_host_callback callback, void *data)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_PING;
+  return queue(host, now, &cmd, callback, data);
+}
+
+bool nova_host_flash(nova_host_t *host, uint64_t now, uint8_t warm, uint8_t cool, uint16_t timeout,
+    nova_host_callback callback, void *data)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_FLASH;
+  cmd.body.flash_settings.warm = warm;
+  cmd.body.flash_settings.cool = cool;
+  cmd.body.flash_settings.timeout = timeout;
+  return queue(host, now, &cmd, callback, data);
+}
+
+bool nova_host_off(nova_host_t *host, uint64_t now, nova_host_callback callback, void *data)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_OFF;
+  return queue(host, now, &cmd, callback, data);
+}
+
+bool nova_host_sync(nova_host_t *host, uint64_t now, nova_host_callback callback, void *data)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_SYNC;
+  return queue(host, now, &cmd, callback, data);
+}
+
+bool nova_host_flash_at(nova_host_t *host, uint64_t now, timestamp_t at, uint8_t warm, uint8_t cool,
+    uint16_t timeout, nova_host_callback callback, void *data)
+{
+  app_command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.header.type = NOVA_CMD_FLASH_AT;
+  cmd.body.flash_at.at = at;
+  cmd.body.flash_at.warm = warm;
+  cmd.body.flash_at.cool = cool;
+  cmd.body.flash_at.timeout = timeout;
+  return queue(host, now, &cmd, callback, data);
+}
+
+void nova_host_received(nova_host_t *host, uint64_t now, const uint8_t *buf, uint16_t len)
+{
+  app_command_t cmd;
+  if (!nova_codec_decode_command(buf, len, &cmd)) {
+    host->stats.bad_notifications++;
+    return;
+  }
+
+  switch (cmd.header.type) {
+
+    case NOVA_CMD_ACK:
+      // A device that doesn't know NEGOTIATE might ACK it.
+      if (host->negotiating && cmd.header.id == host->negotiate_id) {
+        negotiated(host, now, 1);
+        return;
+      }
+      for (uint16_t i = 0; i < host->sent_count; i++) {
+        if (at(host, i)->cmd.header.id == cmd.header.id) {
+          finish(host, i, true);
+          pump(host, now);
+          return;
+        }
+      }
+      host->stats.unexpected_acks++;
+      break;
+
+    case NOVA_CMD_NEGOTIATE:
+      if (host->negotiating && cmd.header.id == host->negotiate_id) {
+        negotiated(host, now, cmd.body.negotiate.window);
+      }
+      break;
+
+    case NOVA_CMD_SYNC:
+      for (uint16_t i = 0; i < host->sent_count; i++) {
+        nova_host_command_t *entry = at(host, i);
+        if (entry->cmd.header.id == cmd.header.id && entry->cmd.header.type == NOVA_CMD_SYNC) {
+          host->stats.syncs++;
+          if (entry->resent_at == entry->sent_at) {
+            nova_host_clock_add(&host->clock, entry->sent_at, now, cmd.body.sync.time);
+            host->stats.sync_samples++;
+          }
+          finish(host, i, true);
+          pump(host, now);
+          return;
+        }
+      }
+      host->stats.unexpected_acks++;
+      break;
+
+    case NOVA_CMD_TRIGGER:
+      {
+        app_command_t ack;
+        memset(&ack, 0, sizeof(ack));
+        ack.header.type = NOVA_CMD_ACK;
+        ack.header.id = cmd.header.id;
+        write_command(host, &ack);
+        host->stats.triggers++;
+        if (host->config.on_trigger) {
+          host->config.on_trigger(host, cmd.body.trigger.is_pressed, host->config.data);
+        }
+      }
+      break;
+
+    default:
+      host->stats.bad_notifications++;
+      break;
+  }
+}
+
+void nova_host_tick(nova_host_t *host, uint64_t now)
+{
+  // Devices that predate NEGOTIATE don't answer it.
+  if (host->negotiating && now - host->negotiate_sent_at >= host->config.ack_timeout) {
+    negotiated(host, now, 1);
+  } else if (host->negotiating && now - host->negotiate_resent_at >= host->config.resend_after) {
+    write_negotiate(host);
+    host->negotiate_resent_at = now;
+    host->stats.resends++;
+  }
+
+  uint16_t i = 0;
+  while (i < host->sent_count) {
+    nova_host_command_t *entry = at(host, i);
+    if (now - entry->sent_at >= host->config.ack_timeout) {
+      finish(host, i, false);
+      continue;
+    }
+    if (host->window > 1 && now - entry->resent_at >= host->config.resend_after) {
+      write_command(host, &entry->cmd);
+      entry->resent_at = now;
+      host->stats.resends++;
+    }
+    i++;
+  }
+  pump(host, now);
+}
+
+int64_t nova_host_next_timeout(nova_host_t *host, uint64_t now)
+{
+  uint64_t next = UINT64_MAX;
+  if (host->negotiating) {
+    next = host->negotiate_resent_at + host->config.resend_after;
+  }
+  for (uint16_t i = 0; i < host->sent_count; i++) {
+    nova_host_command_t *entry = at(host, i);
+    uint64_t due = entry->sent_at + host->config.ack_timeout;
+    if (host->window > 1 && entry->resent_at + host->config.resend_after < due) {
+      due = entry->resent_at + host->config.resend_after;
+    }
+    next = due < next ? due : next;
+  }
+  if (next == UINT64_MAX) {
+    return -1;
+  }
+  return next > now ? (int64_t)(next - now) : 0;
+}
+
+uint16_t nova_host_pending(nova_host_t *host)
+{
+  return host->count;
+}
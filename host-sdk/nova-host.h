@@ -0,0 +1,263 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#pragma once
+
+/**
+ * Host side of the Nova V2 App protocol: sends PING, FLASH, OFF, SYNC
+ * and FLASH_AT commands to a device, and calls back when each is ACKed
+ * (or not).
+ *
+ * This is the protocol logic of NVBluetoothNovaFlash in the iOS SDK, in
+ * portable C with no threads, clocks or I/O of its own, so it can run
+ * on any host:
+ *
+ * - Commands get ids going up by one (wrapping at 65535).
+ * - They're queued, and written one at a time: the next is only written
+ *   once the previous one is ACKed, or its ACK takes longer than
+ *   ack_timeout, when its callback is told it failed.
+ * - On disconnecting, everything queued or waiting for an ACK fails.
+ *
+ * Optionally (config.window > 1) it first NEGOTIATEs a window with the
+ * device (see NOVA_CMD_NEGOTIATE in nova.h), and then keeps up to that
+ * many commands in flight, resending any whose ACK is overdue (and the
+ * NEGOTIATE itself, which the device answers again). Devices that don't
+ * answer it within ack_timeout get stop-and-wait as before.
+ *
+ * TRIGGERs from the device are ACKed, and passed to on_trigger.
+ *
+ * A SYNC is answered with the device's clock, not an ACK, and the
+ * exchange added to host->clock (see nova-host-clock.h), unless it was
+ * resent, when which write was answered can't be told. Once some SYNCs
+ * are done, nova_host_clock_device_time() tells what to send FLASH_AT
+ * for. Samples are forgotten on connecting, as the device may have
+ * restarted.
+ *
+ * Bytes go out through a transport (see nova_host_transport_t), which
+ * writes them to the device's request characteristic (EFF1), and come
+ * back when the transport passes notifications from the response
+ * characteristic (EFF2) to nova_host_received(). nova-host-socket.h is a
+ * transport to the simulator.
+ *
+ * Time is whatever the caller passes as now, in milliseconds. Call
+ * nova_host_tick() by nova_host_next_timeout() to time out ACKs.
+ *
+ * Usage:
+ *
+ *   void on_ack(nova_host_t *host, cmd_id_t id, bool acked, void *data)
+ *   {
+ *     printf("command %u %s\n", id, acked ? "ACKed" : "failed");
+ *   }
+ *
+ *   nova_host_t host;
+ *   nova_host_config_t config = NOVA_HOST_DEFAULTS;
+ *   nova_host_init(&host, &transport, &config);
+ *   nova_host_connected(&host, now());           // once subscribed to EFF2
+ *   nova_host_flash(&host, now(), 255, 127, 5000, on_ack, NULL);
+ *   for(;;) {
+ *     // wait for a notification, or nova_host_next_timeout()
+ *     nova_host_received(&host, now(), buf, len); // for each notification
+ *     nova_host_tick(&host, now());
+ *   }
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nova.h>
+
+#include "nova-host-clock.h"
+
+/** Most commands queued or waiting for an ACK. */
+#ifndef NOVA_HOST_QUEUE
+#define NOVA_HOST_QUEUE 256
+#endif
+
+/** Largest window to ask for. */
+#define NOVA_HOST_MAX_WINDOW 64
+
+/** Give up waiting for an ACK after this many milliseconds (as the iOS SDK). */
+#define NOVA_HOST_ACK_TIMEOUT 2000
+
+/** With a window, resend commands not ACKed within this many milliseconds. */
+#define NOVA_HOST_RESEND_AFTER 250
+
+struct nova_host_t;
+
+/**
+ * Called when a command is ACKed (acked is true), or fails: its ACK
+ * timed out, or the device disconnected.
+ */
+typedef void (*nova_host_callback)(struct nova_host_t *host, cmd_id_t id, bool acked, void *data);
+
+/**
+ * Called when the device sends a TRIGGER (after it's been ACKed).
+ */
+typedef void (*nova_host_trigger_callback)(struct nova_host_t *host, bool pressed, void *data);
+
+/**
+ * Way to the device.
+ */
+typedef struct nova_host_transport_t
+{
+  /**
+   * Write bytes to the request characteristic (EFF1). Returns false if
+   * they couldn't be (the ACK will then time out).
+   */
+  bool (*write)(void *context, const uint8_t *buf, uint16_t len);
+
+  /** Passed to write. */
+  void *context;
+
+} nova_host_transport_t;
+
+typedef struct nova_host_config_t
+{
+  /** Milliseconds to wait for an ACK before failing a command. */
+  uint32_t ack_timeout;
+
+  /**
+   * Window to NEGOTIATE. 0 or 1 for stop-and-wait without negotiating,
+   * as the iOS SDK. At most NOVA_HOST_MAX_WINDOW.
+   */
+  uint8_t window;
+
+  /** With a window, milliseconds before resending a command not ACKed. */
+  uint32_t resend_after;
+
+  /** Called for each TRIGGER from the device. May be NULL. */
+  nova_host_trigger_callback on_trigger;
+
+  /** Passed to on_trigger. */
+  void *data;
+
+} nova_host_config_t;
+
+#define NOVA_HOST_DEFAULTS { NOVA_HOST_ACK_TIMEOUT, 0, NOVA_HOST_RESEND_AFTER, NULL, NULL }
+
+/**
+ * A command queued or waiting for an ACK.
+ */
+typedef struct nova_host_command_t
+{
+  app_command_t cmd;
+  nova_host_callback callback;
+  void *data;
+
+  /** When first written, and last written. */
+  uint64_t sent_at;
+  uint64_t resent_at;
+
+} nova_host_command_t;
+
+typedef struct nova_host_stats_t
+{
+  /** Commands queued, ACKed and failed. */
+  uint32_t queued;
+  uint32_t acked;
+  uint32_t failed;
+
+  /** Writes to the transport (commands, resends and ACKs of TRIGGERs). */
+  uint32_t writes;
+
+  /** Commands resent. */
+  uint32_t resends;
+
+  /** ACKs (or SYNC answers) for commands not waiting for one (e.g. resent too early). */
+  uint32_t unexpected_acks;
+
+  /** Notifications that weren't a command. */
+  uint32_t bad_notifications;
+
+  /** TRIGGERs received. */
+  uint32_t triggers;
+
+  /** SYNCs answered, and how many of those were added to the clock. */
+  uint32_t syncs;
+  uint32_t sync_samples;
+
+} nova_host_stats_t;
+
+typedef struct nova_host_t
+{
+  nova_host_transport_t transport;
+  nova_host_config_t config;
+
+  bool connected;
+
+  /** NEGOTIATE written, waiting for the answer (id negotiate_id). */
+  bool negotiating;
+  cmd_id_t negotiate_id;
+  uint64_t negotiate_sent_at;
+  uint64_t negotiate_resent_at;
+
+  /** Commands in flight at once: 1 unless a window was negotiated. */
+  uint8_t window;
+
+  /** id of the last command. */
+  cmd_id_t last_id;
+
+  /**
+   * Ring of commands: the first sent_count have been written and are
+   * waiting for their ACK (oldest first), the rest are waiting to be.
+   */
+  nova_host_command_t queue[NOVA_HOST_QUEUE];
+  uint16_t head;
+  uint16_t count;
+  uint16_t sent_count;
+
+  /** The device's clock, by SYNCs. */
+  nova_host_clock_t clock;
+
+  nova_host_stats_t stats;
+
+} nova_host_t;
+
+/**
+ * Initialize host to talk through transport. It starts disconnected.
+ */
+void nova_host_init(nova_host_t *host, const nova_host_transport_t *transport, const nova_host_config_t *config);
+
+/**
+ * The transport has connected to the device, and subscribed to its
+ * notifications. Negotiates, if a window was asked for.
+ */
+void nova_host_connected(nova_host_t *host, uint64_t now);
+
+/**
+ * The transport has lost the device. Every command fails.
+ */
+void nova_host_disconnected(nova_host_t *host);
+
+/**
+ * Queue a PING, FLASH, OFF, SYNC or FLASH_AT (at a time by the device's
+ * clock, see nova_host_clock_device_time()). Returns false (and callback
+ * isn't called) if not connected, or the queue is full.
+ */
+bool nova_host_ping(nova_host_t *host, uint64_t now, nova_host_callback callback, void *data);
+bool nova_host_flash(nova_host_t *host, uint64_t now, uint8_t warm, uint8_t cool, uint16_t timeout,
+    nova_host_callback callback, void *data);
+bool nova_host_off(nova_host_t *host, uint64_t now, nova_host_callback callback, void *data);
+bool nova_host_sync(nova_host_t *host, uint64_t now, nova_host_callback callback, void *data);
+bool nova_host_flash_at(nova_host_t *host, uint64_t now, timestamp_t at, uint8_t warm, uint8_t cool,
+    uint16_t timeout, nova_host_callback callback, void *data);
+
+/**
+ * The device notified buf on the response characteristic (EFF2).
+ */
+void nova_host_received(nova_host_t *host, uint64_t now, const uint8_t *buf, uint16_t len);
+
+/**
+ * Time out (or resend) commands whose ACK is overdue.
+ */
+void nova_host_tick(nova_host_t *host, uint64_t now);
+
+/**
+ * Milliseconds until nova_host_tick() next needs calling, or -1 if
+ * nothing is waiting for an ACK.
+ */
+int64_t nova_host_next_timeout(nova_host_t *host, uint64_t now);
+
+/**
+ * Commands queued or waiting for an ACK.
+ */
+uint16_t nova_host_pending(nova_host_t *host);
@@ -0,0 +1,264 @@
+// (c) 2015, Joe Walnes, Sneaky Squid
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nova-host.h"
+#include "nova-host-socket.h"
+
+/**
+ * Load generator.
+ *
+ * Connects to the simulator's GATT stand-in (firmware-ui/firmware-gatt)
+ * and drives a storm of commands through nova-host.h, keeping depth of
+ * them outstanding. Reports commands per second, and percentiles of ACK
+ * latency: from queueing each command to its ACK.
+ *
+ * With SYNCs, also reports what the device's clock reads, as estimated
+ * from them (see nova-host-clock.h).
+ *
+ * Exits with 1 if any command failed.
+ *
+ * Usage:
+ *
+ *   nova-load [-c ADDRESS] [-n COUNT] [-t TYPE] [-w WINDOW] [-d DEPTH] [-u]
+ *
+ *   -c ADDRESS  Unix socket path, or tcp:PORT (default nova.sock)
+ *   -n COUNT    commands to send (default 1000)
+ *   -t TYPE     ping, flash, off, mix of those three, or sync (default
+ *               ping)
+ *   -w WINDOW   window to negotiate (default 0: stop-and-wait, as the
+ *               iOS SDK)
+ *   -d DEPTH    commands kept outstanding (default the window, or 1)
+ *   -u          write without response
+ */
+
+/** Keep trying to connect for this long, while the stand-in starts. */
+#define CONNECT_RETRY_MS 2000
+
+typedef enum
+{
+  LOAD_PING,
+  LOAD_FLASH,
+  LOAD_OFF,
+  LOAD_SYNC,
+  LOAD_MIX
+} load_type_t;
+
+typedef struct load_t
+{
+  load_type_t type;
+  uint32_t count;
+  uint32_t issued;
+  uint32_t finished;
+  uint32_t failed;
+
+  /** When each outstanding command was queued (by id), in microseconds. */
+  uint64_t queued_at[65536];
+
+  /** ACK latency of each ACKed command, in microseconds. */
+  uint32_t *latencies;
+  uint32_t latency_count;
+
+} load_t;
+
+static load_t load;
+
+static uint64_t micros_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void on_ack(nova_host_t *host, cmd_id_t id, bool acked, void *data)
+{
+  load.finished++;
+  if (!acked) {
+    load.failed++;
+    return;
+  }
+  load.latencies[load.latency_count++] = (uint32_t)(micros_now() - load.queued_at[id]);
+}
+
+static bool issue(nova_host_t *host, uint64_t now)
+{
+  load_type_t type = load.type == LOAD_MIX ? (load_type_t)(load.issued % 3) : load.type;
+  bool queued = false;
+  uint64_t at = micros_now();
+  switch (type) {
+    case LOAD_FLASH:
+      queued = nova_host_flash(host, now, 255, 127, 5000, on_ack, NULL);
+      break;
+    case LOAD_OFF:
+      queued = nova_host_off(host, now, on_ack, NULL);
+      break;
+    case LOAD_SYNC:
+      queued = nova_host_sync(host, now, on_ack, NULL);
+      break;
+    default:
+      queued = nova_host_ping(host, now, on_ack, NULL);
+      break;
+  }
+  if (queued) {
+    load.queued_at[host->last_id] = at;
+    load.issued++;
+  }
+  return queued;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p)
+{
+  if (load.latency_count == 0) {
+    return 0;
+  }
+  uint32_t index = (uint32_t)(p * load.latency_count);
+  return load.latencies[index < load.latency_count ? index : load.latency_count - 1];
+}
+
+int main(int argc, char **argv)
+{
+  const char *address = "nova.sock";
+  nova_host_config_t config = NOVA_HOST_DEFAULTS;
+  uint16_t depth = 0;
+  bool with_response = true;
+
+  load.count = 1000;
+  load.type = LOAD_PING;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      address = argv[++i];
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      load.count = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      const char *type = argv[++i];
+      if (strcmp(type, "ping") == 0) {
+        load.type = LOAD_PING;
+      } else if (strcmp(type, "flash") == 0) {
+        load.type = LOAD_FLASH;
+      } else if (strcmp(type, "off") == 0) {
+        load.type = LOAD_OFF;
+      } else if (strcmp(type, "sync") == 0) {
+        load.type = LOAD_SYNC;
+      } else if (strcmp(type, "mix") == 0) {
+        load.type = LOAD_MIX;
+      } else {
+        fprintf(stderr, "unknown type: %s\n", type);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      unsigned long window = strtoul(argv[++i], NULL, 10);
+      config.window = (uint8_t)(window > NOVA_HOST_MAX_WINDOW ? NOVA_HOST_MAX_WINDOW : window);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      unsigned long d = strtoul(argv[++i], NULL, 10);
+      depth = (uint16_t)(d > NOVA_HOST_QUEUE ? NOVA_HOST_QUEUE : d);
+    } else if (strcmp(argv[i], "-u") == 0) {
+      with_response = false;
+    } else {
+      fprintf(stderr, "Usage: %s [-c ADDRESS] [-n COUNT] [-t TYPE] [-w WINDOW] [-d DEPTH] [-u]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (depth == 0) {
+    depth = config.window > 1 ? config.window : 1;
+  }
+
+  load.latencies = malloc((load.count > 0 ? load.count : 1) * sizeof(uint32_t));
+  if (!load.latencies) {
+    perror("malloc");
+    return 1;
+  }
+
+  // The stand-in may still be starting.
+  nova_host_socket_t sock;
+  uint64_t give_up = micros_now() + CONNECT_RETRY_MS * 1000;
+  while (!nova_host_socket_connect(&sock, address)) {
+    if ((errno != ENOENT && errno != ECONNREFUSED) || micros_now() > give_up) {
+      perror(address);
+      return 1;
+    }
+    usleep(10000);
+  }
+  sock.with_response = with_response;
+  if (!nova_host_socket_subscribe(&sock)) {
+    perror(address);
+    return 1;
+  }
+
+  nova_host_t host;
+  nova_host_transport_t transport = nova_host_socket_transport(&sock);
+  nova_host_init(&host, &transport, &config);
+  nova_host_connected(&host, micros_now() / 1000);
+
+  struct pollfd pfd;
+  pfd.fd = sock.fd;
+  pfd.events = POLLIN;
+
+  bool connected = true;
+  uint64_t started = 0;
+  while (connected && load.finished < load.count) {
+    uint64_t now = micros_now() / 1000;
+
+    // Start the clock once negotiated.
+    if (!host.negotiating) {
+      if (!started) {
+        started = micros_now();
+      }
+      while (load.issued < load.count && nova_host_pending(&host) < depth && issue(&host, now)) {
+      }
+    }
+
+    int64_t timeout = nova_host_next_timeout(&host, now);
+    if (poll(&pfd, 1, timeout > 1000 ? 1000 : (int)timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    now = micros_now() / 1000;
+    if (!nova_host_socket_receive(&sock, &host, now)) {
+      fprintf(stderr, "disconnected\n");
+      nova_host_disconnected(&host);
+      connected = false;
+    }
+    nova_host_tick(&host, now);
+  }
+  double seconds = (double)(micros_now() - started) / 1e6;
+  uint64_t ended = micros_now() / 1000;
+  nova_host_socket_close(&sock);
+
+  qsort(load.latencies, load.latency_count, sizeof(uint32_t), compare_latency);
+
+  printf("%u commands in %.2fs: %.0f/s, window %u, %u failed, %u resends, %u unexpected ACKs\n",
+      load.finished, seconds, seconds > 0 ? load.finished / seconds : 0, host.window, load.failed,
+      host.stats.resends, host.stats.unexpected_acks);
+  printf("ACK latency: p50 %uus, p99 %uus, p999 %uus, max %uus\n",
+      percentile(0.5), percentile(0.99), percentile(0.999), percentile(1.0));
+
+  bool synced = true;
+  if (host.stats.syncs > 0) {
+    timestamp_t device_time;
+    synced = nova_host_clock_device_time(&host.clock, ended, true, &device_time);
+    if (synced) {
+      printf("device clock: %lu at the end, from %u of %u SYNCs\n", (unsigned long)device_time,
+          host.stats.sync_samples, host.stats.syncs);
+    } else {
+      printf("device clock: unknown, every SYNC was resent\n");
+    }
+  }
+
+  free(load.latencies);
+  return load.failed > 0 || load.finished < load.count || !synced ? 1 : 0;
+}